@@ -0,0 +1,243 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file Homa/Coro/Scheduler.h
+ *
+ * Optional C++20 coroutine layer on top of Homa::Transport.  This header (and
+ * the HomaCoro library that implements it) requires C++20; the rest of Homa
+ * only requires C++11.
+ */
+
+#ifndef HOMA_INCLUDE_HOMA_CORO_SCHEDULER_H
+#define HOMA_INCLUDE_HOMA_CORO_SCHEDULER_H
+
+#include <Homa/Homa.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+namespace Homa {
+namespace Coro {
+
+/**
+ * Return type of coroutines run by a Scheduler.
+ *
+ * A Task does not start running until it is handed to Scheduler::spawn(),
+ * after which the Scheduler owns it.
+ */
+class Task {
+  public:
+    /**
+     * Coroutine promise for Task; used by the compiler.
+     */
+    struct promise_type {
+        Task get_return_object()
+        {
+            return Task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception();
+    };
+
+    Task(Task&& other) noexcept;
+    Task& operator=(Task&& other) noexcept;
+    ~Task();
+
+  private:
+    explicit Task(std::coroutine_handle<promise_type> handle);
+
+    /// Coroutine owned by this Task; empty once handed to a Scheduler.
+    std::coroutine_handle<promise_type> handle;
+
+    friend class Scheduler;
+
+    // Disable copy and assign
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+};
+
+/**
+ * Runs coroutines that send and receive messages through a Transport.
+ *
+ * Coroutines await send(), call(), receive(), and reply() instead of polling
+ * the Transport themselves; the Scheduler drives the Transport from poll() and
+ * resumes each coroutine once the operation it is waiting for is done.  Any
+ * number of coroutines can be in flight on the single thread calling poll().
+ *
+ * The Scheduler should be the only consumer of Transport::receive() and
+ * Transport::getDoneMessages().
+ *
+ * This class is NOT thread-safe.
+ */
+class Scheduler {
+  public:
+    /**
+     * Awaitable returned by send(); resumes once the message is COMPLETED,
+     * FAILED, or CANCELED and yields the final status.
+     */
+    class SendAwaitable {
+      public:
+        bool await_ready() const noexcept
+        {
+            return isDone(message->getStatus());
+        }
+        void await_suspend(std::coroutine_handle<> handle);
+        OutMessage::Status await_resume() const noexcept
+        {
+            return message->getStatus();
+        }
+
+      private:
+        SendAwaitable(Scheduler* scheduler, OutMessage* message)
+            : scheduler(scheduler)
+            , message(message)
+        {}
+
+        /// Scheduler that will resume the awaiting coroutine.
+        Scheduler* scheduler;
+        /// Message whose completion is awaited.
+        OutMessage* message;
+        friend class Scheduler;
+    };
+
+    /**
+     * Awaitable returned by call(); resumes once the request is done and
+     * yields its response (nullptr if no response was received).
+     */
+    class CallAwaitable : public SendAwaitable {
+      public:
+        Homa::unique_ptr<InMessage> await_resume() const
+        {
+            return message->getResponse();
+        }
+
+      private:
+        explicit CallAwaitable(const SendAwaitable& awaitable)
+            : SendAwaitable(awaitable)
+        {}
+        friend class Scheduler;
+    };
+
+    /**
+     * Awaitable returned by receive(); resumes once a message has been
+     * received (on the requested port, if any) and yields it.
+     */
+    class ReceiveAwaitable {
+      public:
+        bool await_ready() noexcept;
+        void await_suspend(std::coroutine_handle<> handle);
+        Homa::unique_ptr<InMessage> await_resume() noexcept
+        {
+            return std::move(message);
+        }
+
+      private:
+        ReceiveAwaitable(Scheduler* scheduler, bool anyPort, uint16_t port)
+            : scheduler(scheduler)
+            , anyPort(anyPort)
+            , port(port)
+            , message()
+        {}
+
+        Homa::unique_ptr<InMessage> tryReceive();
+
+        /// Scheduler that will resume the awaiting coroutine.
+        Scheduler* scheduler;
+        /// True if a message sent to any port will do.
+        bool anyPort;
+        /// Port to which the awaited message must be sent, unless anyPort.
+        uint16_t port;
+        /// Message handed to the awaiting coroutine.
+        Homa::unique_ptr<InMessage> message;
+        friend class Scheduler;
+    };
+
+    explicit Scheduler(Transport* transport);
+    ~Scheduler();
+
+    void spawn(Task task);
+    void poll();
+    size_t numTasks() const;
+
+    SendAwaitable send(OutMessage* message, SocketAddress destination,
+                       OutMessage::Options options = OutMessage::NONE);
+    CallAwaitable call(OutMessage* request, SocketAddress destination,
+                       OutMessage::Options options = OutMessage::NONE);
+    ReceiveAwaitable receive();
+    ReceiveAwaitable receive(uint16_t port);
+    SendAwaitable reply(Homa::unique_ptr<InMessage> request,
+                        OutMessage* response,
+                        OutMessage::Options options = OutMessage::NONE);
+
+  private:
+    /**
+     * A coroutine waiting for a message to be received.
+     */
+    struct ReceiveWaiter {
+        /// Awaitable in the waiting coroutine's frame that gets the message.
+        ReceiveAwaitable* awaitable;
+        /// Coroutine to resume.
+        std::coroutine_handle<> handle;
+    };
+
+    bool tryResume(const ReceiveWaiter& waiter);
+    static bool isDone(OutMessage::Status status);
+
+    /// Maximum number of done messages taken from the Transport at once.
+    static const size_t MAX_DONE_BATCH = 32;
+
+    /// Transport through which messages are sent and received.
+    Transport* const transport;
+
+    /// Coroutines spawned by this Scheduler that have not yet finished.
+    std::vector<std::coroutine_handle<Task::promise_type>> tasks;
+
+    /// Coroutines that are ready to run.
+    std::deque<std::coroutine_handle<>> ready;
+
+    /// Coroutines waiting in send() or call(), by the message they are
+    /// waiting on.  They are resumed when the Transport reports the message
+    /// done (see Transport::getDoneMessages()).
+    std::unordered_map<OutMessage*, std::coroutine_handle<>> sendWaiters;
+
+    /// Coroutines waiting in receive(uint16_t), by port, each in the order
+    /// they started waiting.  Ports without waiters have no entry.
+    std::unordered_map<uint16_t, std::deque<ReceiveWaiter>> portWaiters;
+
+    /// Coroutines waiting in receive(), in the order they started waiting.
+    std::deque<ReceiveWaiter> anyPortWaiters;
+
+    // Disable copy and assign
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+};
+
+}  // namespace Coro
+}  // namespace Homa
+
+#endif  // HOMA_INCLUDE_HOMA_CORO_SCHEDULER_H
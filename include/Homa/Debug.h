@@ -20,6 +20,8 @@
  * handled.
  */
 
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <functional>
 #include <initializer_list>
@@ -175,6 +177,40 @@ std::vector<std::pair<std::string, std::string>> logPolicyFromString(
 std::string logPolicyToString(
     const std::vector<std::pair<std::string, std::string>>& policy);
 
+/**
+ * Enable or disable asynchronous logging.
+ *
+ * When enabled, log messages are copied into a bounded lock-free queue and
+ * written (to the log file or handler) by a background thread, so threads
+ * that log never block on I/O or on each other.  If the queue is full, the
+ * message is dropped and counted (see getDroppedLogMessages()).  When
+ * disabled (the default), messages are written synchronously by the thread
+ * that logs them.
+ *
+ * Disabling asynchronous logging waits for threads that are concurrently
+ * queuing messages and drains all queued messages before returning;
+ * applications should do so before exiting so that no messages are lost.
+ *
+ * @param enable
+ *      True to enable asynchronous logging; false to disable it.
+ * @param capacity
+ *      Maximum number of messages that can be queued; rounded up to a power
+ *      of 2.  Ignored if asynchronous logging is already enabled.
+ */
+void setAsyncLogging(bool enable, size_t capacity = 4096);
+
+/**
+ * Wait until all log messages queued before this call have been written.
+ * Returns immediately if asynchronous logging is disabled.
+ */
+void flushLog();
+
+/**
+ * Return the number of log messages that have been dropped because the
+ * asynchronous log queue was full.
+ */
+uint64_t getDroppedLogMessages();
+
 }  // namespace Debug
 }  // namespace Homa
 
@@ -142,6 +142,42 @@ class Driver {
     virtual void sendPacket(Packet* packet, IpAddress destination,
                             int priority) = 0;
 
+    /**
+     * Send a packet made of a header supplied by the caller followed by the
+     * bytes of another packet, starting at an offset.
+     *
+     * This lets the same payload go out with different headers (e.g. to many
+     * destinations) without the caller assembling a packet for each.  Drivers
+     * that can transmit a packet from separate buffers should override this
+     * method so that the payload is not copied; the default implementation
+     * copies the header and payload into a newly allocated packet and passes
+     * it to sendPacket().
+     *
+     * As with sendPacket(), the caller keeps ownership of the payload packet,
+     * and its contents should be considered immutable once passed to this
+     * method; the Driver may keep referencing them until the transmission
+     * completes, even after the packet has been released.
+     *
+     * @param header
+     *      Bytes to send ahead of the payload; copied before this method
+     *      returns.
+     * @param headerLength
+     *      Number of bytes in _header_.
+     * @param payload
+     *      Packet whose bytes from _payloadOffset_ to its length follow the
+     *      header.
+     * @param payloadOffset
+     *      Number of leading bytes of _payload_ that are not sent (e.g. the
+     *      payload packet's own header).
+     * @param destination
+     *      IP address of the packet destination.
+     * @param priority
+     *      Packet's network priority; see sendPacket().
+     */
+    virtual void sendPacketWithHeader(const void* header, uint32_t headerLength,
+                                      Packet* payload, uint32_t payloadOffset,
+                                      IpAddress destination, int priority);
+
     /**
      * Request that the Driver enter the "corked" mode where outbound packets
      * are queued instead of immediately sent so that they can be more
@@ -168,6 +204,11 @@ class Driver {
      * caller must ensure that Packet objects return by this method are
      * eventually released back to the Driver; see Driver::releasePackets().
      *
+     * The caller has exclusive use of the returned Packet objects until it
+     * releases them and may modify their contents (e.g. to send them onward).
+     * A Driver must not return a Packet whose memory is shared with a sent
+     * Packet or with another received Packet.
+     *
      * @param maxPackets
      *      The maximum number of Packet objects that should be returned by
      *      this method.
@@ -125,6 +125,16 @@ class DpdkDriver : public Driver {
     virtual void sendPacket(Packet* packet, IpAddress destination,
                             int priority);
 
+    /// See Driver::sendPacketWithHeader()
+    ///
+    /// If the NIC supports multi-segment transmit, the header is sent in its
+    /// own mbuf chained to an indirect mbuf that references the payload, so
+    /// the payload is not copied.
+    virtual void sendPacketWithHeader(const void* header,
+                                      uint32_t headerLength, Packet* payload,
+                                      uint32_t payloadOffset,
+                                      IpAddress destination, int priority);
+
     /// See Driver::cork()
     virtual void cork();
 
@@ -19,10 +19,10 @@
 #include <Homa/Driver.h>
 #include <Homa/Drivers/Util/QueueEstimator.h>
 
-#include <array>
+#include <atomic>
 #include <chrono>
-#include <deque>
-#include <mutex>
+#include <cstring>
+#include <memory>
 
 namespace Homa {
 namespace Drivers {
@@ -34,6 +34,10 @@ const int NUM_PRIORITIES = 8;
 /// Maximum number of bytes a packet can hold.
 const uint32_t MAX_PAYLOAD_SIZE = 1500;
 
+/// Number of packets each FakeNIC can queue per priority; packets that arrive
+/// at a full queue are dropped.
+const uint32_t NIC_QUEUE_CAPACITY = 4096;
+
 /// A set of methods to control the underlying FakeNetwork's behavior.
 namespace FakeNetworkConfig {
 /**
@@ -49,6 +53,10 @@ void setPacketLossRate(double lossRate);
  * Represents a packet of data that can be send or is received through a
  * FakeDriver over a FakeNetwork.
  *
+ * Sending a FakePacket delivers a copy of it, so a received packet is private
+ * to its receiver, as it would be on a real network.  Packets are recycled
+ * through a pool once they are released.
+ *
  * @sa Driver::Packet
  */
 struct FakePacket {
@@ -58,16 +66,12 @@ struct FakePacket {
     /// Raw storage for this packets payload.
     char buf[MAX_PAYLOAD_SIZE];
 
-    /// Source IpAddress of the packet.
-    IpAddress sourceIp;
-
     /**
      * FakePacket constructor.
      */
     explicit FakePacket()
         : base{.payload = buf, .length = 0}
         , buf()
-        , sourceIp()
     {}
 
     /**
@@ -76,23 +80,13 @@ struct FakePacket {
     FakePacket(const FakePacket& other)
         : base{.payload = buf, .length = other.base.length}
         , buf()
-        , sourceIp()
     {
-        memcpy(base.payload, other.base.payload, MAX_PAYLOAD_SIZE);
+        memcpy(base.payload, other.base.payload, other.base.length);
     }
 };
 
-/// Holds the incoming packets for a particular driver.
-struct FakeNIC {
-    /// Monitor lock for the FakeNIC structure.
-    std::mutex mutex;
-
-    /// A set of incoming packets queued by priority.
-    std::array<std::deque<FakePacket*>, NUM_PRIORITIES> priorityQueue;
-
-    FakeNIC();
-    ~FakeNIC();
-};
+/// Holds the incoming packets for a particular driver; see FakeDriver.cc.
+struct FakeNIC;
 
 /**
  * A fake driver that sends and receives datagrams using a fake network.
@@ -100,6 +94,10 @@ struct FakeNIC {
  * Used in tests to allow multiple instances of Homa::Transport to send and
  * receive datagrams without actually using the network.  Instances of
  * Homa::Transport must be as part of a single process for FakeDriver to work.
+ *
+ * The fake network is lock-free: each FakeNIC queues incoming packets in
+ * per-priority rings, and delivered copies are taken from a lock-free pool of
+ * packets, so it can be used to benchmark multi-threaded Transport code.
  */
 class FakeDriver : public Driver {
   public:
@@ -127,7 +125,7 @@ class FakeDriver : public Driver {
     uint32_t localAddressId;
 
     /// Holds the incoming packets for this driver.
-    FakeNIC nic;
+    std::unique_ptr<FakeNIC> nic;
 
     /// Tracks the size of the NIC's transmit queue.
     Util::QueueEstimator<std::chrono::steady_clock> queueEstimator;
@@ -0,0 +1,236 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_INCLUDE_HOMA_DRIVERS_IMPAIRMENT_IMPAIRMENTDRIVER_H
+#define HOMA_INCLUDE_HOMA_DRIVERS_IMPAIRMENT_IMPAIRMENTDRIVER_H
+
+#include <Homa/Driver.h>
+
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace Homa {
+namespace Drivers {
+namespace Impairment {
+
+/**
+ * Describes the network impairments applied to packets sent to a destination.
+ *
+ * The default-constructed value describes an unimpaired link.
+ */
+struct Impairment {
+    /// Fixed one-way delay added to every packet, in nanoseconds.
+    uint64_t delayNs = 0;
+
+    /// Each packet is delayed by an additional amount chosen uniformly from
+    /// [0, jitterNs] nanoseconds; packets may be reordered as a result.
+    uint64_t jitterNs = 0;
+
+    /// Probability that a packet is held back by an extra #reorderDelayNs so
+    /// that packets sent after it overtake it.
+    double reorderRate = 0.0;
+
+    /// Extra delay applied to packets selected for reordering, in nanoseconds.
+    uint64_t reorderDelayNs = 0;
+
+    /// Probability that a packet is delivered twice.
+    double duplicateRate = 0.0;
+
+    /// Burst loss is modeled with a two-state Gilbert-Elliott channel.  This
+    /// is the probability that a packet is lost while in the "good" state.
+    double lossRate = 0.0;
+
+    /// Probability that a packet is lost while in the "bad" (burst) state.
+    double burstLossRate = 0.0;
+
+    /// Probability of moving from the good to the bad state, per packet.
+    double burstStartRate = 0.0;
+
+    /// Probability of moving from the bad to the good state, per packet.
+    double burstEndRate = 1.0;
+
+    /// If non-zero, packets are shaped by a token bucket to this rate, in
+    /// Megabits per second.
+    uint32_t bandwidthMbps = 0;
+
+    /// Number of bytes that may be sent back-to-back at full speed before the
+    /// token bucket starts shaping.
+    uint32_t burstBytes = 0;
+
+    /// If non-zero, packets that would wait in the token bucket's queue behind
+    /// more than this many bytes are dropped (tail drop).
+    uint32_t queueLimitBytes = 0;
+};
+
+/**
+ * A Driver that wraps another Driver and impairs the packets sent through it
+ * by adding delay, jitter, reordering, duplication, burst loss, and bandwidth
+ * limits, configured per destination.
+ *
+ * Impairments are applied on the send path only.  Delayed packets are copied
+ * into packets allocated from the wrapped driver and are handed to it once
+ * their departure time has passed; this happens whenever the ImpairmentDriver
+ * is used to send or receive packets, so the Transport's polling is enough to
+ * keep delayed packets flowing.
+ *
+ * All random choices are drawn from a generator seeded at construction, so a
+ * single-threaded run with a given seed is reproducible.
+ *
+ * This class is thread-safe.
+ */
+class ImpairmentDriver : public Driver {
+  public:
+    /// Counters describing the impairments applied so far.
+    struct Stats {
+        /// Number of packets passed to sendPacket().
+        uint64_t sentPackets;
+        /// Number of packets dropped by the loss model.
+        uint64_t lostPackets;
+        /// Number of packets dropped because the token bucket queue was full.
+        uint64_t queueDroppedPackets;
+        /// Number of extra copies sent by duplication.
+        uint64_t duplicatedPackets;
+        /// Number of packets held back for reordering.
+        uint64_t reorderedPackets;
+        /// Number of packets whose transmission was deferred.
+        uint64_t delayedPackets;
+    };
+
+    explicit ImpairmentDriver(Driver* driver, uint64_t seed = 0);
+    virtual ~ImpairmentDriver();
+
+    void setDefaultImpairment(const Impairment& impairment);
+    void setImpairment(IpAddress destination, const Impairment& impairment);
+    void clearImpairment(IpAddress destination);
+    Stats getStats();
+    void flush();
+
+    virtual Packet* allocPacket();
+    virtual void sendPacket(Packet* packet, IpAddress destination,
+                            int priority);
+    virtual void cork();
+    virtual void uncork();
+    virtual uint32_t receivePackets(uint32_t maxPackets,
+                                    Packet* receivedPackets[],
+                                    IpAddress sourceAddresses[]);
+    virtual void releasePackets(Packet* packets[], uint16_t numPackets);
+    virtual int getHighestPacketPriority();
+    virtual uint32_t getMaxPayloadSize();
+    virtual uint32_t getBandwidth();
+    virtual IpAddress getLocalAddress();
+    virtual uint32_t getQueuedBytes();
+
+  private:
+    /**
+     * Impairment configuration and channel state for one destination.
+     */
+    struct Link {
+        /// Impairments applied to this link; delays converted to cycles.
+        Impairment config;
+        /// Fixed delay in cycles.
+        uint64_t delay;
+        /// Maximum jitter in cycles.
+        uint64_t jitter;
+        /// Extra reordering delay in cycles.
+        uint64_t reorderDelay;
+        /// Cycles needed to transmit one byte at the shaped rate; 0 if the
+        /// link is not shaped.
+        double cyclesPerByte;
+        /// Cycles worth of tokens the bucket can hold.
+        uint64_t burst;
+        /// True if the Gilbert-Elliott channel is in the bad (burst) state.
+        bool inBurst;
+        /// Time (in cycles) at which the token bucket will have been drained
+        /// of all packets admitted so far.
+        uint64_t shaperTime;
+
+        Link();
+        explicit Link(const Impairment& impairment);
+    };
+
+    /**
+     * A packet waiting for its departure time.
+     */
+    struct DelayedPacket {
+        /// Time (in cycles) at which the packet should be sent.
+        uint64_t departureTime;
+        /// Tie breaker so packets with equal departure times keep their order.
+        uint64_t sequence;
+        /// Copy of the packet, allocated from the wrapped driver.
+        Packet* packet;
+        /// Where the packet should be sent.
+        IpAddress destination;
+        /// Priority at which the packet should be sent.
+        int priority;
+
+        /// Orders the delay queue so the earliest departure is on top.
+        bool operator<(const DelayedPacket& other) const
+        {
+            if (departureTime != other.departureTime) {
+                return departureTime > other.departureTime;
+            }
+            return sequence > other.sequence;
+        }
+    };
+
+    Link* getLink(IpAddress destination);
+    uint64_t getShaperBacklog(Link* link, uint64_t now);
+    bool isLost(Link* link);
+    void schedule(Packet* packet, IpAddress destination, int priority,
+                  uint64_t departureTime);
+    void sendDue(uint64_t now);
+    bool chance(double probability);
+
+    /// The driver through which packets are actually sent and received.
+    Driver* const driver;
+
+    /// Protects all of the state below.
+    std::mutex mutex;
+
+    /// Source of all random choices.
+    std::mt19937_64 gen;
+
+    /// Used to turn gen's output into probabilities.
+    std::uniform_real_distribution<double> uniform;
+
+    /// Link used for destinations without a specific configuration.
+    Link defaultLink;
+
+    /// Links with destination specific configuration.
+    std::unordered_map<IpAddress, Link, IpAddress::Hasher> links;
+
+    /// Packets waiting for their departure time.
+    std::priority_queue<DelayedPacket> delayQueue;
+
+    /// Next DelayedPacket::sequence value.
+    uint64_t nextSequence;
+
+    /// Counters returned by getStats().
+    Stats stats;
+
+    // Disable copy and assign
+    ImpairmentDriver(const ImpairmentDriver&) = delete;
+    ImpairmentDriver& operator=(const ImpairmentDriver&) = delete;
+};
+
+}  // namespace Impairment
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_INCLUDE_HOMA_DRIVERS_IMPAIRMENT_IMPAIRMENTDRIVER_H
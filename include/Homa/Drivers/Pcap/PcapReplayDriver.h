@@ -0,0 +1,158 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef HOMA_INCLUDE_HOMA_DRIVERS_PCAP_PCAPREPLAYDRIVER_H
+#define HOMA_INCLUDE_HOMA_DRIVERS_PCAP_PCAPREPLAYDRIVER_H
+
+#include <Homa/Driver.h>
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace Homa {
+namespace Drivers {
+namespace Pcap {
+
+/**
+ * Controls how a PcapReplayDriver plays back its capture.
+ */
+struct ReplayOptions {
+    /// Playback speed relative to the recorded timestamps; e.g. 2.0 replays
+    /// twice as fast as recorded.  0 replays as fast as packets are polled.
+    double speed = 1.0;
+
+    /// Number of times to play the capture; 0 repeats it forever.
+    uint32_t loops = 1;
+
+    /// If non-zero, only packets that were sent to this address are replayed
+    /// and getLocalAddress() returns it.  Otherwise all packets are replayed.
+    IpAddress localAddress{0};
+
+    /// Value returned by getMaxPayloadSize().
+    uint32_t maxPayloadSize = 1500;
+
+    /// Value returned by getBandwidth(), in Mbps.
+    uint32_t bandwidth = 10000;
+};
+
+/**
+ * A Driver that plays back a capture written by PcapTapDriver as if the
+ * packets were arriving from the network, so that the receive and dispatch
+ * path of a Transport can be exercised and benchmarked without a network.
+ *
+ * The capture file is mapped into memory.  Each received packet is a copy of
+ * a captured packet in a recycled buffer, since the caller may modify
+ * received packets (see Driver::receivePackets()) and a captured packet is
+ * replayed on every loop.  Packets sent through this driver are discarded.
+ *
+ * This class is thread-safe.
+ */
+class PcapReplayDriver : public Driver {
+  public:
+    explicit PcapReplayDriver(const char* fileName);
+    PcapReplayDriver(const char* fileName, const ReplayOptions& options);
+    virtual ~PcapReplayDriver();
+
+    bool isFinished();
+    uint64_t getReplayedPackets();
+    uint64_t getSentPackets();
+
+    virtual Packet* allocPacket();
+    virtual void sendPacket(Packet* packet, IpAddress destination,
+                            int priority);
+    virtual uint32_t receivePackets(uint32_t maxPackets,
+                                    Packet* receivedPackets[],
+                                    IpAddress sourceAddresses[]);
+    virtual void releasePackets(Packet* packets[], uint16_t numPackets);
+    virtual int getHighestPacketPriority();
+    virtual uint32_t getMaxPayloadSize();
+    virtual uint32_t getBandwidth();
+    virtual IpAddress getLocalAddress();
+    virtual uint32_t getQueuedBytes();
+
+  private:
+    /**
+     * A packet from the capture that will be replayed.
+     */
+    struct Record {
+        /// Time at which the packet was captured, in nanoseconds relative to
+        /// the first replayed packet.
+        uint64_t timestamp;
+        /// Address from which the packet was sent.
+        IpAddress source;
+        /// The captured packet; points into #mapping.
+        Packet packet;
+    };
+
+    /**
+     * A packet allocated by allocPacket() or returned by receivePackets().
+     */
+    struct OutboundPacket {
+        /// C-style "inheritance"; used to maintain the base struct as a POD
+        /// type.
+        Packet base;
+        /// Raw storage for the payload.
+        std::vector<char> buf;
+    };
+
+    void load(const char* fileName);
+    OutboundPacket* getFreePacket(const std::lock_guard<std::mutex>& lock);
+
+    /// Playback configuration.
+    const ReplayOptions options;
+
+    /// Start of the memory-mapped capture file.
+    void* mapping;
+
+    /// Length of #mapping in bytes.
+    size_t mappingLength;
+
+    /// Packets to replay, in capture order.
+    std::vector<Record> records;
+
+    /// Protects the playback state below.
+    std::mutex mutex;
+
+    /// Index of the next record to replay.
+    size_t next;
+
+    /// Number of times the capture has been played in full.
+    uint32_t completedLoops;
+
+    /// Time (in cycles) at which the current loop started; 0 if playback has
+    /// not started.
+    uint64_t loopStart;
+
+    /// Number of packets returned by receivePackets().
+    uint64_t replayedPackets;
+
+    /// Number of packets passed to sendPacket().
+    uint64_t sentPackets;
+
+    /// Released OutboundPackets available for reuse.
+    std::vector<OutboundPacket*> freePackets;
+
+    // Disable copy and assign
+    PcapReplayDriver(const PcapReplayDriver&) = delete;
+    PcapReplayDriver& operator=(const PcapReplayDriver&) = delete;
+};
+
+}  // namespace Pcap
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_INCLUDE_HOMA_DRIVERS_PCAP_PCAPREPLAYDRIVER_H
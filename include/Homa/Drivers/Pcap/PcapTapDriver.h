@@ -0,0 +1,93 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef HOMA_INCLUDE_HOMA_DRIVERS_PCAP_PCAPTAPDRIVER_H
+#define HOMA_INCLUDE_HOMA_DRIVERS_PCAP_PCAPTAPDRIVER_H
+
+#include <Homa/Driver.h>
+
+#include <cstdio>
+#include <mutex>
+
+namespace Homa {
+namespace Drivers {
+namespace Pcap {
+
+/**
+ * A Driver that wraps another Driver and records every packet sent or
+ * received through it to a pcap capture file.
+ *
+ * Each record carries a nanosecond wall-clock timestamp and a synthesized
+ * IPv4 header holding the packet's source, destination, and (for sent
+ * packets) priority, followed by the Homa packet exactly as it was handed to
+ * or returned by the wrapped driver.  Captures can be inspected with standard
+ * tools and replayed with PcapReplayDriver.
+ *
+ * This class is thread-safe.
+ */
+class PcapTapDriver : public Driver {
+  public:
+    PcapTapDriver(Driver* driver, const char* fileName);
+    virtual ~PcapTapDriver();
+
+    void flush();
+    uint64_t getRecordedPackets();
+
+    virtual Packet* allocPacket();
+    virtual void sendPacket(Packet* packet, IpAddress destination,
+                            int priority);
+    virtual void cork();
+    virtual void uncork();
+    virtual uint32_t receivePackets(uint32_t maxPackets,
+                                    Packet* receivedPackets[],
+                                    IpAddress sourceAddresses[]);
+    virtual void releasePackets(Packet* packets[], uint16_t numPackets);
+    virtual int getHighestPacketPriority();
+    virtual uint32_t getMaxPayloadSize();
+    virtual uint32_t getBandwidth();
+    virtual IpAddress getLocalAddress();
+    virtual uint32_t getQueuedBytes();
+
+  private:
+    void record(const Packet* packet, IpAddress source,
+                IpAddress destination, int priority);
+
+    /// The driver through which packets are actually sent and received.
+    Driver* const driver;
+
+    /// Address of the wrapped driver; cached since it is recorded with every
+    /// packet.
+    const IpAddress localAddress;
+
+    /// Serializes writes to #file.
+    std::mutex mutex;
+
+    /// Capture file being written.
+    FILE* file;
+
+    /// Number of packets written to #file.
+    uint64_t recordedPackets;
+
+    // Disable copy and assign
+    PcapTapDriver(const PcapTapDriver&) = delete;
+    PcapTapDriver& operator=(const PcapTapDriver&) = delete;
+};
+
+}  // namespace Pcap
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_INCLUDE_HOMA_DRIVERS_PCAP_PCAPTAPDRIVER_H
@@ -24,6 +24,7 @@
 #define HOMA_INCLUDE_HOMA_HOMA_H
 
 #include <Homa/Driver.h>
+#include <Homa/Perf.h>
 
 #include <atomic>
 #include <bitset>
@@ -55,6 +56,35 @@ struct SocketAddress {
  */
 class InMessage {
   public:
+    /**
+     * Times at which a message passed key points on its way to the
+     * application, in cycles on the clock of Perf::Stats::timestamp.  A time
+     * is 0 if the message hasn't reached that point (yet).
+     *
+     * @sa timing()
+     */
+    struct Timing {
+        /// The first packet of the message arrived.
+        uint64_t firstPacketReceived;
+
+        /// The first GRANT for the message was sent; 0 if the message needed
+        /// no grants.
+        uint64_t firstGrantSent;
+
+        /// The most recent GRANT for the message was sent.
+        uint64_t lastGrantSent;
+
+        /// The first RESEND for lost packets of the message was sent.
+        uint64_t firstResendSent;
+
+        /// Every packet of the message had arrived.
+        uint64_t lastPacketReceived;
+
+        /// The message was handed to the application (e.g. by
+        /// Transport::receive()).
+        uint64_t delivered;
+    };
+
     /**
      * Custom deleter for use with std::unique_ptr.
      */
@@ -116,6 +146,16 @@ class InMessage {
      */
     virtual void strip(size_t count) = 0;
 
+    /**
+     * Return the times at which this message passed key points on its way to
+     * the application, e.g. to tell loss recovery from receive-queue delay in
+     * the latency of a slow request.
+     *
+     * Times are only recorded if the Homa library was built with the
+     * HOMA_MESSAGE_TIMING option; otherwise, every time is 0.
+     */
+    virtual Timing timing() const = 0;
+
   protected:
     /**
      * Signal that this message is no longer needed.  The caller should not
@@ -158,6 +198,44 @@ class OutMessage {
         /// Message's receiver to ensure the receiver is still alive and the
         /// Message will not "timeout" due to receiver inactivity.
         NO_KEEP_ALIVE = 1 << 1,
+
+        /// Once the Message is COMPLETED, FAILED, or CANCELED, it will be
+        /// returned by Transport::getDoneMessages() so that the application
+        /// does not have to poll getStatus().
+        NOTIFY_DONE = 1 << 2,
+    };
+
+    /**
+     * Times at which a message passed key points on its way to the receiver,
+     * in cycles on the clock of Perf::Stats::timestamp.  A time is 0 if the
+     * message hasn't reached that point (yet).
+     *
+     * @sa timing()
+     */
+    struct Timing {
+        /// send() was called.
+        uint64_t queued;
+
+        /// The first DATA packet of the message was transmitted.
+        uint64_t firstPacketSent;
+
+        /// Every DATA packet of the message had been transmitted at least
+        /// once.
+        uint64_t lastPacketSent;
+
+        /// Total cycles (not a time) spent with every granted packet sent,
+        /// waiting for the receiver to grant more.
+        uint64_t grantWaitCycles;
+
+        /// Packets of the message were first retransmitted at the receiver's
+        /// request.
+        uint64_t firstResend;
+
+        /// Packets of the message were most recently retransmitted.
+        uint64_t lastResend;
+
+        /// The message became COMPLETED, FAILED, or CANCELED.
+        uint64_t finished;
     };
 
     /**
@@ -191,6 +269,18 @@ class OutMessage {
      */
     virtual Status getStatus() const = 0;
 
+    /**
+     * Return the response to this message, if one has been received.
+     *
+     * A response is a message sent back with Transport::reply().  Receiving it
+     * also marks this message COMPLETED, so no separate acknowledgement is
+     * needed.  The response is returned at most once.
+     *
+     * @return
+     *      The response, if one has been received; otherwise, nullptr.
+     */
+    virtual Homa::unique_ptr<InMessage> getResponse() = 0;
+
     /**
      * Return the number of bytes this Message contains.
      */
@@ -240,6 +330,45 @@ class OutMessage {
     virtual void send(SocketAddress destination,
                       Options options = Options::NONE) = 0;
 
+    /**
+     * Send the contents of this message to several destinations.
+     *
+     * One copy of the message is sent to each destination.  The copies share
+     * this message's packet buffers, so the payload is only built and held
+     * in memory once no matter how many destinations there are.  Only memory
+     * is saved: each packet of a copy is still copied into a new packet with
+     * that copy's header every time it is transmitted, so the CPU cost of
+     * sending grows with the number of destinations as with send().  Each
+     * copy is a separate OutMessage whose progress can be tracked with
+     * getStatus() and which must be released by the application.
+     *
+     * This message must not have been sent and must not be modified after
+     * this call; it should simply be released once it is no longer needed.
+     *
+     * @param destinations
+     *      Array of network addresses to which the message will be sent.
+     * @param count
+     *      Number of entries in _destinations_.
+     * @param[out] copies
+     *      Array of at least _count_ entries; copies[i] is set to the message
+     *      being sent to destinations[i].
+     * @param options
+     *      Flags to request non-default sending behavior for every copy.
+     */
+    virtual void fanOut(const SocketAddress destinations[], size_t count,
+                        unique_ptr<OutMessage> copies[],
+                        Options options = Options::NONE) = 0;
+
+    /**
+     * Return the times at which this message passed key points on its way to
+     * the receiver, e.g. to tell time in the send queue from time waiting for
+     * grants or recovering lost packets in the latency of a slow request.
+     *
+     * Times are only recorded if the Homa library was built with the
+     * HOMA_MESSAGE_TIMING option; otherwise, every time is 0.
+     */
+    virtual Timing timing() const = 0;
+
   protected:
     /**
      * Signal that this message is no longer needed.  The caller should not
@@ -285,6 +414,24 @@ class Transport {
      */
     virtual Homa::unique_ptr<Homa::OutMessage> alloc(uint16_t sourcePort) = 0;
 
+    /**
+     * Allocate several Messages that can be sent with this Transport.
+     *
+     * Equivalent to calling alloc() once per message but cheaper, since the
+     * allocation is done as a batch.
+     *
+     * @param sourcePort
+     *      Port number of the socket from which the messages will be sent.
+     * @param[out] messages
+     *      Array of _count_ entries that is filled with the allocated
+     *      messages.
+     * @param count
+     *      Number of messages to allocate.
+     */
+    virtual void allocMany(uint16_t sourcePort,
+                           Homa::unique_ptr<Homa::OutMessage> messages[],
+                           size_t count) = 0;
+
     /**
      * Check for and return a Message sent to this Transport if available.
      *
@@ -294,6 +441,108 @@ class Transport {
      */
     virtual Homa::unique_ptr<Homa::InMessage> receive() = 0;
 
+    /**
+     * Check for and return a Message sent to the given port of this Transport
+     * if available.
+     *
+     * Messages are kept in a separate queue per destination port, so services
+     * sharing a Transport can each receive their own messages directly.
+     * Messages sent to any port are also returned by receive().
+     *
+     * @param port
+     *      Port number of the socket to which the message was sent.
+     * @return
+     *      Pointer to the received message, if any.  Otherwise, nullptr is
+     *      returned if no message has been delivered to the port.
+     */
+    virtual Homa::unique_ptr<Homa::InMessage> receive(uint16_t port) = 0;
+
+    /**
+     * Check for and return as many of the Messages sent to this Transport as
+     * are available, up to a limit.
+     *
+     * Equivalent to calling receive() until it returns nullptr or the limit
+     * is reached, but cheaper, since the messages are taken as a batch.
+     *
+     * @param[out] messages
+     *      Array of at least _maxMessages_ entries; the first entries are set
+     *      to the received messages.
+     * @param maxMessages
+     *      Maximum number of messages to return.
+     * @return
+     *      Number of messages returned in _messages_.
+     */
+    virtual size_t receiveMany(Homa::unique_ptr<Homa::InMessage> messages[],
+                               size_t maxMessages) = 0;
+
+    /**
+     * Return messages sent with OutMessage::NOTIFY_DONE that have become
+     * COMPLETED, FAILED, or CANCELED, up to a limit, in the order they became
+     * done.
+     *
+     * Each message is returned once; a message released before it is
+     * returned is not returned at all.  The messages remain owned by the
+     * application.
+     *
+     * @param[out] messages
+     *      Array of at least _maxMessages_ entries; the first entries are set
+     *      to the done messages.
+     * @param maxMessages
+     *      Maximum number of messages to return.
+     * @return
+     *      Number of messages returned in _messages_.
+     */
+    virtual size_t getDoneMessages(Homa::OutMessage* messages[],
+                                   size_t maxMessages) = 0;
+
+    /**
+     * Turn a received message into a message that can be sent onward.
+     *
+     * The packets of the received message are reused by the new message when
+     * possible, so the contents are not copied; the packets' headers are
+     * rewritten in place, which relies on the Driver giving the Transport
+     * exclusive use of received packets (see Driver::receivePackets()).  Any
+     * bytes stripped from the received message become reserved space at the
+     * beginning of the new message (see OutMessage::reserve()) which should be
+     * filled with OutMessage::prepend() before the new message is sent.  No
+     * other space is reserved, so at most as many bytes as were stripped may
+     * be prepended; none may be prepended if nothing was stripped.
+     *
+     * The received message is left empty but must still be acknowledged (or
+     * failed) and released as usual.
+     *
+     * @param message
+     *      Message returned by receive() on this transport.
+     * @param sourcePort
+     *      Port number of the socket from which the message will be sent.
+     * @return
+     *      A pointer to the message to be sent onward.
+     */
+    virtual Homa::unique_ptr<Homa::OutMessage> forward(
+        Homa::InMessage* message, uint16_t sourcePort) = 0;
+
+    /**
+     * Send a response to a request returned by receive().
+     *
+     * The response reuses the id of the request, so the requesting transport
+     * hands it directly to the request (see OutMessage::getResponse()) instead
+     * of returning it from receive().  The response also serves as the
+     * request's acknowledgement; acknowledge() should not be called on the
+     * request.
+     *
+     * @param request
+     *      Request being responded to.  The transport keeps the request until
+     *      the response is released.
+     * @param response
+     *      Message to send back to the request's source; it remains owned by
+     *      the caller.
+     * @param options
+     *      Flags to request non-default sending behavior.
+     */
+    virtual void reply(Homa::unique_ptr<Homa::InMessage> request,
+                       Homa::OutMessage* response,
+                       OutMessage::Options options = OutMessage::NONE) = 0;
+
     /**
      * Make incremental progress performing all Transport functionality.
      *
@@ -302,6 +551,90 @@ class Transport {
      */
     virtual void poll() = 0;
 
+    /**
+     * Describes the work a Transport still had pending when poll(uint64_t)
+     * returned.  Each flag is a hint; pending work is done by later calls.
+     */
+    struct PollHints {
+        /// Incoming packets may still be waiting to be processed.
+        bool receivePending;
+        /// Granted packets are waiting to be sent.
+        bool sendPending;
+        /// Incoming messages are still being scheduled and may need GRANTs.
+        bool grantsPending;
+        /// Timeouts were not checked for lack of budget.
+        bool timeoutsPending;
+    };
+
+    /**
+     * Make incremental progress performing Transport functionality, stopping
+     * once the given time budget is used up.
+     *
+     * One step of each stage (pollReceive(), pollSend(), pollGrants(), and
+     * pollTimeouts()) is run in turn while budget remains, and any budget left
+     * after that is used to process more incoming packets.  At least one burst
+     * of incoming packets is always processed.  No single step is preempted,
+     * so a call may overrun its budget by the length of one step.
+     *
+     * @param budgetNs
+     *      Time, in nanoseconds, this call may spend doing work.
+     * @return
+     *      Hints describing the work left for later calls.
+     */
+    virtual PollHints poll(uint64_t budgetNs) = 0;
+
+    /**
+     * Process one burst of incoming packets and hand any received responses
+     * to the requests waiting for them.
+     *
+     * This and the other poll stages can be called separately from poll(),
+     * possibly from different threads, so that the work of the Transport can
+     * be spread out or interleaved with application work.  Calling all of the
+     * stages is equivalent to calling poll().
+     *
+     * @return
+     *      True if more incoming packets may be waiting; false otherwise.
+     */
+    virtual bool pollReceive() = 0;
+
+    /**
+     * Send granted packets of outgoing messages, as many as the driver's
+     * queue allows.
+     *
+     * @return
+     *      True if granted packets are still waiting to be sent; false
+     *      otherwise.
+     */
+    virtual bool pollSend() = 0;
+
+    /**
+     * Send GRANTs to incoming messages according to the Transport's policy.
+     *
+     * @return
+     *      True if incoming messages are still being scheduled; false
+     *      otherwise.
+     */
+    virtual bool pollGrants() = 0;
+
+    /**
+     * Process every expired timeout (e.g. resend requests and liveness
+     * pings).  Returns almost immediately when no timeout is due, so it may
+     * be called as often as convenient, including from a thread dedicated to
+     * timeouts.
+     */
+    virtual void pollTimeouts() = 0;
+
+    /**
+     * Allow small messages to be held for a short time so that messages sent
+     * to the same destination can share a network packet.  Coalescing trades
+     * latency for fewer packets and is disabled by default.
+     *
+     * @param microseconds
+     *      Maximum time a message may be held before it is sent; 0 disables
+     *      coalescing.
+     */
+    virtual void setCoalescingBudget(uint64_t microseconds) = 0;
+
     /**
      * Return the driver that this transport uses to send and receive packets.
      */
@@ -311,6 +644,20 @@ class Transport {
      * Return this transport's unique identifier.
      */
     virtual uint64_t getId() = 0;
+
+    /**
+     * Fill the provided stats structure with the current performance
+     * statistics of this transport only.  Snapshots taken at different times
+     * can be compared with Perf::getRates().
+     */
+    virtual void getStats(Perf::Stats* stats) = 0;
+
+    /**
+     * Replace the contents of the provided vector with the statistics of
+     * this transport's recently active peers.  The number of peers tracked is
+     * bounded; the least recently active peers are forgotten first.
+     */
+    virtual void getPeerStats(std::vector<Perf::PeerStats>* stats) = 0;
 };
 
 /**
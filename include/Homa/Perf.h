@@ -16,8 +16,12 @@
 #ifndef HOMA_INCLUDE_HOMA_PERF_H
 #define HOMA_INCLUDE_HOMA_PERF_H
 
+#include <Homa/Driver.h>
+
 #include <atomic>
 #include <cstdint>
+#include <string>
+#include <vector>
 
 namespace Homa {
 namespace Perf {
@@ -112,13 +116,129 @@ struct Stats {
 
     /// Number of error packets received.
     uint64_t rx_error_pkts;
+
+    /// Number of bundle packets sent.
+    uint64_t tx_bundle_pkts;
+
+    /// Number of bundle packets received.
+    uint64_t rx_bundle_pkts;
+
+    /// Number of received packets dropped because they were truncated, had
+    /// an unknown version or opcode, or referred to an invalid packet index.
+    uint64_t rx_malformed_pkts;
 };
 
 /**
- * Fill the provided stats structure with the current performance statistics.
+ * Fill the provided stats structure with the current performance statistics
+ * summed over every Transport in the process, including those that have been
+ * destroyed.
  */
 void getStats(Stats* stats);
 
+/**
+ * Rates of activity between two Stats snapshots.
+ */
+struct Rates {
+    /// Time between the two snapshots in seconds.
+    double seconds;
+
+    /// Packets of any type sent per second.
+    double tx_pkts_per_second;
+
+    /// Packets of any type received per second.
+    double rx_pkts_per_second;
+
+    /// Bytes sent per second.
+    double tx_bytes_per_second;
+
+    /// Bytes received per second.
+    double rx_bytes_per_second;
+
+    /// CPU time spent actively processing Homa messages as a fraction of the
+    /// time between the snapshots; exceeds 1 when more than one thread was
+    /// active.
+    double active_fraction;
+};
+
+/**
+ * Compute the rates of activity between two snapshots of the same statistics
+ * (e.g. from two calls to getStats() or Transport::getStats()).  Taking
+ * snapshots does not stop the threads updating the statistics.
+ *
+ * @param before
+ *      The earlier snapshot.
+ * @param after
+ *      The later snapshot.
+ * @param[out] rates
+ *      Filled with the rates between the snapshots; all zero if the
+ *      snapshots were taken at the same time.
+ */
+void getRates(const Stats& before, const Stats& after, Rates* rates);
+
+/**
+ * Traffic and health statistics of one peer of a Transport.
+ */
+struct PeerStats {
+    /// Address of the peer.
+    IpAddress address;
+
+    /// Number of packets sent to the peer.
+    uint64_t tx_pkts;
+
+    /// Number of bytes sent to the peer.
+    uint64_t tx_bytes;
+
+    /// Number of packets received from the peer.
+    uint64_t rx_pkts;
+
+    /// Number of bytes received from the peer.
+    uint64_t rx_bytes;
+
+    /// Number of RESEND packets sent to the peer (i.e. requests for data the
+    /// peer sent but that did not arrive).
+    uint64_t tx_resend_pkts;
+
+    /// Number of RESEND packets received from the peer.
+    uint64_t rx_resend_pkts;
+
+    /// Number of messages to or from the peer that timed out.
+    uint64_t timeouts;
+
+    /// Number of messages to or from the peer currently being tracked.
+    uint64_t active_messages;
+
+    /// Bytes granted to the peer's messages, which are still being
+    /// scheduled, that have not been received yet.
+    uint64_t outstanding_grant_bytes;
+};
+
+/**
+ * Contention statistics for a named class of internal locks.
+ */
+struct LockStats {
+    /// Name shared by the locks.
+    std::string name;
+
+    /// Number of times one of the locks was acquired.
+    uint64_t acquisitions;
+
+    /// Number of acquisitions that had to wait for another holder.
+    uint64_t contended_acquisitions;
+
+    /// Total CPU time spent waiting to acquire one of the locks in cycles.
+    uint64_t spin_cycles;
+
+    /// Longest time one of the locks was held in cycles.
+    uint64_t max_hold_cycles;
+};
+
+/**
+ * Replace the contents of the provided vector with the current statistics of
+ * each named class of internal locks.  Locks are only profiled when Homa is
+ * built with HOMA_LOCK_PROFILING; otherwise, the vector is left empty.
+ */
+void getLockStats(std::vector<LockStats>* stats);
+
 }  // namespace Perf
 }  // namespace Homa
 
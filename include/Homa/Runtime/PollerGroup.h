@@ -0,0 +1,154 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_INCLUDE_HOMA_RUNTIME_POLLERGROUP_H
+#define HOMA_INCLUDE_HOMA_RUNTIME_POLLERGROUP_H
+
+#include <Homa/Homa.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace Homa {
+namespace Runtime {
+
+/**
+ * Owns a set of poller threads that drive a Transport, so applications don't
+ * each need their own poll loop.
+ *
+ * The Transport's poll stages (see Transport::pollReceive(), pollSend(),
+ * pollGrants(), and pollTimeouts()) are distributed across the threads, each
+ * of which can be pinned to a CPU.  A thread that finds no work backs off
+ * with progressively longer waits, using TPAUSE when the CPU supports it and
+ * PAUSE otherwise, and resumes spinning as soon as it finds work again.
+ *
+ * If more than one thread runs the RECEIVE stage, the Transport's driver must
+ * support concurrent calls to Driver::receivePackets().
+ *
+ * This class is thread-safe.
+ */
+class PollerGroup {
+  public:
+    /**
+     * Transport poll stages that a poller thread can run; combined as a bit
+     * mask.
+     */
+    enum Stage : unsigned {
+        RECEIVE = 1 << 0,   //< Transport::pollReceive()
+        SEND = 1 << 1,      //< Transport::pollSend()
+        GRANTS = 1 << 2,    //< Transport::pollGrants()
+        TIMEOUTS = 1 << 3,  //< Transport::pollTimeouts()
+        ALL_STAGES = RECEIVE | SEND | GRANTS | TIMEOUTS,
+    };
+
+    /**
+     * Describes how a PollerGroup should run its threads.
+     */
+    struct Config {
+        /// Number of poller threads.
+        int numThreads = 1;
+
+        /// CPU to which each poller thread is pinned, indexed by thread.
+        /// Threads without an entry, or with a negative entry, are not pinned.
+        std::vector<int> cpus;
+
+        /// Stages run by each poller thread, indexed by thread, as masks of
+        /// Stage values.  Threads without an entry run the stages chosen by
+        /// defaultStages().
+        std::vector<unsigned> stages;
+
+        /// Number of consecutive iterations without work after which a poller
+        /// thread starts to back off.
+        uint32_t idleSpins = 1000;
+
+        /// Longest a backed off poller thread waits between iterations, in
+        /// nanoseconds.
+        uint64_t maxBackoffNs = 20000;
+    };
+
+    /**
+     * Time spent by one poller thread.
+     */
+    struct ThreadStats {
+        /// Cycles spent in iterations that found work.
+        uint64_t busyCycles;
+        /// Cycles spent in iterations that found no work, including backoff.
+        uint64_t idleCycles;
+        /// Number of iterations of the poll loop.
+        uint64_t iterations;
+    };
+
+    PollerGroup(Transport* transport, const Config& config);
+    ~PollerGroup();
+
+    int numThreads() const;
+    unsigned getStages(int thread) const;
+    ThreadStats getStats(int thread) const;
+    static unsigned defaultStages(int thread, int numThreads);
+
+  private:
+    /**
+     * State of one poller thread.
+     */
+    struct Poller {
+        Poller()
+            : thread()
+            , stages(0)
+            , busyCycles(0)
+            , idleCycles(0)
+            , iterations(0)
+        {}
+
+        /// The poller thread.
+        std::thread thread;
+        /// Stages this thread runs.
+        unsigned stages;
+        /// See ThreadStats::busyCycles; written only by the poller thread.
+        std::atomic<uint64_t> busyCycles;
+        /// See ThreadStats::idleCycles; written only by the poller thread.
+        std::atomic<uint64_t> idleCycles;
+        /// See ThreadStats::iterations; written only by the poller thread.
+        std::atomic<uint64_t> iterations;
+    };
+
+    void run(Poller* poller);
+
+    /// Transport driven by the poller threads.
+    Transport* const transport;
+
+    /// Number of consecutive idle iterations before backing off.
+    const uint32_t idleSpins;
+
+    /// Longest backoff wait in cycles.
+    const uint64_t maxBackoffCycles;
+
+    /// Cleared to ask the poller threads to exit.
+    std::atomic<bool> running;
+
+    /// One entry per poller thread.
+    std::vector<std::unique_ptr<Poller>> pollers;
+
+    // Disable copy and assign
+    PollerGroup(const PollerGroup&) = delete;
+    PollerGroup& operator=(const PollerGroup&) = delete;
+};
+
+}  // namespace Runtime
+}  // namespace Homa
+
+#endif  // HOMA_INCLUDE_HOMA_RUNTIME_POLLERGROUP_H
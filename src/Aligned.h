@@ -0,0 +1,155 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_ALIGNED_H
+#define HOMA_ALIGNED_H
+
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace Homa {
+namespace Aligned {
+
+/**
+ * Allocate memory aligned for objects of type T.
+ *
+ * Plain operator new only honors alignments larger than
+ * alignof(std::max_align_t) from C++17 onward, and the library is built as
+ * C++11; types declared alignas(64) to keep them on their own cache lines
+ * must be allocated through this function instead.
+ *
+ * @param count
+ *      Number of objects of type T the memory must hold.
+ * @return
+ *      Uninitialized memory; must be released with std::free().
+ * @throw std::bad_alloc
+ *      The memory could not be allocated.
+ */
+template <typename T>
+void*
+allocate(size_t count)
+{
+    size_t alignment = alignof(T) < sizeof(void*) ? sizeof(void*) : alignof(T);
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignment, sizeof(T) * count) != 0) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+/**
+ * Allocate and construct an object of type T at its declared alignment.
+ *
+ * @param args
+ *      Arguments passed to T's constructor.
+ * @return
+ *      The new object; must be freed with destroy().
+ */
+template <typename T, typename... Args>
+T*
+create(Args&&... args)
+{
+    void* memory = allocate<T>(1);
+    try {
+        return new (memory) T(std::forward<Args>(args)...);
+    } catch (...) {
+        std::free(memory);
+        throw;
+    }
+}
+
+/**
+ * Destroy and free an object allocated by create().
+ */
+template <typename T>
+void
+destroy(T* object)
+{
+    if (object != nullptr) {
+        object->~T();
+        std::free(object);
+    }
+}
+
+/**
+ * Allocate and default-construct an array of objects of type T, each at its
+ * declared alignment.
+ *
+ * @param count
+ *      Number of objects in the array.
+ * @return
+ *      The first object in the array; must be freed with destroyArray().
+ */
+template <typename T>
+T*
+createArray(size_t count)
+{
+    T* array = static_cast<T*>(allocate<T>(count));
+    size_t constructed = 0;
+    try {
+        for (; constructed < count; ++constructed) {
+            new (&array[constructed]) T();
+        }
+    } catch (...) {
+        while (constructed > 0) {
+            array[--constructed].~T();
+        }
+        std::free(array);
+        throw;
+    }
+    return array;
+}
+
+/**
+ * Destroy and free an array allocated by createArray().
+ *
+ * @param array
+ *      First object in the array.
+ * @param count
+ *      Number of objects in the array; must match the createArray() call.
+ */
+template <typename T>
+void
+destroyArray(T* array, size_t count)
+{
+    if (array != nullptr) {
+        while (count > 0) {
+            array[--count].~T();
+        }
+        std::free(array);
+    }
+}
+
+/**
+ * Deleter that lets std::unique_ptr own an object allocated by create().
+ */
+template <typename T>
+struct Deleter {
+    void operator()(T* object) const
+    {
+        destroy(object);
+    }
+};
+
+/// std::unique_ptr for objects allocated by create().
+template <typename T>
+using unique_ptr = std::unique_ptr<T, Deleter<T>>;
+
+}  // namespace Aligned
+}  // namespace Homa
+
+#endif  // HOMA_ALIGNED_H
@@ -0,0 +1,74 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Aligned.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+namespace Homa {
+namespace {
+
+struct alignas(64) Line {
+    explicit Line(int value = 7)
+        : value(value)
+    {
+        ++liveCount;
+    }
+    ~Line()
+    {
+        --liveCount;
+    }
+    int value;
+    static int liveCount;
+};
+int Line::liveCount = 0;
+
+TEST(AlignedTest, create)
+{
+    Line* line = Aligned::create<Line>(42);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(line) % 64);
+    EXPECT_EQ(42, line->value);
+    EXPECT_EQ(1, Line::liveCount);
+    Aligned::destroy(line);
+    EXPECT_EQ(0, Line::liveCount);
+    Aligned::destroy<Line>(nullptr);
+}
+
+TEST(AlignedTest, unique_ptr)
+{
+    {
+        Aligned::unique_ptr<Line> line(Aligned::create<Line>());
+        EXPECT_EQ(7, line->value);
+        EXPECT_EQ(1, Line::liveCount);
+    }
+    EXPECT_EQ(0, Line::liveCount);
+}
+
+TEST(AlignedTest, createArray)
+{
+    Line* lines = Aligned::createArray<Line>(5);
+    EXPECT_EQ(5, Line::liveCount);
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(&lines[i]) % 64);
+        EXPECT_EQ(7, lines[i].value);
+    }
+    Aligned::destroyArray(lines, 5);
+    EXPECT_EQ(0, Line::liveCount);
+}
+
+}  // namespace
+}  // namespace Homa
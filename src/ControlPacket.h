@@ -30,6 +30,8 @@ namespace ControlPacket {
  *
  * @param driver
  *      Driver with which to send the packet.
+ * @param perf
+ *      Performance counters of the Transport sending the packet.
  * @param address
  *      Destination IP address for the packet to be sent.
  * @param args
@@ -37,12 +39,14 @@ namespace ControlPacket {
  */
 template <typename PacketHeaderType, typename... Args>
 void
-send(Driver* driver, IpAddress address, Args&&... args)
+send(Driver* driver, Perf::TransportCounters* perf, IpAddress address,
+     Args&&... args)
 {
     Driver::Packet* packet = driver->allocPacket();
     new (packet->payload) PacketHeaderType(static_cast<Args&&>(args)...);
     packet->length = sizeof(PacketHeaderType);
-    Perf::counters.tx_bytes.add(packet->length);
+    perf->local().tx_bytes.add(packet->length);
+    perf->peers.find(address)->sent(packet->length);
     driver->sendPacket(packet, address, driver->getHighestPacketPriority());
     driver->releasePackets(&packet, 1);
 }
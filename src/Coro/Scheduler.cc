@@ -0,0 +1,362 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Coro/Scheduler.h>
+
+#include <exception>
+#include <utility>
+
+namespace Homa {
+namespace Coro {
+
+/**
+ * Exceptions may not escape a Task; there is no one to rethrow them to.
+ */
+void
+Task::promise_type::unhandled_exception()
+{
+    std::terminate();
+}
+
+/**
+ * Construct a Task that owns the given coroutine.
+ */
+Task::Task(std::coroutine_handle<promise_type> handle)
+    : handle(handle)
+{}
+
+/**
+ * Move constructor; the other Task gives up its coroutine.
+ */
+Task::Task(Task&& other) noexcept
+    : handle(std::exchange(other.handle, nullptr))
+{}
+
+/**
+ * Move assignment; any coroutine owned by this Task is destroyed.
+ */
+Task&
+Task::operator=(Task&& other) noexcept
+{
+    if (this != &other) {
+        if (handle) {
+            handle.destroy();
+        }
+        handle = std::exchange(other.handle, nullptr);
+    }
+    return *this;
+}
+
+/**
+ * Destroy the coroutine if it was never handed to a Scheduler.
+ */
+Task::~Task()
+{
+    if (handle) {
+        handle.destroy();
+    }
+}
+
+/**
+ * Suspend the awaiting coroutine until the message is done.
+ */
+void
+Scheduler::SendAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+    scheduler->sendWaiters[message] = handle;
+}
+
+/**
+ * Take a received message right away if one is available.
+ */
+bool
+Scheduler::ReceiveAwaitable::await_ready() noexcept
+{
+    message = tryReceive();
+    return message != nullptr;
+}
+
+/**
+ * Suspend the awaiting coroutine until a message is received.
+ */
+void
+Scheduler::ReceiveAwaitable::await_suspend(std::coroutine_handle<> handle)
+{
+    if (anyPort) {
+        scheduler->anyPortWaiters.push_back({this, handle});
+    } else {
+        scheduler->portWaiters[port].push_back({this, handle});
+    }
+}
+
+/**
+ * Return a received message this awaitable can yield, if one is available.
+ */
+Homa::unique_ptr<InMessage>
+Scheduler::ReceiveAwaitable::tryReceive()
+{
+    if (anyPort) {
+        return scheduler->transport->receive();
+    }
+    return scheduler->transport->receive(port);
+}
+
+/**
+ * Construct a Scheduler.
+ *
+ * @param transport
+ *      Transport through which the Scheduler's coroutines send and receive
+ *      messages.  The transport must outlive the Scheduler.
+ */
+Scheduler::Scheduler(Transport* transport)
+    : transport(transport)
+    , tasks()
+    , ready()
+    , sendWaiters()
+    , portWaiters()
+    , anyPortWaiters()
+{}
+
+/**
+ * Scheduler destructor.  Coroutines that have not finished are destroyed
+ * where they are suspended.
+ */
+Scheduler::~Scheduler()
+{
+    for (std::coroutine_handle<Task::promise_type> task : tasks) {
+        task.destroy();
+    }
+}
+
+/**
+ * Start running a coroutine.  The coroutine first runs during the next call
+ * to poll().
+ *
+ * @param task
+ *      Coroutine to run; the Scheduler takes ownership of it.
+ */
+void
+Scheduler::spawn(Task task)
+{
+    std::coroutine_handle<Task::promise_type> handle =
+        std::exchange(task.handle, nullptr);
+    tasks.push_back(handle);
+    ready.push_back(handle);
+}
+
+/**
+ * Make incremental progress on the Transport and run every coroutine whose
+ * awaited operation has finished.
+ *
+ * This method should be called in a loop by the thread that owns the
+ * Scheduler; it takes the place of calling Transport::poll() directly.
+ */
+void
+Scheduler::poll()
+{
+    transport->poll();
+
+    // Hand received messages to waiting coroutines; coroutines waiting on
+    // the same port get messages in the order they started waiting.  A port
+    // is only checked until it has no more messages, so each poll costs one
+    // receive per port with waiters rather than one per waiter.
+    for (auto it = portWaiters.begin(); it != portWaiters.end();) {
+        std::deque<ReceiveWaiter>& waiters = it->second;
+        while (!waiters.empty() && tryResume(waiters.front())) {
+            waiters.pop_front();
+        }
+        if (waiters.empty()) {
+            it = portWaiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    while (!anyPortWaiters.empty() && tryResume(anyPortWaiters.front())) {
+        anyPortWaiters.pop_front();
+    }
+
+    // Wake coroutines whose messages are done.  Messages are sent with
+    // OutMessage::NOTIFY_DONE, so only those that finished are looked at.
+    OutMessage* done[MAX_DONE_BATCH];
+    size_t numDone;
+    do {
+        numDone = transport->getDoneMessages(done, MAX_DONE_BATCH);
+        for (size_t i = 0; i < numDone; ++i) {
+            auto it = sendWaiters.find(done[i]);
+            if (it != sendWaiters.end()) {
+                ready.push_back(it->second);
+                sendWaiters.erase(it);
+            }
+        }
+    } while (numDone == MAX_DONE_BATCH);
+
+    // Coroutines made ready while running are run in this pass as well.
+    while (!ready.empty()) {
+        std::coroutine_handle<> handle = ready.front();
+        ready.pop_front();
+        handle.resume();
+    }
+
+    for (size_t i = 0; i < tasks.size();) {
+        if (tasks[i].done()) {
+            tasks[i].destroy();
+            tasks[i] = tasks.back();
+            tasks.pop_back();
+        } else {
+            ++i;
+        }
+    }
+}
+
+/**
+ * Return the number of spawned coroutines that have not yet finished.
+ */
+size_t
+Scheduler::numTasks() const
+{
+    return tasks.size();
+}
+
+/**
+ * Send a message and wait for it to be done.
+ *
+ * @param message
+ *      Message to send; the caller keeps ownership.
+ * @param destination
+ *      Where the message should be sent.
+ * @param options
+ *      Flags to request non-default send behavior.
+ * @return
+ *      Awaitable that yields the message's final OutMessage::Status.
+ *
+ * @sa Homa::OutMessage::send()
+ */
+Scheduler::SendAwaitable
+Scheduler::send(OutMessage* message, SocketAddress destination,
+                OutMessage::Options options)
+{
+    message->send(destination, options | OutMessage::NOTIFY_DONE);
+    return SendAwaitable(this, message);
+}
+
+/**
+ * Send a request and wait for its response.
+ *
+ * @param request
+ *      Request to send; the caller keeps ownership.
+ * @param destination
+ *      Where the request should be sent.
+ * @param options
+ *      Flags to request non-default send behavior.
+ * @return
+ *      Awaitable that yields the response, or nullptr if the request finished
+ *      without one (e.g. it failed, or the receiver did not reply).
+ *
+ * @sa Homa::Transport::reply()
+ */
+Scheduler::CallAwaitable
+Scheduler::call(OutMessage* request, SocketAddress destination,
+                OutMessage::Options options)
+{
+    return CallAwaitable(send(request, destination, options));
+}
+
+/**
+ * Wait for a message to be received.
+ *
+ * @return
+ *      Awaitable that yields the received message.
+ *
+ * @sa Homa::Transport::receive()
+ */
+Scheduler::ReceiveAwaitable
+Scheduler::receive()
+{
+    return ReceiveAwaitable(this, true, 0);
+}
+
+/**
+ * Wait for a message sent to the given port to be received.
+ *
+ * @param port
+ *      Port to which the message must have been sent.
+ * @return
+ *      Awaitable that yields the received message.
+ *
+ * @sa Homa::Transport::receive(uint16_t)
+ */
+Scheduler::ReceiveAwaitable
+Scheduler::receive(uint16_t port)
+{
+    return ReceiveAwaitable(this, false, port);
+}
+
+/**
+ * Send a response to a received request and wait for it to be done.
+ *
+ * @param request
+ *      Request being answered.
+ * @param response
+ *      Response to send; the caller keeps ownership.
+ * @param options
+ *      Flags to request non-default send behavior.
+ * @return
+ *      Awaitable that yields the response's final OutMessage::Status.
+ *
+ * @sa Homa::Transport::reply()
+ */
+Scheduler::SendAwaitable
+Scheduler::reply(Homa::unique_ptr<InMessage> request, OutMessage* response,
+                 OutMessage::Options options)
+{
+    transport->reply(std::move(request), response,
+                     options | OutMessage::NOTIFY_DONE);
+    return SendAwaitable(this, response);
+}
+
+/**
+ * Hand a received message to a waiting coroutine and make the coroutine
+ * ready to run, if a message it can take is available.
+ *
+ * @param waiter
+ *      Coroutine waiting in receive().
+ * @return
+ *      True if the coroutine got a message; false if none was available.
+ */
+bool
+Scheduler::tryResume(const ReceiveWaiter& waiter)
+{
+    waiter.awaitable->message = waiter.awaitable->tryReceive();
+    if (!waiter.awaitable->message) {
+        return false;
+    }
+    ready.push_back(waiter.handle);
+    return true;
+}
+
+/**
+ * Return true if a message with the given status will make no further
+ * progress.
+ */
+bool
+Scheduler::isDone(OutMessage::Status status)
+{
+    return status == OutMessage::Status::COMPLETED ||
+           status == OutMessage::Status::FAILED ||
+           status == OutMessage::Status::CANCELED;
+}
+
+}  // namespace Coro
+}  // namespace Homa
@@ -0,0 +1,235 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Coro/Scheduler.h>
+#include <Homa/Drivers/Fake/FakeDriver.h>
+#include <gtest/gtest.h>
+
+namespace Homa {
+namespace Coro {
+namespace {
+
+class SchedulerTest : public ::testing::Test {
+  public:
+    SchedulerTest()
+        : clientDriver()
+        , serverDriver()
+        , client(Transport::create(&clientDriver, 1))
+        , server(Transport::create(&serverDriver, 2))
+        , clientScheduler(client)
+        , serverScheduler(server)
+        , serverAddress{serverDriver.getLocalAddress(), 60001}
+    {}
+
+    /// Poll both schedulers until the client has no tasks left.
+    void run()
+    {
+        for (int i = 0; i < 10000 && clientScheduler.numTasks() != 0; ++i) {
+            clientScheduler.poll();
+            serverScheduler.poll();
+        }
+    }
+
+    Drivers::Fake::FakeDriver clientDriver;
+    Drivers::Fake::FakeDriver serverDriver;
+    Transport* client;
+    Transport* server;
+    Scheduler clientScheduler;
+    Scheduler serverScheduler;
+    SocketAddress serverAddress;
+};
+
+Task
+sendOne(Scheduler* scheduler, Transport* transport, SocketAddress destination,
+        OutMessage::Status* status)
+{
+    Homa::unique_ptr<OutMessage> message = transport->alloc(0);
+    uint32_t value = 42;
+    message->append(&value, sizeof(value));
+    *status = co_await scheduler->send(message.get(), destination);
+}
+
+Task
+receiveOne(Scheduler* scheduler, uint32_t* value)
+{
+    Homa::unique_ptr<InMessage> message = co_await scheduler->receive();
+    message->get(0, value, sizeof(*value));
+    message->acknowledge();
+}
+
+Task
+receiveOnPort(Scheduler* scheduler, uint16_t port, uint16_t* order,
+              uint16_t* next)
+{
+    Homa::unique_ptr<InMessage> message = co_await scheduler->receive(port);
+    message->acknowledge();
+    order[(*next)++] = port;
+}
+
+Task
+receiveInTurn(Scheduler* scheduler, uint16_t port, int turn, int* order,
+              int* next)
+{
+    Homa::unique_ptr<InMessage> message = co_await scheduler->receive(port);
+    message->acknowledge();
+    order[(*next)++] = turn;
+}
+
+Task
+echoServer(Scheduler* scheduler, Transport* transport, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        Homa::unique_ptr<InMessage> request = co_await scheduler->receive();
+        uint32_t value = 0;
+        request->get(0, &value, sizeof(value));
+        Homa::unique_ptr<OutMessage> response = transport->alloc(0);
+        value += 1;
+        response->append(&value, sizeof(value));
+        co_await scheduler->reply(std::move(request), response.get());
+    }
+}
+
+Task
+callOne(Scheduler* scheduler, Transport* transport, SocketAddress destination,
+        uint32_t value, uint32_t* result)
+{
+    Homa::unique_ptr<OutMessage> request = transport->alloc(0);
+    request->append(&value, sizeof(value));
+    Homa::unique_ptr<InMessage> response =
+        co_await scheduler->call(request.get(), destination);
+    if (response) {
+        response->get(0, result, sizeof(*result));
+        response->acknowledge();
+    }
+}
+
+Task
+finishImmediately(int* count)
+{
+    ++*count;
+    co_return;
+}
+
+TEST_F(SchedulerTest, spawn)
+{
+    int count = 0;
+    clientScheduler.spawn(finishImmediately(&count));
+    EXPECT_EQ(1U, clientScheduler.numTasks());
+    EXPECT_EQ(0, count);
+
+    clientScheduler.poll();
+    EXPECT_EQ(1, count);
+    EXPECT_EQ(0U, clientScheduler.numTasks());
+}
+
+TEST_F(SchedulerTest, send)
+{
+    OutMessage::Status status = OutMessage::Status::NOT_STARTED;
+    uint32_t value = 0;
+    clientScheduler.spawn(
+        sendOne(&clientScheduler, client, serverAddress, &status));
+    serverScheduler.spawn(receiveOne(&serverScheduler, &value));
+    run();
+    EXPECT_EQ(0U, clientScheduler.numTasks());
+    EXPECT_EQ(0U, serverScheduler.numTasks());
+    EXPECT_EQ(OutMessage::Status::COMPLETED, status);
+    EXPECT_EQ(42U, value);
+}
+
+TEST_F(SchedulerTest, receive_port)
+{
+    OutMessage::Status status[2];
+    uint16_t order[2] = {};
+    uint16_t next = 0;
+    serverScheduler.spawn(receiveOnPort(&serverScheduler, 81, order, &next));
+    serverScheduler.spawn(receiveOnPort(&serverScheduler, 80, order, &next));
+    clientScheduler.spawn(sendOne(&clientScheduler, client,
+                                  {serverAddress.ip, 80}, &status[0]));
+    run();
+    EXPECT_EQ(1U, serverScheduler.numTasks());
+    clientScheduler.spawn(sendOne(&clientScheduler, client,
+                                  {serverAddress.ip, 81}, &status[1]));
+    run();
+    EXPECT_EQ(0U, serverScheduler.numTasks());
+    EXPECT_EQ(80U, order[0]);
+    EXPECT_EQ(81U, order[1]);
+}
+
+TEST_F(SchedulerTest, receive_samePort)
+{
+    OutMessage::Status status[2];
+    int order[3] = {};
+    int next = 0;
+    for (int i = 0; i < 3; ++i) {
+        serverScheduler.spawn(
+            receiveInTurn(&serverScheduler, 80, i, order, &next));
+    }
+    for (int i = 0; i < 2; ++i) {
+        clientScheduler.spawn(sendOne(&clientScheduler, client,
+                                      {serverAddress.ip, 80}, &status[i]));
+    }
+    run();
+    EXPECT_EQ(1U, serverScheduler.numTasks());
+    EXPECT_EQ(2, next);
+    EXPECT_EQ(0, order[0]);
+    EXPECT_EQ(1, order[1]);
+}
+
+TEST_F(SchedulerTest, send_doneMessagesTaken)
+{
+    OutMessage::Status status = OutMessage::Status::NOT_STARTED;
+    uint32_t value = 0;
+    clientScheduler.spawn(
+        sendOne(&clientScheduler, client, serverAddress, &status));
+    serverScheduler.spawn(receiveOne(&serverScheduler, &value));
+    run();
+    EXPECT_EQ(OutMessage::Status::COMPLETED, status);
+
+    // The Scheduler took the message's notification before releasing it.
+    OutMessage* done[1];
+    EXPECT_EQ(0U, client->getDoneMessages(done, 1));
+}
+
+TEST_F(SchedulerTest, call_concurrent)
+{
+    const int count = 50;
+    uint32_t results[count] = {};
+    serverScheduler.spawn(echoServer(&serverScheduler, server, count));
+    for (int i = 0; i < count; ++i) {
+        clientScheduler.spawn(callOne(&clientScheduler, client,
+                                      serverAddress, i, &results[i]));
+    }
+    run();
+    EXPECT_EQ(0U, clientScheduler.numTasks());
+    for (int i = 0; i < count; ++i) {
+        EXPECT_EQ(i + 1U, results[i]);
+    }
+}
+
+TEST_F(SchedulerTest, destructor_suspendedTask)
+{
+    uint32_t value = 0;
+    {
+        Scheduler scheduler(client);
+        scheduler.spawn(receiveOne(&scheduler, &value));
+        scheduler.poll();
+        EXPECT_EQ(1U, scheduler.numTasks());
+    }
+    EXPECT_EQ(0U, value);
+}
+
+}  // namespace
+}  // namespace Coro
+}  // namespace Homa
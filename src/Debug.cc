@@ -16,18 +16,24 @@
 
 #include "Debug.h"
 
+#include "Aligned.h"
+#include "MpmcQueue.h"
 #include "StringUtil.h"
 #include "ThreadId.h"
 
 #include <strings.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 
 namespace Homa {
@@ -108,7 +114,7 @@ std::string processName = StringUtil::format("%u", getpid());
 namespace Internal {
 
 /**
- * Protects #logPolicy and #isLoggingCache.
+ * Protects #logPolicy, #isLoggingCache, and #logSites.
  */
 std::mutex mutex;
 
@@ -134,6 +140,14 @@ std::vector<std::pair<std::string, std::string>> logPolicy;
  */
 std::unordered_map<const char*, LogLevel> isLoggingCache;
 
+/**
+ * Head of the linked list of LogSite objects that have been resolved; these
+ * must be updated whenever the logPolicy changes.
+ *
+ * Protected by #mutex.
+ */
+LogSite* logSites = nullptr;
+
 /**
  * Where log messages go (unless logHandler is set).
  */
@@ -146,6 +160,104 @@ FILE* stream = stderr;
  */
 std::function<void(DebugMessage)> logHandler;
 
+/**
+ * A log message that has been queued for the asynchronous log writer.
+ */
+struct LogEntry {
+    /// The level of importance of the message.
+    LogLevel level;
+    /// The output of __FILE__.
+    const char* fileName;
+    /// The output of __LINE__.
+    uint32_t lineNum;
+    /// The output of __FUNCTION__.
+    const char* functionName;
+    /// When the message was logged.
+    struct timespec time;
+    /// ThreadId of the thread that logged the message.
+    uint64_t threadId;
+    /// The contents of the message.
+    std::string message;
+};
+
+/**
+ * State of the asynchronous log writer.
+ */
+struct AsyncLog {
+    /**
+     * Constructor.
+     *
+     * @param capacity
+     *      Maximum number of messages that can be queued.
+     */
+    explicit AsyncLog(size_t capacity)
+        : queue(capacity)
+        , written(0)
+        , stop(false)
+        , thread()
+    {}
+
+    /// Messages waiting to be written.
+    MpmcQueue<LogEntry> queue;
+
+    /// Number of messages removed from the queue that have been completely
+    /// written out; used by flushLog().
+    std::atomic<uint64_t> written;
+
+    /// Set to tell #thread to exit once the queue is empty.
+    std::atomic<bool> stop;
+
+    /// Background thread that writes out queued messages.
+    std::thread thread;
+};
+
+/**
+ * Serializes calls to setAsyncLogging().
+ */
+std::mutex asyncMutex;
+
+/**
+ * The active asynchronous log writer, or nullptr if log messages should be
+ * written synchronously.
+ */
+std::atomic<AsyncLog*> asyncLog(nullptr);
+
+/**
+ * Number of threads that may be using #asyncLog (e.g. pushing a message onto
+ * its queue); setAsyncLogging() waits for this to drop to zero before it
+ * frees a disabled writer.
+ */
+std::atomic<uint64_t> asyncLogUsers(0);
+
+/**
+ * Number of log messages dropped because the asynchronous log queue was full.
+ */
+std::atomic<uint64_t> droppedMessages(0);
+
+/**
+ * Registers the calling thread in #asyncLogUsers for the lifetime of this
+ * object, so that the asynchronous log writer it loads cannot be freed while
+ * it is being used.
+ */
+struct AsyncLogUser {
+    AsyncLogUser()
+        : async()
+    {
+        // Sequentially consistent so that either setAsyncLogging() sees this
+        // user or this user sees asyncLog cleared.
+        asyncLogUsers.fetch_add(1);
+        async = asyncLog.load();
+    }
+
+    ~AsyncLogUser()
+    {
+        asyncLogUsers.fetch_sub(1, std::memory_order_release);
+    }
+
+    /// The active asynchronous log writer, or nullptr if none.
+    AsyncLog* async;
+};
+
 /**
  * Convert a log level to a (static) string.
  * PANICs if the string is not a valid log level (case insensitive).
@@ -256,6 +368,168 @@ relativeFileName(const char* fileName)
         return fileName;
 }
 
+/**
+ * Return the log level for the given file, consulting and filling in
+ * #isLoggingCache.
+ *
+ * Must be called with #mutex held.
+ *
+ * @param fileName
+ *      This should be a string literal, probably __FILE__, since the result is
+ *      cached based on the memory address pointed to by 'fileName'.
+ */
+LogLevel
+getCachedLogLevel(const char* fileName)
+{
+    auto it = isLoggingCache.find(fileName);
+    if (it == isLoggingCache.end()) {
+        LogLevel verbosity = getLogLevel(relativeFileName(fileName));
+        isLoggingCache[fileName] = verbosity;
+        return verbosity;
+    }
+    return it->second;
+}
+
+/**
+ * Write a log message to the log handler, if one is set, or the log file.
+ *
+ * @param level
+ *      The level of importance of the message.
+ * @param fileName
+ *      The output of __FILE__.
+ * @param lineNum
+ *      The output of __LINE__.
+ * @param functionName
+ *      The output of __FUNCTION__.
+ * @param now
+ *      When the message was logged.
+ * @param threadName
+ *      Name of the thread that logged the message.
+ * @param message
+ *      A descriptive message to print, which should not include a line break
+ *      at the end.
+ */
+void
+writeMessage(LogLevel level, const char* fileName, uint32_t lineNum,
+             const char* functionName, const struct timespec& now,
+             const std::string& threadName, const char* message)
+{
+    if (logHandler) {
+        DebugMessage d;
+        d.filename = relativeFileName(fileName);
+        d.linenum = int(lineNum);
+        d.function = functionName;
+        d.logLevel = int(level);
+        d.logLevelString = logLevelToString(level);
+        d.processName = processName;
+        d.threadName = threadName;
+        d.message = message;
+        (logHandler)(d);
+        return;
+    }
+
+    // Failures are a little annoying here, since we can't exactly log
+    // errors that come up.
+    char formattedSeconds[64];  // a human-readable string now.tv_sec
+    bool ok = false;
+    {  // First, try gmtime and strftime.
+        struct tm calendarTime;
+        if (gmtime_r(&now.tv_sec, &calendarTime) != NULL) {
+            ok = (strftime(formattedSeconds, sizeof(formattedSeconds), "%F %T",
+                           &calendarTime) > 0);
+        }
+    }
+    if (!ok) {  // If that failed, use the raw number.
+        snprintf(formattedSeconds, sizeof(formattedSeconds), "%010lu",
+                 now.tv_sec);
+        formattedSeconds[sizeof(formattedSeconds) - 1] = '\0';
+    }
+
+    fprintf(stream, "%s.%06lu %s:%d in %s() %s[%s:%s]: %s\n", formattedSeconds,
+            now.tv_nsec / 1000, relativeFileName(fileName), lineNum,
+            functionName, logLevelToString(level), processName.c_str(),
+            threadName.c_str(), message);
+
+    fflush(stream);
+}
+
+/**
+ * Write out the message at the front of an asynchronous log queue, if any.
+ *
+ * @param async
+ *      Asynchronous log writer whose queue should be drained.
+ * @return
+ *      True if a message was written; false if the queue was empty.
+ */
+bool
+writeQueuedMessage(AsyncLog* async)
+{
+    bool found = async->queue.pop([](LogEntry& entry) {
+        writeMessage(entry.level, entry.fileName, entry.lineNum,
+                     entry.functionName, entry.time,
+                     ThreadId::getName(entry.threadId),
+                     entry.message.c_str());
+    });
+    if (found) {
+        async->written.fetch_add(1, std::memory_order_release);
+    }
+    return found;
+}
+
+/**
+ * Decide whether a rate-limited call site may log a message at the given time.
+ *
+ * @param limit
+ *      The call site's rate limit.
+ * @param nowNs
+ *      Current time from a monotonic clock, in nanoseconds.
+ * @param[out] suppressed
+ *      Set to the number of messages suppressed since the site last logged,
+ *      if the message is admitted.
+ * @return
+ *      True if the message should be logged; false if it was suppressed.
+ */
+bool
+admitLog(LogRateLimit* limit, uint64_t nowNs, uint64_t* suppressed)
+{
+    uint64_t next = limit->nextTimeNs.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t start = std::max(next, nowNs);
+        if (start - nowNs > limit->burstNs) {
+            limit->suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (limit->nextTimeNs.compare_exchange_weak(
+                next, start + limit->intervalNs, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    *suppressed = limit->suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Main loop of the asynchronous log writer's background thread.  Writes
+ * queued messages until told to stop and the queue has been emptied.
+ *
+ * @param async
+ *      Asynchronous log writer whose queue should be drained.
+ */
+void
+asyncLogMain(AsyncLog* async)
+{
+    while (true) {
+        bool stopping = async->stop.load(std::memory_order_acquire);
+        if (writeQueuedMessage(async)) {
+            continue;
+        }
+        if (stopping && async->queue.empty()) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
 }  // namespace Internal
 using namespace Internal;  // NOLINT
 
@@ -294,6 +568,11 @@ setLogPolicy(const std::vector<std::pair<std::string, std::string>>& newPolicy)
     std::lock_guard<std::mutex> lockGuard(mutex);
     logPolicy = newPolicy;
     isLoggingCache.clear();
+    for (LogSite* site = logSites; site != nullptr; site = site->next) {
+        LogLevel verbosity = getCachedLogLevel(site->fileName);
+        site->verbosity.store(static_cast<int>(verbosity),
+                              std::memory_order_relaxed);
+    }
 }
 
 // See <Homa/Debug.h>
@@ -384,20 +663,60 @@ bool
 isLogging(LogLevel level, const char* fileName)
 {
     std::lock_guard<std::mutex> lockGuard(mutex);
-    LogLevel verbosity;
-    auto it = isLoggingCache.find(fileName);
-    if (it == isLoggingCache.end()) {
-        verbosity = getLogLevel(relativeFileName(fileName));
-        isLoggingCache[fileName] = verbosity;
-    } else {
-        verbosity = it->second;
-    }
+    LogLevel verbosity = getCachedLogLevel(fileName);
     return uint32_t(level) <= uint32_t(verbosity);
 }
 
+/**
+ * Decide whether a rate-limited call site may log a message now.
+ * This is normally called by LOG_RATE_LIMITED().
+ *
+ * @param limit
+ *      The call site's statically allocated LogRateLimit.
+ * @param[out] suppressed
+ *      Set to the number of messages suppressed since the site last logged,
+ *      if the message is admitted.
+ * @return
+ *      True if the message should be logged; false if it was suppressed.
+ */
+bool
+admitLog(LogRateLimit* limit, uint64_t* suppressed)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t nowNs = uint64_t(now.tv_sec) * 1000000000UL + now.tv_nsec;
+    return Internal::admitLog(limit, nowNs, suppressed);
+}
+
+/**
+ * Compute the verbosity of a LogSite from the current log policy and register
+ * the site so that it is updated by future calls to setLogPolicy().
+ * This is called by isLogging() the first time a site is checked.
+ *
+ * @param site
+ *      The call site to resolve; its fileName should be a string literal.
+ * @return
+ *      The site's verbosity (as an int LogLevel).
+ */
+int
+resolveLogSite(LogSite* site)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    int verbosity = site->verbosity.load(std::memory_order_relaxed);
+    if (verbosity == LogSite::UNRESOLVED) {
+        verbosity = static_cast<int>(getCachedLogLevel(site->fileName));
+        site->next = logSites;
+        logSites = site;
+        site->verbosity.store(verbosity, std::memory_order_relaxed);
+    }
+    return verbosity;
+}
+
 /**
  * Unconditionally log the given message to stderr.
  * This is normally called by LOG().
+ * If asynchronous logging is enabled, the message is only queued here and is
+ * written later by the background log thread.
  * @param level
  *      The level of importance of the message.
  * @param fileName
@@ -414,46 +733,83 @@ void
 log(LogLevel level, const char* fileName, uint32_t lineNum,
     const char* functionName, const char* message)
 {
-    if (logHandler) {
-        DebugMessage d;
-        d.filename = relativeFileName(fileName);
-        d.linenum = int(lineNum);
-        d.function = functionName;
-        d.logLevel = int(level);
-        d.logLevelString = logLevelToString(level);
-        d.processName = processName;
-        d.threadName = ThreadId::getName();
-        d.message = message;
-        (logHandler)(d);
-        return;
-    }
-
     struct timespec now;
     clock_gettime(CLOCK_REALTIME, &now);
 
-    // Failures are a little annoying here, since we can't exactly log
-    // errors that come up.
-    char formattedSeconds[64];  // a human-readable string now.tv_sec
-    bool ok = false;
-    {  // First, try gmtime and strftime.
-        struct tm calendarTime;
-        if (gmtime_r(&now.tv_sec, &calendarTime) != NULL) {
-            ok = (strftime(formattedSeconds, sizeof(formattedSeconds), "%F %T",
-                           &calendarTime) > 0);
+    if (asyncLog.load(std::memory_order_relaxed) != nullptr) {
+        AsyncLogUser user;
+        if (user.async != nullptr) {
+            uint64_t threadId = ThreadId::getId();
+            bool queued = user.async->queue.push([&](LogEntry& entry) {
+                entry.level = level;
+                entry.fileName = fileName;
+                entry.lineNum = lineNum;
+                entry.functionName = functionName;
+                entry.time = now;
+                entry.threadId = threadId;
+                entry.message.assign(message);
+            });
+            if (!queued) {
+                droppedMessages.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
         }
     }
-    if (!ok) {  // If that failed, use the raw number.
-        snprintf(formattedSeconds, sizeof(formattedSeconds), "%010lu",
-                 now.tv_sec);
-        formattedSeconds[sizeof(formattedSeconds) - 1] = '\0';
+
+    writeMessage(level, fileName, lineNum, functionName, now,
+                 ThreadId::getName(), message);
+}
+
+// See <Homa/Debug.h>
+void
+setAsyncLogging(bool enable, size_t capacity)
+{
+    std::lock_guard<std::mutex> lockGuard(asyncMutex);
+    AsyncLog* async = asyncLog.load();
+    if (enable) {
+        if (async == nullptr) {
+            async = Aligned::create<AsyncLog>(capacity);
+            async->thread = std::thread(asyncLogMain, async);
+            asyncLog.store(async);
+        }
+    } else if (async != nullptr) {
+        asyncLog.store(nullptr);
+        // Threads that registered as users before the store above may still
+        // push to the queue; later ones will see nullptr and log directly.
+        while (asyncLogUsers.load() != 0) {
+            std::this_thread::yield();
+        }
+        async->stop.store(true, std::memory_order_release);
+        async->thread.join();
+        // Catch any messages queued by threads that raced with the shutdown.
+        while (writeQueuedMessage(async)) {
+        }
+        Aligned::destroy(async);
     }
+}
 
-    fprintf(stream, "%s.%06lu %s:%d in %s() %s[%s:%s]: %s\n", formattedSeconds,
-            now.tv_nsec / 1000, relativeFileName(fileName), lineNum,
-            functionName, logLevelToString(level), processName.c_str(),
-            ThreadId::getName().c_str(), message);
+// See <Homa/Debug.h>
+void
+flushLog()
+{
+    if (asyncLog.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
+    AsyncLogUser user;
+    if (user.async == nullptr) {
+        return;
+    }
+    uint64_t target = user.async->queue.pushed();
+    while (user.async->written.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+    }
+}
 
-    fflush(stream);
+// See <Homa/Debug.h>
+uint64_t
+getDroppedLogMessages()
+{
+    return droppedMessages.load(std::memory_order_relaxed);
 }
 
 }  // namespace Debug
@@ -16,6 +16,7 @@
 
 #include "StringUtil.h"
 
+#include <atomic>
 #include <cinttypes>
 #include <cstdlib>
 #include <string>
@@ -25,6 +26,15 @@
 #ifndef HOMA_DEBUG_H
 #define HOMA_DEBUG_H
 
+/**
+ * The most verbose LogLevel (as an int) for which LOG() statements are
+ * compiled in; statements for noisier levels are compiled out entirely.
+ * Normally set through the HOMA_LOG_COMPILE_LEVEL CMake cache variable.
+ */
+#ifndef HOMA_LOG_COMPILE_LEVEL
+#define HOMA_LOG_COMPILE_LEVEL 40
+#endif
+
 namespace Homa {
 namespace Debug {
 
@@ -33,11 +43,125 @@ namespace Debug {
 
 std::ostream& operator<<(std::ostream& ostream, LogLevel level);
 
+/**
+ * Caches the log verbosity that applies to a single LOG() call site so that
+ * messages which are filtered out cost only a single relaxed load.
+ *
+ * Each LOG() expansion defines one of these as a function-local static; its
+ * constructor is constexpr so the object is constant-initialized and needs no
+ * guard variable.  The first time a site is checked, its verbosity is
+ * resolved from the log policy and the site is linked into a registry so that
+ * setLogPolicy() can later update it in place.
+ */
+struct LogSite {
+    /// Value of #verbosity before the site has been resolved.
+    static constexpr int UNRESOLVED = -1;
+
+    /**
+     * Constructor.
+     *
+     * @param fileName
+     *      The output of __FILE__ at the call site.
+     */
+    constexpr explicit LogSite(const char* fileName)
+        : fileName(fileName)
+        , verbosity(UNRESOLVED)
+        , next(nullptr)
+    {}
+
+    /// The output of __FILE__ at the call site.
+    const char* const fileName;
+
+    /// The most verbose LogLevel (as an int) that should be logged from this
+    /// site, or UNRESOLVED if the log policy has not yet been consulted.
+    std::atomic<int> verbosity;
+
+    /// Next site in the registry of resolved sites; protected by the Debug
+    /// module's internal mutex.
+    LogSite* next;
+};
+
 bool isLogging(LogLevel level, const char* fileName);
 
+int resolveLogSite(LogSite* site);
+
+/**
+ * Return whether the current logging configuration includes messages of the
+ * given level for the given call site.
+ * This is normally called by LOG().
+ *
+ * @param level
+ *      The log level to query.
+ * @param site
+ *      The call site's statically allocated LogSite.
+ */
+inline bool
+isLogging(LogLevel level, LogSite* site)
+{
+    int verbosity = site->verbosity.load(std::memory_order_relaxed);
+    if (__builtin_expect(verbosity == LogSite::UNRESOLVED, 0)) {
+        verbosity = resolveLogSite(site);
+    }
+    return static_cast<int>(level) <= verbosity;
+}
+
 void log(LogLevel level, const char* fileName, uint32_t lineNum,
          const char* functionName, const char* message);
 
+/**
+ * Token bucket that limits the rate at which a single LOG_RATE_LIMITED() call
+ * site (i.e. a single CodeLocation) may emit messages, and counts the messages
+ * it suppresses so the next emitted message can summarize them.
+ *
+ * The bucket is implemented as a virtual scheduling clock (GCRA) so it can be
+ * updated with a single compare-and-swap.  Like LogSite, the constructor is
+ * constexpr so that function-local instances need no guard variable.
+ */
+struct LogRateLimit {
+    /**
+     * Constructor.
+     *
+     * @param messagesPerSecond
+     *      Sustained number of messages per second that may be emitted.
+     * @param burst
+     *      Number of messages that may be emitted back-to-back before the
+     *      sustained rate applies.
+     */
+    constexpr LogRateLimit(uint64_t messagesPerSecond, uint64_t burst)
+        : intervalNs(1000000000UL / (messagesPerSecond ? messagesPerSecond : 1))
+        , burstNs((burst ? burst - 1 : 0) *
+                  (1000000000UL / (messagesPerSecond ? messagesPerSecond : 1)))
+        , nextTimeNs(0)
+        , suppressed(0)
+    {}
+
+    /// Nanoseconds of credit consumed by each emitted message.
+    const uint64_t intervalNs;
+
+    /// How far ahead of the current time #nextTimeNs may run before messages
+    /// are suppressed.
+    const uint64_t burstNs;
+
+    /// Time (from a monotonic clock, in nanoseconds) at which the bucket will
+    /// next be full; advanced by #intervalNs for each emitted message.
+    std::atomic<uint64_t> nextTimeNs;
+
+    /// Number of messages suppressed since the last emitted message.
+    std::atomic<uint64_t> suppressed;
+};
+
+/**
+ * Default sustained rate for the *_RATE_LIMITED() macros.
+ */
+constexpr uint64_t DEFAULT_LOG_RATE = 10;
+
+/**
+ * Default burst size for the *_RATE_LIMITED() macros.
+ */
+constexpr uint64_t DEFAULT_LOG_BURST = 10;
+
+bool admitLog(LogRateLimit* limit, uint64_t* suppressed);
+
 /**
  * A short name to be used in log messages to identify this process.
  * This defaults to the UNIX process ID.
@@ -60,13 +184,52 @@ extern std::string processName;
  */
 #define LOG(level, _format, ...)                                             \
     do {                                                                     \
-        if (::Homa::Debug::isLogging(level, __FILE__)) {                     \
+        static ::Homa::Debug::LogSite _homaLogSite(__FILE__);                \
+        if (static_cast<int>(level) <= HOMA_LOG_COMPILE_LEVEL &&             \
+            ::Homa::Debug::isLogging(level, &_homaLogSite)) {                \
             ::Homa::Debug::log(                                              \
                 level, __FILE__, __LINE__, __FUNCTION__,                     \
                 ::Homa::StringUtil::format(_format, ##__VA_ARGS__).c_str()); \
         }                                                                    \
     } while (0)
 
+/**
+ * Log the given message, unless this call site has recently logged too many
+ * messages.  When messages have been suppressed, the next message that gets
+ * through reports how many.
+ * This is normally called by ERROR_RATE_LIMITED(), WARNING_RATE_LIMITED(),
+ * NOTICE_RATE_LIMITED(), or VERBOSE_RATE_LIMITED().
+ * @param level
+ *      The level of importance of the message.
+ * @param rate
+ *      Sustained number of messages per second this call site may log.
+ * @param burst
+ *      Number of messages this call site may log back-to-back.
+ * @param _format
+ *      A printf-style format string for the message. It should not include a
+ *      line break at the end, as LOG will add one.
+ * @param ...
+ *      The arguments to the format string, as in printf.
+ */
+#define LOG_RATE_LIMITED(level, rate, burst, _format, ...)                    \
+    do {                                                                      \
+        static ::Homa::Debug::LogSite _homaLogSite(__FILE__);                 \
+        static ::Homa::Debug::LogRateLimit _homaLogLimit(rate, burst);        \
+        uint64_t _homaSuppressed;                                             \
+        if (static_cast<int>(level) <= HOMA_LOG_COMPILE_LEVEL &&              \
+            ::Homa::Debug::isLogging(level, &_homaLogSite) &&                 \
+            ::Homa::Debug::admitLog(&_homaLogLimit, &_homaSuppressed)) {      \
+            std::string _homaMessage =                                        \
+                ::Homa::StringUtil::format(_format, ##__VA_ARGS__);           \
+            if (_homaSuppressed > 0) {                                        \
+                _homaMessage += ::Homa::StringUtil::format(                   \
+                    " (%lu similar messages suppressed)", _homaSuppressed);   \
+            }                                                                 \
+            ::Homa::Debug::log(level, __FILE__, __LINE__, __FUNCTION__,       \
+                               _homaMessage.c_str());                         \
+        }                                                                     \
+    } while (0)
+
 /**
  * Log an ERROR message and abort the process.
  * @copydetails ERROR
@@ -119,4 +282,41 @@ extern std::string processName;
 #define VERBOSE(format, ...) \
     LOG((::Homa::Debug::LogLevel::VERBOSE), format, ##__VA_ARGS__)
 
+/**
+ * Log an ERROR message, limited to DEFAULT_LOG_RATE messages per second (with
+ * bursts of DEFAULT_LOG_BURST) from the call site.
+ * @copydetails ERROR
+ */
+#define ERROR_RATE_LIMITED(format, ...)                                   \
+    LOG_RATE_LIMITED((::Homa::Debug::LogLevel::ERROR),                    \
+                     ::Homa::Debug::DEFAULT_LOG_RATE,                     \
+                     ::Homa::Debug::DEFAULT_LOG_BURST, format, ##__VA_ARGS__)
+
+/**
+ * Log a WARNING message, rate limited per call site.
+ * @copydetails ERROR_RATE_LIMITED
+ */
+#define WARNING_RATE_LIMITED(format, ...)                                 \
+    LOG_RATE_LIMITED((::Homa::Debug::LogLevel::WARNING),                  \
+                     ::Homa::Debug::DEFAULT_LOG_RATE,                     \
+                     ::Homa::Debug::DEFAULT_LOG_BURST, format, ##__VA_ARGS__)
+
+/**
+ * Log a NOTICE message, rate limited per call site.
+ * @copydetails ERROR_RATE_LIMITED
+ */
+#define NOTICE_RATE_LIMITED(format, ...)                                  \
+    LOG_RATE_LIMITED((::Homa::Debug::LogLevel::NOTICE),                   \
+                     ::Homa::Debug::DEFAULT_LOG_RATE,                     \
+                     ::Homa::Debug::DEFAULT_LOG_BURST, format, ##__VA_ARGS__)
+
+/**
+ * Log a VERBOSE message, rate limited per call site.
+ * @copydetails ERROR_RATE_LIMITED
+ */
+#define VERBOSE_RATE_LIMITED(format, ...)                                 \
+    LOG_RATE_LIMITED((::Homa::Debug::LogLevel::VERBOSE),                  \
+                     ::Homa::Debug::DEFAULT_LOG_RATE,                     \
+                     ::Homa::Debug::DEFAULT_LOG_BURST, format, ##__VA_ARGS__)
+
 #endif /* HOMA_DEBUG_H */
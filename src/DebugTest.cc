@@ -19,8 +19,11 @@
 #include "Debug.h"
 
 #include "STLUtil.h"
+#include "ThreadId.h"
 
 #include <sys/stat.h>
+#include <atomic>
+#include <thread>
 #include <unordered_map>
 
 namespace Homa {
@@ -28,6 +31,10 @@ namespace Debug {
 
 namespace Internal {
 extern std::unordered_map<const char*, LogLevel> isLoggingCache;
+extern LogSite* logSites;
+bool admitLog(LogRateLimit* limit, uint64_t nowNs, uint64_t* suppressed);
+struct AsyncLog;
+extern std::atomic<AsyncLog*> asyncLog;
 const char* logLevelToString(LogLevel);
 LogLevel logLevelFromString(const std::string& level);
 LogLevel getLogLevel(const char* fileName);
@@ -89,6 +96,17 @@ TEST_F(DebugTest, relativeFileName)
     EXPECT_STREQ("/a/b/c", Internal::relativeFileName("/a/b/c"));
 }
 
+struct VectorHandler {
+    VectorHandler()
+        : messages()
+    {}
+    void operator()(DebugMessage message)
+    {
+        messages.push_back(message);
+    }
+    std::vector<DebugMessage> messages;
+};
+
 TEST_F(DebugTest, isLogging)
 {
     EXPECT_TRUE(isLogging(LogLevel::ERROR, "abc"));
@@ -100,23 +118,110 @@ TEST_F(DebugTest, isLogging)
               STLUtil::getItems(Internal::isLoggingCache));
 }
 
+TEST_F(DebugTest, isLogging_LogSite)
+{
+    static LogSite site("abc");
+    EXPECT_EQ(LogSite::UNRESOLVED, site.verbosity.load());
+    EXPECT_TRUE(isLogging(LogLevel::NOTICE, &site));
+    EXPECT_FALSE(isLogging(LogLevel::VERBOSE, &site));
+    EXPECT_EQ(int(LogLevel::NOTICE), site.verbosity.load());
+    EXPECT_EQ(&site, Internal::logSites);
+
+    // Registered only once.
+    EXPECT_EQ(int(LogLevel::NOTICE), resolveLogSite(&site));
+    EXPECT_EQ(&site, Internal::logSites);
+
+    // Policy changes are pushed to resolved sites.
+    setLogPolicy({{"abc", "VERBOSE"}});
+    EXPECT_EQ(int(LogLevel::VERBOSE), site.verbosity.load());
+    EXPECT_TRUE(isLogging(LogLevel::VERBOSE, &site));
+    setLogPolicy({{"abc", "ERROR"}});
+    EXPECT_FALSE(isLogging(LogLevel::WARNING, &site));
+}
+
+TEST_F(DebugTest, LOG_policyChange)
+{
+    VectorHandler handler;
+    setLogHandler(std::ref(handler));
+    for (int i = 0; i < 3; ++i) {
+        if (i == 1) {
+            setLogPolicy({{"", "WARNING"}});
+        } else if (i == 2) {
+            setLogPolicy({{"", "VERBOSE"}});
+        }
+        VERBOSE("iteration %d", i);
+    }
+    EXPECT_EQ(1U, handler.messages.size());
+    EXPECT_EQ("iteration 2", handler.messages.at(0).message);
+}
+
+TEST_F(DebugTest, LOG_compileLevel)
+{
+    // The unit tests rely on every level being compiled in.
+    static_assert(HOMA_LOG_COMPILE_LEVEL == int(LogLevel::VERBOSE),
+                  "unit tests expect all log levels to be compiled in");
+    VectorHandler handler;
+    setLogHandler(std::ref(handler));
+    setLogPolicy({{"", "VERBOSE"}});
+    VERBOSE("compiled in");
+    EXPECT_EQ(1U, handler.messages.size());
+}
+
+TEST_F(DebugTest, admitLog)
+{
+    LogRateLimit limit(10, 3);  // 100ms interval, burst of 3
+    uint64_t suppressed = 42;
+    uint64_t now = 5000000000UL;
+    EXPECT_EQ(100000000U, limit.intervalNs);
+    EXPECT_EQ(200000000U, limit.burstNs);
+
+    // Burst.
+    EXPECT_TRUE(Internal::admitLog(&limit, now, &suppressed));
+    EXPECT_EQ(0U, suppressed);
+    EXPECT_TRUE(Internal::admitLog(&limit, now, &suppressed));
+    EXPECT_TRUE(Internal::admitLog(&limit, now, &suppressed));
+    EXPECT_FALSE(Internal::admitLog(&limit, now, &suppressed));
+    EXPECT_FALSE(Internal::admitLog(&limit, now + 50000000, &suppressed));
+    EXPECT_EQ(2U, limit.suppressed.load());
+
+    // Refill one token.
+    EXPECT_TRUE(Internal::admitLog(&limit, now + 100000000, &suppressed));
+    EXPECT_EQ(2U, suppressed);
+    EXPECT_EQ(0U, limit.suppressed.load());
+    EXPECT_FALSE(Internal::admitLog(&limit, now + 100000000, &suppressed));
+
+    // Fully refilled after a long quiet period.
+    now += 10000000000UL;
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_TRUE(Internal::admitLog(&limit, now, &suppressed));
+    }
+    EXPECT_FALSE(Internal::admitLog(&limit, now, &suppressed));
+}
+
+TEST_F(DebugTest, LOG_RATE_LIMITED)
+{
+    VectorHandler handler;
+    setLogHandler(std::ref(handler));
+    for (int i = 0; i < 5; ++i) {
+        LOG_RATE_LIMITED(LogLevel::ERROR, 1, 2, "message %d", i);
+    }
+    ASSERT_EQ(2U, handler.messages.size());
+    EXPECT_EQ("message 0", handler.messages.at(0).message);
+    EXPECT_EQ("message 1", handler.messages.at(1).message);
+
+    // Filtered messages are not counted as suppressed.
+    for (int i = 0; i < 2; ++i) {
+        VERBOSE_RATE_LIMITED("filtered %d", i);
+    }
+    EXPECT_EQ(2U, handler.messages.size());
+}
+
 TEST_F(DebugTest, setLogFile)
 {
     EXPECT_EQ(stderr, setLogFile(stdout));
     EXPECT_EQ(stdout, setLogFile(stderr));
 }
 
-struct VectorHandler {
-    VectorHandler()
-        : messages()
-    {}
-    void operator()(DebugMessage message)
-    {
-        messages.push_back(message);
-    }
-    std::vector<DebugMessage> messages;
-};
-
 TEST_F(DebugTest, setLogHandler)
 {
     VectorHandler handler;
@@ -172,6 +277,84 @@ TEST_F(DebugTest, logPolicyToString)
               logPolicyToString(getLogPolicy()));
 }
 
+TEST_F(DebugTest, setAsyncLogging)
+{
+    VectorHandler handler;
+    setLogHandler(std::ref(handler));
+    setAsyncLogging(true, 16);
+    EXPECT_NE(nullptr, Internal::asyncLog.load());
+    ERROR("Hello, world! %d", 1);
+    ERROR("Hello, world! %d", 2);
+    flushLog();
+    EXPECT_EQ(2U, handler.messages.size());
+    ERROR("Hello, world! %d", 3);
+    setAsyncLogging(false);
+    EXPECT_EQ(nullptr, Internal::asyncLog.load());
+    EXPECT_EQ(3U, handler.messages.size());
+    const DebugMessage& m = handler.messages.at(0);
+    EXPECT_STREQ("src/DebugTest.cc", m.filename);
+    EXPECT_STREQ("TestBody", m.function);
+    EXPECT_EQ(ThreadId::getName(), m.threadName);
+    EXPECT_EQ("Hello, world! 1", m.message);
+    EXPECT_EQ("Hello, world! 3", handler.messages.at(2).message);
+}
+
+TEST_F(DebugTest, setAsyncLogging_dropped)
+{
+    std::atomic<bool> entered(false);
+    std::atomic<bool> release(false);
+    std::vector<std::string> messages;
+    setLogHandler([&](DebugMessage m) {
+        entered = true;
+        while (!release) {
+            std::this_thread::yield();
+        }
+        messages.push_back(m.message);
+    });
+    uint64_t dropped = getDroppedLogMessages();
+    setAsyncLogging(true, 2);
+
+    // Park the writer thread in the handler on the first message.
+    ERROR("1");
+    while (!entered) {
+        std::this_thread::yield();
+    }
+    // The slot of the message being written stays occupied until the handler
+    // returns, so there is room for just one more.
+    ERROR("2");
+    ERROR("3");
+    EXPECT_EQ(dropped + 1, getDroppedLogMessages());
+
+    release = true;
+    setAsyncLogging(false);
+    EXPECT_EQ((std::vector<std::string>{"1", "2"}), messages);
+}
+
+TEST_F(DebugTest, setAsyncLogging_concurrentLoggers)
+{
+    std::atomic<uint64_t> written(0);
+    setLogHandler([&](DebugMessage) { written.fetch_add(1); });
+    uint64_t dropped = getDroppedLogMessages();
+    const int numMessages = 20000;
+
+    // Every message must be either written or counted as dropped, however
+    // the logging thread interleaves with enabling and disabling.
+    std::thread logger([] {
+        for (int i = 0; i < numMessages; ++i) {
+            ERROR("%d", i);
+        }
+    });
+    for (int i = 0; i < 50; ++i) {
+        setAsyncLogging(true, 64);
+        std::this_thread::yield();
+        setAsyncLogging(false);
+    }
+    logger.join();
+    EXPECT_EQ(nullptr, Internal::asyncLog.load());
+    EXPECT_EQ(uint64_t(numMessages),
+              written.load() + getDroppedLogMessages() - dropped);
+}
+
 // log: low cost-benefit in testing
 
 }  // namespace
@@ -15,10 +15,30 @@
 
 #include <Homa/Driver.h>
 
+#include <cstring>
+
 #include "StringUtil.h"
 
 namespace Homa {
 
+// See Driver::sendPacketWithHeader()
+void
+Driver::sendPacketWithHeader(const void* header, uint32_t headerLength,
+                             Packet* payload, uint32_t payloadOffset,
+                             IpAddress destination, int priority)
+{
+    Packet* packet = allocPacket();
+    char* data = static_cast<char*>(packet->payload);
+    uint32_t payloadLength = payload->length - payloadOffset;
+    std::memcpy(data, header, headerLength);
+    std::memcpy(data + headerLength,
+                static_cast<char*>(payload->payload) + payloadOffset,
+                payloadLength);
+    packet->length = headerLength + payloadLength;
+    sendPacket(packet, destination, priority);
+    releasePackets(&packet, 1);
+}
+
 std::string
 IpAddress::toString(IpAddress address)
 {
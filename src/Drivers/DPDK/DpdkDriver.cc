@@ -51,6 +51,20 @@ DpdkDriver::sendPacket(Packet* packet, IpAddress destination, int priority)
     return pImpl->sendPacket(packet, destination, priority);
 }
 
+/// See Driver::sendPacketWithHeader()
+void
+DpdkDriver::sendPacketWithHeader(const void* header, uint32_t headerLength,
+                                 Packet* payload, uint32_t payloadOffset,
+                                 IpAddress destination, int priority)
+{
+    if (!pImpl->sendPacketWithHeader(header, headerLength, payload,
+                                     payloadOffset, destination, priority)) {
+        // Fall back to copying the header and payload into one packet.
+        Driver::sendPacketWithHeader(header, headerLength, payload,
+                                     payloadOffset, destination, priority);
+    }
+}
+
 /// See Driver::cork()
 void
 DpdkDriver::cork()
@@ -94,7 +94,7 @@ DpdkDriver::Impl::Impl(const char* ifname, int argc, char* argv[],
           (config == nullptr || config->HIGHEST_PACKET_PRIORITY_OVERRIDE < 0)
               ? Homa::Util::arrayLength(PRIORITY_TO_PCP) - 1
               : config->HIGHEST_PACKET_PRIORITY_OVERRIDE)
-    , packetLock()
+    , packetLock("DpdkDriver::packetLock")
     , packetPool()
     , overflowBufferPool()
     , mbufsOutstanding(0)
@@ -103,6 +103,7 @@ DpdkDriver::Impl::Impl(const char* ifname, int argc, char* argv[],
     , rx()
     , tx()
     , hasHardwareFilter(true)  // Cleared later if not applicable
+    , multiSegmentTx(false)    // Set later if supported
     , corked(0)
     , bandwidthMbps(10000)  // Default bandwidth = 10 gbs
 {
@@ -147,7 +148,7 @@ DpdkDriver::Impl::Impl(const char* ifname,
           (config == nullptr || config->HIGHEST_PACKET_PRIORITY_OVERRIDE < 0)
               ? Homa::Util::arrayLength(PRIORITY_TO_PCP) - 1
               : config->HIGHEST_PACKET_PRIORITY_OVERRIDE)
-    , packetLock()
+    , packetLock("DpdkDriver::packetLock")
     , packetPool()
     , overflowBufferPool()
     , mbufPool(nullptr)
@@ -155,6 +156,7 @@ DpdkDriver::Impl::Impl(const char* ifname,
     , rx()
     , tx()
     , hasHardwareFilter(true)  // Cleared later if not applicable
+    , multiSegmentTx(false)    // Set later if supported
     , corked(0)
     , bandwidthMbps(10000)  // Default bandwidth = 10 gbs
 {
@@ -256,29 +258,13 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
         }
     }
 
-    // Fill out the destination and source MAC addresses plus the Ethernet
-    // frame type (i.e., IEEE 802.1Q VLAN tagging).
     auto it = arpTable.find(destination);
     if (it == arpTable.end()) {
         WARNING("Failed to find ARP record for packet; dropping packet");
         return;
     }
     MacAddress& destMac = it->second;
-    struct ether_hdr* ethHdr = rte_pktmbuf_mtod(mbuf, struct ether_hdr*);
-    rte_memcpy(&ethHdr->d_addr, destMac.address, ETHER_ADDR_LEN);
-    rte_memcpy(&ethHdr->s_addr, localMac.address, ETHER_ADDR_LEN);
-    ethHdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_VLAN);
-
-    // Fill out the PCP field and the Ethernet frame type of the
-    // encapsulated frame (DEI and VLAN ID are not relevant and trivially
-    // set to 0).
-    struct vlan_hdr* vlanHdr = reinterpret_cast<struct vlan_hdr*>(ethHdr + 1);
-    vlanHdr->vlan_tci = rte_cpu_to_be_16(PRIORITY_TO_PCP[priority]);
-    vlanHdr->eth_proto = rte_cpu_to_be_16(EthPayloadType::HOMA);
-
-    // Store our local IP address right before the payload.
-    *rte_pktmbuf_mtod_offset(mbuf, uint32_t*, PACKET_HDR_LEN - 4) =
-        (uint32_t)localIp;
+    writeFrameHeader(mbuf, destMac, priority);
 
     // In the normal case, we pre-allocate a pakcet's mbuf with enough
     // storage to hold the MAX_PAYLOAD_SIZE.  If the actual payload is
@@ -296,18 +282,26 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
 
     // loopback if src mac == dst mac
     if (localMac == destMac) {
-        struct rte_mbuf* mbuf_clone = rte_pktmbuf_clone(mbuf, mbufPool);
-        if (unlikely(mbuf_clone == NULL)) {
-            WARNING("Failed to clone packet for loopback; dropping packet");
-            return;
+        // The receiver gets exclusive use of the packet (see
+        // Driver::receivePackets()), so it must not share the data buffer
+        // that the sender keeps for retransmission.  An mbuf allocated above
+        // for an overflow packet is private already; anything else is
+        // copied.
+        struct rte_mbuf* loopbackMbuf = mbuf;
+        if (likely(pkt->bufType == DpdkDriver::Impl::Packet::MBUF)) {
+            loopbackMbuf = copyMbuf(mbuf);
+            if (unlikely(loopbackMbuf == NULL)) {
+                WARNING("Failed to copy packet for loopback; dropping packet");
+                return;
+            }
         }
-        int ret = rte_ring_enqueue(loopbackRing, mbuf_clone);
+        int ret = rte_ring_enqueue(loopbackRing, loopbackMbuf);
         if (unlikely(ret != 0)) {
             WARNING(
                 "rte_ring_enqueue returned %d with %u packets queued; "
                 "packet may be lost?",
                 ret, rte_ring_count(loopbackRing));
-            rte_pktmbuf_free(mbuf_clone);
+            rte_pktmbuf_free(loopbackMbuf);
         }
         return;
     }
@@ -318,18 +312,70 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
         rte_pktmbuf_refcnt_update(mbuf, 1);
     }
 
-    // Add the packet to the burst.
-    SpinLock::Lock txLock(tx.mutex);
-    {
-        SpinLock::Lock statsLock(tx.stats.mutex);
-        tx.stats.bufferedBytes += rte_pktmbuf_pkt_len(mbuf);
-    }
-    rte_eth_tx_buffer(port, 0, tx.buffer, mbuf);
+    transmit(mbuf);
+}
 
-    // Flush packets now if the driver is not corked.
-    if (corked.load() < 1) {
-        rte_eth_tx_buffer_flush(port, 0, tx.buffer);
+// See Driver::sendPacketWithHeader()
+bool
+DpdkDriver::Impl::sendPacketWithHeader(const void* header,
+                                       uint32_t headerLength,
+                                       Driver::Packet* payload,
+                                       uint32_t payloadOffset,
+                                       IpAddress destination, int priority)
+{
+    DpdkDriver::Impl::Packet* pkt =
+        container_of(payload, DpdkDriver::Impl::Packet, base);
+    if (!multiSegmentTx || pkt->bufType != DpdkDriver::Impl::Packet::MBUF) {
+        return false;
     }
+
+    // Unknown destinations are reported by sendPacket(), and loopback
+    // packets must be delivered in a single segment of their own.
+    auto it = arpTable.find(destination);
+    if (it == arpTable.end() || it->second == localMac) {
+        return false;
+    }
+
+    // The first segment holds the frame header and the caller's header.
+    struct rte_mbuf* head = rte_pktmbuf_alloc(mbufPool);
+    if (unlikely(head == NULL)) {
+        return false;
+    }
+    char* buf = rte_pktmbuf_append(
+        head, Homa::Util::downCast<uint16_t>(PACKET_HDR_LEN + headerLength));
+    if (unlikely(buf == NULL)) {
+        rte_pktmbuf_free(head);
+        return false;
+    }
+    rte_memcpy(buf + PACKET_HDR_LEN, header, headerLength);
+    writeFrameHeader(head, it->second, priority);
+
+    // The second segment is an indirect mbuf referencing the payload's data,
+    // which stays allocated until the NIC is done with it even if the caller
+    // releases the payload packet first.
+    struct rte_mbuf* mbuf = pkt->bufRef.mbuf;
+    struct rte_mbuf* tail = rte_pktmbuf_clone(mbuf, mbufPool);
+    if (unlikely(tail == NULL)) {
+        rte_pktmbuf_free(head);
+        return false;
+    }
+    uint32_t tailOffset = static_cast<uint32_t>(
+        static_cast<char*>(payload->payload) - rte_pktmbuf_mtod(mbuf, char*) +
+        payloadOffset);
+    uint32_t tailLength = payload->length - payloadOffset;
+    rte_pktmbuf_adj(tail, Homa::Util::downCast<uint16_t>(tailOffset));
+    if (rte_pktmbuf_pkt_len(tail) > tailLength) {
+        rte_pktmbuf_trim(tail, Homa::Util::downCast<uint16_t>(
+                                   rte_pktmbuf_pkt_len(tail) - tailLength));
+    }
+    if (unlikely(rte_pktmbuf_chain(head, tail) != 0)) {
+        rte_pktmbuf_free(tail);
+        rte_pktmbuf_free(head);
+        return false;
+    }
+
+    transmit(head);
+    return true;
 }
 
 // See Driver::cork()
@@ -423,17 +469,24 @@ DpdkDriver::Impl::receivePackets(uint32_t maxPackets,
         uint32_t length = rte_pktmbuf_pkt_len(m) - headerLength;
         assert(length <= MAX_PAYLOAD_SIZE);
 
+        // Received packets may be handed back to sendPacket() (e.g. when a
+        // message is forwarded), which expects the payload PACKET_HDR_LEN
+        // bytes into the mbuf.  Packets that can't be laid out that way are
+        // copied into an overflow buffer instead.
+        bool aligned = alignFrame(m, headerLength);
+
         DpdkDriver::Impl::Packet* packet = nullptr;
         {
             SpinLock::Lock lock(packetLock);
             static const int MBUF_ALLOC_LIMIT = NB_MBUF - NB_MBUF_RESERVED;
-            if (mbufsOutstanding < MBUF_ALLOC_LIMIT) {
+            if (likely(aligned) && mbufsOutstanding < MBUF_ALLOC_LIMIT) {
                 packet = packetPool.construct(m, payload);
                 mbufsOutstanding++;
             } else {
                 OverflowBuffer* buf = overflowBufferPool.construct();
-                rte_memcpy(payload, buf->data, length);
+                rte_memcpy(buf->data, payload, length);
                 packet = packetPool.construct(buf);
+                rte_pktmbuf_free(m);
             }
         }
         packet->base.length = length;
@@ -626,6 +679,17 @@ DpdkDriver::Impl::_init()
     // configure some default NIC port parameters
     memset(&portConf, 0, sizeof(portConf));
     portConf.rxmode.max_rx_pkt_len = ETHER_MAX_VLAN_FRAME_LEN;
+
+    // Chained mbufs let sendPacketWithHeader() send a shared payload without
+    // copying it, provided the NIC can transmit them.
+    struct rte_eth_dev_info devInfo;
+    rte_eth_dev_info_get(port, &devInfo);
+    if (devInfo.tx_offload_capa & DEV_TX_OFFLOAD_MULTI_SEGS) {
+        portConf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS;
+        multiSegmentTx = true;
+    } else {
+        NOTICE("multi-segment transmit is not supported on port %u.", port);
+    }
     rte_eth_dev_configure(port, 1, 1, &portConf);
 
     // Set up a NIC/HW-based filter on the ethernet type so that only
@@ -777,6 +841,118 @@ DpdkDriver::Impl::txBurstCallback(uint16_t port_id, uint16_t queue,
     return nb_pkts;
 }
 
+/**
+ * Fill in the Ethernet, VLAN and IP headers at the start of an outgoing
+ * frame.
+ *
+ * @param mbuf
+ *      Frame whose first PACKET_HDR_LEN bytes should be filled in.
+ * @param destMac
+ *      MAC address of the frame's destination.
+ * @param priority
+ *      Packet's network priority.
+ */
+void
+DpdkDriver::Impl::writeFrameHeader(struct rte_mbuf* mbuf,
+                                   const MacAddress& destMac, int priority)
+{
+    // Fill out the destination and source MAC addresses plus the Ethernet
+    // frame type (i.e., IEEE 802.1Q VLAN tagging).
+    struct ether_hdr* ethHdr = rte_pktmbuf_mtod(mbuf, struct ether_hdr*);
+    rte_memcpy(&ethHdr->d_addr, destMac.address, ETHER_ADDR_LEN);
+    rte_memcpy(&ethHdr->s_addr, localMac.address, ETHER_ADDR_LEN);
+    ethHdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_VLAN);
+
+    // Fill out the PCP field and the Ethernet frame type of the
+    // encapsulated frame (DEI and VLAN ID are not relevant and trivially
+    // set to 0).
+    struct vlan_hdr* vlanHdr = reinterpret_cast<struct vlan_hdr*>(ethHdr + 1);
+    vlanHdr->vlan_tci = rte_cpu_to_be_16(PRIORITY_TO_PCP[priority]);
+    vlanHdr->eth_proto = rte_cpu_to_be_16(EthPayloadType::HOMA);
+
+    // Store our local IP address right before the payload.
+    *rte_pktmbuf_mtod_offset(mbuf, uint32_t*, PACKET_HDR_LEN - 4) =
+        (uint32_t)localIp;
+}
+
+/**
+ * Add a frame to the transmit burst, and flush the burst unless the driver
+ * is corked.  The NIC frees the mbuf once it has been sent.
+ *
+ * @param mbuf
+ *      Complete frame to be sent.
+ */
+void
+DpdkDriver::Impl::transmit(struct rte_mbuf* mbuf)
+{
+    // Add the packet to the burst.
+    SpinLock::Lock txLock(tx.mutex);
+    {
+        SpinLock::Lock statsLock(tx.stats.mutex);
+        tx.stats.bufferedBytes += rte_pktmbuf_pkt_len(mbuf);
+    }
+    rte_eth_tx_buffer(port, 0, tx.buffer, mbuf);
+
+    // Flush packets now if the driver is not corked.
+    if (corked.load() < 1) {
+        rte_eth_tx_buffer_flush(port, 0, tx.buffer);
+    }
+}
+
+/**
+ * Lay out a received frame the way sendPacket() expects outgoing frames:
+ * with its payload PACKET_HDR_LEN bytes after the start of the mbuf's data.
+ *
+ * Frames without a VLAN tag have a shorter header; the start of their data
+ * is moved back into the mbuf's headroom to make up the difference.  The
+ * bytes in front of the payload are rewritten by sendPacket() anyway.
+ *
+ * @param mbuf
+ *      Single-segment frame to be laid out.
+ * @param headerLength
+ *      Number of bytes in front of the frame's payload.
+ * @return
+ *      True if the payload now starts PACKET_HDR_LEN bytes into the mbuf's
+ *      data; false if the mbuf has too little headroom.
+ */
+bool
+DpdkDriver::Impl::alignFrame(struct rte_mbuf* mbuf, uint32_t headerLength)
+{
+    if (likely(headerLength == PACKET_HDR_LEN)) {
+        return true;
+    }
+    assert(headerLength < PACKET_HDR_LEN);
+    uint16_t missing =
+        Homa::Util::downCast<uint16_t>(PACKET_HDR_LEN - headerLength);
+    return rte_pktmbuf_prepend(mbuf, missing) != NULL;
+}
+
+/**
+ * Copy a single-segment frame into a newly allocated mbuf that shares no
+ * memory with the original.
+ *
+ * @param mbuf
+ *      The frame to copy.
+ * @return
+ *      The copy, or NULL if no mbuf could be allocated.
+ */
+struct rte_mbuf*
+DpdkDriver::Impl::copyMbuf(struct rte_mbuf* mbuf)
+{
+    struct rte_mbuf* copy = rte_pktmbuf_alloc(mbufPool);
+    if (unlikely(copy == NULL)) {
+        return NULL;
+    }
+    uint16_t length = rte_pktmbuf_data_len(mbuf);
+    char* data = rte_pktmbuf_append(copy, length);
+    if (unlikely(data == NULL)) {
+        rte_pktmbuf_free(copy);
+        return NULL;
+    }
+    rte_memcpy(data, rte_pktmbuf_mtod(mbuf, void*), length);
+    return copy;
+}
+
 }  // namespace DPDK
 }  // namespace Drivers
 }  // namespace Homa
@@ -145,6 +145,9 @@ class DpdkDriver::Impl {
     Driver::Packet* allocPacket();
     void sendPacket(Driver::Packet* packet, IpAddress destination,
                     int priority);
+    bool sendPacketWithHeader(const void* header, uint32_t headerLength,
+                              Driver::Packet* payload, uint32_t payloadOffset,
+                              IpAddress destination, int priority);
     void cork();
     void uncork();
     uint32_t receivePackets(uint32_t maxPackets,
@@ -163,6 +166,11 @@ class DpdkDriver::Impl {
     static uint16_t txBurstCallback(uint16_t port_id, uint16_t queue,
                                     struct rte_mbuf* pkts[], uint16_t nb_pkts,
                                     void* user_param);
+    void writeFrameHeader(struct rte_mbuf* mbuf, const MacAddress& destMac,
+                          int priority);
+    void transmit(struct rte_mbuf* mbuf);
+    static bool alignFrame(struct rte_mbuf* mbuf, uint32_t headerLength);
+    struct rte_mbuf* copyMbuf(struct rte_mbuf* mbuf);
 
     /// Name of the Linux network interface to be used by DPDK.
     std::string ifname;
@@ -211,7 +219,7 @@ class DpdkDriver::Impl {
          * Basic Constructor.
          */
         Rx()
-            : mutex()
+            : mutex("DpdkDriver::rx.mutex")
         {}
 
         /// Provides thread safety for receive (rx) operations.
@@ -224,7 +232,7 @@ class DpdkDriver::Impl {
          * Basic Constructor.
          */
         Tx()
-            : mutex()
+            : mutex("DpdkDriver::tx.mutex")
             , buffer(nullptr)
             , stats()
         {}
@@ -239,7 +247,7 @@ class DpdkDriver::Impl {
              * Basic Constructor.
              */
             Stats()
-                : mutex()
+                : mutex("DpdkDriver::tx.stats.mutex")
                 , bufferedBytes(0)
                 , queueEstimator(0)
             {}
@@ -257,6 +265,10 @@ class DpdkDriver::Impl {
     /// Hardware packet filter is provided by the NIC
     std::atomic<bool> hasHardwareFilter;
 
+    /// True if the NIC can transmit packets made of chained mbufs; used by
+    /// sendPacketWithHeader().  Set during initialization.
+    bool multiSegmentTx;
+
     /// True if the Driver should buffer sends for batched transmission. False,
     /// if the Driver should
     std::atomic<int> corked;
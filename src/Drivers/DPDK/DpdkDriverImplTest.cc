@@ -0,0 +1,98 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "DpdkDriverImpl.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+namespace Homa {
+namespace Drivers {
+namespace DPDK {
+namespace {
+
+/**
+ * Single-segment mbuf backed by a local buffer, laid out the way the NIC
+ * hands received frames to the driver.
+ */
+struct TestFrame {
+    TestFrame(uint16_t headroom, const char* frame, uint16_t frameLength)
+        : mbuf()
+        , buffer()
+    {
+        mbuf.buf_addr = buffer;
+        mbuf.buf_len = sizeof(buffer);
+        mbuf.data_off = headroom;
+        mbuf.data_len = frameLength;
+        mbuf.pkt_len = frameLength;
+        mbuf.nb_segs = 1;
+        mbuf.next = NULL;
+        std::memcpy(buffer + headroom, frame, frameLength);
+    }
+
+    struct rte_mbuf mbuf;
+    char buffer[256];
+};
+
+TEST(DpdkDriverImplTest, alignFrame_tagged)
+{
+    uint32_t headerLength = PACKET_HDR_LEN;
+    char frame[64] = {};
+    std::memcpy(frame + headerLength, "payload", 7);
+    TestFrame test(64, frame, headerLength + 7);
+
+    EXPECT_TRUE(DpdkDriver::Impl::alignFrame(&test.mbuf, headerLength));
+    EXPECT_EQ(64U, test.mbuf.data_off);
+    EXPECT_EQ(headerLength + 7, rte_pktmbuf_pkt_len(&test.mbuf));
+    EXPECT_EQ(0, std::memcmp("payload",
+                             rte_pktmbuf_mtod_offset(&test.mbuf, char*,
+                                                     PACKET_HDR_LEN),
+                             7));
+}
+
+TEST(DpdkDriverImplTest, alignFrame_untagged)
+{
+    // Ethernet header and source IP address, without a VLAN tag.
+    uint32_t headerLength = ETHER_HDR_LEN + IP_HDR_LEN;
+    uint32_t packetHeaderLength = PACKET_HDR_LEN;
+    char frame[64] = {};
+    std::memcpy(frame + headerLength, "payload", 7);
+    TestFrame test(64, frame, headerLength + 7);
+    char* payload = rte_pktmbuf_mtod_offset(&test.mbuf, char*, headerLength);
+
+    EXPECT_TRUE(DpdkDriver::Impl::alignFrame(&test.mbuf, headerLength));
+    EXPECT_EQ(packetHeaderLength + 7, rte_pktmbuf_pkt_len(&test.mbuf));
+    EXPECT_EQ(packetHeaderLength + 7, rte_pktmbuf_data_len(&test.mbuf));
+    EXPECT_EQ(payload, rte_pktmbuf_mtod_offset(&test.mbuf, char*,
+                                               PACKET_HDR_LEN));
+    EXPECT_EQ(0, std::memcmp("payload", payload, 7));
+}
+
+TEST(DpdkDriverImplTest, alignFrame_noHeadroom)
+{
+    uint32_t headerLength = ETHER_HDR_LEN + IP_HDR_LEN;
+    char frame[64] = {};
+    TestFrame test(0, frame, headerLength + 7);
+
+    EXPECT_FALSE(DpdkDriver::Impl::alignFrame(&test.mbuf, headerLength));
+    EXPECT_EQ(0U, test.mbuf.data_off);
+    EXPECT_EQ(headerLength + 7, rte_pktmbuf_pkt_len(&test.mbuf));
+}
+
+}  // namespace
+}  // namespace DPDK
+}  // namespace Drivers
+}  // namespace Homa
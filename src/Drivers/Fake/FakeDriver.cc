@@ -15,118 +15,246 @@
 
 #include <Homa/Drivers/Fake/FakeDriver.h>
 
+#include <array>
 #include <atomic>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <random>
-#include <unordered_map>
+#include <thread>
 
+#include "Aligned.h"
 #include "CodeLocation.h"
+#include "MpmcQueue.h"
 #include "StringUtil.h"
 
 namespace Homa {
 namespace Drivers {
 namespace Fake {
 
-// Used to generate random numbers;
-std::random_device rd;
-std::mt19937 gen(rd());
+/**
+ * A packet waiting in a FakeNIC's receive queue.
+ */
+struct Delivery {
+    /// The delivered copy of the packet; owned by the queue.
+    FakePacket* packet;
+
+    /// Address of the driver that sent the packet.
+    IpAddress sourceIp;
+};
+
+/// Holds the incoming packets for a particular driver.
+struct FakeNIC {
+    /**
+     * FakeNIC constructor.
+     *
+     * @param addressId
+     *      Identifier of the FakeNIC's driver on the FakeNetwork.
+     */
+    explicit FakeNIC(uint32_t addressId)
+        : addressId(addressId)
+        , priorityQueue()
+    {
+        for (int i = 0; i < NUM_PRIORITIES; ++i) {
+            priorityQueue[i].reset(
+                Aligned::create<MpmcQueue<Delivery>>(NIC_QUEUE_CAPACITY));
+        }
+    }
+
+    /// Identifier of this FakeNIC's driver on the FakeNetwork.
+    const uint32_t addressId;
+
+    /// A set of incoming packets queued by priority.
+    std::array<Aligned::unique_ptr<MpmcQueue<Delivery>>, NUM_PRIORITIES>
+        priorityQueue;
+};
+
+/**
+ * Pool of free FakePackets shared by all FakeDrivers (packets are typically
+ * allocated by one driver and released by another).
+ */
+static class FakePacketPool {
+  public:
+    /// Constructor.
+    FakePacketPool()
+        : freePackets(POOL_CAPACITY)
+    {}
+
+    /// Destructor.
+    ~FakePacketPool()
+    {
+        FakePacket* packet;
+        while (freePackets.pop([&](FakePacket*& e) { packet = e; })) {
+            delete packet;
+        }
+    }
+
+    /// Return a packet with no data.
+    FakePacket* alloc()
+    {
+        FakePacket* packet = nullptr;
+        if (!freePackets.pop([&](FakePacket*& e) { packet = e; })) {
+            return new FakePacket();
+        }
+        packet->base.length = 0;
+        return packet;
+    }
+
+    /// Recycle a packet that is no longer in use.
+    void release(FakePacket* packet)
+    {
+        if (!freePackets.push([&](FakePacket*& e) { e = packet; })) {
+            delete packet;
+        }
+    }
+
+  private:
+    /// Maximum number of free packets kept for reuse.
+    static const size_t POOL_CAPACITY = 1 << 16;
+
+    /// Packets available for reuse.
+    MpmcQueue<FakePacket*> freePackets;
+} packetPool;
 
 /**
  * A fake network that allows a FakeDriver instances to pass around datagrams.
+ *
+ * FakeNICs are found through a fixed-size table indexed by address, so
+ * sending a packet never takes a lock.
  */
 static class FakeNetwork {
   public:
     /// Constructor.
     FakeNetwork()
         : mutex()
-        , network()
+        , ports()
         , nextAddressId(1)
-        , packetLossRate(0)
-        , packetLossDistribution(0.0, 1.0)
+        , packetLossThreshold(0)
     {}
 
-    /// Destructor;
-    ~FakeNetwork()
-    {
-        std::lock_guard<std::mutex> lock_network(mutex);
-        for (auto it = network.begin(); it != network.end(); ++it) {
-            delete it->second;
-        }
-    }
-
-    /// Register the FakeNIC so it can receive packets.  Returns the newly
-    /// registered FakeNIC's addressId.
-    uint32_t registerNIC(FakeNIC* nic)
+    /// Register a new FakeNIC so it can receive packets; returns the newly
+    /// registered FakeNIC.  Throws DriverInitFailure if every port of the
+    /// network is held by a registered FakeNIC.
+    FakeNIC* registerNIC()
     {
         std::lock_guard<std::mutex> lock(mutex);
-        uint32_t addressId = nextAddressId.fetch_add(1);
-        IpAddress ipAddress{addressId};
-        network.insert({ipAddress, nic});
-        return addressId;
+        // Skip addresses whose port is still held by a long-lived driver.
+        // NUM_PORTS + 1 consecutive addresses cover every port even if one
+        // of them is the reserved address 0.
+        for (uint32_t i = 0; i <= NUM_PORTS; ++i) {
+            uint32_t addressId = nextAddressId++;
+            Port* port = &ports[addressId % NUM_PORTS];
+            if (addressId != 0 && port->nic.load() == nullptr) {
+                FakeNIC* nic = new FakeNIC(addressId);
+                port->nic.store(nic);
+                return nic;
+            }
+        }
+        throw DriverInitFailure(HERE_STR, "FakeNetwork has no free ports");
     }
 
-    /// Remove the FakeNIC from the network.
-    void deregisterNIC(uint32_t addressId)
+    /// Remove the FakeNIC from the network and free it.
+    void deregisterNIC(FakeNIC* nic)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        IpAddress ipAddress{addressId};
-        network.erase(ipAddress);
+        Port* port = &ports[nic->addressId % NUM_PORTS];
+        port->nic.store(nullptr);
+        // Wait for concurrent senders that may still reference the NIC.
+        while (port->inflight.load() != 0) {
+            std::this_thread::yield();
+        }
+        for (auto& queue : nic->priorityQueue) {
+            while (queue->pop(
+                [](Delivery& d) { packetPool.release(d.packet); })) {
+            }
+        }
+        delete nic;
     }
 
-    /// Deliver the provide packet to the specified destination.
-    void sendPacket(FakePacket* packet, int priority, IpAddress src,
+    /// Deliver a copy of the provided packet to the specified destination.
+    void sendPacket(const FakePacket* packet, int priority, IpAddress src,
                     IpAddress dst)
     {
-        FakeNIC* nic = nullptr;
-        {
-            std::lock_guard<std::mutex> lock(mutex);
-            if (packetLossDistribution(gen) < packetLossRate) {
-                return;
-            }
-            auto search = network.find(dst);
-            if (search == network.end()) {
-                return;
-            } else {
-                nic = search->second;
-                nic->mutex.lock();
-            }
+        uint64_t threshold =
+            packetLossThreshold.load(std::memory_order_relaxed);
+        if (threshold != 0 && lossGenerator()() < threshold) {
+            return;
         }
-        assert(nic != nullptr);
-        std::lock_guard<std::mutex> lock_nic(nic->mutex, std::adopt_lock);
-        FakePacket* dstPacket = new FakePacket(*packet);
-        dstPacket->sourceIp = src;
         assert(priority < NUM_PRIORITIES);
         assert(priority >= 0);
-        nic->priorityQueue.at(priority).push_back(dstPacket);
+
+        uint32_t addressId = static_cast<uint32_t>(dst);
+        Port* port = &ports[addressId % NUM_PORTS];
+        port->inflight.fetch_add(1);
+        FakeNIC* nic = port->nic.load();
+        if (nic != nullptr && nic->addressId == addressId) {
+            // The receiver gets its own copy so that it may modify it and the
+            // sender may keep (e.g. resend) the original.
+            FakePacket* copy = packetPool.alloc();
+            copy->base.length = packet->base.length;
+            std::memcpy(copy->buf, packet->buf, packet->base.length);
+            bool queued = nic->priorityQueue[priority]->push([&](Delivery& d) {
+                d.packet = copy;
+                d.sourceIp = src;
+            });
+            if (!queued) {
+                // Receive queue overflow; drop the packet.
+                packetPool.release(copy);
+            }
+        }
+        port->inflight.fetch_sub(1);
     }
 
     void setPacketLossRate(double lossRate)
     {
-        std::lock_guard<std::mutex> lock(mutex);
         if (lossRate > 1.0) {
-            packetLossRate = 1.0;
+            lossRate = 1.0;
         } else if (lossRate < 0.0) {
-            packetLossRate = 0.0;
-        } else {
-            packetLossRate = lossRate;
+            lossRate = 0.0;
         }
+        // Scale to the range of the 32-bit loss generator.
+        packetLossThreshold.store(
+            static_cast<uint64_t>(lossRate * (uint64_t(1) << 32)));
     }
 
   private:
-    /// Monitor lock for the entire FakeNetwork structure.
+    /// Number of entries in the address table.
+    static const uint32_t NUM_PORTS = 4096;
+
+    /// Entry in the address table.
+    struct Port {
+        /// Port constructor.
+        Port()
+            : nic(nullptr)
+            , inflight(0)
+        {}
+
+        /// The FakeNIC registered at this port, if any.
+        std::atomic<FakeNIC*> nic;
+
+        /// Number of senders currently delivering to #nic.
+        std::atomic<uint32_t> inflight;
+    };
+
+    /// Returns this thread's random number generator used to decide whether
+    /// a packet should be dropped.
+    static std::mt19937& lossGenerator()
+    {
+        thread_local std::mt19937 gen(std::random_device{}());
+        return gen;
+    }
+
+    /// Serializes registrations.
     std::mutex mutex;
 
-    /// Holds all the packets being sent through the fake network.
-    std::unordered_map<IpAddress, FakeNIC*, IpAddress::Hasher> network;
+    /// Address table; FakeNIC with address id i is found at i % NUM_PORTS.
+    std::array<Port, NUM_PORTS> ports;
 
     /// Identifier for the next FakeDriver that "connects" to the FakeNetwork.
-    std::atomic<uint32_t> nextAddressId;
-
-    /// Rate at which packets should be dropped when sent over this network.
-    double packetLossRate;
+    uint32_t nextAddressId;
 
-    /// Distribution from which we will determine if a packet is dropped.
-    std::uniform_real_distribution<> packetLossDistribution;
+    /// Packets are dropped if a random 32-bit value falls below this
+    /// threshold; 0 disables loss and 2^32 drops every packet.
+    std::atomic<uint64_t> packetLossThreshold;
 
 } fakeNetwork;
 
@@ -136,38 +264,15 @@ FakeNetworkConfig::setPacketLossRate(double lossRate)
     fakeNetwork.setPacketLossRate(lossRate);
 }
 
-/**
- * FakeNIC constructor.
- */
-FakeNIC::FakeNIC()
-    : mutex()
-    , priorityQueue()
-{}
-
-/**
- * FakeNIC destructor.
- */
-FakeNIC::~FakeNIC()
-{
-    std::lock_guard<std::mutex> lock_nic(mutex);
-    for (int i = 0; i < NUM_PRIORITIES; ++i) {
-        while (!priorityQueue.at(i).empty()) {
-            FakePacket* fakePacket = priorityQueue.at(i).front();
-            delete fakePacket;
-            priorityQueue.at(i).pop_front();
-        }
-    }
-}
-
 /**
  * FakeDriver Constructor.
  */
 FakeDriver::FakeDriver()
     : localAddressId()
-    , nic()
+    , nic(fakeNetwork.registerNIC())
     , queueEstimator(getBandwidth())
 {
-    localAddressId = fakeNetwork.registerNIC(&nic);
+    localAddressId = nic->addressId;
 }
 
 /**
@@ -175,7 +280,7 @@ FakeDriver::FakeDriver()
  */
 FakeDriver::~FakeDriver()
 {
-    fakeNetwork.deregisterNIC(localAddressId);
+    fakeNetwork.deregisterNIC(nic.release());
 }
 
 /**
@@ -184,7 +289,7 @@ FakeDriver::~FakeDriver()
 Driver::Packet*
 FakeDriver::allocPacket()
 {
-    FakePacket* packet = new FakePacket();
+    FakePacket* packet = packetPool.alloc();
     return &packet->base;
 }
 
@@ -194,7 +299,7 @@ FakeDriver::allocPacket()
 void
 FakeDriver::sendPacket(Packet* packet, IpAddress destination, int priority)
 {
-    FakePacket* srcPacket = container_of(packet, &FakePacket::base);
+    const FakePacket* srcPacket = container_of(packet, &FakePacket::base);
     IpAddress srcAddress = getLocalAddress();
     IpAddress dstAddress = destination;
     fakeNetwork.sendPacket(srcPacket, priority, srcAddress, dstAddress);
@@ -208,14 +313,13 @@ uint32_t
 FakeDriver::receivePackets(uint32_t maxPackets, Packet* receivedPackets[],
                            IpAddress sourceAddresses[])
 {
-    std::lock_guard<std::mutex> lock_nic(nic.mutex);
     uint32_t numReceived = 0;
     for (int i = NUM_PRIORITIES - 1; i >= 0; --i) {
-        while (numReceived < maxPackets && !nic.priorityQueue.at(i).empty()) {
-            FakePacket* fakePacket = nic.priorityQueue.at(i).front();
-            nic.priorityQueue.at(i).pop_front();
-            receivedPackets[numReceived] = &fakePacket->base;
-            sourceAddresses[numReceived] = fakePacket->sourceIp;
+        while (numReceived < maxPackets &&
+               nic->priorityQueue[i]->pop([&](Delivery& d) {
+                   receivedPackets[numReceived] = &d.packet->base;
+                   sourceAddresses[numReceived] = d.sourceIp;
+               })) {
             numReceived++;
         }
     }
@@ -229,7 +333,7 @@ void
 FakeDriver::releasePackets(Packet* packets[], uint16_t numPackets)
 {
     for (uint16_t i = 0; i < numPackets; ++i) {
-        delete container_of(packets[i], &FakePacket::base);
+        packetPool.release(container_of(packets[i], &FakePacket::base));
     }
 }
 
@@ -37,8 +37,17 @@ TEST(FakeDriverTest, allocPacket)
 {
     FakeDriver driver;
     Driver::Packet* packet = driver.allocPacket();
-    // allocPacket doesn't do much so we just need to make sure we can call it.
-    delete container_of(packet, &FakePacket::base);
+    FakePacket* fakePacket = container_of(packet, &FakePacket::base);
+    EXPECT_EQ(fakePacket->buf, packet->payload);
+    EXPECT_EQ(0, packet->length);
+
+    // Released packets are recycled.
+    packet->length = 100;
+    driver.releasePackets(&packet, 1);
+    Driver::Packet* packet2 = driver.allocPacket();
+    EXPECT_EQ(packet, packet2);
+    EXPECT_EQ(0, packet2->length);
+    driver.releasePackets(&packet2, 1);
 }
 
 TEST(FakeDriverTest, sendPackets)
@@ -51,128 +60,161 @@ TEST(FakeDriverTest, sendPackets)
     int prio[4];
     for (int i = 0; i < 4; ++i) {
         packets[i] = driver1.allocPacket();
+        packets[i]->length = i + 1;
+        static_cast<char*>(packets[i]->payload)[0] = 'a' + i;
         destinations[i] = driver2.getLocalAddress();
         prio[i] = i;
     }
     destinations[2] = IpAddress{42};
 
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(7).size());
+    Driver::Packet* received[8];
+    IpAddress srcAddrs[8];
+    EXPECT_EQ(0U, driver2.receivePackets(8, received, srcAddrs));
 
+    for (int i = 0; i < 4; ++i) {
+        driver1.sendPacket(packets[i], destinations[i], prio[i]);
+    }
     driver1.sendPacket(packets[0], destinations[0], prio[0]);
 
-    EXPECT_EQ(1U, driver2.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(7).size());
-    {
-        FakePacket* packet = driver2.nic.priorityQueue.at(0).front();
-        EXPECT_EQ(driver1.getLocalAddress(), packet->sourceIp);
+    // Received in priority order.
+    EXPECT_EQ(4U, driver2.receivePackets(8, received, srcAddrs));
+    int expected[4] = {3, 1, 0, 0};
+    for (int i = 0; i < 4; ++i) {
+        Driver::Packet* packet = packets[expected[i]];
+        EXPECT_EQ(packet->length, received[i]->length);
+        EXPECT_EQ(0, memcmp(packet->payload, received[i]->payload,
+                            packet->length));
+        EXPECT_EQ(driver1.getLocalAddress(), srcAddrs[i]);
     }
 
-    for (int i = 0; i < 4; ++i) {
-        driver1.sendPacket(packets[i], destinations[i], prio[i]);
+    // The receiver gets its own copy of each packet.
+    EXPECT_NE(packets[0], received[2]);
+    EXPECT_NE(received[2], received[3]);
+    static_cast<char*>(received[2]->payload)[0] = 'z';
+    EXPECT_EQ('a', static_cast<char*>(packets[0]->payload)[0]);
+    EXPECT_EQ('a', static_cast<char*>(received[3]->payload)[0]);
+
+    driver2.releasePackets(received, 4);
+    driver1.releasePackets(packets, 4);
+}
+
+TEST(FakeDriverTest, sendPackets_queueFull)
+{
+    FakeDriver driver1;
+    FakeDriver driver2;
+    Driver::Packet* packet = driver1.allocPacket();
+    for (uint32_t i = 0; i < NIC_QUEUE_CAPACITY + 1; ++i) {
+        driver1.sendPacket(packet, driver2.getLocalAddress(), 0);
+    }
+    driver1.releasePackets(&packet, 1);
+
+    // Packets still queued are released when driver2 is destroyed.
+    Driver::Packet* received[1];
+    IpAddress srcAddrs[1];
+    uint32_t numReceived = 0;
+    while (driver2.receivePackets(1, received, srcAddrs) == 1) {
+        ++numReceived;
+        driver2.releasePackets(received, 1);
+        if (numReceived > NIC_QUEUE_CAPACITY) {
+            break;
+        }
     }
+    EXPECT_EQ(NIC_QUEUE_CAPACITY, numReceived);
+}
 
-    EXPECT_EQ(2U, driver2.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(1U, driver2.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(1U, driver2.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(7).size());
+TEST(FakeDriverTest, sendPackets_packetLoss)
+{
+    FakeDriver driver1;
+    FakeDriver driver2;
+    Driver::Packet* packet = driver1.allocPacket();
+    Driver::Packet* received[2];
+    IpAddress srcAddrs[2];
+
+    FakeNetworkConfig::setPacketLossRate(1.0);
+    driver1.sendPacket(packet, driver2.getLocalAddress(), 0);
+    FakeNetworkConfig::setPacketLossRate(0.0);
+    EXPECT_EQ(0U, driver2.receivePackets(2, received, srcAddrs));
+
+    driver1.sendPacket(packet, driver2.getLocalAddress(), 0);
+    EXPECT_EQ(1U, driver2.receivePackets(2, received, srcAddrs));
+    driver2.releasePackets(received, 1);
+    driver1.releasePackets(&packet, 1);
+}
 
-    delete container_of(packets[2], &FakePacket::base);
+TEST(FakeDriverTest, sendPacketWithHeader)
+{
+    // FakeDriver uses the default Driver::sendPacketWithHeader().
+    FakeDriver driver1;
+    FakeDriver driver2;
+    Driver::Packet* payload = driver1.allocPacket();
+    std::memcpy(payload->payload, "..payload", 9);
+    payload->length = 9;
+
+    driver1.sendPacketWithHeader("head", 4, payload, 2,
+                                 driver2.getLocalAddress(), 0);
+
+    Driver::Packet* received[2];
+    IpAddress srcAddrs[2];
+    EXPECT_EQ(1U, driver2.receivePackets(2, received, srcAddrs));
+    EXPECT_EQ(11, received[0]->length);
+    EXPECT_EQ(0, memcmp("headpayload", received[0]->payload, 11));
+    EXPECT_EQ(0, memcmp("..payload", payload->payload, 9));
+    EXPECT_EQ(9, payload->length);
+    driver2.releasePackets(received, 1);
+    driver1.releasePackets(&payload, 1);
 }
 
 TEST(FakeDriverTest, receivePackets)
 {
-    std::string addressStr("42");
+    FakeDriver sender;
     FakeDriver driver;
 
     Driver::Packet* packets[4];
     IpAddress srcAddrs[4];
 
+    auto send = [&](int priority) {
+        Driver::Packet* packet = sender.allocPacket();
+        packet->length = priority;
+        sender.sendPacket(packet, driver.getLocalAddress(), priority);
+        sender.releasePackets(&packet, 1);
+    };
+
     // 3 packets at priority 7
     for (int i = 0; i < 3; ++i)
-        driver.nic.priorityQueue.at(7).push_back(new FakePacket);
+        send(7);
     // 3 packets at priority 5
     for (int i = 0; i < 3; ++i)
-        driver.nic.priorityQueue.at(5).push_back(new FakePacket);
+        send(5);
     // 1 packet at priority 4
-    driver.nic.priorityQueue.at(4).push_back(new FakePacket);
+    send(4);
     // 1 packet at priority 2
-    driver.nic.priorityQueue.at(2).push_back(new FakePacket);
-
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(3U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(3U, driver.nic.priorityQueue.at(7).size());
+    send(2);
 
     EXPECT_EQ(4U, driver.receivePackets(4, packets, srcAddrs));
+    EXPECT_EQ(7, packets[0]->length);
+    EXPECT_EQ(7, packets[1]->length);
+    EXPECT_EQ(7, packets[2]->length);
+    EXPECT_EQ(5, packets[3]->length);
+    EXPECT_EQ(sender.getLocalAddress(), srcAddrs[0]);
     driver.releasePackets(packets, 4);
 
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(2U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(7).size());
-
     EXPECT_EQ(1U, driver.receivePackets(1, packets, srcAddrs));
+    EXPECT_EQ(5, packets[0]->length);
     driver.releasePackets(packets, 1);
 
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(7).size());
-
-    driver.nic.priorityQueue.at(7).push_back(new FakePacket);
-
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(7).size());
+    send(7);
 
     EXPECT_EQ(1U, driver.receivePackets(1, packets, srcAddrs));
+    EXPECT_EQ(7, packets[0]->length);
     driver.releasePackets(packets, 1);
 
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(7).size());
-
     EXPECT_EQ(3U, driver.receivePackets(4, packets, srcAddrs));
+    EXPECT_EQ(5, packets[0]->length);
+    EXPECT_EQ(4, packets[1]->length);
+    EXPECT_EQ(2, packets[2]->length);
     driver.releasePackets(packets, 3);
+
+    EXPECT_EQ(0U, driver.receivePackets(4, packets, srcAddrs));
 }
 
 TEST(FakeDriverTest, releasePackets)
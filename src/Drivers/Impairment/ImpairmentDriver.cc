@@ -0,0 +1,418 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Drivers/Impairment/ImpairmentDriver.h>
+
+#include <Cycles.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace Homa {
+namespace Drivers {
+namespace Impairment {
+
+/**
+ * Construct an unimpaired Link.
+ */
+ImpairmentDriver::Link::Link()
+    : Link(Impairment())
+{}
+
+/**
+ * Construct a Link with the given impairments.
+ */
+ImpairmentDriver::Link::Link(const Impairment& impairment)
+    : config(impairment)
+    , delay(PerfUtils::Cycles::fromNanoseconds(impairment.delayNs))
+    , jitter(PerfUtils::Cycles::fromNanoseconds(impairment.jitterNs))
+    , reorderDelay(
+          PerfUtils::Cycles::fromNanoseconds(impairment.reorderDelayNs))
+    , cyclesPerByte(0.0)
+    , burst(0)
+    , inBurst(false)
+    , shaperTime(0)
+{
+    if (impairment.bandwidthMbps != 0) {
+        // Mbps is bits per microsecond.
+        double bytesPerSecond = impairment.bandwidthMbps * 1e6 / 8.0;
+        cyclesPerByte = PerfUtils::Cycles::fromSeconds(1.0) / bytesPerSecond;
+        burst = static_cast<uint64_t>(impairment.burstBytes * cyclesPerByte);
+    }
+}
+
+/**
+ * Construct an ImpairmentDriver.
+ *
+ * @param driver
+ *      Driver through which packets will actually be sent and received.  The
+ *      driver must outlive the ImpairmentDriver.
+ * @param seed
+ *      Seed for the random number generator that drives all impairments.
+ */
+ImpairmentDriver::ImpairmentDriver(Driver* driver, uint64_t seed)
+    : driver(driver)
+    , mutex()
+    , gen(seed)
+    , uniform(0.0, 1.0)
+    , defaultLink()
+    , links()
+    , delayQueue()
+    , nextSequence(0)
+    , stats()
+{}
+
+/**
+ * ImpairmentDriver destructor.  Packets still waiting to be sent are dropped.
+ */
+ImpairmentDriver::~ImpairmentDriver()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!delayQueue.empty()) {
+        Packet* packet = delayQueue.top().packet;
+        delayQueue.pop();
+        driver->releasePackets(&packet, 1);
+    }
+}
+
+/**
+ * Set the impairments applied to destinations that do not have their own
+ * configuration.
+ */
+void
+ImpairmentDriver::setDefaultImpairment(const Impairment& impairment)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    defaultLink = Link(impairment);
+}
+
+/**
+ * Set the impairments applied to packets sent to a particular destination,
+ * overriding the default.
+ */
+void
+ImpairmentDriver::setImpairment(IpAddress destination,
+                                const Impairment& impairment)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    links[destination] = Link(impairment);
+}
+
+/**
+ * Remove the destination specific impairments for a destination, so that the
+ * default impairments apply again.
+ */
+void
+ImpairmentDriver::clearImpairment(IpAddress destination)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    links.erase(destination);
+}
+
+/**
+ * Return the counters describing the impairments applied so far.
+ */
+ImpairmentDriver::Stats
+ImpairmentDriver::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+/**
+ * Hand any delayed packets whose departure time has passed to the wrapped
+ * driver.  This is done automatically when sending or receiving packets.
+ */
+void
+ImpairmentDriver::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    sendDue(PerfUtils::Cycles::rdtsc());
+}
+
+/**
+ * See Driver::allocPacket()
+ */
+Driver::Packet*
+ImpairmentDriver::allocPacket()
+{
+    return driver->allocPacket();
+}
+
+/**
+ * See Driver::sendPacket()
+ */
+void
+ImpairmentDriver::sendPacket(Packet* packet, IpAddress destination,
+                             int priority)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    sendDue(now);
+    stats.sentPackets++;
+
+    Link* link = getLink(destination);
+    if (isLost(link)) {
+        stats.lostPackets++;
+        return;
+    }
+
+    int copies = 1;
+    if (chance(link->config.duplicateRate)) {
+        stats.duplicatedPackets++;
+        copies = 2;
+    }
+
+    for (int i = 0; i < copies; ++i) {
+        uint64_t departureTime = now;
+        if (link->cyclesPerByte != 0.0) {
+            if (link->config.queueLimitBytes != 0 &&
+                getShaperBacklog(link, now) > link->config.queueLimitBytes) {
+                stats.queueDroppedPackets++;
+                continue;
+            }
+            uint64_t start = std::max(link->shaperTime, now);
+            uint64_t transmitTime =
+                static_cast<uint64_t>(packet->length * link->cyclesPerByte);
+            link->shaperTime = start + transmitTime;
+            if (link->shaperTime > now + link->burst) {
+                departureTime = link->shaperTime - link->burst;
+            }
+        }
+        departureTime += link->delay;
+        if (link->jitter != 0) {
+            departureTime += static_cast<uint64_t>(uniform(gen) * link->jitter);
+        }
+        if (chance(link->config.reorderRate)) {
+            stats.reorderedPackets++;
+            departureTime += link->reorderDelay;
+        }
+
+        if (departureTime <= now && i == 0) {
+            driver->sendPacket(packet, destination, priority);
+        } else {
+            // A duplicate is always sent as a copy; drivers may ignore a
+            // second send of a packet they are still transmitting.
+            if (departureTime > now) {
+                stats.delayedPackets++;
+            }
+            schedule(packet, destination, priority, departureTime);
+        }
+    }
+    sendDue(now);
+}
+
+/**
+ * See Driver::cork()
+ */
+void
+ImpairmentDriver::cork()
+{
+    driver->cork();
+}
+
+/**
+ * See Driver::uncork()
+ */
+void
+ImpairmentDriver::uncork()
+{
+    driver->uncork();
+}
+
+/**
+ * See Driver::receivePackets()
+ */
+uint32_t
+ImpairmentDriver::receivePackets(uint32_t maxPackets,
+                                 Packet* receivedPackets[],
+                                 IpAddress sourceAddresses[])
+{
+    flush();
+    return driver->receivePackets(maxPackets, receivedPackets,
+                                  sourceAddresses);
+}
+
+/**
+ * See Driver::releasePackets()
+ */
+void
+ImpairmentDriver::releasePackets(Packet* packets[], uint16_t numPackets)
+{
+    driver->releasePackets(packets, numPackets);
+}
+
+/**
+ * See Driver::getHighestPacketPriority()
+ */
+int
+ImpairmentDriver::getHighestPacketPriority()
+{
+    return driver->getHighestPacketPriority();
+}
+
+/**
+ * See Driver::getMaxPayloadSize()
+ */
+uint32_t
+ImpairmentDriver::getMaxPayloadSize()
+{
+    return driver->getMaxPayloadSize();
+}
+
+/**
+ * See Driver::getBandwidth()
+ */
+uint32_t
+ImpairmentDriver::getBandwidth()
+{
+    return driver->getBandwidth();
+}
+
+/**
+ * See Driver::getLocalAddress()
+ */
+IpAddress
+ImpairmentDriver::getLocalAddress()
+{
+    return driver->getLocalAddress();
+}
+
+/**
+ * See Driver::getQueuedBytes()
+ *
+ * Includes the bytes waiting in the token buckets of shaped links so that the
+ * Transport sees a shaped link as congested.  Packets held back only for
+ * delay, jitter, or reordering are in flight on the modeled link, not queued
+ * for it, and are not counted.
+ */
+uint32_t
+ImpairmentDriver::getQueuedBytes()
+{
+    uint64_t queuedBytes = driver->getQueuedBytes();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t now = PerfUtils::Cycles::rdtsc();
+        queuedBytes += getShaperBacklog(&defaultLink, now);
+        for (auto& entry : links) {
+            queuedBytes += getShaperBacklog(&entry.second, now);
+        }
+    }
+    return static_cast<uint32_t>(std::min<uint64_t>(queuedBytes, UINT32_MAX));
+}
+
+/**
+ * Return the Link whose impairments apply to the given destination.
+ *
+ * Must be called with #mutex held.
+ */
+ImpairmentDriver::Link*
+ImpairmentDriver::getLink(IpAddress destination)
+{
+    auto it = links.find(destination);
+    if (it == links.end()) {
+        return &defaultLink;
+    }
+    return &it->second;
+}
+
+/**
+ * Return the number of bytes waiting in a link's token bucket queue, i.e.
+ * admitted but not yet serialized at the shaped rate beyond what the burst
+ * allowance lets through at once.  Returns 0 for unshaped links.
+ *
+ * Must be called with #mutex held.
+ */
+uint64_t
+ImpairmentDriver::getShaperBacklog(Link* link, uint64_t now)
+{
+    if (link->cyclesPerByte == 0.0 || link->shaperTime <= now + link->burst) {
+        return 0;
+    }
+    uint64_t backlog = link->shaperTime - now - link->burst;
+    return static_cast<uint64_t>(backlog / link->cyclesPerByte);
+}
+
+/**
+ * Advance the link's Gilbert-Elliott channel by one packet and return true if
+ * that packet should be dropped.
+ *
+ * Must be called with #mutex held.
+ */
+bool
+ImpairmentDriver::isLost(Link* link)
+{
+    if (link->inBurst) {
+        if (chance(link->config.burstEndRate)) {
+            link->inBurst = false;
+        }
+    } else if (chance(link->config.burstStartRate)) {
+        link->inBurst = true;
+    }
+    return chance(link->inBurst ? link->config.burstLossRate
+                                : link->config.lossRate);
+}
+
+/**
+ * Copy a packet into a packet from the wrapped driver and queue the copy to
+ * be sent at the given time.
+ *
+ * Must be called with #mutex held.
+ */
+void
+ImpairmentDriver::schedule(Packet* packet, IpAddress destination, int priority,
+                           uint64_t departureTime)
+{
+    Packet* copy = driver->allocPacket();
+    std::memcpy(copy->payload, packet->payload, packet->length);
+    copy->length = packet->length;
+    delayQueue.push(
+        {departureTime, nextSequence++, copy, destination, priority});
+}
+
+/**
+ * Send all delayed packets whose departure time is at or before now.
+ *
+ * Must be called with #mutex held.
+ */
+void
+ImpairmentDriver::sendDue(uint64_t now)
+{
+    while (!delayQueue.empty() && delayQueue.top().departureTime <= now) {
+        DelayedPacket delayed = delayQueue.top();
+        delayQueue.pop();
+        driver->sendPacket(delayed.packet, delayed.destination,
+                           delayed.priority);
+        driver->releasePackets(&delayed.packet, 1);
+    }
+}
+
+/**
+ * Return true with the given probability.
+ *
+ * Must be called with #mutex held.
+ */
+bool
+ImpairmentDriver::chance(double probability)
+{
+    if (probability <= 0.0) {
+        return false;
+    }
+    return uniform(gen) < probability;
+}
+
+}  // namespace Impairment
+}  // namespace Drivers
+}  // namespace Homa
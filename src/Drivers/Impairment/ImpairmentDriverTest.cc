@@ -0,0 +1,256 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Cycles.h>
+#include <Homa/Drivers/Fake/FakeDriver.h>
+#include <Homa/Drivers/Impairment/ImpairmentDriver.h>
+#include <gtest/gtest.h>
+
+#include "Mock/MockDriver.h"
+
+#include <string>
+
+namespace Homa {
+namespace Drivers {
+namespace Impairment {
+namespace {
+
+using PerfUtils::Cycles;
+
+class ImpairmentDriverTest : public ::testing::Test {
+  public:
+    ImpairmentDriverTest()
+        : fakeDriver()
+        , peer()
+        , driver(&fakeDriver, 1)
+        , destination(peer.getLocalAddress())
+    {
+        Cycles::mockTscValue = 10000;
+    }
+
+    ~ImpairmentDriverTest()
+    {
+        Cycles::mockTscValue = 0;
+    }
+
+    /// Send a packet whose first byte is tag through the ImpairmentDriver.
+    void send(char tag, int32_t length = 100)
+    {
+        Driver::Packet* packet = driver.allocPacket();
+        packet->length = length;
+        static_cast<char*>(packet->payload)[0] = tag;
+        driver.sendPacket(packet, destination, 0);
+        driver.releasePackets(&packet, 1);
+    }
+
+    /// Return the tags of the packets that have reached the peer.
+    std::string receive()
+    {
+        std::string tags;
+        Driver::Packet* packets[16];
+        IpAddress sources[16];
+        uint32_t count = peer.receivePackets(16, packets, sources);
+        for (uint32_t i = 0; i < count; ++i) {
+            tags += static_cast<char*>(packets[i]->payload)[0];
+        }
+        peer.releasePackets(packets, count);
+        return tags;
+    }
+
+    Fake::FakeDriver fakeDriver;
+    Fake::FakeDriver peer;
+    ImpairmentDriver driver;
+    IpAddress destination;
+};
+
+TEST_F(ImpairmentDriverTest, sendPacket_unimpaired)
+{
+    send('a');
+    send('b');
+    EXPECT_EQ("ab", receive());
+    ImpairmentDriver::Stats stats = driver.getStats();
+    EXPECT_EQ(2U, stats.sentPackets);
+    EXPECT_EQ(0U, stats.delayedPackets);
+}
+
+TEST_F(ImpairmentDriverTest, sendPacket_delay)
+{
+    Impairment impairment;
+    impairment.delayNs = 1000;
+    driver.setDefaultImpairment(impairment);
+
+    send('a', 60);
+    EXPECT_EQ("", receive());
+    EXPECT_EQ(1U, driver.getStats().delayedPackets);
+    // Propagation delay does not make the link look congested.
+    EXPECT_EQ(0U, driver.getQueuedBytes());
+
+    Cycles::mockTscValue += Cycles::fromNanoseconds(1000);
+    driver.flush();
+    EXPECT_EQ("a", receive());
+}
+
+TEST_F(ImpairmentDriverTest, sendPacket_reorder)
+{
+    Impairment impairment;
+    impairment.reorderRate = 1.0;
+    impairment.reorderDelayNs = 1000;
+    driver.setDefaultImpairment(impairment);
+    send('a');
+    driver.setDefaultImpairment(Impairment());
+    send('b');
+
+    Cycles::mockTscValue += Cycles::fromNanoseconds(1000);
+    driver.flush();
+    EXPECT_EQ("ba", receive());
+    EXPECT_EQ(1U, driver.getStats().reorderedPackets);
+}
+
+TEST_F(ImpairmentDriverTest, sendPacket_duplicate)
+{
+    Impairment impairment;
+    impairment.duplicateRate = 1.0;
+    driver.setDefaultImpairment(impairment);
+    send('a');
+
+    EXPECT_EQ("aa", receive());
+    EXPECT_EQ(1U, driver.getStats().duplicatedPackets);
+    EXPECT_EQ(0U, driver.getStats().delayedPackets);
+}
+
+TEST_F(ImpairmentDriverTest, sendPacket_duplicateIsCopy)
+{
+    Mock::MockDriver mockDriver;
+    ImpairmentDriver impairedDriver(&mockDriver, 1);
+    Impairment impairment;
+    impairment.duplicateRate = 1.0;
+    impairedDriver.setDefaultImpairment(impairment);
+
+    char payload[100] = {'a'};
+    char copyPayload[100] = {};
+    Driver::Packet packet{payload, 100};
+    Driver::Packet copy{copyPayload, 0};
+
+    // The duplicate must not be a second send of the same packet.
+    EXPECT_CALL(mockDriver, allocPacket()).WillOnce(::testing::Return(&copy));
+    {
+        ::testing::InSequence sequence;
+        EXPECT_CALL(mockDriver, sendPacket(::testing::Eq(&packet),
+                                           ::testing::_, ::testing::_));
+        EXPECT_CALL(mockDriver, sendPacket(::testing::Eq(&copy), ::testing::_,
+                                           ::testing::_));
+        EXPECT_CALL(mockDriver,
+                    releasePackets(::testing::Pointee(&copy), 1));
+    }
+    impairedDriver.sendPacket(&packet, destination, 0);
+    EXPECT_EQ('a', copyPayload[0]);
+    EXPECT_EQ(100, copy.length);
+}
+
+TEST_F(ImpairmentDriverTest, sendPacket_loss)
+{
+    Impairment impairment;
+    impairment.lossRate = 1.0;
+    driver.setDefaultImpairment(impairment);
+    send('a');
+    send('b');
+    EXPECT_EQ("", receive());
+    EXPECT_EQ(2U, driver.getStats().lostPackets);
+}
+
+TEST_F(ImpairmentDriverTest, sendPacket_burstLoss)
+{
+    Impairment impairment;
+    impairment.burstStartRate = 1.0;
+    impairment.burstEndRate = 0.0;
+    impairment.burstLossRate = 1.0;
+    driver.setDefaultImpairment(impairment);
+    send('a');
+    EXPECT_TRUE(driver.defaultLink.inBurst);
+    EXPECT_EQ("", receive());
+
+    impairment.burstStartRate = 0.0;
+    impairment.burstEndRate = 1.0;
+    driver.setDefaultImpairment(impairment);
+    send('b');
+    EXPECT_FALSE(driver.defaultLink.inBurst);
+    EXPECT_EQ("b", receive());
+}
+
+TEST_F(ImpairmentDriverTest, sendPacket_bandwidth)
+{
+    Impairment impairment;
+    impairment.bandwidthMbps = 8;  // 1 byte per microsecond
+    impairment.burstBytes = 100;
+    impairment.queueLimitBytes = 150;
+    driver.setDefaultImpairment(impairment);
+
+    // The first packet fits in the burst.
+    send('a');
+    EXPECT_EQ("a", receive());
+
+    // The next two are queued behind it; the last overflows the queue.
+    send('b');
+    send('c');
+    send('d');
+    EXPECT_EQ("", receive());
+    ImpairmentDriver::Stats stats = driver.getStats();
+    EXPECT_EQ(2U, stats.delayedPackets);
+    EXPECT_EQ(1U, stats.queueDroppedPackets);
+    EXPECT_NEAR(200U, driver.getQueuedBytes(), 1);
+
+    Cycles::mockTscValue += Cycles::fromNanoseconds(100 * 1000 + 500);
+    driver.flush();
+    EXPECT_EQ("b", receive());
+    EXPECT_NEAR(100U, driver.getQueuedBytes(), 1);
+    Cycles::mockTscValue += Cycles::fromNanoseconds(100 * 1000);
+    driver.flush();
+    EXPECT_EQ("c", receive());
+}
+
+TEST_F(ImpairmentDriverTest, setImpairment)
+{
+    Impairment impairment;
+    impairment.lossRate = 1.0;
+    driver.setImpairment(destination, impairment);
+    send('a');
+    EXPECT_EQ("", receive());
+
+    driver.clearImpairment(destination);
+    send('b');
+    EXPECT_EQ("b", receive());
+}
+
+TEST_F(ImpairmentDriverTest, receivePackets)
+{
+    Impairment impairment;
+    impairment.delayNs = 1000;
+    driver.setDefaultImpairment(impairment);
+    send('a');
+
+    // Receiving through the ImpairmentDriver releases due packets.
+    Driver::Packet* packets[4];
+    IpAddress sources[4];
+    EXPECT_EQ(0U, driver.receivePackets(4, packets, sources));
+    EXPECT_EQ("", receive());
+    Cycles::mockTscValue += Cycles::fromNanoseconds(1000);
+    EXPECT_EQ(0U, driver.receivePackets(4, packets, sources));
+    EXPECT_EQ("a", receive());
+}
+
+}  // namespace
+}  // namespace Impairment
+}  // namespace Drivers
+}  // namespace Homa
@@ -0,0 +1,281 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <Cycles.h>
+#include <Homa/Drivers/Fake/FakeDriver.h>
+#include <Homa/Drivers/Pcap/PcapReplayDriver.h>
+#include <Homa/Drivers/Pcap/PcapTapDriver.h>
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+
+#include "PcapFormat.h"
+
+namespace Homa {
+namespace Drivers {
+namespace Pcap {
+namespace {
+
+using PerfUtils::Cycles;
+
+class PcapDriverTest : public ::testing::Test {
+  public:
+    PcapDriverTest()
+        : path()
+    {
+        char pathTemplate[] = "/tmp/PcapDriverTest.XXXXXX";
+        int fd = mkstemp(pathTemplate);
+        close(fd);
+        path = pathTemplate;
+    }
+
+    ~PcapDriverTest()
+    {
+        unlink(path.c_str());
+        Cycles::mockTscValue = 0;
+    }
+
+    /// Append a record holding a single tag byte to a capture file.
+    static void writeRecord(FILE* file, uint64_t timestamp, IpAddress source,
+                            IpAddress destination, char tag)
+    {
+        Format::RecordHeader recordHeader;
+        recordHeader.seconds = timestamp / 1000000000;
+        recordHeader.nanoseconds = timestamp % 1000000000;
+        recordHeader.capturedLength = sizeof(Format::Ipv4Header) + 1;
+        recordHeader.originalLength = recordHeader.capturedLength;
+        Format::Ipv4Header ipHeader;
+        memset(&ipHeader, 0, sizeof(ipHeader));
+        ipHeader.versionIhl = 0x45;
+        ipHeader.protocol = Format::IP_PROTOCOL_HOMA;
+        ipHeader.source = htonl(source.addr);
+        ipHeader.destination = htonl(destination.addr);
+        fwrite(&recordHeader, sizeof(recordHeader), 1, file);
+        fwrite(&ipHeader, sizeof(ipHeader), 1, file);
+        fwrite(&tag, 1, 1, file);
+    }
+
+    /// Write a capture with packets "a", "b" and "c" sent to 10 from 1, 2
+    /// and 3, spaced 1000ns apart; "b" is sent to 20 instead.
+    void writeCapture(uint32_t magic = Format::MAGIC_NANOSECONDS)
+    {
+        FILE* file = fopen(path.c_str(), "wb");
+        Format::FileHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = magic;
+        header.versionMajor = 2;
+        header.versionMinor = 4;
+        header.snapLen = Format::SNAPLEN;
+        header.linkType = Format::LINKTYPE_RAW;
+        fwrite(&header, sizeof(header), 1, file);
+        writeRecord(file, 5000000000, IpAddress{1}, IpAddress{10}, 'a');
+        writeRecord(file, 5000001000, IpAddress{2}, IpAddress{20}, 'b');
+        writeRecord(file, 5000002000, IpAddress{3}, IpAddress{10}, 'c');
+        fclose(file);
+    }
+
+    /// Return the tags of the packets replayed by a single receivePackets().
+    static std::string receive(Driver* driver, std::string* sources = nullptr)
+    {
+        std::string tags;
+        Driver::Packet* packets[16];
+        IpAddress addresses[16];
+        uint32_t count = driver->receivePackets(16, packets, addresses);
+        for (uint32_t i = 0; i < count; ++i) {
+            tags += static_cast<char*>(packets[i]->payload)[0];
+            if (sources != nullptr) {
+                *sources += std::to_string(addresses[i].addr);
+            }
+        }
+        driver->releasePackets(packets, count);
+        return tags;
+    }
+
+    std::string path;
+};
+
+TEST_F(PcapDriverTest, tap_sendPacket)
+{
+    Fake::FakeDriver fakeDriver;
+    Fake::FakeDriver peer;
+    PcapTapDriver tap(&fakeDriver, path.c_str());
+
+    Driver::Packet* packet = tap.allocPacket();
+    static_cast<char*>(packet->payload)[0] = 'a';
+    packet->length = 7;
+    tap.sendPacket(packet, peer.getLocalAddress(), 3);
+    tap.releasePackets(&packet, 1);
+    tap.flush();
+    EXPECT_EQ(1U, tap.getRecordedPackets());
+    EXPECT_EQ("a", receive(&peer));
+
+    FILE* file = fopen(path.c_str(), "rb");
+    Format::FileHeader header;
+    Format::RecordHeader recordHeader;
+    Format::Ipv4Header ipHeader;
+    char payload[7];
+    ASSERT_EQ(1U, fread(&header, sizeof(header), 1, file));
+    ASSERT_EQ(1U, fread(&recordHeader, sizeof(recordHeader), 1, file));
+    ASSERT_EQ(1U, fread(&ipHeader, sizeof(ipHeader), 1, file));
+    ASSERT_EQ(1U, fread(payload, sizeof(payload), 1, file));
+    fclose(file);
+    EXPECT_EQ(Format::MAGIC_NANOSECONDS, header.magic);
+    EXPECT_EQ(Format::LINKTYPE_RAW, header.linkType);
+    EXPECT_EQ(27U, recordHeader.capturedLength);
+    EXPECT_EQ(27U, recordHeader.originalLength);
+    EXPECT_EQ(3 << 5, ipHeader.tos);
+    EXPECT_EQ(27, ntohs(ipHeader.totalLength));
+    EXPECT_EQ(Format::IP_PROTOCOL_HOMA, ipHeader.protocol);
+    EXPECT_EQ(fakeDriver.getLocalAddress().addr, ntohl(ipHeader.source));
+    EXPECT_EQ(peer.getLocalAddress().addr, ntohl(ipHeader.destination));
+    EXPECT_EQ('a', payload[0]);
+}
+
+TEST_F(PcapDriverTest, tap_replay)
+{
+    Fake::FakeDriver fakeDriver;
+    Fake::FakeDriver peer;
+    {
+        PcapTapDriver tap(&fakeDriver, path.c_str());
+        Driver::Packet* packet = peer.allocPacket();
+        static_cast<char*>(packet->payload)[0] = 'b';
+        packet->length = 1;
+        peer.sendPacket(packet, fakeDriver.getLocalAddress(), 0);
+        peer.releasePackets(&packet, 1);
+
+        packet = tap.allocPacket();
+        static_cast<char*>(packet->payload)[0] = 'a';
+        packet->length = 1;
+        tap.sendPacket(packet, peer.getLocalAddress(), 0);
+        tap.releasePackets(&packet, 1);
+        EXPECT_EQ("b", receive(&tap));
+        EXPECT_EQ(2U, tap.getRecordedPackets());
+    }
+
+    // Only the packet received by the tapped driver is replayed to it.
+    ReplayOptions options;
+    options.speed = 0;
+    options.localAddress = fakeDriver.getLocalAddress();
+    PcapReplayDriver replay(path.c_str(), options);
+    std::string sources;
+    EXPECT_EQ("b", receive(&replay, &sources));
+    EXPECT_EQ(std::to_string(peer.getLocalAddress().addr), sources);
+    EXPECT_TRUE(replay.isFinished());
+}
+
+TEST_F(PcapDriverTest, replay_constructor_badFile)
+{
+    EXPECT_THROW(PcapReplayDriver("/nonexistent/capture.pcap"),
+                 DriverInitFailure);
+    EXPECT_THROW(PcapReplayDriver(path.c_str()), DriverInitFailure);
+    writeCapture(0x12345678);
+    EXPECT_THROW(PcapReplayDriver(path.c_str()), DriverInitFailure);
+}
+
+TEST_F(PcapDriverTest, replay_constructor_filter)
+{
+    writeCapture();
+    PcapReplayDriver all(path.c_str());
+    EXPECT_EQ(3U, all.records.size());
+    EXPECT_EQ(0U, all.records[0].timestamp);
+    EXPECT_EQ(2000U, all.records[2].timestamp);
+
+    ReplayOptions options;
+    options.localAddress = IpAddress{10};
+    PcapReplayDriver filtered(path.c_str(), options);
+    EXPECT_EQ(2U, filtered.records.size());
+    EXPECT_EQ(IpAddress{3}, filtered.records[1].source);
+    EXPECT_EQ(1, filtered.records[1].packet.length);
+    EXPECT_EQ(IpAddress{10}, filtered.getLocalAddress());
+}
+
+TEST_F(PcapDriverTest, replay_constructor_microseconds)
+{
+    writeCapture(0xa1b2c3d4);
+    PcapReplayDriver replay(path.c_str());
+    EXPECT_EQ(1000000U, replay.records[1].timestamp);
+}
+
+TEST_F(PcapDriverTest, receivePackets_recordedSpeed)
+{
+    writeCapture();
+    ReplayOptions options;
+    options.speed = 2.0;
+    PcapReplayDriver replay(path.c_str(), options);
+
+    Cycles::mockTscValue = 10000;
+    EXPECT_EQ("a", receive(&replay));
+    EXPECT_EQ("", receive(&replay));
+    Cycles::mockTscValue += Cycles::fromNanoseconds(600);
+    EXPECT_EQ("b", receive(&replay));
+    EXPECT_FALSE(replay.isFinished());
+    Cycles::mockTscValue += Cycles::fromNanoseconds(600);
+    EXPECT_EQ("c", receive(&replay));
+    EXPECT_TRUE(replay.isFinished());
+    EXPECT_EQ("", receive(&replay));
+    EXPECT_EQ(3U, replay.getReplayedPackets());
+}
+
+TEST_F(PcapDriverTest, receivePackets_loops)
+{
+    writeCapture();
+    ReplayOptions options;
+    options.speed = 0;
+    options.loops = 2;
+    PcapReplayDriver replay(path.c_str(), options);
+
+    Driver::Packet* packets[4];
+    IpAddress addresses[4];
+    EXPECT_EQ(4U, replay.receivePackets(4, packets, addresses));
+    EXPECT_EQ('a', static_cast<char*>(packets[3]->payload)[0]);
+
+    // Received packets are copies; changing one doesn't change the replay.
+    EXPECT_NE(replay.records[0].packet.payload, packets[3]->payload);
+    static_cast<char*>(packets[3]->payload)[0] = 'z';
+    replay.releasePackets(packets, 4);
+    EXPECT_EQ(2U, replay.receivePackets(4, packets, addresses));
+    EXPECT_EQ('b', static_cast<char*>(packets[0]->payload)[0]);
+    EXPECT_EQ('c', static_cast<char*>(packets[1]->payload)[0]);
+    replay.releasePackets(packets, 2);
+    EXPECT_EQ('a', static_cast<char*>(replay.records[0].packet.payload)[0]);
+    EXPECT_TRUE(replay.isFinished());
+    EXPECT_EQ(0U, replay.receivePackets(4, packets, addresses));
+}
+
+TEST_F(PcapDriverTest, replay_sendPacket)
+{
+    writeCapture();
+    PcapReplayDriver replay(path.c_str());
+    Driver::Packet* packet = replay.allocPacket();
+    EXPECT_EQ(0, packet->length);
+    packet->length = 1500;
+    replay.sendPacket(packet, IpAddress{1}, 0);
+    EXPECT_EQ(1U, replay.getSentPackets());
+
+    // Released packets are recycled.
+    replay.releasePackets(&packet, 1);
+    EXPECT_EQ(packet, replay.allocPacket());
+    EXPECT_EQ(0, packet->length);
+    replay.releasePackets(&packet, 1);
+}
+
+}  // namespace
+}  // namespace Pcap
+}  // namespace Drivers
+}  // namespace Homa
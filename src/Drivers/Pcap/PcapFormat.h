@@ -0,0 +1,99 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_DRIVERS_PCAP_PCAPFORMAT_H
+#define HOMA_DRIVERS_PCAP_PCAPFORMAT_H
+
+#include <cstdint>
+
+namespace Homa {
+namespace Drivers {
+namespace Pcap {
+
+/**
+ * On-disk layout of the capture files written by PcapTapDriver and read by
+ * PcapReplayDriver.
+ *
+ * Files use the classic pcap format with nanosecond timestamps and
+ * LINKTYPE_RAW, so each record is an IPv4 datagram.  Homa packets carry no
+ * IP header of their own, so the tap synthesizes one holding the source and
+ * destination addresses and the packet's priority (in the TOS field); this is
+ * enough for standard tools to display and filter the capture.  Multi-byte
+ * fields are written in host byte order except for the IPv4 header, which is
+ * in network byte order as usual.
+ */
+namespace Format {
+
+/// Magic number identifying a pcap file with nanosecond timestamps.
+const uint32_t MAGIC_NANOSECONDS = 0xa1b23c4d;
+
+/// Link-layer header type for raw IPv4/IPv6 packets.
+const uint32_t LINKTYPE_RAW = 101;
+
+/// IP protocol number used in the synthesized IPv4 headers; 253 is reserved
+/// for experimentation (RFC 3692).
+const uint8_t IP_PROTOCOL_HOMA = 253;
+
+/// Largest packet the tap will record.
+const uint32_t SNAPLEN = 65535;
+
+/**
+ * Header at the start of every pcap file.
+ */
+struct FileHeader {
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t timeZone;
+    uint32_t sigFigs;
+    uint32_t snapLen;
+    uint32_t linkType;
+} __attribute__((packed));
+static_assert(sizeof(FileHeader) == 24, "pcap file header size");
+
+/**
+ * Header preceding every packet record.
+ */
+struct RecordHeader {
+    uint32_t seconds;
+    uint32_t nanoseconds;
+    uint32_t capturedLength;
+    uint32_t originalLength;
+} __attribute__((packed));
+static_assert(sizeof(RecordHeader) == 16, "pcap record header size");
+
+/**
+ * Minimal IPv4 header (no options) prepended to each recorded Homa packet.
+ */
+struct Ipv4Header {
+    uint8_t versionIhl;
+    uint8_t tos;
+    uint16_t totalLength;
+    uint16_t id;
+    uint16_t fragmentOffset;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t checksum;
+    uint32_t source;
+    uint32_t destination;
+} __attribute__((packed));
+static_assert(sizeof(Ipv4Header) == 20, "IPv4 header size");
+
+}  // namespace Format
+}  // namespace Pcap
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_DRIVERS_PCAP_PCAPFORMAT_H
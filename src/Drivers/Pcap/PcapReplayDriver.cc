@@ -0,0 +1,396 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <Homa/Drivers/Pcap/PcapReplayDriver.h>
+
+#include <Cycles.h>
+#include <Homa/Util.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "CodeLocation.h"
+#include "PcapFormat.h"
+
+namespace Homa {
+namespace Drivers {
+namespace Pcap {
+
+namespace {
+
+/// Magic number identifying a pcap file with microsecond timestamps.
+const uint32_t MAGIC_MICROSECONDS = 0xa1b2c3d4;
+
+}  // namespace
+
+/**
+ * Construct a PcapReplayDriver that replays a capture once at the recorded
+ * speed.
+ *
+ * @param fileName
+ *      Path of the capture file to replay.
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the capture file cannot be read or is malformed.
+ */
+PcapReplayDriver::PcapReplayDriver(const char* fileName)
+    : PcapReplayDriver(fileName, ReplayOptions())
+{}
+
+/**
+ * Construct a PcapReplayDriver.
+ *
+ * @param fileName
+ *      Path of the capture file to replay.
+ * @param options
+ *      Controls how the capture is played back.
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the capture file cannot be read or is malformed.
+ */
+PcapReplayDriver::PcapReplayDriver(const char* fileName,
+                                   const ReplayOptions& options)
+    : options(options)
+    , mapping(nullptr)
+    , mappingLength(0)
+    , records()
+    , mutex()
+    , next(0)
+    , completedLoops(0)
+    , loopStart(0)
+    , replayedPackets(0)
+    , sentPackets(0)
+    , freePackets()
+{
+    load(fileName);
+}
+
+/**
+ * PcapReplayDriver destructor.
+ */
+PcapReplayDriver::~PcapReplayDriver()
+{
+    for (OutboundPacket* packet : freePackets) {
+        delete packet;
+    }
+    if (mapping != nullptr) {
+        munmap(mapping, mappingLength);
+    }
+}
+
+/**
+ * Return true if every packet of every loop has been replayed.
+ */
+bool
+PcapReplayDriver::isFinished()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return records.empty() ||
+           (options.loops != 0 && completedLoops >= options.loops);
+}
+
+/**
+ * Return the number of packets returned by receivePackets() so far.
+ */
+uint64_t
+PcapReplayDriver::getReplayedPackets()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return replayedPackets;
+}
+
+/**
+ * Return the number of packets passed to sendPacket() so far.
+ */
+uint64_t
+PcapReplayDriver::getSentPackets()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return sentPackets;
+}
+
+/**
+ * See Driver::allocPacket()
+ */
+Driver::Packet*
+PcapReplayDriver::allocPacket()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return &getFreePacket(lock)->base;
+}
+
+/**
+ * See Driver::sendPacket()
+ *
+ * The packet is discarded.
+ */
+void
+PcapReplayDriver::sendPacket(Packet* packet, IpAddress destination,
+                             int priority)
+{
+    (void)packet;
+    (void)destination;
+    (void)priority;
+    std::lock_guard<std::mutex> lock(mutex);
+    sentPackets++;
+}
+
+/**
+ * See Driver::receivePackets()
+ *
+ * Returns the captured packets whose (scaled) capture time has been reached
+ * since playback started.  Playback starts with the first call.
+ */
+uint32_t
+PcapReplayDriver::receivePackets(uint32_t maxPackets,
+                                 Packet* receivedPackets[],
+                                 IpAddress sourceAddresses[])
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (records.empty()) {
+        return 0;
+    }
+
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    if (loopStart == 0) {
+        loopStart = now;
+    }
+    uint64_t elapsed = UINT64_MAX;
+    if (options.speed > 0.0) {
+        elapsed = static_cast<uint64_t>(
+            PerfUtils::Cycles::toNanoseconds(now - loopStart) * options.speed);
+    }
+
+    uint32_t numPackets = 0;
+    while (numPackets < maxPackets &&
+           (options.loops == 0 || completedLoops < options.loops)) {
+        Record* record = &records[next];
+        if (record->timestamp > elapsed) {
+            break;
+        }
+        OutboundPacket* packet = getFreePacket(lock);
+        if (packet->buf.size() < static_cast<size_t>(record->packet.length)) {
+            packet->buf.resize(record->packet.length);
+            packet->base.payload = packet->buf.data();
+        }
+        std::memcpy(packet->base.payload, record->packet.payload,
+                    record->packet.length);
+        packet->base.length = record->packet.length;
+        receivedPackets[numPackets] = &packet->base;
+        sourceAddresses[numPackets] = record->source;
+        numPackets++;
+        next++;
+        if (next == records.size()) {
+            completedLoops++;
+            next = 0;
+            loopStart = now;
+            elapsed = options.speed > 0.0 ? 0 : UINT64_MAX;
+        }
+    }
+    replayedPackets += numPackets;
+    return numPackets;
+}
+
+/**
+ * See Driver::releasePackets()
+ */
+void
+PcapReplayDriver::releasePackets(Packet* packets[], uint16_t numPackets)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint16_t i = 0; i < numPackets; ++i) {
+        freePackets.push_back(container_of(packets[i], &OutboundPacket::base));
+    }
+}
+
+/**
+ * Return an empty packet, reusing a released one if possible.
+ *
+ * @param lock
+ *      Reminder to hold the PcapReplayDriver::mutex during this call.
+ */
+PcapReplayDriver::OutboundPacket*
+PcapReplayDriver::getFreePacket(const std::lock_guard<std::mutex>& lock)
+{
+    (void)lock;
+    OutboundPacket* packet = nullptr;
+    if (!freePackets.empty()) {
+        packet = freePackets.back();
+        freePackets.pop_back();
+    } else {
+        packet = new OutboundPacket;
+        packet->buf.resize(options.maxPayloadSize);
+        packet->base.payload = packet->buf.data();
+    }
+    packet->base.length = 0;
+    return packet;
+}
+
+/**
+ * See Driver::getHighestPacketPriority()
+ */
+int
+PcapReplayDriver::getHighestPacketPriority()
+{
+    return 7;
+}
+
+/**
+ * See Driver::getMaxPayloadSize()
+ */
+uint32_t
+PcapReplayDriver::getMaxPayloadSize()
+{
+    return options.maxPayloadSize;
+}
+
+/**
+ * See Driver::getBandwidth()
+ */
+uint32_t
+PcapReplayDriver::getBandwidth()
+{
+    return options.bandwidth;
+}
+
+/**
+ * See Driver::getLocalAddress()
+ */
+IpAddress
+PcapReplayDriver::getLocalAddress()
+{
+    return options.localAddress;
+}
+
+/**
+ * See Driver::getQueuedBytes()
+ */
+uint32_t
+PcapReplayDriver::getQueuedBytes()
+{
+    return 0;
+}
+
+/**
+ * Map the capture file into memory and index the packets to be replayed.
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the capture file cannot be read or is malformed.
+ */
+void
+PcapReplayDriver::load(const char* fileName)
+{
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        throw DriverInitFailure(HERE_STR, "Unable to open capture file", errno);
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        int error = errno;
+        close(fd);
+        throw DriverInitFailure(HERE_STR, "Unable to stat capture file", error);
+    }
+    mappingLength = fileStat.st_size;
+    if (mappingLength < sizeof(Format::FileHeader)) {
+        close(fd);
+        throw DriverInitFailure(HERE_STR, "Capture file is truncated");
+    }
+    // Private so that callers may modify replayed packets in place.
+    void* addr = mmap(nullptr, mappingLength, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    int error = errno;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw DriverInitFailure(HERE_STR, "Unable to map capture file", error);
+    }
+    mapping = addr;
+
+    char* data = static_cast<char*>(mapping);
+    const Format::FileHeader* fileHeader =
+        reinterpret_cast<const Format::FileHeader*>(data);
+    uint64_t fractionScale = 1;
+    const char* problem = nullptr;
+    if (fileHeader->magic == MAGIC_MICROSECONDS) {
+        fractionScale = 1000;
+    } else if (fileHeader->magic != Format::MAGIC_NANOSECONDS) {
+        problem = "Not a host byte order pcap file";
+    }
+    if (problem == nullptr && fileHeader->linkType != Format::LINKTYPE_RAW) {
+        problem = "Unsupported pcap link type";
+    }
+    if (problem != nullptr) {
+        munmap(mapping, mappingLength);
+        mapping = nullptr;
+        throw DriverInitFailure(HERE_STR, problem);
+    }
+
+    bool haveFirst = false;
+    uint64_t firstTimestamp = 0;
+    size_t offset = sizeof(Format::FileHeader);
+    while (offset + sizeof(Format::RecordHeader) <= mappingLength) {
+        const Format::RecordHeader* recordHeader =
+            reinterpret_cast<const Format::RecordHeader*>(data + offset);
+        offset += sizeof(Format::RecordHeader);
+        if (recordHeader->capturedLength > mappingLength - offset) {
+            // Truncated final record; e.g. the capture is still being written.
+            break;
+        }
+        char* frame = data + offset;
+        offset += recordHeader->capturedLength;
+
+        if (recordHeader->capturedLength < sizeof(Format::Ipv4Header)) {
+            continue;
+        }
+        const Format::Ipv4Header* ipHeader =
+            reinterpret_cast<const Format::Ipv4Header*>(frame);
+        uint32_t headerLength = (ipHeader->versionIhl & 0xf) * 4;
+        if ((ipHeader->versionIhl >> 4) != 4 ||
+            headerLength < sizeof(Format::Ipv4Header) ||
+            headerLength > recordHeader->capturedLength ||
+            ipHeader->protocol != Format::IP_PROTOCOL_HOMA) {
+            continue;
+        }
+        IpAddress destination{ntohl(ipHeader->destination)};
+        if (options.localAddress.addr != 0 &&
+            !(destination == options.localAddress)) {
+            continue;
+        }
+
+        uint64_t timestamp = recordHeader->seconds * 1000000000ULL +
+                             recordHeader->nanoseconds * fractionScale;
+        if (!haveFirst) {
+            firstTimestamp = timestamp;
+            haveFirst = true;
+        }
+        Record record;
+        record.timestamp =
+            timestamp > firstTimestamp ? timestamp - firstTimestamp : 0;
+        record.source = IpAddress{ntohl(ipHeader->source)};
+        record.packet.payload = frame + headerLength;
+        record.packet.length =
+            static_cast<int32_t>(recordHeader->capturedLength - headerLength);
+        records.push_back(record);
+    }
+}
+
+}  // namespace Pcap
+}  // namespace Drivers
+}  // namespace Homa
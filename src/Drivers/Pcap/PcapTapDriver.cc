@@ -0,0 +1,279 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <Homa/Drivers/Pcap/PcapTapDriver.h>
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include "CodeLocation.h"
+#include "PcapFormat.h"
+
+namespace Homa {
+namespace Drivers {
+namespace Pcap {
+
+namespace {
+
+/**
+ * Return the Internet checksum of an IPv4 header whose checksum field is 0.
+ */
+uint16_t
+ipChecksum(const Format::Ipv4Header* header)
+{
+    uint16_t words[sizeof(*header) / sizeof(uint16_t)];
+    std::memcpy(words, header, sizeof(words));
+    uint32_t sum = 0;
+    for (size_t i = 0; i < sizeof(words) / sizeof(uint16_t); ++i) {
+        sum += words[i];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return static_cast<uint16_t>(~sum);
+}
+
+}  // namespace
+
+/**
+ * Construct a PcapTapDriver.
+ *
+ * @param driver
+ *      Driver through which packets will actually be sent and received.  The
+ *      driver must outlive the PcapTapDriver.
+ * @param fileName
+ *      Path of the capture file to write; an existing file is truncated.
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the capture file cannot be created.
+ */
+PcapTapDriver::PcapTapDriver(Driver* driver, const char* fileName)
+    : driver(driver)
+    , localAddress(driver->getLocalAddress())
+    , mutex()
+    , file(fopen(fileName, "wb"))
+    , recordedPackets(0)
+{
+    if (file == nullptr) {
+        throw DriverInitFailure(HERE_STR, "Unable to create capture file",
+                                errno);
+    }
+    Format::FileHeader header;
+    header.magic = Format::MAGIC_NANOSECONDS;
+    header.versionMajor = 2;
+    header.versionMinor = 4;
+    header.timeZone = 0;
+    header.sigFigs = 0;
+    header.snapLen = Format::SNAPLEN;
+    header.linkType = Format::LINKTYPE_RAW;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        int error = errno;
+        fclose(file);
+        throw DriverInitFailure(HERE_STR, "Unable to write capture file",
+                                error);
+    }
+}
+
+/**
+ * PcapTapDriver destructor.
+ */
+PcapTapDriver::~PcapTapDriver()
+{
+    fclose(file);
+}
+
+/**
+ * Write any buffered records to the capture file.
+ */
+void
+PcapTapDriver::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    fflush(file);
+}
+
+/**
+ * Return the number of packets recorded so far.
+ */
+uint64_t
+PcapTapDriver::getRecordedPackets()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return recordedPackets;
+}
+
+/**
+ * See Driver::allocPacket()
+ */
+Driver::Packet*
+PcapTapDriver::allocPacket()
+{
+    return driver->allocPacket();
+}
+
+/**
+ * See Driver::sendPacket()
+ */
+void
+PcapTapDriver::sendPacket(Packet* packet, IpAddress destination, int priority)
+{
+    record(packet, localAddress, destination, priority);
+    driver->sendPacket(packet, destination, priority);
+}
+
+/**
+ * See Driver::cork()
+ */
+void
+PcapTapDriver::cork()
+{
+    driver->cork();
+}
+
+/**
+ * See Driver::uncork()
+ */
+void
+PcapTapDriver::uncork()
+{
+    driver->uncork();
+}
+
+/**
+ * See Driver::receivePackets()
+ */
+uint32_t
+PcapTapDriver::receivePackets(uint32_t maxPackets, Packet* receivedPackets[],
+                              IpAddress sourceAddresses[])
+{
+    uint32_t numPackets =
+        driver->receivePackets(maxPackets, receivedPackets, sourceAddresses);
+    for (uint32_t i = 0; i < numPackets; ++i) {
+        record(receivedPackets[i], sourceAddresses[i], localAddress, 0);
+    }
+    return numPackets;
+}
+
+/**
+ * See Driver::releasePackets()
+ */
+void
+PcapTapDriver::releasePackets(Packet* packets[], uint16_t numPackets)
+{
+    driver->releasePackets(packets, numPackets);
+}
+
+/**
+ * See Driver::getHighestPacketPriority()
+ */
+int
+PcapTapDriver::getHighestPacketPriority()
+{
+    return driver->getHighestPacketPriority();
+}
+
+/**
+ * See Driver::getMaxPayloadSize()
+ */
+uint32_t
+PcapTapDriver::getMaxPayloadSize()
+{
+    return driver->getMaxPayloadSize();
+}
+
+/**
+ * See Driver::getBandwidth()
+ */
+uint32_t
+PcapTapDriver::getBandwidth()
+{
+    return driver->getBandwidth();
+}
+
+/**
+ * See Driver::getLocalAddress()
+ */
+IpAddress
+PcapTapDriver::getLocalAddress()
+{
+    return localAddress;
+}
+
+/**
+ * See Driver::getQueuedBytes()
+ */
+uint32_t
+PcapTapDriver::getQueuedBytes()
+{
+    return driver->getQueuedBytes();
+}
+
+/**
+ * Append a packet to the capture file.
+ *
+ * @param packet
+ *      Packet to record.
+ * @param source
+ *      Address of the packet's sender.
+ * @param destination
+ *      Address of the packet's recipient.
+ * @param priority
+ *      Priority at which the packet was sent; stored in the IP precedence
+ *      bits of the synthesized header.
+ */
+void
+PcapTapDriver::record(const Packet* packet, IpAddress source,
+                      IpAddress destination, int priority)
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint32_t length = sizeof(Format::Ipv4Header) + packet->length;
+    uint32_t capturedLength = std::min(length, Format::SNAPLEN);
+
+    Format::RecordHeader recordHeader;
+    recordHeader.seconds = static_cast<uint32_t>(now.tv_sec);
+    recordHeader.nanoseconds = static_cast<uint32_t>(now.tv_nsec);
+    recordHeader.capturedLength = capturedLength;
+    recordHeader.originalLength = length;
+
+    Format::Ipv4Header ipHeader;
+    ipHeader.versionIhl = 0x45;
+    ipHeader.tos = static_cast<uint8_t>((priority & 0x7) << 5);
+    ipHeader.totalLength = htons(static_cast<uint16_t>(capturedLength));
+    ipHeader.id = 0;
+    ipHeader.fragmentOffset = 0;
+    ipHeader.ttl = 64;
+    ipHeader.protocol = Format::IP_PROTOCOL_HOMA;
+    ipHeader.checksum = 0;
+    ipHeader.source = htonl(source.addr);
+    ipHeader.destination = htonl(destination.addr);
+    ipHeader.checksum = ipChecksum(&ipHeader);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    fwrite(&recordHeader, sizeof(recordHeader), 1, file);
+    fwrite(&ipHeader, sizeof(ipHeader), 1, file);
+    fwrite(packet->payload, capturedLength - sizeof(ipHeader), 1, file);
+    recordedPackets++;
+}
+
+}  // namespace Pcap
+}  // namespace Drivers
+}  // namespace Homa
@@ -41,6 +41,10 @@ class MockDriver : public Driver {
     MOCK_METHOD(void, sendPacket,
                 (Packet * packet, IpAddress destination, int priority),
                 (override));
+    MOCK_METHOD(void, sendPacketWithHeader,
+                (const void* header, uint32_t headerLength, Packet* payload,
+                 uint32_t payloadOffset, IpAddress destination, int priority),
+                (override));
     MOCK_METHOD(void, flushPackets, ());
     MOCK_METHOD(uint32_t, receivePackets,
                 (uint32_t maxPackets, Packet* receivedPackets[],
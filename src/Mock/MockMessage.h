@@ -29,19 +29,15 @@ namespace Mock {
  */
 class MockInMessage : public Homa::InMessage {
   public:
-    // Homa::Message methods
-    MOCK_METHOD2(append, void(const void* source, uint32_t num));
-    MOCK_CONST_METHOD3(get, uint32_t(uint32_t offset, void* destination,
-                                     uint32_t num));
-    MOCK_CONST_METHOD0(length, uint32_t());
-    MOCK_METHOD2(prepend, void(const void* source, uint32_t num));
-    MOCK_METHOD1(reserve, void(uint32_t num));
-    MOCK_METHOD1(strip, void(uint32_t num));
-    // Homa::InMessage methods
-    MOCK_CONST_METHOD0(acknowledge, void());
-    MOCK_CONST_METHOD0(fail, void());
-    MOCK_CONST_METHOD0(dropped, bool());
-    MOCK_METHOD0(release, void());
+    MOCK_METHOD(void, acknowledge, (), (const, override));
+    MOCK_METHOD(bool, dropped, (), (const, override));
+    MOCK_METHOD(void, fail, (), (const, override));
+    MOCK_METHOD(size_t, get, (size_t offset, void* destination, size_t count),
+                (const, override));
+    MOCK_METHOD(size_t, length, (), (const, override));
+    MOCK_METHOD(void, strip, (size_t count), (override));
+    MOCK_METHOD(Timing, timing, (), (const, override));
+    MOCK_METHOD(void, release, (), (override));
 };
 
 /**
@@ -50,19 +46,22 @@ class MockInMessage : public Homa::InMessage {
  */
 class MockOutMessage : public Homa::OutMessage {
   public:
-    // Homa::Message methods
-    MOCK_METHOD2(append, void(const void* source, uint32_t num));
-    MOCK_CONST_METHOD3(get, uint32_t(uint32_t offset, void* destination,
-                                     uint32_t num));
-    MOCK_CONST_METHOD0(length, uint32_t());
-    MOCK_METHOD2(prepend, void(const void* source, uint32_t num));
-    MOCK_METHOD1(reserve, void(uint32_t num));
-    MOCK_METHOD1(strip, void(uint32_t num));
-    // Homa::OutMessage methods
-    MOCK_METHOD1(send, void(Homa::Driver::Address destination));
-    MOCK_METHOD0(cancel, void());
-    MOCK_CONST_METHOD0(getStatus, Homa::OutMessage::Status());
-    MOCK_METHOD0(release, void());
+    MOCK_METHOD(void, append, (const void* source, size_t count), (override));
+    MOCK_METHOD(void, cancel, (), (override));
+    MOCK_METHOD(Homa::OutMessage::Status, getStatus, (), (const, override));
+    MOCK_METHOD(Homa::unique_ptr<Homa::InMessage>, getResponse, (),
+                (override));
+    MOCK_METHOD(size_t, length, (), (const, override));
+    MOCK_METHOD(void, prepend, (const void* source, size_t count), (override));
+    MOCK_METHOD(void, reserve, (size_t count), (override));
+    MOCK_METHOD(void, send, (SocketAddress destination, Options options),
+                (override));
+    MOCK_METHOD(void, fanOut,
+                (const SocketAddress destinations[], size_t count,
+                 Homa::unique_ptr<OutMessage> copies[], Options options),
+                (override));
+    MOCK_METHOD(Timing, timing, (), (const, override));
+    MOCK_METHOD(void, release, (), (override));
 };
 
 }  // namespace Mock
@@ -31,18 +31,37 @@ namespace Mock {
  */
 class MockReceiver : public Core::Receiver {
   public:
-    MockReceiver(Driver* driver, uint64_t messageTimeoutCycles,
-                 uint64_t resendIntervalCycles)
-        : Receiver(driver, nullptr, messageTimeoutCycles, resendIntervalCycles)
+    MockReceiver(Driver* driver, Perf::TransportCounters* perf,
+                 uint64_t messageTimeoutCycles, uint64_t resendIntervalCycles)
+        : Receiver(0, driver, nullptr, perf, messageTimeoutCycles,
+                   resendIntervalCycles)
     {}
 
     MOCK_METHOD(void, handleDataPacket,
                 (Driver::Packet * packet, IpAddress sourceIp), (override));
+    MOCK_METHOD(void, handleBundlePacket,
+                (Driver::Packet * packet, IpAddress sourceIp), (override));
     MOCK_METHOD(void, handleBusyPacket, (Driver::Packet * packet), (override));
     MOCK_METHOD(void, handlePingPacket,
                 (Driver::Packet * packet, IpAddress sourceIp), (override));
     MOCK_METHOD(Homa::InMessage*, receiveMessage, (), (override));
+    MOCK_METHOD(Homa::InMessage*, receiveMessage, (uint16_t port),
+                (override));
+    MOCK_METHOD(size_t, receiveMessages,
+                (Homa::InMessage * messages[], size_t maxMessages),
+                (override));
+    MOCK_METHOD(Homa::InMessage*, receiveResponse,
+                (Protocol::MessageId * requestId), (override));
+    MOCK_METHOD(void, getMessageSource,
+                (Homa::InMessage * message, Protocol::MessageId* id,
+                 SocketAddress* source),
+                (override));
+    MOCK_METHOD(int, takePackets,
+                (Homa::InMessage * message, Driver::Packet* packets[],
+                 int* headroom),
+                (override));
     MOCK_METHOD(void, poll, (), (override));
+    MOCK_METHOD(bool, pollGrants, (), (override));
     MOCK_METHOD(void, checkTimeouts, (), (override));
 };
 
@@ -32,12 +32,16 @@ namespace Mock {
 class MockSender : public Core::Sender {
   public:
     MockSender(uint64_t transportId, Driver* driver,
-               uint64_t messageTimeoutCycles, uint64_t pingIntervalCycles)
-        : Sender(transportId, driver, nullptr, messageTimeoutCycles,
+               Perf::TransportCounters* perf, uint64_t messageTimeoutCycles,
+               uint64_t pingIntervalCycles)
+        : Sender(transportId, driver, nullptr, perf, messageTimeoutCycles,
                  pingIntervalCycles)
     {}
 
     MOCK_METHOD(Homa::OutMessage*, allocMessage, (uint16_t sport), (override));
+    MOCK_METHOD(void, allocMessages,
+                (uint16_t sport, Homa::OutMessage* messages[], size_t count),
+                (override));
     MOCK_METHOD(void, handleDonePacket, (Driver::Packet * packet), (override));
     MOCK_METHOD(void, handleGrantPacket, (Driver::Packet * packet), (override));
     MOCK_METHOD(void, handleResendPacket, (Driver::Packet * packet),
@@ -45,7 +49,19 @@ class MockSender : public Core::Sender {
     MOCK_METHOD(void, handleUnknownPacket, (Driver::Packet * packet),
                 (override));
     MOCK_METHOD(void, handleErrorPacket, (Driver::Packet * packet), (override));
+    MOCK_METHOD(void, handleResponse,
+                (Protocol::MessageId requestId, Homa::InMessage* response),
+                (override));
+    MOCK_METHOD(void, replyMessage,
+                (Homa::OutMessage * response, Protocol::MessageId requestId,
+                 SocketAddress destination, Homa::InMessage* request,
+                 OutMessage::Options options),
+                (override));
+    MOCK_METHOD(size_t, getDoneMessages,
+                (Homa::OutMessage * messages[], size_t maxMessages),
+                (override));
     MOCK_METHOD(void, poll, (), (override));
+    MOCK_METHOD(bool, pollSend, (), (override));
     MOCK_METHOD(void, checkTimeouts, (), (override));
 };
 
@@ -0,0 +1,224 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_MPMCQUEUE_H
+#define HOMA_MPMCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace Homa {
+
+/**
+ * A bounded, lock-free, multi-producer multi-consumer FIFO queue.
+ *
+ * Each slot in the queue's ring buffer carries a sequence number that tells
+ * producers and consumers whether the slot is ready to be written or read, so
+ * that neither side ever needs to take a lock (this is Dmitry Vyukov's bounded
+ * MPMC queue).  Operations never block; push() fails if the queue is full and
+ * pop() fails if the queue is empty.
+ *
+ * Elements are constructed once, when the queue is constructed, and are reused
+ * for the lifetime of the queue.  Callers fill and drain slots in place via
+ * functors, which allows elements that own resources (e.g. std::string) to
+ * keep their capacity across uses.
+ *
+ * This class is thread-safe.
+ */
+template <typename ElementType>
+class MpmcQueue {
+  public:
+    /**
+     * Construct an empty queue.
+     *
+     * @param capacity
+     *      Minimum number of elements the queue should be able to hold; the
+     *      actual capacity will be rounded up to the next power of 2.
+     */
+    explicit MpmcQueue(size_t capacity)
+        : mask(roundUpToPowerOfTwo(capacity) - 1)
+        , slots(new Slot[mask + 1])
+        , enqueuePosition(0)
+        , dequeuePosition(0)
+    {
+        for (size_t i = 0; i <= mask; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Append an element to the end of the queue.
+     *
+     * @param fill
+     *      Functor invoked as fill(ElementType&) to set the contents of the
+     *      element being appended.  It is only invoked if there was room in
+     *      the queue.
+     * @return
+     *      True if the element was appended; false if the queue was full.
+     */
+    template <typename Functor>
+    bool push(Functor&& fill)
+    {
+        Slot* slot;
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        while (true) {
+            slot = &slots[position & mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) -
+                            static_cast<intptr_t>(position);
+            if (diff == 0) {
+                // The slot is free; try to claim it.
+                if (enqueuePosition.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The slot still holds an element from the last lap.
+                return false;
+            } else {
+                // Another producer claimed the slot first.
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        fill(slot->element);
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Remove the element at the front of the queue.
+     *
+     * @param drain
+     *      Functor invoked as drain(ElementType&) to consume the contents of
+     *      the element being removed.  It is only invoked if the queue was not
+     *      empty.
+     * @return
+     *      True if an element was removed; false if the queue was empty.
+     */
+    template <typename Functor>
+    bool pop(Functor&& drain)
+    {
+        Slot* slot;
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        while (true) {
+            slot = &slots[position & mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) -
+                            static_cast<intptr_t>(position + 1);
+            if (diff == 0) {
+                // The slot is full; try to claim it.
+                if (dequeuePosition.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // No producer has filled the slot yet.
+                return false;
+            } else {
+                // Another consumer claimed the slot first.
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        drain(slot->element);
+        slot->sequence.store(position + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Return the maximum number of elements this queue can hold.
+     */
+    size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+    /**
+     * Return the total number of elements that have ever been appended to the
+     * queue (including those that have since been removed).
+     *
+     * The result may be stale if there are concurrent calls to push().
+     */
+    uint64_t pushed() const
+    {
+        return enqueuePosition.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Return the total number of elements that have ever been removed from
+     * the queue.
+     *
+     * The result may be stale if there are concurrent calls to pop().
+     */
+    uint64_t popped() const
+    {
+        return dequeuePosition.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Return true if the queue appeared to be empty at the time of the call.
+     */
+    bool empty() const
+    {
+        return popped() >= pushed();
+    }
+
+  private:
+    /**
+     * Return the smallest power of 2 that is greater or equal to n.
+     */
+    static size_t roundUpToPowerOfTwo(size_t n)
+    {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    /**
+     * Holds one element of the queue and the sequence number that coordinates
+     * access to it.
+     */
+    struct Slot {
+        /// Position at which this slot can next be written (if equal to the
+        /// enqueue position) or read (if one more than the dequeue position).
+        std::atomic<size_t> sequence;
+
+        /// The queued element.
+        ElementType element;
+    };
+
+    /// Bit mask used to map a position to its slot; capacity - 1.
+    const size_t mask;
+
+    /// Ring buffer of slots.
+    std::unique_ptr<Slot[]> slots;
+
+    /// Position at which the next element will be appended.
+    alignas(64) std::atomic<size_t> enqueuePosition;
+
+    /// Position from which the next element will be removed.
+    alignas(64) std::atomic<size_t> dequeuePosition;
+
+    // Disable copy and assign
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+};
+
+}  // namespace Homa
+
+#endif  // HOMA_MPMCQUEUE_H
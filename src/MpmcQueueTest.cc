@@ -0,0 +1,118 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "MpmcQueue.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Homa {
+namespace {
+
+TEST(MpmcQueueTest, constructor)
+{
+    MpmcQueue<int> queue(5);
+    EXPECT_EQ(8U, queue.capacity());
+    EXPECT_TRUE(queue.empty());
+
+    MpmcQueue<int> queue1(1);
+    EXPECT_EQ(1U, queue1.capacity());
+}
+
+TEST(MpmcQueueTest, push_full)
+{
+    MpmcQueue<int> queue(2);
+    int calls = 0;
+    EXPECT_TRUE(queue.push([&](int& e) { e = ++calls; }));
+    EXPECT_TRUE(queue.push([&](int& e) { e = ++calls; }));
+    EXPECT_FALSE(queue.push([&](int& e) { e = ++calls; }));
+    EXPECT_EQ(2, calls);
+    EXPECT_EQ(2U, queue.pushed());
+    EXPECT_FALSE(queue.empty());
+}
+
+TEST(MpmcQueueTest, pop_empty)
+{
+    MpmcQueue<int> queue(2);
+    int calls = 0;
+    EXPECT_FALSE(queue.pop([&](int&) { ++calls; }));
+    EXPECT_EQ(0, calls);
+    EXPECT_EQ(0U, queue.popped());
+}
+
+TEST(MpmcQueueTest, fifo_wrapAround)
+{
+    MpmcQueue<std::string> queue(4);
+    int next = 0;
+    for (int i = 0; i < 10; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            EXPECT_TRUE(queue.push(
+                [&](std::string& e) { e = std::to_string(next + j); }));
+        }
+        for (int j = 0; j < 3; ++j) {
+            std::string out;
+            EXPECT_TRUE(queue.pop([&](std::string& e) { out = e; }));
+            EXPECT_EQ(std::to_string(next + j), out);
+        }
+        next += 3;
+    }
+    EXPECT_EQ(30U, queue.pushed());
+    EXPECT_EQ(30U, queue.popped());
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(MpmcQueueTest, concurrent)
+{
+    const int PRODUCERS = 4;
+    const int CONSUMERS = 2;
+    const uint64_t ITEMS = 10000;
+    MpmcQueue<uint64_t> queue(64);
+    std::atomic<uint64_t> sum(0);
+    std::atomic<uint64_t> count(0);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < PRODUCERS; ++p) {
+        threads.emplace_back([&] {
+            for (uint64_t i = 1; i <= ITEMS; ++i) {
+                while (!queue.push([i](uint64_t& e) { e = i; })) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < CONSUMERS; ++c) {
+        threads.emplace_back([&] {
+            while (count.load() < PRODUCERS * ITEMS) {
+                if (!queue.pop([&](uint64_t& e) { sum += e; })) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                ++count;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(PRODUCERS * ITEMS, count.load());
+    EXPECT_EQ(PRODUCERS * (ITEMS * (ITEMS + 1) / 2), sum.load());
+    EXPECT_TRUE(queue.empty());
+}
+
+}  // namespace
+}  // namespace Homa
@@ -0,0 +1,143 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "PeerTable.h"
+
+#include <Cycles.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "Aligned.h"
+
+namespace Homa {
+namespace Perf {
+
+/**
+ * Construct an empty PeerTable.
+ *
+ * @param capacity
+ *      Maximum number of peers tracked; rounded up to a multiple of WAYS.
+ */
+PeerTable::PeerTable(uint32_t capacity)
+    : numSets(std::max(1U, (capacity + WAYS - 1) / WAYS))
+    , entries(Aligned::createArray<Entry>(numSets * WAYS))
+{}
+
+/**
+ * PeerTable destructor.
+ */
+PeerTable::~PeerTable()
+{
+    Aligned::destroyArray(entries, numSets * WAYS);
+}
+
+/**
+ * Return the statistics entry of a peer, adding the peer to the table (and
+ * evicting the least recently used peer of its set if needed) if it isn't
+ * already present.
+ *
+ * @param address
+ *      Address of the peer.
+ * @return
+ *      The peer's entry; never nullptr.
+ */
+PeerTable::Entry*
+PeerTable::find(IpAddress address)
+{
+    const uint64_t key = static_cast<uint64_t>(address.addr) + 1;
+    Entry* set = &entries[(address.addr * 0x9E3779B1U) % numSets * WAYS];
+    const uint64_t now = PerfUtils::Cycles::rdtsc();
+    while (true) {
+        Entry* victim = nullptr;
+        uint64_t victimKey = 0;
+        uint64_t victimLastUsed = 0;
+        for (uint32_t i = 0; i < WAYS; ++i) {
+            Entry* entry = &set[i];
+            uint64_t entryKey = entry->key.load(std::memory_order_acquire);
+            if (entryKey == key) {
+                entry->lastUsed.store(now, std::memory_order_relaxed);
+                return entry;
+            }
+            uint64_t entryLastUsed =
+                entry->lastUsed.load(std::memory_order_relaxed);
+            // Prefer an unused entry, then the least recently used one.
+            if (victim == nullptr ||
+                (victimKey != 0 &&
+                 (entryKey == 0 || entryLastUsed < victimLastUsed))) {
+                victim = entry;
+                victimKey = entryKey;
+                victimLastUsed = entryLastUsed;
+            }
+        }
+
+        if (victim->key.compare_exchange_strong(victimKey, key,
+                                                std::memory_order_acq_rel)) {
+            victim->lastUsed.store(now, std::memory_order_relaxed);
+            victim->tx_pkts.store(0, std::memory_order_relaxed);
+            victim->tx_bytes.store(0, std::memory_order_relaxed);
+            victim->rx_pkts.store(0, std::memory_order_relaxed);
+            victim->rx_bytes.store(0, std::memory_order_relaxed);
+            victim->tx_resend_pkts.store(0, std::memory_order_relaxed);
+            victim->rx_resend_pkts.store(0, std::memory_order_relaxed);
+            victim->timeouts.store(0, std::memory_order_relaxed);
+            victim->active_messages.reset();
+            victim->outstanding_grant_bytes.reset();
+            return victim;
+        }
+        // Another thread changed the entry; look again.
+    }
+}
+
+/**
+ * Replace the contents of the provided vector with the statistics of every
+ * peer currently in the table.
+ */
+void
+PeerTable::getStats(std::vector<PeerStats>* stats) const
+{
+    stats->clear();
+    std::unordered_map<uint32_t, size_t> indexes;
+    for (uint32_t i = 0; i < numSets * WAYS; ++i) {
+        const Entry* entry = &entries[i];
+        uint64_t key = entry->key.load(std::memory_order_acquire);
+        if (key == 0) {
+            continue;
+        }
+        uint32_t addr = static_cast<uint32_t>(key - 1);
+        auto it = indexes.find(addr);
+        if (it == indexes.end()) {
+            it = indexes.emplace(addr, stats->size()).first;
+            PeerStats peer = {};
+            peer.address = IpAddress{addr};
+            stats->push_back(peer);
+        }
+        PeerStats* peer = &stats->at(it->second);
+        peer->tx_pkts += entry->tx_pkts.load(std::memory_order_relaxed);
+        peer->tx_bytes += entry->tx_bytes.load(std::memory_order_relaxed);
+        peer->rx_pkts += entry->rx_pkts.load(std::memory_order_relaxed);
+        peer->rx_bytes += entry->rx_bytes.load(std::memory_order_relaxed);
+        peer->tx_resend_pkts +=
+            entry->tx_resend_pkts.load(std::memory_order_relaxed);
+        peer->rx_resend_pkts +=
+            entry->rx_resend_pkts.load(std::memory_order_relaxed);
+        peer->timeouts += entry->timeouts.load(std::memory_order_relaxed);
+        peer->active_messages += entry->active_messages.get();
+        peer->outstanding_grant_bytes += entry->outstanding_grant_bytes.get();
+    }
+}
+
+}  // namespace Perf
+}  // namespace Homa
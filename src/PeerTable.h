@@ -0,0 +1,293 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_PEERTABLE_H
+#define HOMA_PEERTABLE_H
+
+#include <Homa/Driver.h>
+#include <Homa/Perf.h>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace Homa {
+namespace Perf {
+
+/**
+ * A bounded table of traffic and health statistics for each peer of a
+ * Transport.
+ *
+ * The table is set-associative: each peer hashes to a set of WAYS entries,
+ * and a peer that finds its set full evicts the set's least recently used
+ * entry.  Entries are found and updated with atomic operations only, so
+ * neither updating nor sampling the table takes a lock.  As a consequence,
+ * the counters are approximate around evictions: updates racing with the
+ * eviction of an entry may be lost or credited to the new peer (the gauges
+ * avoid this; see Gauge), and
+ * concurrent first uses of a peer may briefly create two entries for it
+ * (getStats() merges them).
+ *
+ * This class is thread-safe.
+ */
+class PeerTable {
+  public:
+    /**
+     * A gauge of an Entry, which is zeroed when the entry is evicted.
+     *
+     * Each reset starts a new generation of the gauge.  Callers remember the
+     * generation in which they added to the gauge and only undo their
+     * addition if the gauge hasn't been reset since; otherwise, a message
+     * that outlived an eviction would leave the entry's next peer
+     * permanently low.  The generation and the value share one atomic word
+     * so that an update can't race with a reset.
+     */
+    class Gauge {
+      public:
+        Gauge()
+            : word(0)
+        {}
+
+        /**
+         * Add to the gauge.
+         *
+         * @param delta
+         *      Amount to add.
+         * @return
+         *      Generation in which _delta_ was added.
+         */
+        inline uint32_t add(int64_t delta)
+        {
+            uint64_t current = word.load(std::memory_order_relaxed);
+            while (!word.compare_exchange_weak(
+                current, pack(generationOf(current), valueOf(current) + delta),
+                std::memory_order_relaxed)) {
+            }
+            return generationOf(current);
+        }
+
+        /**
+         * Add to the gauge unless it has been reset since a generation.
+         *
+         * @param delta
+         *      Amount to add.
+         * @param generation
+         *      Generation returned by an earlier add().
+         * @return
+         *      True if _delta_ was added; false if the gauge has been reset
+         *      since _generation_.
+         */
+        inline bool add(int64_t delta, uint32_t generation)
+        {
+            uint64_t current = word.load(std::memory_order_relaxed);
+            do {
+                if (generationOf(current) != generation) {
+                    return false;
+                }
+            } while (!word.compare_exchange_weak(
+                current, pack(generation, valueOf(current) + delta),
+                std::memory_order_relaxed));
+            return true;
+        }
+
+        /**
+         * Zero the gauge and start a new generation.
+         */
+        inline void reset()
+        {
+            uint64_t current = word.load(std::memory_order_relaxed);
+            while (!word.compare_exchange_weak(
+                current, pack(generationOf(current) + 1, 0),
+                std::memory_order_relaxed)) {
+            }
+        }
+
+        /**
+         * Return the current value of the gauge.
+         */
+        inline int64_t get() const
+        {
+            return valueOf(word.load(std::memory_order_relaxed));
+        }
+
+      private:
+        static inline uint32_t generationOf(uint64_t word)
+        {
+            return static_cast<uint32_t>(word >> 32);
+        }
+
+        static inline int64_t valueOf(uint64_t word)
+        {
+            return static_cast<int32_t>(static_cast<uint32_t>(word));
+        }
+
+        static inline uint64_t pack(uint32_t generation, int64_t value)
+        {
+            return (static_cast<uint64_t>(generation) << 32) |
+                   static_cast<uint32_t>(value);
+        }
+
+        /// Generation in the high 32 bits; signed value in the low 32 bits.
+        std::atomic<uint64_t> word;
+    };
+
+    /**
+     * Statistics of one peer.  Unless noted, the fields are those of
+     * Perf::PeerStats.
+     */
+    struct alignas(64) Entry {
+        Entry()
+            : key(0)
+            , lastUsed(0)
+            , tx_pkts(0)
+            , tx_bytes(0)
+            , rx_pkts(0)
+            , rx_bytes(0)
+            , tx_resend_pkts(0)
+            , rx_resend_pkts(0)
+            , timeouts(0)
+            , active_messages()
+            , outstanding_grant_bytes()
+        {}
+
+        /**
+         * Record a packet sent to the peer.
+         */
+        inline void sent(uint64_t bytes)
+        {
+            tx_pkts.fetch_add(1, std::memory_order_relaxed);
+            tx_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        /**
+         * Record a packet received from the peer.
+         */
+        inline void received(uint64_t bytes)
+        {
+            rx_pkts.fetch_add(1, std::memory_order_relaxed);
+            rx_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        /// Peer's IpAddress plus one; 0 if the entry is unused.
+        std::atomic<uint64_t> key;
+        /// Cycle time at which the entry was last looked up.
+        std::atomic<uint64_t> lastUsed;
+        std::atomic<uint64_t> tx_pkts;
+        std::atomic<uint64_t> tx_bytes;
+        std::atomic<uint64_t> rx_pkts;
+        std::atomic<uint64_t> rx_bytes;
+        std::atomic<uint64_t> tx_resend_pkts;
+        std::atomic<uint64_t> rx_resend_pkts;
+        std::atomic<uint64_t> timeouts;
+        Gauge active_messages;
+        Gauge outstanding_grant_bytes;
+    };
+
+    /**
+     * One contributor's share of a gauge of a peer's Entry (e.g. a message's
+     * contribution to Entry::active_messages).  If the entry is evicted, the
+     * share is dropped along with the rest of the gauge rather than taken
+     * out of the entry's next peer.
+     *
+     * This class is not thread-safe; each share has a single owner.
+     */
+    class Share {
+      public:
+        /**
+         * @param gauge
+         *      The gauge of an Entry to which the share contributes.
+         */
+        explicit Share(Gauge Entry::*gauge)
+            : gauge(gauge)
+            , entry(nullptr)
+            , generation(0)
+            , value(0)
+        {}
+
+        /**
+         * Change this share of a peer's gauge.
+         *
+         * @param table
+         *      Table that holds the peer's entry.
+         * @param address
+         *      The peer's address; must be the same on every call.
+         * @param value
+         *      New value of the share.
+         */
+        inline void set(PeerTable* table, IpAddress address, int64_t value)
+        {
+            if (value == this->value) {
+                return;
+            }
+            if (entry == nullptr ||
+                !(entry->*gauge).add(value - this->value, generation)) {
+                // No share yet, or the entry was evicted since it was taken.
+                entry = nullptr;
+                if (value != 0) {
+                    entry = table->find(address);
+                    generation = (entry->*gauge).add(value);
+                }
+            }
+            this->value = value;
+        }
+
+        /**
+         * Return the current value of this share.
+         */
+        inline int64_t get() const
+        {
+            return value;
+        }
+
+      private:
+        /// Gauge to which this share contributes.
+        Gauge Entry::*const gauge;
+        /// Entry holding this share; nullptr if none.
+        Entry* entry;
+        /// Generation of the gauge in which this share was added.
+        uint32_t generation;
+        /// Value of this share.
+        int64_t value;
+    };
+
+    explicit PeerTable(uint32_t capacity = DEFAULT_CAPACITY);
+    ~PeerTable();
+
+    Entry* find(IpAddress address);
+    void getStats(std::vector<PeerStats>* stats) const;
+
+    /// Number of entries a peer can be stored in.
+    static const uint32_t WAYS = 4;
+
+    /// Default number of peers tracked.
+    static const uint32_t DEFAULT_CAPACITY = 1024;
+
+  private:
+    /// Number of sets of WAYS entries.
+    const uint32_t numSets;
+
+    /// numSets * WAYS entries; the entries of a set are adjacent.  Allocated
+    /// with Aligned::createArray() to honor the Entry alignment.
+    Entry* const entries;
+
+    // Disable copy and assign
+    PeerTable(const PeerTable&) = delete;
+    PeerTable& operator=(const PeerTable&) = delete;
+};
+
+}  // namespace Perf
+}  // namespace Homa
+
+#endif  // HOMA_PEERTABLE_H
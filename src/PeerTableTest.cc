@@ -0,0 +1,190 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <Cycles.h>
+
+#include "PeerTable.h"
+
+namespace Homa {
+namespace Perf {
+namespace {
+
+class PeerTableTest : public ::testing::Test {
+  public:
+    PeerTableTest()
+        : table(PeerTable::WAYS)
+    {
+        PerfUtils::Cycles::mockTscValue = 10000;
+    }
+
+    ~PeerTableTest()
+    {
+        PerfUtils::Cycles::mockTscValue = 0;
+    }
+
+    /// Holds a single set, so every peer competes for the same entries.
+    PeerTable table;
+};
+
+TEST_F(PeerTableTest, constructor)
+{
+    PeerTable defaultTable;
+    EXPECT_EQ(PeerTable::DEFAULT_CAPACITY / PeerTable::WAYS,
+              defaultTable.numSets);
+    EXPECT_EQ(1U, table.numSets);
+
+    PeerTable small(1);
+    EXPECT_EQ(1U, small.numSets);
+}
+
+TEST_F(PeerTableTest, find_basic)
+{
+    PeerTable::Entry* entry = table.find(IpAddress{22});
+    EXPECT_EQ(23U, entry->key.load());
+    EXPECT_EQ(10000U, entry->lastUsed.load());
+
+    PerfUtils::Cycles::mockTscValue = 10100;
+    EXPECT_EQ(entry, table.find(IpAddress{22}));
+    EXPECT_EQ(10100U, entry->lastUsed.load());
+
+    EXPECT_NE(entry, table.find(IpAddress{33}));
+}
+
+TEST_F(PeerTableTest, find_evictLeastRecentlyUsed)
+{
+    PeerTable::Entry* entries[PeerTable::WAYS];
+    for (uint32_t i = 0; i < PeerTable::WAYS; ++i) {
+        PerfUtils::Cycles::mockTscValue = 10000 + i;
+        entries[i] = table.find(IpAddress{i});
+    }
+    entries[0]->sent(100);
+    entries[0]->active_messages.add(1);
+    PerfUtils::Cycles::mockTscValue = 20000;
+    EXPECT_EQ(entries[0], table.find(IpAddress{0}));
+
+    // Peer 1 is now the least recently used.
+    PeerTable::Entry* entry = table.find(IpAddress{99});
+    EXPECT_EQ(entries[1], entry);
+    EXPECT_EQ(100U, entry->key.load());
+
+    // The evicted peer's statistics are not carried over.
+    entries[0]->received(50);
+    PerfUtils::Cycles::mockTscValue = 20001;
+    table.find(IpAddress{2});
+    table.find(IpAddress{3});
+    table.find(IpAddress{99});
+    entry = table.find(IpAddress{98});
+    EXPECT_EQ(entries[0], entry);
+    EXPECT_EQ(0U, entry->tx_pkts.load());
+    EXPECT_EQ(0U, entry->rx_bytes.load());
+    EXPECT_EQ(0, entry->active_messages.get());
+}
+
+TEST_F(PeerTableTest, Gauge)
+{
+    PeerTable::Gauge gauge;
+    uint32_t generation = gauge.add(3);
+    EXPECT_EQ(3, gauge.get());
+    EXPECT_TRUE(gauge.add(-1, generation));
+    EXPECT_EQ(2, gauge.get());
+    EXPECT_EQ(generation, gauge.add(-3));
+    EXPECT_EQ(-1, gauge.get());
+
+    gauge.reset();
+    EXPECT_EQ(0, gauge.get());
+    EXPECT_FALSE(gauge.add(-1, generation));
+    EXPECT_EQ(0, gauge.get());
+    EXPECT_EQ(generation + 1, gauge.add(2));
+    EXPECT_EQ(2, gauge.get());
+}
+
+TEST_F(PeerTableTest, Share)
+{
+    PeerTable::Share share(&PeerTable::Entry::outstanding_grant_bytes);
+    PeerTable::Entry* entry = table.find(IpAddress{22});
+    share.set(&table, IpAddress{22}, 3000);
+    EXPECT_EQ(3000, share.get());
+    EXPECT_EQ(3000, entry->outstanding_grant_bytes.get());
+    share.set(&table, IpAddress{22}, 1000);
+    EXPECT_EQ(1000, entry->outstanding_grant_bytes.get());
+
+    // Evict the peer; its share is dropped with the rest of the gauge.
+    PerfUtils::Cycles::mockTscValue = 10001;
+    for (uint32_t i = 1; i < PeerTable::WAYS; ++i) {
+        table.find(IpAddress{i});
+    }
+    EXPECT_EQ(entry, table.find(IpAddress{99}));
+    entry->outstanding_grant_bytes.add(500);
+    share.set(&table, IpAddress{22}, 0);
+    EXPECT_EQ(0, share.get());
+    EXPECT_EQ(500, entry->outstanding_grant_bytes.get());
+
+    // A new share is counted in the peer's new entry.
+    PerfUtils::Cycles::mockTscValue = 10002;
+    table.find(IpAddress{99});
+    share.set(&table, IpAddress{22}, 200);
+    PeerTable::Entry* newEntry = table.find(IpAddress{22});
+    EXPECT_NE(entry, newEntry);
+    EXPECT_EQ(200, newEntry->outstanding_grant_bytes.get());
+    EXPECT_EQ(500, entry->outstanding_grant_bytes.get());
+}
+
+TEST_F(PeerTableTest, getStats)
+{
+    std::vector<PeerStats> stats;
+    stats.resize(3);
+    table.getStats(&stats);
+    EXPECT_TRUE(stats.empty());
+
+    PeerTable::Entry* entry = table.find(IpAddress{22});
+    entry->sent(100);
+    entry->sent(200);
+    entry->received(50);
+    entry->tx_resend_pkts.fetch_add(1);
+    entry->rx_resend_pkts.fetch_add(2);
+    entry->timeouts.fetch_add(3);
+    entry->active_messages.add(4);
+    entry->outstanding_grant_bytes.add(5000);
+
+    // A duplicate entry, as left by racing first uses of a peer.
+    PeerTable::Entry* duplicate = table.find(IpAddress{33});
+    duplicate->key.store(23);
+    duplicate->received(10);
+    duplicate->active_messages.add(1);
+    duplicate->outstanding_grant_bytes.add(100);
+
+    table.find(IpAddress{44})->received(1);
+
+    table.getStats(&stats);
+    ASSERT_EQ(2U, stats.size());
+    EXPECT_EQ(22U, stats.at(0).address.addr);
+    EXPECT_EQ(2U, stats.at(0).tx_pkts);
+    EXPECT_EQ(300U, stats.at(0).tx_bytes);
+    EXPECT_EQ(2U, stats.at(0).rx_pkts);
+    EXPECT_EQ(60U, stats.at(0).rx_bytes);
+    EXPECT_EQ(1U, stats.at(0).tx_resend_pkts);
+    EXPECT_EQ(2U, stats.at(0).rx_resend_pkts);
+    EXPECT_EQ(3U, stats.at(0).timeouts);
+    EXPECT_EQ(5U, stats.at(0).active_messages);
+    EXPECT_EQ(5100U, stats.at(0).outstanding_grant_bytes);
+    EXPECT_EQ(44U, stats.at(1).address.addr);
+    EXPECT_EQ(1U, stats.at(1).rx_pkts);
+}
+
+}  // namespace
+}  // namespace Perf
+}  // namespace Homa
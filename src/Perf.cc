@@ -15,7 +15,10 @@
 
 #include "Perf.h"
 
+#include <memory>
 #include <mutex>
+#include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 namespace Homa {
@@ -24,43 +27,116 @@ namespace Perf {
 namespace Internal {
 
 /**
- * Protects access to globalCounters and perThreadCounters
+ * Protects access to globalCounters and transportCounters
  */
 std::mutex mutex;
 
 /**
- * Contains statistics information for any thread that as already exited.
+ * Contains statistics information for any Transport that has already been
+ * destroyed.
  */
 Counters globalCounters;
 
 /**
- * Set of all counters for all threads.
+ * Set of the counters of all live Transports.
  */
-std::unordered_set<const Counters*> perThreadCounters;
+std::unordered_set<const TransportCounters*> transportCounters;
+
+/**
+ * Source of TransportCounters identifiers.
+ */
+std::atomic<uint64_t> nextTransportCountersId(1);
+
+/**
+ * Protects access to lockCounters.
+ */
+std::mutex lockMutex;
+
+/**
+ * Counters for each named class of SpinLocks; entries are never removed so
+ * that registered pointers remain valid.
+ */
+std::unordered_map<std::string, std::unique_ptr<LockCounters>> lockCounters;
 
 }  // namespace Internal
 
-// Init thread local thread counters
-thread_local ThreadCounters counters;
+thread_local TransportCounters::LocalCache TransportCounters::localCache = {
+    0, nullptr};
+thread_local uint64_t TransportCounters::threadActiveCycles = 0;
 
 /**
- * Construct and register a new per thread set of counters.
+ * Construct and register a new set of Transport counters.
  */
-ThreadCounters::ThreadCounters()
-    : Counters()
+TransportCounters::TransportCounters()
+    : peers()
+    , id(Internal::nextTransportCountersId.fetch_add(1))
+    , mutex()
+    , shards()
 {
     std::lock_guard<std::mutex> lock(Internal::mutex);
-    Internal::perThreadCounters.insert(this);
+    Internal::transportCounters.insert(this);
 }
 
 /**
- * Deregister and destruct a per thread set of counters.
+ * Deregister and destruct a set of Transport counters; their totals are
+ * retained in the process-wide statistics.
  */
-ThreadCounters::~ThreadCounters()
+TransportCounters::~TransportCounters()
 {
     std::lock_guard<std::mutex> lock(Internal::mutex);
-    Internal::globalCounters.add(this);
-    Internal::perThreadCounters.erase(this);
+    sum(&Internal::globalCounters);
+    Internal::transportCounters.erase(this);
+}
+
+/**
+ * Fill the provided stats structure with the current performance statistics
+ * of this Transport.
+ */
+void
+TransportCounters::getStats(Stats* stats) const
+{
+    stats->timestamp = PerfUtils::Cycles::rdtsc();
+    stats->cycles_per_second = PerfUtils::Cycles::perSecond();
+
+    Counters output;
+    sum(&output);
+    output.dumpStats(stats);
+}
+
+/**
+ * Add the counters of every thread to the provided counters.
+ */
+void
+TransportCounters::sum(Counters* output) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const Aligned::unique_ptr<Shard>& shard : shards) {
+        output->add(shard.get());
+    }
+}
+
+/**
+ * Slow path of local(): find or create the calling thread's shard.
+ */
+Counters*
+TransportCounters::registerThread()
+{
+    // Shards of every TransportCounters the calling thread has used.
+    thread_local std::unordered_map<uint64_t, Counters*> threadShards;
+
+    Counters* counters;
+    auto it = threadShards.find(id);
+    if (it != threadShards.end()) {
+        counters = it->second;
+    } else {
+        std::lock_guard<std::mutex> lock(mutex);
+        shards.emplace_back(Aligned::create<Shard>());
+        counters = shards.back().get();
+        threadShards[id] = counters;
+    }
+    localCache.id = id;
+    localCache.counters = counters;
+    return counters;
 }
 
 /**
@@ -75,12 +151,96 @@ getStats(Stats* stats)
     Counters output;
     output.add(&Internal::globalCounters);
 
-    for (const Counters* counters : Internal::perThreadCounters) {
-        output.add(counters);
+    for (const TransportCounters* counters : Internal::transportCounters) {
+        counters->sum(&output);
     }
 
     output.dumpStats(stats);
 }
 
+/**
+ */
+void
+getRates(const Stats& before, const Stats& after, Rates* rates)
+{
+    double seconds = static_cast<double>(after.timestamp - before.timestamp) /
+                     after.cycles_per_second;
+    rates->seconds = seconds;
+    if (seconds <= 0) {
+        rates->tx_pkts_per_second = 0;
+        rates->rx_pkts_per_second = 0;
+        rates->tx_bytes_per_second = 0;
+        rates->rx_bytes_per_second = 0;
+        rates->active_fraction = 0;
+        return;
+    }
+    uint64_t txPkts = (after.tx_data_pkts - before.tx_data_pkts) +
+                      (after.tx_grant_pkts - before.tx_grant_pkts) +
+                      (after.tx_done_pkts - before.tx_done_pkts) +
+                      (after.tx_resend_pkts - before.tx_resend_pkts) +
+                      (after.tx_busy_pkts - before.tx_busy_pkts) +
+                      (after.tx_ping_pkts - before.tx_ping_pkts) +
+                      (after.tx_unknown_pkts - before.tx_unknown_pkts) +
+                      (after.tx_error_pkts - before.tx_error_pkts) +
+                      (after.tx_bundle_pkts - before.tx_bundle_pkts);
+    uint64_t rxPkts = (after.rx_data_pkts - before.rx_data_pkts) +
+                      (after.rx_grant_pkts - before.rx_grant_pkts) +
+                      (after.rx_done_pkts - before.rx_done_pkts) +
+                      (after.rx_resend_pkts - before.rx_resend_pkts) +
+                      (after.rx_busy_pkts - before.rx_busy_pkts) +
+                      (after.rx_ping_pkts - before.rx_ping_pkts) +
+                      (after.rx_unknown_pkts - before.rx_unknown_pkts) +
+                      (after.rx_error_pkts - before.rx_error_pkts) +
+                      (after.rx_bundle_pkts - before.rx_bundle_pkts);
+    rates->tx_pkts_per_second = txPkts / seconds;
+    rates->rx_pkts_per_second = rxPkts / seconds;
+    rates->tx_bytes_per_second = (after.tx_bytes - before.tx_bytes) / seconds;
+    rates->rx_bytes_per_second = (after.rx_bytes - before.rx_bytes) / seconds;
+    rates->active_fraction =
+        static_cast<double>(after.active_cycles - before.active_cycles) /
+        static_cast<double>(after.timestamp - before.timestamp);
+}
+
+/**
+ * Return the counters shared by all SpinLocks with the given name, creating
+ * them if necessary.
+ *
+ * @param name
+ *      Name of the lock; must remain valid for the life of the program.
+ */
+LockCounters*
+registerLock(const char* name)
+{
+    std::lock_guard<std::mutex> lock(Internal::lockMutex);
+    std::unique_ptr<LockCounters>& entry = Internal::lockCounters[name];
+    if (!entry) {
+        entry.reset(new LockCounters(name));
+    }
+    return entry.get();
+}
+
+/**
+ */
+void
+getLockStats(std::vector<LockStats>* stats)
+{
+    std::lock_guard<std::mutex> lock(Internal::lockMutex);
+    stats->clear();
+    for (const auto& it : Internal::lockCounters) {
+        const LockCounters* counters = it.second.get();
+        LockStats entry;
+        entry.name = counters->name;
+        entry.acquisitions =
+            counters->acquisitions.load(std::memory_order_relaxed);
+        entry.contended_acquisitions =
+            counters->contended_acquisitions.load(std::memory_order_relaxed);
+        entry.spin_cycles =
+            counters->spin_cycles.load(std::memory_order_relaxed);
+        entry.max_hold_cycles =
+            counters->max_hold_cycles.load(std::memory_order_relaxed);
+        stats->push_back(entry);
+    }
+}
+
 }  // namespace Perf
 }  // namespace Homa
@@ -20,10 +20,85 @@
 #include <Cycles.h>
 
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Aligned.h"
+#include "PeerTable.h"
 
 namespace Homa {
 namespace Perf {
 
+/**
+ * Contention statistics shared by all SpinLocks with the same name; only
+ * maintained when built with HOMA_LOCK_PROFILING.
+ *
+ * This structure is thread-safe.
+ */
+struct LockCounters {
+    /**
+     * Construct zeroed counters for the named locks.
+     */
+    explicit LockCounters(const char* name)
+        : name(name)
+        , acquisitions(0)
+        , contended_acquisitions(0)
+        , spin_cycles(0)
+        , max_hold_cycles(0)
+    {}
+
+    /**
+     * Record an acquisition of one of the locks.
+     *
+     * @param contended
+     *      True if the lock was held by another thread when the acquisition
+     *      started.
+     * @param spinCycles
+     *      Number of cycles spent waiting for the lock.
+     */
+    inline void acquired(bool contended, uint64_t spinCycles)
+    {
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (contended) {
+            contended_acquisitions.fetch_add(1, std::memory_order_relaxed);
+            spin_cycles.fetch_add(spinCycles, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Record the release of one of the locks.
+     *
+     * @param holdCycles
+     *      Number of cycles the lock was held.
+     */
+    inline void released(uint64_t holdCycles)
+    {
+        uint64_t max = max_hold_cycles.load(std::memory_order_relaxed);
+        while (holdCycles > max &&
+               !max_hold_cycles.compare_exchange_weak(
+                   max, holdCycles, std::memory_order_relaxed)) {
+        }
+    }
+
+    /// Name shared by the locks.
+    const char* const name;
+
+    /// Number of times one of the locks was acquired.
+    std::atomic<uint64_t> acquisitions;
+
+    /// Number of acquisitions that had to wait for another holder.
+    std::atomic<uint64_t> contended_acquisitions;
+
+    /// Total cycles spent waiting to acquire one of the locks.
+    std::atomic<uint64_t> spin_cycles;
+
+    /// Longest time one of the locks was held in cycles.
+    std::atomic<uint64_t> max_hold_cycles;
+};
+
+LockCounters* registerLock(const char* name);
+
 /**
  * Collection of collected performance counters.
  */
@@ -105,6 +180,9 @@ struct Counters {
         , rx_unknown_pkts(0)
         , tx_error_pkts(0)
         , rx_error_pkts(0)
+        , tx_bundle_pkts(0)
+        , rx_bundle_pkts(0)
+        , rx_malformed_pkts(0)
     {}
 
     /**
@@ -144,6 +222,9 @@ struct Counters {
         rx_unknown_pkts.add(other->rx_unknown_pkts);
         tx_error_pkts.add(other->tx_error_pkts);
         rx_error_pkts.add(other->rx_error_pkts);
+        tx_bundle_pkts.add(other->tx_bundle_pkts);
+        rx_bundle_pkts.add(other->rx_bundle_pkts);
+        rx_malformed_pkts.add(other->rx_malformed_pkts);
     }
 
     /**
@@ -178,6 +259,9 @@ struct Counters {
         stats->rx_unknown_pkts = rx_unknown_pkts.get();
         stats->tx_error_pkts = tx_error_pkts.get();
         stats->rx_error_pkts = rx_error_pkts.get();
+        stats->tx_bundle_pkts = tx_bundle_pkts.get();
+        stats->rx_bundle_pkts = rx_bundle_pkts.get();
+        stats->rx_malformed_pkts = rx_malformed_pkts.get();
     }
 
     /// CPU time spent running the Homa poll loop in cycles.
@@ -260,20 +344,104 @@ struct Counters {
 
     /// Number of error packets received.
     Stat<uint64_t> rx_error_pkts;
-};
 
-/**
- * Thread-local collection of performance counters.
- */
-struct ThreadCounters : public Counters {
-    ThreadCounters();
-    ~ThreadCounters();
+    /// Number of bundle packets sent.
+    Stat<uint64_t> tx_bundle_pkts;
+
+    /// Number of bundle packets received.
+    Stat<uint64_t> rx_bundle_pkts;
+
+    /// Number of received packets dropped because they were truncated, had
+    /// an unknown version or opcode, or referred to an invalid packet index.
+    Stat<uint64_t> rx_malformed_pkts;
 };
 
 /**
- * Per thread counters.
+ * The performance counters of one Transport.
+ *
+ * The counters are sharded by thread: each thread that does work for the
+ * Transport updates its own cache-line aligned Counters without atomic
+ * read-modify-write operations, and readers sum the shards.  Shards are kept
+ * until the TransportCounters is destroyed, at which point their totals are
+ * retained for the process-wide Homa::Perf::getStats().
+ *
+ * This class is thread-safe.
  */
-extern thread_local ThreadCounters counters;
+class TransportCounters {
+  public:
+    TransportCounters();
+    ~TransportCounters();
+
+    /**
+     * Return the calling thread's counters for this Transport.
+     */
+    inline Counters& local()
+    {
+        if (localCache.id == id) {
+            return *localCache.counters;
+        }
+        return *registerThread();
+    }
+
+    /**
+     * Record time the calling thread spent actively processing messages for
+     * this Transport.
+     *
+     * @param cycles
+     *      Active processing time in cycles.
+     */
+    inline void addActiveCycles(uint64_t cycles)
+    {
+        local().active_cycles.add(cycles);
+        threadActiveCycles += cycles;
+    }
+
+    void getStats(Stats* stats) const;
+    void sum(Counters* output) const;
+
+    /// Statistics of each of the Transport's peers.
+    PeerTable peers;
+
+    /**
+     * The most recently used shard of the calling thread.
+     */
+    struct LocalCache {
+        /// Identifies the TransportCounters that owns the shard; 0 if none.
+        uint64_t id;
+        /// The shard.
+        Counters* counters;
+    };
+
+    /// Cached result of the calling thread's last call to local().
+    static thread_local LocalCache localCache;
+
+    /// Active cycles recorded by the calling thread for any Transport; lets
+    /// a poll loop tell whether an iteration found work.
+    static thread_local uint64_t threadActiveCycles;
+
+  private:
+    /**
+     * Counters of one thread, aligned so that shards never share a cache
+     * line.
+     */
+    struct alignas(64) Shard : public Counters {};
+
+    Counters* registerThread();
+
+    /// Unique identifier of this TransportCounters; never reused.
+    const uint64_t id;
+
+    /// Protects shards.
+    mutable std::mutex mutex;
+
+    /// One entry per thread that has done work for this Transport; allocated
+    /// with Aligned::create() to honor the Shard alignment.
+    std::vector<Aligned::unique_ptr<Shard>> shards;
+
+    // Disable copy and assign
+    TransportCounters(const TransportCounters&) = delete;
+    TransportCounters& operator=(const TransportCounters&) = delete;
+};
 
 /**
  * Provides a convenient way to measure multiple consecutive cycle time
@@ -303,6 +471,116 @@ class Timer {
     uint64_t split_tsc;
 };
 
+/**
+ * Times at which a message passed key points in its life (see
+ * OutMessage::timing() and InMessage::timing()); only recorded when built
+ * with HOMA_MESSAGE_TIMING.  Otherwise, the class is empty and its methods
+ * do nothing, so that recording a time costs nothing.
+ *
+ * The times are recorded by the Transport's threads and may be read by the
+ * application at any time.
+ *
+ * @tparam NUM_POINTS
+ *      Number of times recorded; points are identified by their index.
+ */
+template <int NUM_POINTS>
+class Timestamps {
+  public:
+    /**
+     * Construct a Timestamps with no times recorded.
+     */
+    Timestamps()
+    {
+        reset();
+    }
+
+    /**
+     * Forget all recorded times.
+     */
+    inline void reset()
+    {
+#if HOMA_MESSAGE_TIMING
+        for (int i = 0; i < NUM_POINTS; ++i) {
+            times[i].store(0, std::memory_order_relaxed);
+        }
+#endif
+    }
+
+    /**
+     * Record the current time for a point, replacing any earlier time.
+     */
+    inline void record(int point)
+    {
+#if HOMA_MESSAGE_TIMING
+        times[point].store(PerfUtils::Cycles::rdtsc(),
+                           std::memory_order_relaxed);
+#else
+        (void)point;
+#endif
+    }
+
+    /**
+     * Record the current time for a point unless a time has already been
+     * recorded for it.
+     */
+    inline void recordFirst(int point)
+    {
+#if HOMA_MESSAGE_TIMING
+        if (times[point].load(std::memory_order_relaxed) == 0) {
+            uint64_t unset = 0;
+            times[point].compare_exchange_strong(unset,
+                                                 PerfUtils::Cycles::rdtsc(),
+                                                 std::memory_order_relaxed);
+        }
+#else
+        (void)point;
+#endif
+    }
+
+    /**
+     * Add the cycles elapsed since the time recorded for one point to the
+     * total kept in another, and forget the time of the first point.  Does
+     * nothing if no time is recorded for the first point.
+     *
+     * @param total
+     *      Point holding a cumulative number of cycles.
+     * @param since
+     *      Point at which the interval being added started.
+     */
+    inline void accumulate(int total, int since)
+    {
+#if HOMA_MESSAGE_TIMING
+        uint64_t start = times[since].exchange(0, std::memory_order_relaxed);
+        if (start != 0) {
+            times[total].fetch_add(PerfUtils::Cycles::rdtsc() - start,
+                                   std::memory_order_relaxed);
+        }
+#else
+        (void)total;
+        (void)since;
+#endif
+    }
+
+    /**
+     * Return the time recorded for a point; 0 if there is none.
+     */
+    inline uint64_t get(int point) const
+    {
+#if HOMA_MESSAGE_TIMING
+        return times[point].load(std::memory_order_relaxed);
+#else
+        (void)point;
+        return 0;
+#endif
+    }
+
+#if HOMA_MESSAGE_TIMING
+  private:
+    /// Time recorded for each point in cycles; 0 if none.
+    std::atomic<uint64_t> times[NUM_POINTS];
+#endif
+};
+
 }  // namespace Perf
 }  // namespace Homa
 
@@ -0,0 +1,157 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "Perf.h"
+
+namespace Homa {
+namespace Perf {
+namespace {
+
+TEST(PerfTest, TransportCounters_local)
+{
+    TransportCounters a;
+    TransportCounters b;
+    EXPECT_EQ(&a.local(), &a.local());
+    EXPECT_NE(&a.local(), &b.local());
+    EXPECT_EQ(1U, a.shards.size());
+    EXPECT_EQ(1U, b.shards.size());
+
+    // Switching back finds the thread's existing shard.
+    Counters* shard = &a.local();
+    EXPECT_EQ(shard, &a.local());
+    EXPECT_EQ(1U, a.shards.size());
+
+    Counters* other = nullptr;
+    std::thread thread([&] { other = &a.local(); });
+    thread.join();
+    EXPECT_NE(shard, other);
+    EXPECT_EQ(2U, a.shards.size());
+}
+
+TEST(PerfTest, TransportCounters_addActiveCycles)
+{
+    TransportCounters counters;
+    uint64_t threadActiveCycles = TransportCounters::threadActiveCycles;
+    counters.addActiveCycles(10);
+    EXPECT_EQ(10U, counters.local().active_cycles.get());
+    EXPECT_EQ(threadActiveCycles + 10, TransportCounters::threadActiveCycles);
+}
+
+TEST(PerfTest, TransportCounters_getStats)
+{
+    TransportCounters a;
+    TransportCounters b;
+    a.local().tx_data_pkts.add(2);
+    b.local().tx_data_pkts.add(5);
+    std::thread thread([&] { a.local().tx_data_pkts.add(3); });
+    thread.join();
+
+    Stats stats;
+    a.getStats(&stats);
+    EXPECT_EQ(5U, stats.tx_data_pkts);
+    b.getStats(&stats);
+    EXPECT_EQ(5U, stats.tx_data_pkts);
+}
+
+TEST(PerfTest, TransportCounters_destructor)
+{
+    Stats before;
+    getStats(&before);
+    {
+        TransportCounters counters;
+        counters.local().rx_data_pkts.add(4);
+        Stats during;
+        getStats(&during);
+        EXPECT_EQ(4U, during.rx_data_pkts - before.rx_data_pkts);
+    }
+    Stats after;
+    getStats(&after);
+    EXPECT_EQ(4U, after.rx_data_pkts - before.rx_data_pkts);
+}
+
+TEST(PerfTest, getRates)
+{
+    Stats before = {};
+    Stats after = {};
+    before.timestamp = 1000;
+    before.cycles_per_second = 1000;
+    before.tx_data_pkts = 10;
+    before.tx_bytes = 100;
+    after.timestamp = 3000;
+    after.cycles_per_second = 1000;
+    after.tx_data_pkts = 20;
+    after.tx_grant_pkts = 2;
+    after.rx_done_pkts = 4;
+    after.tx_bytes = 300;
+    after.rx_bytes = 50;
+    after.active_cycles = 500;
+
+    Rates rates;
+    getRates(before, after, &rates);
+    EXPECT_DOUBLE_EQ(2.0, rates.seconds);
+    EXPECT_DOUBLE_EQ(6.0, rates.tx_pkts_per_second);
+    EXPECT_DOUBLE_EQ(2.0, rates.rx_pkts_per_second);
+    EXPECT_DOUBLE_EQ(100.0, rates.tx_bytes_per_second);
+    EXPECT_DOUBLE_EQ(25.0, rates.rx_bytes_per_second);
+    EXPECT_DOUBLE_EQ(0.25, rates.active_fraction);
+}
+
+TEST(PerfTest, getRates_sameTime)
+{
+    Stats stats = {};
+    stats.timestamp = 1000;
+    stats.cycles_per_second = 1000;
+    Rates rates;
+    getRates(stats, stats, &rates);
+    EXPECT_EQ(0.0, rates.seconds);
+    EXPECT_EQ(0.0, rates.tx_pkts_per_second);
+    EXPECT_EQ(0.0, rates.active_fraction);
+}
+
+TEST(PerfTest, Timestamps)
+{
+    Timestamps<3> timestamps;
+    PerfUtils::Cycles::mockTscValue = 100;
+    timestamps.record(0);
+    timestamps.recordFirst(1);
+    PerfUtils::Cycles::mockTscValue = 150;
+    timestamps.record(0);
+    timestamps.recordFirst(1);
+    timestamps.accumulate(2, 1);
+    timestamps.accumulate(2, 1);
+#if HOMA_MESSAGE_TIMING
+    EXPECT_EQ(150U, timestamps.get(0));
+    EXPECT_EQ(0U, timestamps.get(1));
+    EXPECT_EQ(50U, timestamps.get(2));
+
+    timestamps.reset();
+    EXPECT_EQ(0U, timestamps.get(0));
+    EXPECT_EQ(0U, timestamps.get(2));
+#else
+    // Nothing is recorded.
+    EXPECT_EQ(0U, timestamps.get(0));
+    EXPECT_EQ(0U, timestamps.get(1));
+    EXPECT_EQ(0U, timestamps.get(2));
+#endif
+    PerfUtils::Cycles::mockTscValue = 0;
+}
+
+}  // namespace
+}  // namespace Perf
+}  // namespace Homa
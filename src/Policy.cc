@@ -39,14 +39,19 @@ const int MAX_OVERCOMMIT_COUNT = 4;
  *      The transport that owns this Policy::Manager.
  */
 Manager::Manager(Driver* driver)
-    : mutex()
+    : mutex("Policy::Manager::mutex")
     , driver(driver)
     , localUnscheduledPolicy()
     , localScheduledPolicy()
     , peerPolicies()
+    , peerPolicyCache()
     , RTT_BYTES(Default::RTT_TIME_US * (driver->getBandwidth() / 8))
     , MAX_PRIORITY(driver->getHighestPacketPriority())
 {
+    for (auto& slot : peerPolicyCache) {
+        slot.store(nullptr, std::memory_order_relaxed);
+    }
+
     // Set default unschedule policy
     localUnscheduledPolicy.version = 0;
     localUnscheduledPolicy.highestPriority = MAX_PRIORITY;
@@ -107,19 +112,29 @@ Unscheduled
 Manager::getUnscheduledPolicy(const IpAddress destination,
                               const uint32_t messageLength)
 {
-    SpinLock::Lock lock(mutex);
-    Unscheduled policy;
-    auto ret = peerPolicies.insert({destination, UnscheduledPolicy()});
-    UnscheduledPolicy* peer = &ret.first->second;
-    bool inserted = ret.second;
-    if (inserted) {
-        // No existing peer policy; set policy to the default.
-        peer->version = 0;
-        peer->highestPriority = MAX_PRIORITY;
-        peer->priorityCutoffBytes = std::vector<uint32_t>(
-            std::begin(Default::UNSCHEDULED_PRIORITY_CUTOFFS),
-            std::end(Default::UNSCHEDULED_PRIORITY_CUTOFFS));
+    std::atomic<const PeerPolicyEntry*>* slot =
+        &peerPolicyCache[IpAddress::Hasher()(destination) &
+                         (PEER_POLICY_CACHE_SIZE - 1)];
+    const PeerPolicyEntry* entry = slot->load(std::memory_order_acquire);
+    if (entry == nullptr || !(entry->first == destination)) {
+        // Not cached; look up the peer (and publish it) under the lock.
+        SpinLock::Lock lock(mutex);
+        auto ret = peerPolicies.insert({destination, UnscheduledPolicy()});
+        UnscheduledPolicy* peer = &ret.first->second;
+        bool inserted = ret.second;
+        if (inserted) {
+            // No existing peer policy; set policy to the default.
+            peer->version = 0;
+            peer->highestPriority = MAX_PRIORITY;
+            peer->priorityCutoffBytes = std::vector<uint32_t>(
+                std::begin(Default::UNSCHEDULED_PRIORITY_CUTOFFS),
+                std::end(Default::UNSCHEDULED_PRIORITY_CUTOFFS));
+        }
+        entry = &*ret.first;
+        slot->store(entry, std::memory_order_release);
     }
+    const UnscheduledPolicy* peer = &entry->second;
+    Unscheduled policy;
     policy.version = peer->version;
     policy.unscheduledByteLimit = RTT_BYTES;
     int rank = 0;
@@ -18,6 +18,8 @@
 
 #include <Homa/Driver.h>
 
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <unordered_map>
 #include <vector>
@@ -97,6 +99,12 @@ class Manager {
         std::vector<uint32_t> priorityCutoffBytes;
     };
 
+    /// An element of peerPolicies.
+    typedef std::pair<const IpAddress, UnscheduledPolicy> PeerPolicyEntry;
+
+    /// Number of slots in the peerPolicyCache; must be a power of 2.
+    static const size_t PEER_POLICY_CACHE_SIZE = 256;
+
     /// Monitor-style lock
     SpinLock mutex;
     /// Driver used by the Transport that owns this Manager.
@@ -108,6 +116,12 @@ class Manager {
     /// Collection of the known Policies for each peered Homa::Transport;
     std::unordered_map<IpAddress, UnscheduledPolicy, IpAddress::Hasher>
         peerPolicies;
+    /// Direct-mapped cache of peerPolicies entries that lets
+    /// getUnscheduledPolicy() find a known peer without taking the mutex.
+    /// Entries are never removed from peerPolicies and are not modified once
+    /// published here, so a cached pointer can be read without the lock.
+    std::array<std::atomic<const PeerPolicyEntry*>, PEER_POLICY_CACHE_SIZE>
+        peerPolicyCache;
     /// Number of bytes that can be transmitted in one round-trip-time.
     const uint32_t RTT_BYTES;
     /// The highest network packet priority that the driver supports.
@@ -86,6 +86,35 @@ TEST(PolicyManagerTest, getUnscheduledPolicy)
     }
 }
 
+TEST(PolicyManagerTest, getUnscheduledPolicy_cached)
+{
+    Homa::Mock::MockDriver mockDriver;
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    Policy::Manager manager(&mockDriver);
+    IpAddress dest{22};
+    IpAddress collidingDest{22 + Manager::PEER_POLICY_CACHE_SIZE};
+    const size_t mask = Manager::PEER_POLICY_CACHE_SIZE - 1;
+    size_t slot = IpAddress::Hasher()(dest) & mask;
+    ASSERT_EQ(slot, IpAddress::Hasher()(collidingDest) & mask);
+
+    manager.getUnscheduledPolicy(dest, 1);
+    EXPECT_EQ(&*manager.peerPolicies.find(dest),
+              manager.peerPolicyCache[slot].load());
+
+    // A cached peer is found without the lock.
+    {
+        SpinLock::Lock lock(manager.mutex);
+        EXPECT_EQ(7, manager.getUnscheduledPolicy(dest, 1).priority);
+    }
+
+    // Peers that map to the same slot replace each other.
+    manager.getUnscheduledPolicy(collidingDest, 1);
+    EXPECT_EQ(&*manager.peerPolicies.find(collidingDest),
+              manager.peerPolicyCache[slot].load());
+    EXPECT_EQ(2U, manager.peerPolicies.size());
+}
+
 }  // namespace
 }  // namespace Policy
 }  // namespace Core
@@ -103,8 +103,24 @@ enum Opcode {
     PING = 26,
     UNKNOWN = 27,
     ERROR = 28,
+    BUNDLE = 29,
 };
 
+/// Smallest valid Opcode value; the valid opcodes are contiguous.
+const uint8_t MIN_OPCODE = DATA;
+
+/// Largest valid Opcode value.
+const uint8_t MAX_OPCODE = BUNDLE;
+
+/// Version of the protocol sent and accepted by this implementation.
+const uint8_t VERSION = 1;
+
+/// Version carried by compact DATA packets (see CompactDataHeader).  Control
+/// packets use the regular layout with either version; a DONE marked with
+/// COMPACT_VERSION tells the message's sender that the receiver accepts
+/// compact DATA packets.
+const uint8_t COMPACT_VERSION = 2;
+
 /**
  * This is the first part of the Homa packet header and is common to all
  * versions of the protocol. The first four bytes of the header store the source
@@ -140,8 +156,8 @@ struct CommonHeader {
     MessageId messageId;  ///< RemoteOp/Message associated with this packet.
 
     /// CommonHeader constructor.
-    CommonHeader(Opcode opcode, MessageId messageId)
-        : prefix(0, 0, 1)
+    CommonHeader(Opcode opcode, MessageId messageId, uint8_t version = VERSION)
+        : prefix(0, 0, version)
         , opcode(opcode)
         , messageId(messageId)
     {}
@@ -181,6 +197,38 @@ struct DataHeader {
     }
 } __attribute__((packed));
 
+/**
+ * Describes the wire format for a compact DATA packet, which carries an entire
+ * single-packet message.
+ *
+ * Compact packets omit the fields implied for single-packet messages (the
+ * packet index and unscheduled index limit are 0 and 1) and carry only the
+ * sequence part of the MessageId; the receiver recovers the transportId from
+ * earlier full DATA packets sent by the same address.  Compact packets are
+ * only sent to peers that have advertised support for them.
+ */
+struct CompactDataHeader {
+    HeaderPrefix prefix;    ///< Common to all versions of the protocol.
+    uint8_t opcode;         ///< Always DATA.
+    uint64_t sequence;      ///< MessageId::sequence of the message.
+    uint16_t length;        ///< Total # bytes in the message; the packet may
+                            ///< be longer (e.g. padded by the link layer).
+    uint8_t policyVersion;  ///< Version of the network priority policy being
+                            ///< used by the Sender.
+
+    // The _length_ packet bytes after the header constitute message data.
+
+    /// CompactDataHeader constructor.
+    CompactDataHeader(uint16_t sport, uint16_t dport, uint64_t sequence,
+                      uint16_t length, uint8_t policyVersion)
+        : prefix(htobe16(sport), htobe16(dport), COMPACT_VERSION)
+        , opcode(Opcode::DATA)
+        , sequence(sequence)
+        , length(length)
+        , policyVersion(policyVersion)
+    {}
+} __attribute__((packed));
+
 /**
  * Describes the wire format for GRANT packets. A GRANT is sent by the receiver
  * back to the sender to indicate that it is now safe for the sender to transmit
@@ -212,8 +260,8 @@ struct DoneHeader {
     CommonHeader common;  ///< Common header fields.
 
     /// DoneHeader constructor.
-    DoneHeader(MessageId messageId)
-        : common(Opcode::DONE, messageId)
+    DoneHeader(MessageId messageId, uint8_t version = VERSION)
+        : common(Opcode::DONE, messageId, version)
     {}
 } __attribute__((packed));
 
@@ -298,6 +346,64 @@ struct ErrorHeader {
     {}
 } __attribute__((packed));
 
+/**
+ * Describes the wire format for BUNDLE packets.  A BUNDLE carries several
+ * small single-packet messages bound for the same Transport so that they can
+ * share one network packet.
+ *
+ * The header is followed by numMessages entries, each of which is a DataHeader
+ * immediately followed by the DataHeader::totalLength bytes of the message.
+ */
+struct BundleHeader {
+    HeaderPrefix prefix;   ///< Common to all versions of the protocol.
+    uint8_t opcode;        ///< Always BUNDLE.
+    uint16_t numMessages;  ///< Number of messages in the packet.
+
+    /// BundleHeader constructor.
+    BundleHeader()
+        : prefix(0, 0, VERSION)
+        , opcode(Opcode::BUNDLE)
+        , numMessages(0)
+    {}
+} __attribute__((packed));
+
+// The header sizes are part of the wire format.
+static_assert(sizeof(HeaderPrefix) == 5, "HeaderPrefix wire size changed");
+static_assert(sizeof(CommonHeader) == 22, "CommonHeader wire size changed");
+static_assert(sizeof(DataHeader) == 31, "DataHeader wire size changed");
+static_assert(sizeof(CompactDataHeader) == 17,
+              "CompactDataHeader wire size changed");
+static_assert(sizeof(GrantHeader) == 27, "GrantHeader wire size changed");
+static_assert(sizeof(DoneHeader) == 22, "DoneHeader wire size changed");
+static_assert(sizeof(ResendHeader) == 27, "ResendHeader wire size changed");
+static_assert(sizeof(BusyHeader) == 22, "BusyHeader wire size changed");
+static_assert(sizeof(PingHeader) == 22, "PingHeader wire size changed");
+static_assert(sizeof(UnknownHeader) == 22, "UnknownHeader wire size changed");
+static_assert(sizeof(ErrorHeader) == 22, "ErrorHeader wire size changed");
+static_assert(sizeof(BundleHeader) == 8, "BundleHeader wire size changed");
+
+/**
+ * Return the number of bytes a packet with the given opcode and version must
+ * contain for its header to be parsed, or 0 if the opcode is not valid.
+ */
+constexpr uint32_t
+minLength(uint8_t opcode, uint8_t version = VERSION)
+{
+    return opcode == DATA && version == COMPACT_VERSION
+               ? sizeof(CompactDataHeader)
+           : opcode == DATA    ? sizeof(DataHeader)
+           : opcode == GRANT   ? sizeof(GrantHeader)
+           : opcode == DONE    ? sizeof(DoneHeader)
+           : opcode == RESEND  ? sizeof(ResendHeader)
+           : opcode == BUSY    ? sizeof(BusyHeader)
+           : opcode == PING    ? sizeof(PingHeader)
+           : opcode == UNKNOWN ? sizeof(UnknownHeader)
+           : opcode == ERROR   ? sizeof(ErrorHeader)
+           : opcode == BUNDLE  ? sizeof(BundleHeader)
+                               : 0;
+}
+static_assert(MAX_OPCODE - MIN_OPCODE + 1 == 9, "Opcode values not contiguous");
+
 }  // namespace Packet
 }  // namespace Protocol
 }  // namespace Homa
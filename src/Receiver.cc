@@ -17,6 +17,10 @@
 
 #include <Cycles.h>
 
+#include <algorithm>
+#include <cstring>
+
+#include "Debug.h"
 #include "Perf.h"
 
 namespace Homa {
@@ -25,10 +29,15 @@ namespace Core {
 /**
  * Receiver constructor.
  *
+ * @param transportId
+ *      Unique identifier of the Transport that owns this Receiver; messages
+ *      with this identifier are responses to requests the Transport sent.
  * @param driver
  *      The driver used to send and receive packets.
  * @param policyManager
  *      Provides information about the grant and network priority policies.
+ * @param perf
+ *      Performance counters of the Transport that owns this Receiver.
  * @param messageTimeoutCycles
  *      Number of cycles of inactivity to wait before this Receiver declares an
  *      Receiver::Message receive failure.
@@ -36,17 +45,23 @@ namespace Core {
  *      Number of cycles of inactivity to wait between requesting retransmission
  *      of un-received parts of a message.
  */
-Receiver::Receiver(Driver* driver, Policy::Manager* policyManager,
+Receiver::Receiver(uint64_t transportId, Driver* driver,
+                   Policy::Manager* policyManager,
+                   Perf::TransportCounters* perf,
                    uint64_t messageTimeoutCycles, uint64_t resendIntervalCycles)
-    : driver(driver)
+    : transportId(transportId)
+    , driver(driver)
     , policyManager(policyManager)
-    , messageBuckets(messageTimeoutCycles, resendIntervalCycles)
-    , schedulerMutex()
+    , perf(perf)
+    , messageBuckets(messageTimeoutCycles, resendIntervalCycles, &nextTimeout)
+    , schedulerMutex("Receiver::schedulerMutex")
     , scheduledPeers()
     , receivedMessages()
     , granting()
-    , nextBucketIndex(0)
+    , nextTimeout(UINT64_MAX)
+    , sweeping()
     , messageAllocator()
+    , peerTransportIds()
 {}
 
 /**
@@ -59,6 +74,8 @@ Receiver::~Receiver()
     peerTable.clear();
     receivedMessages.mutex.lock();
     receivedMessages.queue.clear();
+    receivedMessages.ports.clear();
+    receivedMessages.responses.clear();
     for (auto it = messageBuckets.buckets.begin();
          it != messageBuckets.buckets.end(); ++it) {
         MessageBucket* bucket = *it;
@@ -88,35 +105,85 @@ Receiver::~Receiver()
 void
 Receiver::handleDataPacket(Driver::Packet* packet, IpAddress sourceIp)
 {
-    Protocol::Packet::DataHeader* header =
-        static_cast<Protocol::Packet::DataHeader*>(packet->payload);
-    uint16_t dataHeaderLength = sizeof(Protocol::Packet::DataHeader);
-    Protocol::MessageId id = header->common.messageId;
+    const Protocol::Packet::CommonHeader* common =
+        static_cast<const Protocol::Packet::CommonHeader*>(packet->payload);
+    Protocol::MessageId id;
+    uint16_t dataHeaderLength;
+    int messageLength;
+    int numUnscheduledPackets;
+    uint8_t policyVersion;
+    uint16_t index;
+    uint16_t sport = be16toh(common->prefix.sport);
+    uint16_t dport = be16toh(common->prefix.dport);
+    if (common->prefix.version == Protocol::Packet::COMPACT_VERSION) {
+        // Compact packets carry a whole message; the remaining fields are
+        // implied.
+        const Protocol::Packet::CompactDataHeader* header =
+            static_cast<const Protocol::Packet::CompactDataHeader*>(
+                packet->payload);
+        uint64_t peerTransportId;
+        if (!findPeerTransportId(sourceIp, &peerTransportId)) {
+            // Can't identify the message; the sender will find out via
+            // PING/UNKNOWN and fall back to full headers.
+            WARNING_RATE_LIMITED(
+                "Dropped compact DATA packet from unknown peer %s",
+                IpAddress::toString(sourceIp).c_str());
+            driver->releasePackets(&packet, 1);
+            return;
+        }
+        id = Protocol::MessageId(peerTransportId, header->sequence);
+        dataHeaderLength = sizeof(Protocol::Packet::CompactDataHeader);
+        messageLength = header->length;
+        if (packet->length < dataHeaderLength + messageLength) {
+            perf->local().rx_malformed_pkts.add(1);
+            WARNING_RATE_LIMITED(
+                "Dropped truncated compact DATA packet from %s",
+                IpAddress::toString(sourceIp).c_str());
+            driver->releasePackets(&packet, 1);
+            return;
+        }
+        numUnscheduledPackets = 1;
+        policyVersion = header->policyVersion;
+        index = 0;
+    } else {
+        const Protocol::Packet::DataHeader* header =
+            static_cast<const Protocol::Packet::DataHeader*>(packet->payload);
+        id = header->common.messageId;
+        dataHeaderLength = sizeof(Protocol::Packet::DataHeader);
+        messageLength = header->totalLength;
+        numUnscheduledPackets = header->unscheduledIndexLimit;
+        policyVersion = header->policyVersion;
+        index = header->index;
+    }
 
     MessageBucket* bucket = messageBuckets.getBucket(id);
     SpinLock::Lock lock_bucket(bucket->mutex);
     Message* message = bucket->findMessage(id, lock_bucket);
     if (message == nullptr) {
         // New message
-        int messageLength = header->totalLength;
-        int numUnscheduledPackets = header->unscheduledIndexLimit;
+        if (dataHeaderLength == sizeof(Protocol::Packet::DataHeader) &&
+            id.transportId != transportId) {
+            // Remember the sender so that it can later send compact packets.
+            recordPeerTransportId(sourceIp, id.transportId);
+        }
         {
             SpinLock::Lock lock_allocator(messageAllocator.mutex);
-            SocketAddress srcAddress = {
-                .ip = sourceIp, .port = be16toh(header->common.prefix.sport)};
+            SocketAddress srcAddress = {.ip = sourceIp, .port = sport};
             message = messageAllocator.pool.construct(
                 this, driver, dataHeaderLength, messageLength, id, srcAddress,
-                numUnscheduledPackets);
-            Perf::counters.allocated_rx_messages.add(1);
+                dport, numUnscheduledPackets);
+            perf->local().allocated_rx_messages.add(1);
         }
+        message->timestamps.record(Message::FIRST_PACKET_RECEIVED);
 
         bucket->messages.push_back(&message->bucketNode);
-        policyManager->signalNewMessage(
-            message->source.ip, header->policyVersion, header->totalLength);
+        message->activeCount.set(&perf->peers, sourceIp, 1);
+        policyManager->signalNewMessage(message->source.ip, policyVersion,
+                                        messageLength);
 
         if (message->scheduled) {
             // Message needs to be scheduled.
-            SpinLock::Lock lock_scheduler(schedulerMutex);
+            SchedulerMutex::Lock lock_scheduler(schedulerMutex);
             schedule(message, lock_scheduler);
         }
     }
@@ -125,15 +192,26 @@ Receiver::handleDataPacket(Driver::Packet* packet, IpAddress sourceIp)
     assert(id == message->id);
     assert(message->driver == driver);
     assert(message->source.ip == sourceIp);
-    assert(message->source.port == be16toh(header->common.prefix.sport));
-    assert(message->messageLength == Util::downCast<int>(header->totalLength));
+    assert(message->source.port == sport);
+    assert(message->destinationPort == dport);
+    assert(message->messageLength == messageLength);
+
+    // Reject packets that claim to lie outside the message.
+    if (index >= message->numExpectedPackets ||
+        index >= Message::MAX_MESSAGE_PACKETS) {
+        perf->local().rx_malformed_pkts.add(1);
+        WARNING_RATE_LIMITED("Dropped DATA packet with invalid index %u",
+                             index);
+        driver->releasePackets(&packet, 1);
+        return;
+    }
 
     // Add the packet
-    bool packetAdded = message->setPacket(header->index, packet);
+    bool packetAdded = message->setPacket(index, packet);
     if (packetAdded) {
         // Update schedule for scheduled messages.
         if (message->scheduled) {
-            SpinLock::Lock lock_scheduler(schedulerMutex);
+            SchedulerMutex::Lock lock_scheduler(schedulerMutex);
             ScheduledMessageInfo* info = &message->scheduledMessageInfo;
             // Update the schedule if the message is still being scheduled
             // (i.e. still linked to a scheduled peer).
@@ -143,6 +221,7 @@ Receiver::handleDataPacket(Driver::Packet* packet, IpAddress sourceIp)
                 assert(info->bytesRemaining >= packetDataBytes);
                 info->bytesRemaining -= packetDataBytes;
                 updateSchedule(message, lock_scheduler);
+                updateOutstandingGrant(message, lock_scheduler);
             }
         }
 
@@ -157,10 +236,20 @@ Receiver::handleDataPacket(Driver::Packet* packet, IpAddress sourceIp)
         } else {
             // All message packets have been received.
             message->state.store(Message::State::COMPLETED);
+            message->timestamps.record(Message::LAST_PACKET_RECEIVED);
             bucket->resendTimeouts.cancelTimeout(&message->resendTimeout);
             SpinLock::Lock lock_received_messages(receivedMessages.mutex);
-            receivedMessages.queue.push_back(&message->receivedMessageNode);
-            Perf::counters.received_rx_messages.add(1);
+            if (id.transportId == transportId) {
+                // Responses carry the id of the request sent by this transport
+                // and are handed to the request rather than the application.
+                receivedMessages.responses.push_back(
+                    &message->receivedMessageNode);
+            } else {
+                receivedMessages.queue.push_back(&message->receivedMessageNode);
+                receivedMessages.ports[dport].push_back(
+                    &message->receivedPortNode);
+            }
+            perf->local().received_rx_messages.add(1);
         }
     } else {
         // must be a duplicate packet; drop packet.
@@ -169,6 +258,51 @@ Receiver::handleDataPacket(Driver::Packet* packet, IpAddress sourceIp)
     return;
 }
 
+/**
+ * Process an incoming BUNDLE packet by handing each of the messages it
+ * carries to handleDataPacket() in a packet of its own.
+ *
+ * @param packet
+ *      The incoming BUNDLE packet to be processed.
+ * @param sourceIp
+ *      Source IP address of the packet.
+ */
+void
+Receiver::handleBundlePacket(Driver::Packet* packet, IpAddress sourceIp)
+{
+    const Protocol::Packet::BundleHeader* header =
+        static_cast<const Protocol::Packet::BundleHeader*>(packet->payload);
+    const char* payload = static_cast<const char*>(packet->payload);
+    const int headerLength = sizeof(Protocol::Packet::DataHeader);
+    int offset = sizeof(Protocol::Packet::BundleHeader);
+    for (uint16_t i = 0; i < header->numMessages; ++i) {
+        const Protocol::Packet::DataHeader* dataHeader =
+            reinterpret_cast<const Protocol::Packet::DataHeader*>(payload +
+                                                                  offset);
+        if (offset + headerLength > packet->length ||
+            dataHeader->common.prefix.version != Protocol::Packet::VERSION ||
+            dataHeader->common.opcode != Protocol::Packet::DATA ||
+            dataHeader->index != 0 ||
+            offset + headerLength + Util::downCast<int>(
+                                        dataHeader->totalLength) >
+                packet->length) {
+            perf->local().rx_malformed_pkts.add(1);
+            WARNING_RATE_LIMITED("Dropped malformed BUNDLE packet from %s",
+                                 IpAddress::toString(sourceIp).c_str());
+            break;
+        }
+        // Each message gets its own packet so that it can be released
+        // independently of the others.
+        int length = headerLength + dataHeader->totalLength;
+        Driver::Packet* dataPacket = driver->allocPacket();
+        std::memcpy(dataPacket->payload, dataHeader, length);
+        dataPacket->length = length;
+        handleDataPacket(dataPacket, sourceIp);
+        offset += length;
+    }
+    driver->releasePackets(&packet, 1);
+}
+
 /**
  * Process an incoming BUSY packet.
  *
@@ -231,21 +365,22 @@ Receiver::handlePingPacket(Driver::Packet* packet, IpAddress sourceIp)
             // Use the scheduled GRANT information for scheduled messages.
             // This may still contain the default values (i.e. an empty GRANT)
             // if no GRANTs have been issued yet.
-            SpinLock::Lock lock_scheduler(schedulerMutex);
+            SchedulerMutex::Lock lock_scheduler(schedulerMutex);
             ScheduledMessageInfo* info = &message->scheduledMessageInfo;
             bytesGranted = info->bytesGranted;
             priority = info->priority;
         }
 
-        Perf::counters.tx_grant_pkts.add(1);
+        perf->local().tx_grant_pkts.add(1);
         ControlPacket::send<Protocol::Packet::GrantHeader>(
-            driver, message->source.ip, message->id, bytesGranted, priority);
+            driver, perf, message->source.ip, message->id, bytesGranted,
+            priority);
     } else {
         // We are here because we have no knowledge of the message the Sender is
         // asking about.  Reply UNKNOWN so the Sender can react accordingly.
-        Perf::counters.tx_unknown_pkts.add(1);
-        ControlPacket::send<Protocol::Packet::UnknownHeader>(driver, sourceIp,
-                                                             id);
+        perf->local().tx_unknown_pkts.add(1);
+        ControlPacket::send<Protocol::Packet::UnknownHeader>(driver, perf,
+                                                             sourceIp, id);
     }
     driver->releasePackets(&packet, 1);
 }
@@ -269,11 +404,158 @@ Receiver::receiveMessage()
     if (!receivedMessages.queue.empty()) {
         message = &receivedMessages.queue.front();
         receivedMessages.queue.pop_front();
-        Perf::counters.delivered_rx_messages.add(1);
+        receivedMessages.ports.find(message->destinationPort)
+            ->second.remove(&message->receivedPortNode);
+        message->timestamps.record(Message::DELIVERED);
+        perf->local().delivered_rx_messages.add(1);
+    }
+    return message;
+}
+
+/**
+ * Return handles to as many new received Messages as are available, up to a
+ * limit, taking the received message lock only once.
+ *
+ * @param[out] messages
+ *      Array of at least _maxMessages_ entries; the first entries are set to
+ *      the received messages.
+ * @param maxMessages
+ *      Maximum number of messages to return.
+ * @return
+ *      Number of messages returned in _messages_.
+ *
+ * @sa dropMessage()
+ */
+size_t
+Receiver::receiveMessages(Homa::InMessage* messages[], size_t maxMessages)
+{
+    SpinLock::Lock lock_received_messages(receivedMessages.mutex);
+    size_t numMessages = 0;
+    while (numMessages < maxMessages && !receivedMessages.queue.empty()) {
+        Message* message = &receivedMessages.queue.front();
+        receivedMessages.queue.pop_front();
+        receivedMessages.ports.find(message->destinationPort)
+            ->second.remove(&message->receivedPortNode);
+        message->timestamps.record(Message::DELIVERED);
+        messages[numMessages++] = message;
+    }
+    perf->local().delivered_rx_messages.add(numMessages);
+    return numMessages;
+}
+
+/**
+ * Return a handle to a new received Message sent to the given port.
+ *
+ * Messages sent to other ports are left to be returned by other calls.
+ *
+ * @param port
+ *      Destination port of the message to be returned.
+ * @return
+ *      A new Message sent to the port which has been received, if available;
+ *      otherwise, nullptr.
+ *
+ * @sa dropMessage()
+ */
+Homa::InMessage*
+Receiver::receiveMessage(uint16_t port)
+{
+    SpinLock::Lock lock_received_messages(receivedMessages.mutex);
+    Message* message = nullptr;
+    auto it = receivedMessages.ports.find(port);
+    if (it != receivedMessages.ports.end() && !it->second.empty()) {
+        message = &it->second.front();
+        it->second.pop_front();
+        receivedMessages.queue.remove(&message->receivedMessageNode);
+        message->timestamps.record(Message::DELIVERED);
+        perf->local().delivered_rx_messages.add(1);
+    }
+    return message;
+}
+
+/**
+ * Return a response to a request sent by this transport, if one has been
+ * completely received.
+ *
+ * @param[out] requestId
+ *      Set to the id of the request to which the returned message responds.
+ * @return
+ *      A response which has been received, if available; otherwise, nullptr.
+ */
+Homa::InMessage*
+Receiver::receiveResponse(Protocol::MessageId* requestId)
+{
+    SpinLock::Lock lock_received_messages(receivedMessages.mutex);
+    Message* message = nullptr;
+    if (!receivedMessages.responses.empty()) {
+        message = &receivedMessages.responses.front();
+        receivedMessages.responses.pop_front();
+        *requestId = message->id;
+        message->timestamps.record(Message::DELIVERED);
+        perf->local().delivered_rx_messages.add(1);
     }
     return message;
 }
 
+/**
+ * Return the identity of a message returned by receiveMessage().
+ *
+ * @param message
+ *      Message whose identity should be returned.
+ * @param[out] id
+ *      Set to the message's id.
+ * @param[out] source
+ *      Set to the address from which the message was sent.
+ */
+void
+Receiver::getMessageSource(Homa::InMessage* message, Protocol::MessageId* id,
+                           SocketAddress* source)
+{
+    Message* inMessage = static_cast<Message*>(message);
+    *id = inMessage->id;
+    *source = inMessage->source;
+}
+
+/**
+ * Hand the packets of a message returned by receiveMessage() over to the
+ * caller so that they can be reused (e.g. to forward the message without
+ * copying its contents).  The message is empty afterwards.
+ *
+ * Packets are only handed over if they have room for a full DataHeader;
+ * messages that arrived with a compact header keep their packets.
+ *
+ * @param message
+ *      Message whose packets should be handed over.
+ * @param[out] packets
+ *      Array of at least MAX_MESSAGE_PACKETS entries that will be set to the
+ *      message's packets.  The caller takes ownership of the packets.
+ * @param[out] headroom
+ *      Set to the number of bytes stripped from the beginning of the message.
+ * @return
+ *      Number of packets handed over; 0 if the packets cannot be reused.
+ */
+int
+Receiver::takePackets(Homa::InMessage* message, Driver::Packet* packets[],
+                      int* headroom)
+{
+    Message* inMessage = static_cast<Message*>(message);
+    *headroom = inMessage->start;
+    if (inMessage->TRANSPORT_HEADER_LENGTH !=
+        sizeof(Protocol::Packet::DataHeader)) {
+        return 0;
+    }
+    MessageBucket* bucket = messageBuckets.getBucket(inMessage->id);
+    SpinLock::Lock lock(bucket->mutex);
+    assert(inMessage->numPackets == inMessage->numExpectedPackets);
+    int count = inMessage->numPackets;
+    std::copy(inMessage->packets, inMessage->packets + count, packets);
+    // The occupied bits are left set so that duplicate DATA packets are still
+    // recognized and dropped; with numPackets at 0 nothing is released when
+    // the message is destroyed.
+    inMessage->numPackets = 0;
+    inMessage->start = inMessage->messageLength;
+    return count;
+}
+
 /**
  * Allow the Receiver to make progress toward receiving incoming messages.
  *
@@ -287,19 +569,51 @@ Receiver::poll()
 }
 
 /**
- * Make incremental progress processing expired Receiver timeouts.
+ * Send GRANTs to incoming messages without processing timeouts.
+ *
+ * @return
+ *      True if incoming messages are still being scheduled; false otherwise.
+ */
+bool
+Receiver::pollGrants()
+{
+    return trySendGrants();
+}
+
+/**
+ * Process every expired Receiver timeout.
+ *
+ * Returns right away unless some timeout might have elapsed; otherwise, every
+ * bucket is swept so that timeouts are processed promptly no matter how often
+ * this method is called.  Safe to call from a thread dedicated to timeouts.
  *
  * Pulled out of poll() for ease of testing.
  */
 void
 Receiver::checkTimeouts()
 {
-    uint index = nextBucketIndex.fetch_add(1, std::memory_order_relaxed) &
-                 MessageBucketMap::HASH_KEY_MASK;
-    MessageBucket* bucket = messageBuckets.buckets.at(index);
     uint64_t now = PerfUtils::Cycles::rdtsc();
-    checkResendTimeouts(now, bucket);
-    checkMessageTimeouts(now, bucket);
+    if (now < nextTimeout.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // Skip the sweep if another thread is already doing it.
+    if (sweeping.test_and_set()) {
+        return;
+    }
+
+    // Timeouts scheduled during the sweep lower nextTimeout again on their
+    // own; the remaining timeouts of each swept bucket are folded back in.
+    nextTimeout.exchange(UINT64_MAX);
+    uint64_t deadline = UINT64_MAX;
+    for (MessageBucket* bucket : messageBuckets.buckets) {
+        checkResendTimeouts(now, bucket);
+        checkMessageTimeouts(now, bucket);
+        deadline = std::min(deadline, bucket->messageTimeouts.nextExpiration());
+        deadline = std::min(deadline, bucket->resendTimeouts.nextExpiration());
+    }
+    TimeoutManager<Message>::lowerDeadline(&nextTimeout, deadline);
+    sweeping.clear();
 }
 
 /**
@@ -342,8 +656,11 @@ Receiver::Message::acknowledge() const
 {
     MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
     SpinLock::Lock lock(bucket->mutex);
-    Perf::counters.tx_done_pkts.add(1);
-    ControlPacket::send<Protocol::Packet::DoneHeader>(driver, source.ip, id);
+    receiver->perf->local().tx_done_pkts.add(1);
+    // Advertise that compact DATA packets are accepted.
+    ControlPacket::send<Protocol::Packet::DoneHeader>(
+        driver, receiver->perf, source.ip, id,
+        Protocol::Packet::COMPACT_VERSION);
 }
 
 /**
@@ -363,8 +680,9 @@ Receiver::Message::fail() const
 {
     MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
     SpinLock::Lock lock(bucket->mutex);
-    Perf::counters.tx_error_pkts.add(1);
-    ControlPacket::send<Protocol::Packet::ErrorHeader>(driver, source.ip, id);
+    receiver->perf->local().tx_error_pkts.add(1);
+    ControlPacket::send<Protocol::Packet::ErrorHeader>(driver, receiver->perf,
+                                                       source.ip, id);
 }
 
 /**
@@ -430,6 +748,22 @@ Receiver::Message::strip(size_t count)
     start = std::min(start + Util::downCast<int>(count), messageLength);
 }
 
+/**
+ * @copydoc Homa::InMessage::timing()
+ */
+InMessage::Timing
+Receiver::Message::timing() const
+{
+    Timing timing;
+    timing.firstPacketReceived = timestamps.get(FIRST_PACKET_RECEIVED);
+    timing.firstGrantSent = timestamps.get(FIRST_GRANT_SENT);
+    timing.lastGrantSent = timestamps.get(LAST_GRANT_SENT);
+    timing.firstResendSent = timestamps.get(FIRST_RESEND_SENT);
+    timing.lastPacketReceived = timestamps.get(LAST_PACKET_RECEIVED);
+    timing.delivered = timestamps.get(DELIVERED);
+    return timing;
+}
+
 /**
  * @copydoc Homa::InMessage::release()
  */
@@ -506,21 +840,77 @@ Receiver::dropMessage(Receiver::Message* message)
         if (message->scheduled) {
             // Unschedule the message if it is still scheduled (i.e. still
             // linked to a scheduled peer).
-            SpinLock::Lock lock_scheduler(schedulerMutex);
+            SchedulerMutex::Lock lock_scheduler(schedulerMutex);
             ScheduledMessageInfo* info = &message->scheduledMessageInfo;
             if (info->peer != nullptr) {
                 unschedule(message, lock_scheduler);
             }
         }
         bucket->messages.remove(&message->bucketNode);
+        message->activeCount.set(&perf->peers, message->source.ip, 0);
         {
             SpinLock::Lock lock_allocator(messageAllocator.mutex);
             messageAllocator.pool.destroy(message);
-            Perf::counters.destroyed_rx_messages.add(1);
+            perf->local().destroyed_rx_messages.add(1);
         }
     }
 }
 
+/**
+ * Look up the transportId of a peer that has sent full DATA packets, and mark
+ * the peer as recently active.
+ *
+ * @param sourceIp
+ *      Address of the peer.
+ * @param[out] peerTransportId
+ *      Set to the peer's transportId, if it is known.
+ * @return
+ *      True if the peer's transportId is known; false, otherwise.
+ */
+bool
+Receiver::findPeerTransportId(IpAddress sourceIp, uint64_t* peerTransportId)
+{
+    SpinLock::Lock lock_peers(peerTransportIds.mutex);
+    auto it = peerTransportIds.map.find(sourceIp);
+    if (it == peerTransportIds.map.end()) {
+        return false;
+    }
+    std::list<IpAddress>& lru = peerTransportIds.lru;
+    lru.splice(lru.begin(), lru, it->second.lruNode);
+    *peerTransportId = it->second.transportId;
+    return true;
+}
+
+/**
+ * Remember the transportId of a peer so that the messages of its compact DATA
+ * packets can be identified.  If MAX_PEER_TRANSPORT_IDS peers are already
+ * known, the least recently active one is forgotten.
+ *
+ * @param sourceIp
+ *      Address of the peer.
+ * @param peerTransportId
+ *      The peer's transportId.
+ */
+void
+Receiver::recordPeerTransportId(IpAddress sourceIp, uint64_t peerTransportId)
+{
+    SpinLock::Lock lock_peers(peerTransportIds.mutex);
+    auto& map = peerTransportIds.map;
+    std::list<IpAddress>& lru = peerTransportIds.lru;
+    auto it = map.find(sourceIp);
+    if (it != map.end()) {
+        lru.splice(lru.begin(), lru, it->second.lruNode);
+        it->second.transportId = peerTransportId;
+        return;
+    }
+    if (map.size() >= MAX_PEER_TRANSPORT_IDS) {
+        map.erase(lru.back());
+        lru.pop_back();
+    }
+    lru.push_front(sourceIp);
+    map[sourceIp] = {peerTransportId, lru.begin()};
+}
+
 /**
  * Process any inbound messages that have timed out due to lack of activity from
  * the Sender.
@@ -569,7 +959,7 @@ Receiver::checkMessageTimeouts(uint64_t now, MessageBucket* bucket)
             if (message->scheduled) {
                 // Unschedule the message if it is still scheduled (i.e.
                 // still linked to a scheduled peer).
-                SpinLock::Lock lock_scheduler(schedulerMutex);
+                SchedulerMutex::Lock lock_scheduler(schedulerMutex);
                 ScheduledMessageInfo* info = &message->scheduledMessageInfo;
                 if (info->peer != nullptr) {
                     unschedule(message, lock_scheduler);
@@ -577,6 +967,8 @@ Receiver::checkMessageTimeouts(uint64_t now, MessageBucket* bucket)
             }
 
             bucket->messages.remove(&message->bucketNode);
+            message->activeCount.set(&perf->peers, message->source.ip, 0);
+            perf->peers.find(message->source.ip)->timeouts.fetch_add(1);
             {
                 SpinLock::Lock lock_allocator(messageAllocator.mutex);
                 messageAllocator.pool.destroy(message);
@@ -633,7 +1025,7 @@ Receiver::checkResendTimeouts(uint64_t now, MessageBucket* bucket)
         int grantIndexLimit = message->numUnscheduledPackets;
 
         if (message->scheduled) {
-            SpinLock::Lock lock_scheduler(schedulerMutex);
+            SchedulerMutex::Lock lock_scheduler(schedulerMutex);
             ScheduledMessageInfo* info = &message->scheduledMessageInfo;
             int receivedBytes = info->messageLength - info->bytesRemaining;
             if (receivedBytes >= info->bytesGranted) {
@@ -669,10 +1061,14 @@ Receiver::checkResendTimeouts(uint64_t now, MessageBucket* bucket)
                     // ignore the priority field for resends of purely
                     // unscheduled packets (see
                     // Sender::handleResendPacket()).
-                    SpinLock::Lock lock_scheduler(schedulerMutex);
-                    Perf::counters.tx_resend_pkts.add(1);
+                    SchedulerMutex::Lock lock_scheduler(schedulerMutex);
+                    perf->local().tx_resend_pkts.add(1);
+                    perf->peers.find(message->source.ip)
+                        ->tx_resend_pkts.fetch_add(1);
+                    message->timestamps.recordFirst(
+                        Message::FIRST_RESEND_SENT);
                     ControlPacket::send<Protocol::Packet::ResendHeader>(
-                        message->driver, message->source.ip, message->id,
+                        message->driver, perf, message->source.ip, message->id,
                         Util::downCast<uint16_t>(index),
                         Util::downCast<uint16_t>(num),
                         message->scheduledMessageInfo.priority);
@@ -682,10 +1078,12 @@ Receiver::checkResendTimeouts(uint64_t now, MessageBucket* bucket)
         }
         if (num != 0) {
             // Send out the last range of packets found.
-            SpinLock::Lock lock_scheduler(schedulerMutex);
-            Perf::counters.tx_resend_pkts.add(1);
+            SchedulerMutex::Lock lock_scheduler(schedulerMutex);
+            perf->local().tx_resend_pkts.add(1);
+            perf->peers.find(message->source.ip)->tx_resend_pkts.fetch_add(1);
+            message->timestamps.recordFirst(Message::FIRST_RESEND_SENT);
             ControlPacket::send<Protocol::Packet::ResendHeader>(
-                message->driver, message->source.ip, message->id,
+                message->driver, perf, message->source.ip, message->id,
                 Util::downCast<uint16_t>(index), Util::downCast<uint16_t>(num),
                 message->scheduledMessageInfo.priority);
         }
@@ -694,21 +1092,24 @@ Receiver::checkResendTimeouts(uint64_t now, MessageBucket* bucket)
 
 /**
  * Send GRANTs to incoming Message according to the Receiver's policy.
+ *
+ * @return
+ *      True if incoming messages are still being scheduled; false otherwise.
  */
-void
+bool
 Receiver::trySendGrants()
 {
     Perf::Timer timer;
 
     // Skip scheduling if another poller is already working on it.
     if (granting.test_and_set()) {
-        return;
+        return true;
     }
 
-    SpinLock::Lock lock(schedulerMutex);
+    SchedulerMutex::Lock lock(schedulerMutex);
     if (scheduledPeers.empty()) {
         granting.clear();
-        return;
+        return false;
     }
 
     /* The overall goal is to grant up to policy.degreeOvercommitment number of
@@ -751,11 +1152,14 @@ Receiver::trySendGrants()
                 receivedBytes + policy.maxScheduledBytes, info->messageLength);
             assert(newGrantLimit >= info->bytesGranted);
             info->bytesGranted = newGrantLimit;
-            Perf::counters.tx_grant_pkts.add(1);
+            updateOutstandingGrant(message, lock);
+            message->timestamps.recordFirst(Message::FIRST_GRANT_SENT);
+            message->timestamps.record(Message::LAST_GRANT_SENT);
+            perf->local().tx_grant_pkts.add(1);
             ControlPacket::send<Protocol::Packet::GrantHeader>(
-                driver, sourceIp, id,
+                driver, perf, sourceIp, id,
                 Util::downCast<uint32_t>(info->bytesGranted), info->priority);
-            Perf::counters.active_cycles.add(timer.split());
+            perf->addActiveCycles(timer.split());
         }
 
         // Update the iterator first since calling unschedule() may cause the
@@ -765,13 +1169,15 @@ Receiver::trySendGrants()
         if (info->messageLength <= info->bytesGranted) {
             // All packets granted, unschedule the message.
             unschedule(message, lock);
-            Perf::counters.active_cycles.add(timer.split());
+            perf->addActiveCycles(timer.split());
         }
 
         ++slot;
     }
 
+    bool grantsPending = !scheduledPeers.empty();
     granting.clear();
+    return grantsPending;
 }
 
 /**
@@ -785,7 +1191,8 @@ Receiver::trySendGrants()
  *      Reminder to hold the Receiver::schedulerMutex during this call.
  */
 void
-Receiver::schedule(Receiver::Message* message, const SpinLock::Lock& lock)
+Receiver::schedule(Receiver::Message* message,
+                   const SchedulerMutex::Lock& lock)
 {
     (void)lock;
     ScheduledMessageInfo* info = &message->scheduledMessageInfo;
@@ -825,7 +1232,8 @@ Receiver::schedule(Receiver::Message* message, const SpinLock::Lock& lock)
  *      Reminder to hold the Receiver::schedulerMutex during this call.
  */
 void
-Receiver::unschedule(Receiver::Message* message, const SpinLock::Lock& lock)
+Receiver::unschedule(Receiver::Message* message,
+                     const SchedulerMutex::Lock& lock)
 {
     (void)lock;
     ScheduledMessageInfo* info = &message->scheduledMessageInfo;
@@ -839,6 +1247,7 @@ Receiver::unschedule(Receiver::Message* message, const SpinLock::Lock& lock)
     assert(peer->scheduledMessages.contains(&info->scheduledMessageNode));
     peer->scheduledMessages.remove(&info->scheduledMessageNode);
     info->peer = nullptr;
+    updateOutstandingGrant(message, lock);
 
     // Cleanup the schedule
     if (peer->scheduledMessages.empty()) {
@@ -869,7 +1278,8 @@ Receiver::unschedule(Receiver::Message* message, const SpinLock::Lock& lock)
  *      Reminder to hold the Receiver::schedulerMutex during this call.
  */
 void
-Receiver::updateSchedule(Receiver::Message* message, const SpinLock::Lock& lock)
+Receiver::updateSchedule(Receiver::Message* message,
+                         const SchedulerMutex::Lock& lock)
 {
     (void)lock;
     ScheduledMessageInfo* info = &message->scheduledMessageInfo;
@@ -890,5 +1300,31 @@ Receiver::updateSchedule(Receiver::Message* message, const SpinLock::Lock& lock)
     }
 }
 
+/**
+ * Bring the peer statistics' count of granted but unreceived bytes up to date
+ * with a Message's schedule.
+ *
+ * Called whenever the Message's granted bytes, received bytes, or scheduled
+ * state change.
+ *
+ * @param message
+ *      Message whose schedule changed.
+ * @param lock
+ *      Reminder to hold the Receiver::schedulerMutex during this call.
+ */
+void
+Receiver::updateOutstandingGrant(Receiver::Message* message,
+                                 const SchedulerMutex::Lock& lock)
+{
+    (void)lock;
+    ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+    int outstanding = 0;
+    if (info->peer != nullptr) {
+        int receivedBytes = info->messageLength - info->bytesRemaining;
+        outstanding = std::max(0, info->bytesGranted - receivedBytes);
+    }
+    info->bytesOutstanding.set(&perf->peers, message->source.ip, outstanding);
+}
+
 }  // namespace Core
 }  // namespace Homa
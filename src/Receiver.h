@@ -22,14 +22,17 @@
 
 #include <atomic>
 #include <deque>
+#include <list>
 #include <unordered_map>
 
 #include "ControlPacket.h"
 #include "Intrusive.h"
 #include "ObjectPool.h"
+#include "Perf.h"
 #include "Policy.h"
 #include "Protocol.h"
 #include "SpinLock.h"
+#include "TicketLock.h"
 #include "Timeout.h"
 #include "Util.h"
 
@@ -44,17 +47,34 @@ namespace Core {
  */
 class Receiver {
   public:
-    explicit Receiver(Driver* driver, Policy::Manager* policyManager,
+    explicit Receiver(uint64_t transportId, Driver* driver,
+                      Policy::Manager* policyManager,
+                      Perf::TransportCounters* perf,
                       uint64_t messageTimeoutCycles,
                       uint64_t resendIntervalCycles);
     virtual ~Receiver();
     virtual void handleDataPacket(Driver::Packet* packet, IpAddress sourceIp);
+    virtual void handleBundlePacket(Driver::Packet* packet,
+                                    IpAddress sourceIp);
     virtual void handleBusyPacket(Driver::Packet* packet);
     virtual void handlePingPacket(Driver::Packet* packet, IpAddress sourceIp);
     virtual Homa::InMessage* receiveMessage();
+    virtual Homa::InMessage* receiveMessage(uint16_t port);
+    virtual size_t receiveMessages(Homa::InMessage* messages[],
+                                   size_t maxMessages);
+    virtual Homa::InMessage* receiveResponse(Protocol::MessageId* requestId);
+    virtual void getMessageSource(Homa::InMessage* message,
+                                  Protocol::MessageId* id,
+                                  SocketAddress* source);
+    virtual int takePackets(Homa::InMessage* message, Driver::Packet* packets[],
+                            int* headroom);
     virtual void poll();
+    virtual bool pollGrants();
     virtual void checkTimeouts();
 
+    /// Maximum number of packets that a received message can hold.
+    static const int MAX_MESSAGE_PACKETS = 1024;
+
   private:
     // Forward declaration
     class Message;
@@ -88,6 +108,7 @@ class Receiver {
             : messageLength(length)
             , bytesRemaining(length)
             , bytesGranted(0)
+            , bytesOutstanding(&Perf::PeerTable::Entry::outstanding_grant_bytes)
             , priority(0)
             , peer(nullptr)
             , scheduledMessageNode(message)
@@ -103,6 +124,10 @@ class Receiver {
         /// The cumulative number of bytes that have granted for this Message.
         int bytesGranted;
 
+        /// Granted but unreceived bytes of this Message last counted in the
+        /// peer statistics (see Receiver::updateOutstandingGrant()).
+        Perf::PeerTable::Share bytesOutstanding;
+
         /// The network priority at which the Receiver requests Message be sent.
         int priority;
 
@@ -135,11 +160,12 @@ class Receiver {
         explicit Message(Receiver* receiver, Driver* driver,
                          size_t packetHeaderLength, size_t messageLength,
                          Protocol::MessageId id, SocketAddress source,
-                         int numUnscheduledPackets)
+                         uint16_t destinationPort, int numUnscheduledPackets)
             : receiver(receiver)
             , driver(driver)
             , id(id)
             , source(source)
+            , destinationPort(destinationPort)
             , TRANSPORT_HEADER_LENGTH(packetHeaderLength)
             , PACKET_DATA_LENGTH(driver->getMaxPayloadSize() -
                                  TRANSPORT_HEADER_LENGTH)
@@ -156,9 +182,12 @@ class Receiver {
             , state(Message::State::IN_PROGRESS)
             , bucketNode(this)
             , receivedMessageNode(this)
+            , receivedPortNode(this)
             , messageTimeout(this)
             , resendTimeout(this)
             , scheduledMessageInfo(this, messageLength)
+            , activeCount(&Perf::PeerTable::Entry::active_messages)
+            , timestamps()
         {}
 
         virtual ~Message();
@@ -169,6 +198,7 @@ class Receiver {
                            size_t count) const;
         virtual size_t length() const;
         virtual void strip(size_t count);
+        virtual Timing timing() const;
         virtual void release();
 
         /**
@@ -181,7 +211,21 @@ class Receiver {
 
       private:
         /// Define the maximum number of packets that a message can hold.
-        static const int MAX_MESSAGE_PACKETS = 1024;
+        static const int MAX_MESSAGE_PACKETS = Receiver::MAX_MESSAGE_PACKETS;
+
+        /**
+         * Points in the life of the message recorded in timestamps; see
+         * InMessage::Timing.
+         */
+        enum TimingPoint {
+            FIRST_PACKET_RECEIVED,
+            FIRST_GRANT_SENT,
+            LAST_GRANT_SENT,
+            FIRST_RESEND_SENT,
+            LAST_PACKET_RECEIVED,
+            DELIVERED,
+            NUM_TIMING_POINTS,
+        };
 
         Driver::Packet* getPacket(size_t index) const;
         bool setPacket(size_t index, Driver::Packet* packet);
@@ -199,6 +243,9 @@ class Receiver {
         /// Contains source address this message.
         const SocketAddress source;
 
+        /// Port to which this message was sent.
+        const uint16_t destinationPort;
+
         /// Number of bytes at the beginning of each Packet that should be
         /// reserved for the Homa transport header.
         const int TRANSPORT_HEADER_LENGTH;
@@ -245,6 +292,10 @@ class Receiver {
         /// message when it has been completely received.
         Intrusive::List<Message>::Node receivedMessageNode;
 
+        /// Intrusive structure used by the Receiver to keep track of this
+        /// message in the list of received messages sent to its port.
+        Intrusive::List<Message>::Node receivedPortNode;
+
         /// Intrusive structure used by the Receiver to keep track when the
         /// receiving of this message should be considered failed.
         Timeout<Message> messageTimeout;
@@ -258,6 +309,13 @@ class Receiver {
         /// Access to this structure is protected by Receiver::schedulerMutex.
         ScheduledMessageInfo scheduledMessageInfo;
 
+        /// This message's count (1 or 0) in its peer's active_messages
+        /// statistic.  Protected by the associated MessageBucket::mutex.
+        Perf::PeerTable::Share activeCount;
+
+        /// Times at which this message passed the points in TimingPoint.
+        Perf::Timestamps<NUM_TIMING_POINTS> timestamps;
+
         friend class Receiver;
     };
 
@@ -278,13 +336,17 @@ class Receiver {
          *      Number of cycles of inactivity to wait between requesting
          *      retransmission of un-received parts of a Message.
          *      liveness of a Message.
+         * @param nextTimeout
+         *      Deadline shared by all buckets; lowered whenever a timeout in
+         *      this bucket is scheduled to elapse before it.
          */
-        explicit MessageBucket(uint64_t messageTimeoutCycles,
-                               uint64_t resendIntervalCycles)
-            : mutex()
+        MessageBucket(uint64_t messageTimeoutCycles,
+                      uint64_t resendIntervalCycles,
+                      std::atomic<uint64_t>* nextTimeout)
+            : mutex("Receiver::MessageBucket::mutex")
             , messages()
-            , messageTimeouts(messageTimeoutCycles)
-            , resendTimeouts(resendIntervalCycles)
+            , messageTimeouts(messageTimeoutCycles, nextTimeout)
+            , resendTimeouts(resendIntervalCycles, nextTimeout)
         {}
 
         /**
@@ -357,14 +419,17 @@ class Receiver {
          *      Number of cycles of inactivity to wait between requesting
          *      retransmission of un-received parts of a Message.
          *      liveness of a Message.
+         * @param nextTimeout
+         *      Deadline shared by all buckets; see MessageBucket().
          */
         static std::array<MessageBucket*, NUM_BUCKETS> makeBuckets(
-            uint64_t messageTimeoutCycles, uint64_t resendIntervalCycles)
+            uint64_t messageTimeoutCycles, uint64_t resendIntervalCycles,
+            std::atomic<uint64_t>* nextTimeout)
         {
             std::array<MessageBucket*, NUM_BUCKETS> buckets;
             for (int i = 0; i < NUM_BUCKETS; ++i) {
-                buckets[i] = new MessageBucket(messageTimeoutCycles,
-                                               resendIntervalCycles);
+                buckets[i] = new MessageBucket(
+                    messageTimeoutCycles, resendIntervalCycles, nextTimeout);
             }
             return buckets;
         }
@@ -379,10 +444,14 @@ class Receiver {
          *      Number of cycles of inactivity to wait between requesting
          *      retransmission of un-received parts of a Message.
          *      liveness of a Message.
+         * @param nextTimeout
+         *      Deadline shared by all buckets; see MessageBucket().
          */
-        explicit MessageBucketMap(uint64_t messageTimeoutCycles,
-                                  uint64_t resendIntervalCycles)
-            : buckets(makeBuckets(messageTimeoutCycles, resendIntervalCycles))
+        MessageBucketMap(uint64_t messageTimeoutCycles,
+                         uint64_t resendIntervalCycles,
+                         std::atomic<uint64_t>* nextTimeout)
+            : buckets(makeBuckets(messageTimeoutCycles, resendIntervalCycles,
+                                  nextTimeout))
             , hasher()
         {}
 
@@ -454,13 +523,24 @@ class Receiver {
         Intrusive::List<Peer>::Node scheduledPeerNode;
     };
 
+    /// Lock type of the schedulerMutex.  Every poller that sends grants
+    /// contends for it, so it is a fair TicketLock.
+    using SchedulerMutex = TicketLock;
+
     void dropMessage(Receiver::Message* message);
+    bool findPeerTransportId(IpAddress sourceIp, uint64_t* peerTransportId);
+    void recordPeerTransportId(IpAddress sourceIp, uint64_t peerTransportId);
     void checkMessageTimeouts(uint64_t now, MessageBucket* bucket);
     void checkResendTimeouts(uint64_t now, MessageBucket* bucket);
-    void trySendGrants();
-    void schedule(Message* message, const SpinLock::Lock& lock);
-    void unschedule(Message* message, const SpinLock::Lock& lock);
-    void updateSchedule(Message* message, const SpinLock::Lock& lock);
+    bool trySendGrants();
+    void schedule(Message* message, const SchedulerMutex::Lock& lock);
+    void unschedule(Message* message, const SchedulerMutex::Lock& lock);
+    void updateSchedule(Message* message, const SchedulerMutex::Lock& lock);
+    void updateOutstandingGrant(Message* message,
+                                const SchedulerMutex::Lock& lock);
+
+    /// Identifier of the Transport that owns this Receiver.
+    const uint64_t transportId;
 
     /// Driver with which all packets will be sent and received.  This driver
     /// is chosen by the Transport that owns this Sender.
@@ -469,12 +549,15 @@ class Receiver {
     /// Provider of network packet priority and grant policy decisions.
     Policy::Manager* const policyManager;
 
+    /// Performance counters of the Transport that owns this Receiver.
+    Perf::TransportCounters* const perf;
+
     /// Tracks the set of inbound messages being received by this Receiver.
     MessageBucketMap messageBuckets;
 
     /// Protects access to the Receiver's scheduler state (i.e. peerTable,
     /// scheduledPeers, and ScheduledMessageInfo).
-    SpinLock schedulerMutex;
+    SchedulerMutex schedulerMutex;
 
     /// Collection of all peers; used for fast access.  Access is protected by
     /// the schedulerMutex.
@@ -486,10 +569,18 @@ class Receiver {
 
     /// Message objects to be processed by the transport.
     struct {
-        /// Protects the receivedMessage.queue
-        SpinLock mutex;
+        /// Protects the receivedMessage.queue, receivedMessages.ports, and
+        /// receivedMessages.responses
+        SpinLock mutex{"Receiver::receivedMessages.mutex"};
         /// List of completely received messages.
         Intrusive::List<Message> queue;
+        /// Completely received messages by destination port.  Each message in
+        /// the queue is also in the list of its port, so messages can be
+        /// taken in arrival order either from any port or from one port.
+        std::unordered_map<uint16_t, Intrusive::List<Message>> ports;
+        /// List of completely received responses to requests sent by this
+        /// transport.
+        Intrusive::List<Message> responses;
     } receivedMessages;
 
     /// True if the Receiver is executing trySendGrants(); false, otherwise.
@@ -497,19 +588,51 @@ class Receiver {
     /// each other.
     std::atomic_flag granting = ATOMIC_FLAG_INIT;
 
-    /// The index of the next bucket in the messageBuckets::buckets array to
-    /// process in the poll loop. The index is held in the lower order bits of
-    /// this variable; the higher order bits should be masked off using the
-    /// MessageBucketMap::HASH_KEY_MASK bit mask.
-    std::atomic<uint> nextBucketIndex;
+    /// Earliest cycle time at which any timeout in the messageBuckets might
+    /// elapse; lets checkTimeouts() return in O(1) when nothing is due.  It
+    /// may be earlier than any scheduled timeout (e.g. after cancellations),
+    /// but never later.
+    std::atomic<uint64_t> nextTimeout;
+
+    /// True if a thread is sweeping the messageBuckets in checkTimeouts();
+    /// false, otherwise.  Used to prevent concurrent sweeps from raising
+    /// nextTimeout past each other's unprocessed buckets.
+    std::atomic_flag sweeping = ATOMIC_FLAG_INIT;
 
     /// Used to allocate Message objects.
     struct {
         /// Protects the messageAllocator.pool
-        SpinLock mutex;
+        SpinLock mutex{"Receiver::messageAllocator.mutex"};
         /// Pool from which Message objects can be allocated.
         ObjectPool<Message> pool;
     } messageAllocator;
+
+    /// Maximum number of peers whose transport identifiers are remembered in
+    /// peerTransportIds.
+    static const size_t MAX_PEER_TRANSPORT_IDS = 4096;
+
+    /// Transport identifier of a peer, as remembered in peerTransportIds.
+    struct PeerTransportId {
+        /// The peer's transportId.
+        uint64_t transportId;
+        /// The peer's position in peerTransportIds.lru.
+        std::list<IpAddress>::iterator lruNode;
+    };
+
+    /// Transport identifiers of the peers that have sent full DATA packets;
+    /// used to identify the messages of compact DATA packets.  At most
+    /// MAX_PEER_TRANSPORT_IDS peers are remembered; once full, the least
+    /// recently active peer is forgotten to make room, and its compact
+    /// packets are dropped until it falls back to full headers (see
+    /// Sender::handleUnknownPacket()).
+    struct {
+        /// Protects the peerTransportIds.map and peerTransportIds.lru
+        SpinLock mutex{"Receiver::peerTransportIds.mutex"};
+        /// Maps a peer's address to its transportId.
+        std::unordered_map<IpAddress, PeerTransportId, IpAddress::Hasher> map;
+        /// Addresses of the peers in the map, most recently active first.
+        std::list<IpAddress> lru;
+    } peerTransportIds;
 };
 
 }  // namespace Core
@@ -21,6 +21,7 @@
 
 #include "Mock/MockDriver.h"
 #include "Mock/MockPolicy.h"
+#include "Perf.h"
 #include "Receiver.h"
 #include "TransportImpl.h"
 
@@ -51,6 +52,7 @@ class ReceiverTest : public ::testing::Test {
         , mockPacket{&payload}
         , mockPolicyManager(&mockDriver)
         , payload()
+        , perf()
         , receiver()
         , savedLogPolicy(Debug::getLogPolicy())
     {
@@ -58,7 +60,7 @@ class ReceiverTest : public ::testing::Test {
         ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1027));
         Debug::setLogPolicy(
             Debug::logPolicyFromString("src/ObjectPool@SILENT"));
-        receiver = new Receiver(&mockDriver, &mockPolicyManager,
+        receiver = new Receiver(22, &mockDriver, &mockPolicyManager, &perf,
                                 messageTimeoutCycles, resendIntervalCycles);
         PerfUtils::Cycles::mockTscValue = 10000;
     }
@@ -78,6 +80,7 @@ class ReceiverTest : public ::testing::Test {
     Homa::Mock::MockDriver::MockPacket mockPacket;
     NiceMock<Homa::Mock::MockPolicyManager> mockPolicyManager;
     char payload[1028];
+    Perf::TransportCounters perf;
     Receiver* receiver;
     std::vector<std::pair<std::string, std::string>> savedLogPolicy;
 };
@@ -109,6 +112,7 @@ TEST_F(ReceiverTest, handleDataPacket)
         static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
     header->common.opcode = Protocol::Packet::DATA;
     header->common.messageId = id;
+    header->common.prefix.dport = htobe16(60001);
     header->totalLength = totalMessageLength;
     header->policyVersion = policyVersion;
     header->unscheduledIndexLimit = 1;
@@ -138,6 +142,7 @@ TEST_F(ReceiverTest, handleDataPacket)
     EXPECT_EQ(totalMessageLength, message->messageLength);
     EXPECT_EQ(4U, message->numExpectedPackets);
     EXPECT_EQ(Receiver::Message::State::IN_PROGRESS, message->state);
+    EXPECT_EQ(42U, receiver->peerTransportIds.map.at(sourceIp).transportId);
     ASSERT_TRUE(message->scheduled);
     info = &message->scheduledMessageInfo;
     EXPECT_NE(nullptr, info->peer);
@@ -206,6 +211,7 @@ TEST_F(ReceiverTest, handleDataPacket)
     EXPECT_EQ(0U, info->bytesRemaining);
     EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
     EXPECT_EQ(message, &receiver->receivedMessages.queue.back());
+    EXPECT_EQ(message, &receiver->receivedMessages.ports[60001].back());
     Mock::VerifyAndClearExpectations(&mockDriver);
 
     // -------------------------------------------------------------------------
@@ -224,7 +230,7 @@ TEST_F(ReceiverTest, handleBusyPacket_basic)
 {
     Protocol::MessageId id(42, 32);
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{0, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{0, 60001}, 0, 0);
     Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
     bucket->messages.push_back(&message->bucketNode);
 
@@ -241,6 +247,240 @@ TEST_F(ReceiverTest, handleBusyPacket_basic)
     EXPECT_EQ(10100U, message->resendTimeout.expirationCycleTime);
 }
 
+TEST_F(ReceiverTest, handleDataPacket_invalidIndex)
+{
+    Protocol::MessageId id(42, 33);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA;
+    header->common.messageId = id;
+    header->totalLength = 3500;
+    header->policyVersion = 1;
+    header->unscheduledIndexLimit = 1;
+    header->index = 4;
+    mockPacket.length = sizeof(Protocol::Packet::DataHeader) + 1000;
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    receiver->handleDataPacket(&mockPacket, IpAddress{22});
+
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+    SpinLock::Lock lock_bucket(bucket->mutex);
+    Receiver::Message* message = bucket->findMessage(id, lock_bucket);
+    ASSERT_NE(nullptr, message);
+    EXPECT_EQ(4, message->numExpectedPackets);
+    EXPECT_EQ(0, message->numPackets);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_response)
+{
+    // The message carries this receiver's transport id.
+    Protocol::MessageId id(22, 33);
+    IpAddress sourceIp{42};
+    new (mockPacket.payload)
+        Protocol::Packet::DataHeader(60001, 60002, id, 100, 1, 1, 0);
+    mockPacket.length = sizeof(Protocol::Packet::DataHeader) + 100;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_TRUE(receiver->receivedMessages.queue.empty());
+    EXPECT_EQ(0U, receiver->peerTransportIds.map.count(sourceIp));
+    EXPECT_EQ(nullptr, receiver->receiveMessage());
+
+    Protocol::MessageId requestId;
+    Homa::InMessage* response = receiver->receiveResponse(&requestId);
+    ASSERT_NE(nullptr, response);
+    EXPECT_EQ(id, requestId);
+    EXPECT_EQ(100U, response->length());
+    EXPECT_EQ(nullptr, receiver->receiveResponse(&requestId));
+}
+
+TEST_F(ReceiverTest, handleDataPacket_peerTransportIdsFull)
+{
+    const size_t MAX_PEERS = Receiver::MAX_PEER_TRANSPORT_IDS;
+    for (uint32_t i = 0; i < MAX_PEERS; ++i) {
+        receiver->recordPeerTransportId(IpAddress{1000 + i}, i);
+    }
+    // The oldest peer sends a compact packet, so the next oldest is the least
+    // recently active.
+    uint64_t peerTransportId;
+    EXPECT_TRUE(
+        receiver->findPeerTransportId(IpAddress{1000}, &peerTransportId));
+    EXPECT_EQ(0U, peerTransportId);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    new (header) Protocol::Packet::DataHeader(60002, 60001, {42, 33}, 100, 1,
+                                              1, 0);
+    mockPacket.length = sizeof(Protocol::Packet::DataHeader) + 100;
+    IpAddress sourceIp{22};
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    // The least recently active peer is forgotten to make room for the new
+    // one.
+    EXPECT_EQ(MAX_PEERS, receiver->peerTransportIds.map.size());
+    EXPECT_EQ(MAX_PEERS, receiver->peerTransportIds.lru.size());
+    EXPECT_EQ(0U, receiver->peerTransportIds.map.count(IpAddress{1001}));
+    EXPECT_EQ(1U, receiver->peerTransportIds.map.count(IpAddress{1000}));
+    EXPECT_EQ(sourceIp, receiver->peerTransportIds.lru.front());
+    EXPECT_EQ(42U, receiver->peerTransportIds.map.at(sourceIp).transportId);
+
+    // Known peers don't displace others.
+    new (header) Protocol::Packet::DataHeader(60002, 60001, {42, 34}, 100, 1,
+                                              1, 0);
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+    EXPECT_EQ(MAX_PEERS, receiver->peerTransportIds.map.size());
+}
+
+TEST_F(ReceiverTest, handleDataPacket_compact)
+{
+    IpAddress sourceIp{22};
+    receiver->recordPeerTransportId(sourceIp, 42);
+    new (mockPacket.payload)
+        Protocol::Packet::CompactDataHeader(60001, 60002, 33, 100, 1);
+    mockPacket.length = sizeof(Protocol::Packet::CompactDataHeader) + 100;
+
+    EXPECT_CALL(mockPolicyManager, signalNewMessage(Eq(sourceIp), Eq(1),
+                                                    Eq(100)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(_, _)).Times(0);
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    Protocol::MessageId id(42, 33);
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+    SpinLock::Lock lock_bucket(bucket->mutex);
+    Receiver::Message* message = bucket->findMessage(id, lock_bucket);
+    ASSERT_NE(nullptr, message);
+    EXPECT_EQ(60001, message->source.port);
+    EXPECT_EQ(100, message->messageLength);
+    EXPECT_EQ(sizeof(Protocol::Packet::CompactDataHeader),
+              message->TRANSPORT_HEADER_LENGTH);
+    EXPECT_EQ(1, message->numPackets);
+    EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_compactPadded)
+{
+    // Short frames may be padded (e.g. to the Ethernet minimum); the message
+    // length comes from the header, not the packet length.
+    IpAddress sourceIp{22};
+    receiver->recordPeerTransportId(sourceIp, 42);
+    new (mockPacket.payload)
+        Protocol::Packet::CompactDataHeader(60001, 60002, 33, 5, 1);
+    mockPacket.length = 60;
+
+    EXPECT_CALL(mockPolicyManager, signalNewMessage(Eq(sourceIp), Eq(1),
+                                                    Eq(5)))
+        .Times(1);
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    Protocol::MessageId id(42, 33);
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+    SpinLock::Lock lock_bucket(bucket->mutex);
+    Receiver::Message* message = bucket->findMessage(id, lock_bucket);
+    ASSERT_NE(nullptr, message);
+    EXPECT_EQ(5, message->messageLength);
+    EXPECT_EQ(5U, message->length());
+    EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_compactTruncated)
+{
+    IpAddress sourceIp{22};
+    receiver->recordPeerTransportId(sourceIp, 42);
+    new (mockPacket.payload)
+        Protocol::Packet::CompactDataHeader(60001, 60002, 33, 100, 1);
+    mockPacket.length = sizeof(Protocol::Packet::CompactDataHeader) + 99;
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+    Perf::Stats before;
+    perf.getStats(&before);
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    Protocol::MessageId id(42, 33);
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+    SpinLock::Lock lock_bucket(bucket->mutex);
+    EXPECT_EQ(nullptr, bucket->findMessage(id, lock_bucket));
+    Perf::Stats after;
+    perf.getStats(&after);
+    EXPECT_EQ(1U, after.rx_malformed_pkts - before.rx_malformed_pkts);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_compactUnknownPeer)
+{
+    new (mockPacket.payload)
+        Protocol::Packet::CompactDataHeader(60001, 60002, 33, 100, 1);
+    mockPacket.length = sizeof(Protocol::Packet::CompactDataHeader) + 100;
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    receiver->handleDataPacket(&mockPacket, IpAddress{22});
+
+    Protocol::MessageId id(42, 33);
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+    SpinLock::Lock lock_bucket(bucket->mutex);
+    EXPECT_EQ(nullptr, bucket->findMessage(id, lock_bucket));
+}
+
+TEST_F(ReceiverTest, handleBundlePacket)
+{
+    IpAddress sourceIp{22};
+    char* cursor = static_cast<char*>(mockPacket.payload);
+    Protocol::Packet::BundleHeader* header =
+        new (cursor) Protocol::Packet::BundleHeader();
+    header->numMessages = 3;
+    cursor += sizeof(Protocol::Packet::BundleHeader);
+    for (uint64_t sequence = 1; sequence <= 2; ++sequence) {
+        new (cursor) Protocol::Packet::DataHeader(
+            60001, 60002, Protocol::MessageId(42, sequence), 10, 1, 1, 0);
+        cursor += sizeof(Protocol::Packet::DataHeader) + 10;
+    }
+    // The third message is truncated.
+    new (cursor) Protocol::Packet::DataHeader(
+        60001, 60002, Protocol::MessageId(42, 3), 10, 1, 1, 0);
+    cursor += sizeof(Protocol::Packet::DataHeader) + 5;
+    mockPacket.length = cursor - static_cast<char*>(mockPacket.payload);
+
+    char payloads[2][1028];
+    Homa::Mock::MockDriver::MockPacket packets[2] = {{payloads[0]},
+                                                     {payloads[1]}};
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packets[0]))
+        .WillOnce(Return(&packets[1]));
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+    Perf::Stats before;
+    perf.getStats(&before);
+
+    receiver->handleBundlePacket(&mockPacket, sourceIp);
+
+    for (uint64_t sequence = 1; sequence <= 3; ++sequence) {
+        Protocol::MessageId id(42, sequence);
+        Receiver::MessageBucket* bucket =
+            receiver->messageBuckets.getBucket(id);
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        Receiver::Message* message = bucket->findMessage(id, lock_bucket);
+        if (sequence == 3) {
+            EXPECT_EQ(nullptr, message);
+            continue;
+        }
+        ASSERT_NE(nullptr, message);
+        EXPECT_EQ(10, message->messageLength);
+        EXPECT_EQ(&packets[sequence - 1], message->getPacket(0));
+        EXPECT_EQ(sizeof(Protocol::Packet::DataHeader) + 10,
+                  packets[sequence - 1].length);
+    }
+    Perf::Stats after;
+    perf.getStats(&after);
+    EXPECT_EQ(1U, after.rx_malformed_pkts - before.rx_malformed_pkts);
+}
+
 TEST_F(ReceiverTest, handleBusyPacket_unknown)
 {
     Protocol::MessageId id(42, 32);
@@ -260,7 +500,8 @@ TEST_F(ReceiverTest, handlePingPacket_basic)
     Protocol::MessageId id(42, 32);
     IpAddress mockAddress{22};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 20000, id, SocketAddress{mockAddress, 0}, 0);
+        receiver, &mockDriver, 0, 20000, id, SocketAddress{mockAddress, 0}, 0,
+        0);
     ASSERT_TRUE(message->scheduled);
     Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
     info->bytesGranted = 500;
@@ -328,47 +569,205 @@ TEST_F(ReceiverTest, receiveMessage)
 {
     Receiver::Message* msg0 = receiver->messageAllocator.pool.construct(
         receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
-        SocketAddress{22, 60001}, 0);
+        SocketAddress{22, 60001}, 0, 0);
     Receiver::Message* msg1 = receiver->messageAllocator.pool.construct(
         receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
-        SocketAddress{22, 60001}, 0);
+        SocketAddress{22, 60001}, 0, 0);
 
     receiver->receivedMessages.queue.push_back(&msg0->receivedMessageNode);
+    receiver->receivedMessages.ports[0].push_back(&msg0->receivedPortNode);
     receiver->receivedMessages.queue.push_back(&msg1->receivedMessageNode);
+    receiver->receivedMessages.ports[0].push_back(&msg1->receivedPortNode);
     EXPECT_FALSE(receiver->receivedMessages.queue.empty());
 
     EXPECT_EQ(msg0, receiver->receiveMessage());
     EXPECT_FALSE(receiver->receivedMessages.queue.empty());
+    EXPECT_EQ(1U, receiver->receivedMessages.ports[0].size());
 
     EXPECT_EQ(msg1, receiver->receiveMessage());
     EXPECT_TRUE(receiver->receivedMessages.queue.empty());
+    EXPECT_TRUE(receiver->receivedMessages.ports[0].empty());
 
     EXPECT_EQ(nullptr, receiver->receiveMessage());
     EXPECT_TRUE(receiver->receivedMessages.queue.empty());
 }
 
+TEST_F(ReceiverTest, receiveMessages)
+{
+    Receiver::Message* msg[3];
+    for (uint64_t i = 0; i < 3; ++i) {
+        msg[i] = receiver->messageAllocator.pool.construct(
+            receiver, &mockDriver, 0, 0, Protocol::MessageId(42, i),
+            SocketAddress{22, 60001}, 80, 0);
+        receiver->receivedMessages.queue.push_back(
+            &msg[i]->receivedMessageNode);
+        receiver->receivedMessages.ports[80].push_back(
+            &msg[i]->receivedPortNode);
+    }
+    Homa::InMessage* messages[4];
+
+    EXPECT_EQ(2U, receiver->receiveMessages(messages, 2));
+    EXPECT_EQ(msg[0], messages[0]);
+    EXPECT_EQ(msg[1], messages[1]);
+    EXPECT_EQ(1U, receiver->receivedMessages.ports[80].size());
+
+    EXPECT_EQ(1U, receiver->receiveMessages(messages, 4));
+    EXPECT_EQ(msg[2], messages[0]);
+    EXPECT_TRUE(receiver->receivedMessages.queue.empty());
+    EXPECT_TRUE(receiver->receivedMessages.ports[80].empty());
+
+    EXPECT_EQ(0U, receiver->receiveMessages(messages, 4));
+}
+
+TEST_F(ReceiverTest, receiveMessage_port)
+{
+    Receiver::Message* msg0 = receiver->messageAllocator.pool.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
+        SocketAddress{22, 60001}, 80, 0);
+    Receiver::Message* msg1 = receiver->messageAllocator.pool.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 1),
+        SocketAddress{22, 60001}, 81, 0);
+
+    receiver->receivedMessages.queue.push_back(&msg0->receivedMessageNode);
+    receiver->receivedMessages.ports[80].push_back(&msg0->receivedPortNode);
+    receiver->receivedMessages.queue.push_back(&msg1->receivedMessageNode);
+    receiver->receivedMessages.ports[81].push_back(&msg1->receivedPortNode);
+
+    EXPECT_EQ(nullptr, receiver->receiveMessage(82));
+
+    EXPECT_EQ(msg1, receiver->receiveMessage(81));
+    EXPECT_EQ(1U, receiver->receivedMessages.queue.size());
+    EXPECT_EQ(nullptr, receiver->receiveMessage(81));
+
+    EXPECT_EQ(msg0, receiver->receiveMessage());
+    EXPECT_TRUE(receiver->receivedMessages.ports[80].empty());
+    EXPECT_EQ(nullptr, receiver->receiveMessage(80));
+}
+
+TEST_F(ReceiverTest, takePackets)
+{
+    // 1027 - 31 bytes of data per packet; 2 packets.
+    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 1500,
+        Protocol::MessageId(42, 1), SocketAddress{22, 60001}, 0, 2);
+    Driver::Packet* packet0 = (Driver::Packet*)41;
+    Driver::Packet* packet1 = (Driver::Packet*)42;
+    message->setPacket(0, packet0);
+    message->setPacket(1, packet1);
+    message->strip(20);
+
+    Driver::Packet* packets[Receiver::MAX_MESSAGE_PACKETS];
+    int headroom = 0;
+    EXPECT_EQ(2, receiver->takePackets(message, packets, &headroom));
+
+    EXPECT_EQ(packet0, packets[0]);
+    EXPECT_EQ(packet1, packets[1]);
+    EXPECT_EQ(20, headroom);
+    EXPECT_EQ(0U, message->length());
+    EXPECT_EQ(0, message->numPackets);
+    // Duplicates are still recognized.
+    EXPECT_FALSE(message->setPacket(1, packet1));
+
+    EXPECT_CALL(mockDriver, releasePackets).Times(0);
+    receiver->messageAllocator.pool.destroy(message);
+}
+
+TEST_F(ReceiverTest, takePackets_compact)
+{
+    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::CompactDataHeader),
+        100, Protocol::MessageId(42, 1), SocketAddress{22, 60001}, 0, 1);
+    message->setPacket(0, &mockPacket);
+    message->strip(10);
+
+    Driver::Packet* packets[Receiver::MAX_MESSAGE_PACKETS];
+    int headroom = 0;
+    EXPECT_EQ(0, receiver->takePackets(message, packets, &headroom));
+
+    EXPECT_EQ(10, headroom);
+    EXPECT_EQ(90U, message->length());
+    EXPECT_EQ(1, message->numPackets);
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+    receiver->messageAllocator.pool.destroy(message);
+}
+
+TEST_F(ReceiverTest, getMessageSource)
+{
+    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 7),
+        SocketAddress{23, 60001}, 0, 0);
+    Protocol::MessageId id;
+    SocketAddress source;
+
+    receiver->getMessageSource(message, &id, &source);
+
+    EXPECT_EQ(Protocol::MessageId(42, 7), id);
+    EXPECT_EQ(IpAddress{23}, source.ip);
+    EXPECT_EQ(60001, source.port);
+}
+
 TEST_F(ReceiverTest, poll)
 {
     // Nothing to test
     receiver->poll();
 }
 
+TEST_F(ReceiverTest, pollGrants)
+{
+    // Nothing scheduled.
+    EXPECT_FALSE(receiver->pollGrants());
+
+    // Another poller is granting.
+    receiver->granting.test_and_set();
+    EXPECT_TRUE(receiver->pollGrants());
+    receiver->granting.clear();
+}
+
 TEST_F(ReceiverTest, checkTimeouts)
 {
-    Receiver::MessageBucket* bucket = receiver->messageBuckets.buckets.at(0);
+    Receiver::Message* message[2];
+    Receiver::MessageBucket* bucket[2];
+    for (uint64_t i = 0; i < 2; ++i) {
+        Protocol::MessageId id = {42, 10 + i};
+        bucket[i] = receiver->messageBuckets.buckets.at(i);
+        message[i] = receiver->messageAllocator.pool.construct(
+            receiver, &mockDriver, 0, 10000, id, SocketAddress{22, 60001}, 0,
+            5);
+        // Blocked on grants; a resend timeout only reschedules itself.
+        message[i]->scheduledMessageInfo.bytesGranted = 6000;
+        message[i]->scheduledMessageInfo.bytesRemaining = 4000;
+    }
+    EXPECT_EQ(UINT64_MAX, receiver->nextTimeout.load());
+
+    bucket[0]->resendTimeouts.setTimeout(&message[0]->resendTimeout);
+    PerfUtils::Cycles::mockTscValue = 10050;
+    bucket[1]->resendTimeouts.setTimeout(&message[1]->resendTimeout);
+    EXPECT_EQ(10100U, receiver->nextTimeout.load());
 
-    EXPECT_EQ(0, receiver->nextBucketIndex.load());
+    // Nothing due yet.
+    receiver->checkTimeouts();
+    EXPECT_EQ(10100U, message[0]->resendTimeout.expirationCycleTime);
+    EXPECT_EQ(10100U, receiver->nextTimeout.load());
 
+    // Every due timeout is processed, whichever bucket it is in.
+    PerfUtils::Cycles::mockTscValue = 10150;
     receiver->checkTimeouts();
+    EXPECT_EQ(10250U, message[0]->resendTimeout.expirationCycleTime);
+    EXPECT_EQ(10250U, message[1]->resendTimeout.expirationCycleTime);
+    EXPECT_EQ(10250U, receiver->nextTimeout.load());
 
-    EXPECT_EQ(1, receiver->nextBucketIndex.load());
+    for (uint64_t i = 0; i < 2; ++i) {
+        bucket[i]->resendTimeouts.cancelTimeout(&message[i]->resendTimeout);
+    }
 }
 
 TEST_F(ReceiverTest, Message_destructor_basic)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
 
     const uint16_t NUM_PKTS = 5;
 
@@ -387,7 +786,7 @@ TEST_F(ReceiverTest, Message_destructor_holes)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
 
     const uint16_t NUM_PKTS = 4;
 
@@ -409,7 +808,7 @@ TEST_F(ReceiverTest, Message_acknowledge)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
 
     EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
     EXPECT_CALL(mockDriver,
@@ -423,6 +822,7 @@ TEST_F(ReceiverTest, Message_acknowledge)
     Protocol::Packet::CommonHeader* header =
         static_cast<Protocol::Packet::CommonHeader*>(mockPacket.payload);
     EXPECT_EQ(Protocol::Packet::DONE, header->opcode);
+    EXPECT_EQ(Protocol::Packet::COMPACT_VERSION, header->prefix.version);
     EXPECT_EQ(id, header->messageId);
     EXPECT_EQ(sizeof(Protocol::Packet::DoneHeader), mockPacket.length);
 }
@@ -431,7 +831,7 @@ TEST_F(ReceiverTest, Message_dropped)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
 
     message->state = Receiver::Message::State::IN_PROGRESS;
 
@@ -446,7 +846,7 @@ TEST_F(ReceiverTest, Message_fail)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
 
     EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
     EXPECT_CALL(mockDriver,
@@ -469,7 +869,8 @@ TEST_F(ReceiverTest, Message_get_basic)
     ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0,
+        0);
     char buf[4096];
     Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
     Homa::Mock::MockDriver::MockPacket packet1{buf + 2048};
@@ -496,7 +897,8 @@ TEST_F(ReceiverTest, Message_get_offsetTooLarge)
     ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0,
+        0);
     char buf[4096];
     Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
     Homa::Mock::MockDriver::MockPacket packet1{buf + 2048};
@@ -522,7 +924,8 @@ TEST_F(ReceiverTest, Message_get_missingPacket)
     ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0,
+        0);
     char buf[4096];
     Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
     Homa::Mock::MockDriver::MockPacket packet1{buf + 2048};
@@ -554,7 +957,7 @@ TEST_F(ReceiverTest, Message_length)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
     message->messageLength = 200;
     message->start = 20;
     EXPECT_EQ(180U, message->length());
@@ -564,7 +967,7 @@ TEST_F(ReceiverTest, Message_strip)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
     message->messageLength = 30;
     message->start = 0;
 
@@ -577,6 +980,31 @@ TEST_F(ReceiverTest, Message_strip)
     EXPECT_EQ(30U, message->start);
 }
 
+TEST_F(ReceiverTest, Message_timing)
+{
+    Protocol::MessageId id = {42, 32};
+    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
+    for (int i = 0; i < Receiver::Message::NUM_TIMING_POINTS; ++i) {
+        PerfUtils::Cycles::mockTscValue = 10000 + i;
+        message->timestamps.record(i);
+    }
+
+    InMessage::Timing timing = message->timing();
+
+#if HOMA_MESSAGE_TIMING
+    EXPECT_EQ(10000U, timing.firstPacketReceived);
+    EXPECT_EQ(10001U, timing.firstGrantSent);
+    EXPECT_EQ(10002U, timing.lastGrantSent);
+    EXPECT_EQ(10003U, timing.firstResendSent);
+    EXPECT_EQ(10004U, timing.lastPacketReceived);
+    EXPECT_EQ(10005U, timing.delivered);
+#else
+    EXPECT_EQ(0U, timing.firstPacketReceived);
+    EXPECT_EQ(0U, timing.delivered);
+#endif
+}
+
 TEST_F(ReceiverTest, Message_release)
 {
     // Nothing to test
@@ -586,7 +1014,7 @@ TEST_F(ReceiverTest, Message_getPacket)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
 
     Driver::Packet* packet = (Driver::Packet*)42;
     message->packets[0] = packet;
@@ -602,7 +1030,7 @@ TEST_F(ReceiverTest, Message_setPacket)
 {
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0, 0);
     Driver::Packet* packet = (Driver::Packet*)42;
 
     EXPECT_FALSE(message->occupied.test(0));
@@ -624,11 +1052,11 @@ TEST_F(ReceiverTest, MessageBucket_findMessage)
     Protocol::MessageId id0 = {42, 0};
     Receiver::Message* msg0 = receiver->messageAllocator.pool.construct(
         receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 0, id0,
-        SocketAddress{0, 60001}, 0);
+        SocketAddress{0, 60001}, 0, 0);
     Protocol::MessageId id1 = {42, 1};
     Receiver::Message* msg1 = receiver->messageAllocator.pool.construct(
         receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 0, id1,
-        SocketAddress{0, 60001}, 0);
+        SocketAddress{0, 60001}, 0, 0);
     Protocol::MessageId id_none = {42, 42};
 
     bucket->messages.push_back(&msg0->bucketNode);
@@ -656,12 +1084,16 @@ TEST_F(ReceiverTest, dropMessage)
     SpinLock::Lock dummy(dummyMutex);
     Protocol::MessageId id = {42, 32};
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 1000, id, SocketAddress{22, 60001}, 0);
+        receiver, &mockDriver, 0, 1000, id, SocketAddress{22, 60001}, 0, 0);
     ASSERT_TRUE(message->scheduled);
     Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
 
     bucket->messages.push_back(&message->bucketNode);
-    receiver->schedule(message, dummy);
+    {
+        Receiver::SchedulerMutex::Lock lock_scheduler(
+            receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
     bucket->messageTimeouts.setTimeout(&message->messageTimeout);
     bucket->resendTimeouts.setTimeout(&message->resendTimeout);
 
@@ -690,7 +1122,7 @@ TEST_F(ReceiverTest, checkMessageTimeouts)
         Protocol::MessageId id = {42, 10 + i};
         op[i] = reinterpret_cast<void*>(i);
         message[i] = receiver->messageAllocator.pool.construct(
-            receiver, &mockDriver, 0, 1000, id, SocketAddress{0, 60001}, 0);
+            receiver, &mockDriver, 0, 1000, id, SocketAddress{0, 60001}, 0, 0);
         bucket->messages.push_back(&message[i]->bucketNode);
         bucket->messageTimeouts.setTimeout(&message[i]->messageTimeout);
         bucket->resendTimeouts.setTimeout(&message[i]->resendTimeout);
@@ -702,7 +1134,7 @@ TEST_F(ReceiverTest, checkMessageTimeouts)
     ASSERT_EQ(Receiver::Message::State::IN_PROGRESS, message[0]->state.load());
     ASSERT_TRUE(message[0]->scheduled);
     {
-        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        Receiver::SchedulerMutex::Lock lock_scheduler(receiver->schedulerMutex);
         receiver->schedule(message[0], lock_scheduler);
     }
 
@@ -755,7 +1187,8 @@ TEST_F(ReceiverTest, checkResendTimeouts)
     for (uint64_t i = 0; i < 3; ++i) {
         Protocol::MessageId id = {42, 10 + i};
         message[i] = receiver->messageAllocator.pool.construct(
-            receiver, &mockDriver, 0, 10000, id, SocketAddress{22, 60001}, 5);
+            receiver, &mockDriver, 0, 10000, id, SocketAddress{22, 60001}, 0,
+            5);
         bucket->resendTimeouts.setTimeout(&message[i]->resendTimeout);
     }
 
@@ -848,10 +1281,11 @@ TEST_F(ReceiverTest, trySendGrants)
         Protocol::MessageId id = {42, 10 + i};
         message[i] = receiver->messageAllocator.pool.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
-            10000 * (i + 1), id, SocketAddress{IP(100 + i), 60001},
+            10000 * (i + 1), id, SocketAddress{IP(100 + i), 60001}, 0,
             10 * (i + 1));
         {
-            SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+            Receiver::SchedulerMutex::Lock lock_scheduler(
+                receiver->schedulerMutex);
             receiver->schedule(message[i], lock_scheduler);
         }
         info[i] = &message[i]->scheduledMessageInfo;
@@ -880,7 +1314,7 @@ TEST_F(ReceiverTest, trySendGrants)
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(1);
 
-    receiver->trySendGrants();
+    EXPECT_TRUE(receiver->trySendGrants());
 
     EXPECT_EQ(1, info[0]->priority);
     EXPECT_EQ(info[0]->messageLength, info[0]->bytesGranted);
@@ -963,11 +1397,11 @@ TEST_F(ReceiverTest, schedule)
         Protocol::MessageId id = {42, 10 + i};
         message[i] = receiver->messageAllocator.pool.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
-            messageLength[i], id, SocketAddress{address[i], 60001}, 0);
+            messageLength[i], id, SocketAddress{address[i], 60001}, 0, 0);
         info[i] = &message[i]->scheduledMessageInfo;
     }
 
-    SpinLock::Lock lock(receiver->schedulerMutex);
+    Receiver::SchedulerMutex::Lock lock(receiver->schedulerMutex);
 
     //--------------------------------------------------------------------------
     // NEW PEER
@@ -1021,14 +1455,14 @@ TEST_F(ReceiverTest, unschedule)
 {
     Receiver::Message* message[5];
     Receiver::ScheduledMessageInfo* info[5];
-    SpinLock::Lock lock(receiver->schedulerMutex);
+    Receiver::SchedulerMutex::Lock lock(receiver->schedulerMutex);
     int messageLength[5] = {10, 20, 30, 10, 20};
     for (uint32_t i = 0; i < 5; ++i) {
         Protocol::MessageId id = {42, 10 + i};
         IpAddress source = IP((i / 3) + 10);
         message[i] = receiver->messageAllocator.pool.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
-            messageLength[i], id, SocketAddress{source, 60001}, 0);
+            messageLength[i], id, SocketAddress{source, 60001}, 0, 0);
         info[i] = &message[i]->scheduledMessageInfo;
         receiver->schedule(message[i], lock);
     }
@@ -1106,7 +1540,7 @@ TEST_F(ReceiverTest, updateSchedule)
 {
     // 10 : [10]
     // 11 : [20][30]
-    SpinLock::Lock lock(receiver->schedulerMutex);
+    Receiver::SchedulerMutex::Lock lock(receiver->schedulerMutex);
     Receiver::Message* other[3];
     for (uint32_t i = 0; i < 3; ++i) {
         Protocol::MessageId id = {42, 10 + i};
@@ -1114,12 +1548,12 @@ TEST_F(ReceiverTest, updateSchedule)
         IpAddress source = IP(((i + 1) / 2) + 10);
         other[i] = receiver->messageAllocator.pool.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
-            10 * (i + 1), id, SocketAddress{source, 60001}, 0);
+            10 * (i + 1), id, SocketAddress{source, 60001}, 0, 0);
         receiver->schedule(other[i], lock);
     }
     Receiver::Message* message = receiver->messageAllocator.pool.construct(
         receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 100,
-        Protocol::MessageId(42, 1), SocketAddress{11, 60001}, 0);
+        Protocol::MessageId(42, 1), SocketAddress{11, 60001}, 0, 0);
     receiver->schedule(message, lock);
     auto& peerTable = receiver->peerTable;
     ASSERT_EQ(&peerTable.at(IP(10)), other[0]->scheduledMessageInfo.peer);
@@ -1173,6 +1607,38 @@ TEST_F(ReceiverTest, updateSchedule)
                   &message->scheduledMessageInfo.scheduledMessageNode));
 }
 
+TEST_F(ReceiverTest, updateOutstandingGrant)
+{
+    Receiver::SchedulerMutex::Lock lock(receiver->schedulerMutex);
+    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 10000,
+        Protocol::MessageId(42, 1), SocketAddress{IP(22), 60001}, 0, 0);
+    receiver->schedule(message, lock);
+    Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+    Perf::PeerTable::Entry* peer = perf.peers.find(IP(22));
+
+    info->bytesGranted = 5000;
+    info->bytesRemaining = 8000;
+    receiver->updateOutstandingGrant(message, lock);
+    EXPECT_EQ(3000, info->bytesOutstanding.get());
+    EXPECT_EQ(3000, peer->outstanding_grant_bytes.get());
+
+    // More bytes received than granted (e.g. unscheduled bytes).
+    info->bytesRemaining = 4000;
+    receiver->updateOutstandingGrant(message, lock);
+    EXPECT_EQ(0, info->bytesOutstanding.get());
+    EXPECT_EQ(0, peer->outstanding_grant_bytes.get());
+
+    info->bytesGranted = 9000;
+    receiver->updateOutstandingGrant(message, lock);
+    EXPECT_EQ(3000, peer->outstanding_grant_bytes.get());
+
+    // No longer scheduled.
+    receiver->unschedule(message, lock);
+    EXPECT_EQ(0, info->bytesOutstanding.get());
+    EXPECT_EQ(0, peer->outstanding_grant_bytes.get());
+}
+
 }  // namespace
 }  // namespace Core
 }  // namespace Homa
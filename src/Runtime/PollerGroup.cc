@@ -0,0 +1,267 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Runtime/PollerGroup.h>
+
+#include <Cycles.h>
+#include <cpuid.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+
+#include "Debug.h"
+#include "Perf.h"
+
+namespace Homa {
+namespace Runtime {
+
+namespace {
+
+/// Shortest backoff wait in nanoseconds; doubled on each idle iteration up to
+/// Config::maxBackoffNs.
+const uint64_t MIN_BACKOFF_NS = 100;
+
+/**
+ * Return true if the CPU supports the TPAUSE instruction.
+ */
+bool
+hasWaitpkg()
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & (1U << 5)) != 0;
+}
+
+/**
+ * Wait, without yielding the CPU, until the TSC reaches the given deadline.
+ *
+ * @param deadline
+ *      TSC value at which to stop waiting.
+ * @param useTpause
+ *      True to wait in the C0.1 power state using TPAUSE; otherwise, spin on
+ *      PAUSE.
+ */
+void
+waitUntil(uint64_t deadline, bool useTpause)
+{
+    while (PerfUtils::Cycles::rdtsc() < deadline) {
+        if (useTpause) {
+            // tpause %ecx (encoded directly so no -mwaitpkg is needed); may
+            // return early if the OS limits the wait time.
+            __asm__ __volatile__(".byte 0x66, 0x0f, 0xae, 0xf1"
+                                 :
+                                 : "c"(1), "a"(static_cast<uint32_t>(deadline)),
+                                   "d"(static_cast<uint32_t>(deadline >> 32))
+                                 : "cc", "memory");
+        } else {
+            __asm__ __volatile__("pause" ::: "memory");
+        }
+    }
+}
+
+}  // namespace
+
+/**
+ * Construct a PollerGroup and start its poller threads.
+ *
+ * @param transport
+ *      Transport to be driven by the poller threads.  The transport must
+ *      outlive the PollerGroup.
+ * @param config
+ *      Describes the poller threads to run.
+ */
+PollerGroup::PollerGroup(Transport* transport, const Config& config)
+    : transport(transport)
+    , idleSpins(config.idleSpins)
+    , maxBackoffCycles(
+          PerfUtils::Cycles::fromNanoseconds(config.maxBackoffNs))
+    , running(true)
+    , pollers()
+{
+    for (int i = 0; i < config.numThreads; ++i) {
+        std::unique_ptr<Poller> poller(new Poller);
+        if (static_cast<size_t>(i) < config.stages.size()) {
+            poller->stages = config.stages.at(i);
+        } else {
+            poller->stages = defaultStages(i, config.numThreads);
+        }
+        pollers.push_back(std::move(poller));
+    }
+
+    for (int i = 0; i < config.numThreads; ++i) {
+        Poller* poller = pollers.at(i).get();
+        poller->thread = std::thread(&PollerGroup::run, this, poller);
+        if (static_cast<size_t>(i) < config.cpus.size() &&
+            config.cpus.at(i) >= 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(config.cpus.at(i), &cpuset);
+            int error = pthread_setaffinity_np(poller->thread.native_handle(),
+                                               sizeof(cpuset), &cpuset);
+            if (error != 0) {
+                WARNING("Failed to pin poller thread %d to CPU %d", i,
+                        config.cpus.at(i));
+            }
+        }
+    }
+}
+
+/**
+ * Stop and join the poller threads.
+ */
+PollerGroup::~PollerGroup()
+{
+    running.store(false, std::memory_order_release);
+    for (std::unique_ptr<Poller>& poller : pollers) {
+        poller->thread.join();
+    }
+}
+
+/**
+ * Return the number of poller threads.
+ */
+int
+PollerGroup::numThreads() const
+{
+    return static_cast<int>(pollers.size());
+}
+
+/**
+ * Return the stages run by a poller thread as a mask of Stage values.
+ *
+ * @param thread
+ *      Index of the poller thread.
+ */
+unsigned
+PollerGroup::getStages(int thread) const
+{
+    return pollers.at(thread)->stages;
+}
+
+/**
+ * Return the time spent so far by a poller thread.
+ *
+ * @param thread
+ *      Index of the poller thread.
+ */
+PollerGroup::ThreadStats
+PollerGroup::getStats(int thread) const
+{
+    const Poller* poller = pollers.at(thread).get();
+    ThreadStats stats;
+    stats.busyCycles = poller->busyCycles.load(std::memory_order_relaxed);
+    stats.idleCycles = poller->idleCycles.load(std::memory_order_relaxed);
+    stats.iterations = poller->iterations.load(std::memory_order_relaxed);
+    return stats;
+}
+
+/**
+ * Return the stages run by a poller thread when Config::stages doesn't say.
+ *
+ * The four stages are dealt out round-robin to the first (up to) four
+ * threads; any further threads run the RECEIVE stage so that incoming packets
+ * are processed in parallel.
+ *
+ * @param thread
+ *      Index of the poller thread.
+ * @param numThreads
+ *      Number of poller threads.
+ */
+unsigned
+PollerGroup::defaultStages(int thread, int numThreads)
+{
+    const unsigned stages[] = {RECEIVE, SEND, GRANTS, TIMEOUTS};
+    const int numStages = sizeof(stages) / sizeof(stages[0]);
+    if (thread >= numStages) {
+        return RECEIVE;
+    }
+    int stride = std::min(numThreads, numStages);
+    unsigned mask = 0;
+    for (int i = thread; i < numStages; i += stride) {
+        mask |= stages[i];
+    }
+    return mask;
+}
+
+/**
+ * Main loop of a poller thread.
+ *
+ * An iteration counts as busy if a stage reports pending work or the
+ * Transport did active work on this thread (see Perf::Stats::active_cycles).
+ *
+ * @param poller
+ *      State of the thread running this loop.
+ */
+void
+PollerGroup::run(Poller* poller)
+{
+    const bool useTpause = hasWaitpkg();
+    const uint64_t minBackoffCycles =
+        std::min(PerfUtils::Cycles::fromNanoseconds(MIN_BACKOFF_NS),
+                 maxBackoffCycles);
+    const unsigned stages = poller->stages;
+    uint64_t busyCycles = 0;
+    uint64_t idleCycles = 0;
+    uint64_t iterations = 0;
+    uint32_t idleIterations = 0;
+    uint64_t backoffCycles = 0;
+
+    while (running.load(std::memory_order_acquire)) {
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        uint64_t activeCycles = Perf::TransportCounters::threadActiveCycles;
+        bool pending = false;
+        if (stages & RECEIVE) {
+            pending |= transport->pollReceive();
+        }
+        if (stages & SEND) {
+            pending |= transport->pollSend();
+        }
+        if (stages & GRANTS) {
+            pending |= transport->pollGrants();
+        }
+        if (stages & TIMEOUTS) {
+            transport->pollTimeouts();
+        }
+
+        if (pending ||
+            Perf::TransportCounters::threadActiveCycles != activeCycles) {
+            idleIterations = 0;
+            backoffCycles = 0;
+            busyCycles += PerfUtils::Cycles::rdtsc() - start;
+        } else {
+            if (idleIterations < idleSpins) {
+                ++idleIterations;
+            } else {
+                backoffCycles = std::max(
+                    minBackoffCycles, std::min(2 * backoffCycles,
+                                               maxBackoffCycles));
+                waitUntil(PerfUtils::Cycles::rdtsc() + backoffCycles,
+                          useTpause);
+            }
+            idleCycles += PerfUtils::Cycles::rdtsc() - start;
+        }
+        ++iterations;
+
+        poller->busyCycles.store(busyCycles, std::memory_order_relaxed);
+        poller->idleCycles.store(idleCycles, std::memory_order_relaxed);
+        poller->iterations.store(iterations, std::memory_order_relaxed);
+    }
+}
+
+}  // namespace Runtime
+}  // namespace Homa
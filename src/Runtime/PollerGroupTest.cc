@@ -0,0 +1,113 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Drivers/Fake/FakeDriver.h>
+#include <Homa/Runtime/PollerGroup.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+namespace Homa {
+namespace Runtime {
+namespace {
+
+TEST(PollerGroupTest, defaultStages)
+{
+    EXPECT_EQ(PollerGroup::ALL_STAGES, PollerGroup::defaultStages(0, 1));
+
+    EXPECT_EQ(PollerGroup::RECEIVE | PollerGroup::GRANTS,
+              PollerGroup::defaultStages(0, 2));
+    EXPECT_EQ(PollerGroup::SEND | PollerGroup::TIMEOUTS,
+              PollerGroup::defaultStages(1, 2));
+
+    EXPECT_EQ(PollerGroup::RECEIVE | PollerGroup::TIMEOUTS,
+              PollerGroup::defaultStages(0, 3));
+    EXPECT_EQ(PollerGroup::SEND, PollerGroup::defaultStages(1, 3));
+    EXPECT_EQ(PollerGroup::GRANTS, PollerGroup::defaultStages(2, 3));
+
+    EXPECT_EQ(PollerGroup::RECEIVE, PollerGroup::defaultStages(0, 6));
+    EXPECT_EQ(PollerGroup::TIMEOUTS, PollerGroup::defaultStages(3, 6));
+    EXPECT_EQ(PollerGroup::RECEIVE, PollerGroup::defaultStages(5, 6));
+}
+
+TEST(PollerGroupTest, constructor)
+{
+    Drivers::Fake::FakeDriver driver;
+    Transport* transport = Transport::create(&driver, 1);
+    PollerGroup::Config config;
+    config.numThreads = 3;
+    config.cpus = {-1};
+    config.stages = {PollerGroup::ALL_STAGES};
+    PollerGroup group(transport, config);
+    EXPECT_EQ(3, group.numThreads());
+    EXPECT_EQ(PollerGroup::ALL_STAGES, group.getStages(0));
+    EXPECT_EQ(PollerGroup::SEND, group.getStages(1));
+    EXPECT_EQ(PollerGroup::GRANTS, group.getStages(2));
+}
+
+TEST(PollerGroupTest, sendAndReceive)
+{
+    Drivers::Fake::FakeDriver clientDriver;
+    Drivers::Fake::FakeDriver serverDriver;
+    Transport* client = Transport::create(&clientDriver, 1);
+    Transport* server = Transport::create(&serverDriver, 2);
+    PollerGroup::Config config;
+    config.numThreads = 2;
+    config.idleSpins = 10;
+    PollerGroup clientPollers(client, config);
+    PollerGroup serverPollers(server, config);
+
+    const int count = 20;
+    Homa::unique_ptr<OutMessage> messages[count];
+    for (int i = 0; i < count; ++i) {
+        messages[i] = client->alloc(0);
+        char buf[5000] = {};
+        messages[i]->append(buf, sizeof(buf));
+        messages[i]->send({serverDriver.getLocalAddress(), 60001});
+    }
+
+    // Keep serving until every message completes; a message can be delivered
+    // more than once if its sender restarts it (e.g. after a ping timeout).
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    int received = 0;
+    int completed = 0;
+    while (completed < count && std::chrono::steady_clock::now() < deadline) {
+        Homa::unique_ptr<InMessage> message = server->receive();
+        if (message) {
+            EXPECT_EQ(5000U, message->length());
+            message->acknowledge();
+            ++received;
+        }
+        completed = 0;
+        for (int i = 0; i < count; ++i) {
+            if (messages[i]->getStatus() == OutMessage::Status::COMPLETED) {
+                ++completed;
+            }
+        }
+    }
+    EXPECT_EQ(count, completed);
+    EXPECT_LE(count, received);
+
+    for (int i = 0; i < clientPollers.numThreads(); ++i) {
+        PollerGroup::ThreadStats stats = clientPollers.getStats(i);
+        EXPECT_LT(0U, stats.iterations);
+        EXPECT_LT(0U, stats.idleCycles);
+    }
+    EXPECT_LT(0U, serverPollers.getStats(0).busyCycles);
+}
+
+}  // namespace
+}  // namespace Runtime
+}  // namespace Homa
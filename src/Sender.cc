@@ -18,6 +18,7 @@
 #include <Cycles.h>
 
 #include <algorithm>
+#include <cstring>
 
 #include "ControlPacket.h"
 #include "Debug.h"
@@ -35,6 +36,8 @@ namespace Core {
  *      The driver used to send and receive packets.
  * @param policyManager
  *      Provides information about the network packet priority policies.
+ * @param perf
+ *      Performance counters of the Transport that owns this Sender.
  * @param messageTimeoutCycles
  *      Number of cycles of inactivity to wait before this Sender declares an
  *      Sender::Message send failure.
@@ -43,26 +46,42 @@ namespace Core {
  *      of an Sender::Message.
  */
 Sender::Sender(uint64_t transportId, Driver* driver,
-               Policy::Manager* policyManager, uint64_t messageTimeoutCycles,
-               uint64_t pingIntervalCycles)
+               Policy::Manager* policyManager, Perf::TransportCounters* perf,
+               uint64_t messageTimeoutCycles, uint64_t pingIntervalCycles)
     : transportId(transportId)
     , driver(driver)
     , policyManager(policyManager)
+    , perf(perf)
     , nextMessageSequenceNumber(1)
     , DRIVER_QUEUED_BYTE_LIMIT(2 * driver->getMaxPayloadSize())
-    , messageBuckets(messageTimeoutCycles, pingIntervalCycles)
-    , queueMutex()
+    , messageBuckets(messageTimeoutCycles, pingIntervalCycles, &nextTimeout)
+    , queueMutex("Sender::queueMutex")
     , sendQueue()
     , sending()
     , sendReady(false)
-    , nextBucketIndex(0)
+    , batchesStarted(0)
+    , batchesTransmitted(0)
+    , nextTimeout(UINT64_MAX)
+    , sweeping()
     , messageAllocator()
+    , compactPeers()
+    , coalescingBudgetCycles(0)
+    , bundles()
+    , nextBundleDeadline(UINT64_MAX)
+    , doneMessages()
 {}
 
 /**
  * Sender Destructor
  */
-Sender::~Sender() {}
+Sender::~Sender()
+{
+    for (auto& entry : bundles.map) {
+        if (entry.second.packet != nullptr) {
+            driver->releasePackets(&entry.second.packet, 1);
+        }
+    }
+}
 
 /**
  * Allocate an OutMessage that can be sent with this Sender.
@@ -71,10 +90,71 @@ Homa::OutMessage*
 Sender::allocMessage(uint16_t sourcePort)
 {
     SpinLock::Lock lock_allocator(messageAllocator.mutex);
-    Perf::counters.allocated_tx_messages.add(1);
+    perf->local().allocated_tx_messages.add(1);
     return messageAllocator.pool.construct(this, sourcePort);
 }
 
+/**
+ * Allocate several OutMessages that can be sent with this Sender, taking the
+ * allocator lock only once.
+ *
+ * @param sourcePort
+ *      Port number of the socket from which the messages will be sent.
+ * @param[out] messages
+ *      Array of _count_ entries that is filled with the allocated messages.
+ * @param count
+ *      Number of messages to allocate.
+ */
+void
+Sender::allocMessages(uint16_t sourcePort, Homa::OutMessage* messages[],
+                      size_t count)
+{
+    SpinLock::Lock lock_allocator(messageAllocator.mutex);
+    perf->local().allocated_tx_messages.add(count);
+    for (size_t i = 0; i < count; ++i) {
+        messages[i] = messageAllocator.pool.construct(this, sourcePort);
+    }
+}
+
+/**
+ * Allocate an OutMessage made up of packets that already hold its contents,
+ * such as the packets of a received message that is being forwarded.
+ *
+ * @param sourcePort
+ *      Port number of the socket from which the message will be sent.
+ * @param packets
+ *      Packets holding the message contents, each leaving room for a
+ *      DataHeader in front of its data.  The new message takes ownership of
+ *      these packets.
+ * @param numPackets
+ *      Number of entries in _packets_.
+ * @param headroom
+ *      Number of bytes at the beginning of the message that are reserved for
+ *      Message::prepend().
+ * @param messageLength
+ *      Number of bytes in the message including the headroom.
+ */
+Homa::OutMessage*
+Sender::allocMessage(uint16_t sourcePort, Driver::Packet* const packets[],
+                     int numPackets, int headroom, int messageLength)
+{
+    Message* message = static_cast<Message*>(allocMessage(sourcePort));
+    assert(numPackets <= static_cast<int>(Message::MAX_MESSAGE_PACKETS));
+    for (int i = 0; i < numPackets; ++i) {
+        int offset = i * message->PACKET_DATA_LENGTH;
+        int dataLength =
+            std::min(message->PACKET_DATA_LENGTH, messageLength - offset);
+        message->packets[i] = packets[i];
+        message->packets[i]->length =
+            message->TRANSPORT_HEADER_LENGTH + dataLength;
+        message->occupied.set(i);
+    }
+    message->numPackets = numPackets;
+    message->start = headroom;
+    message->messageLength = messageLength;
+    return message;
+}
+
 /**
  * Process an incoming DONE packet.
  *
@@ -98,6 +178,12 @@ Sender::handleDonePacket(Driver::Packet* packet)
         return;
     }
 
+    if (header->common.prefix.version == Protocol::Packet::COMPACT_VERSION) {
+        // The receiver can identify messages sent with compact headers.
+        SpinLock::Lock lock_peers(compactPeers.mutex);
+        compactPeers.set.insert(message->destination.ip);
+    }
+
     // Process DONE packet
     OutMessage::Status status = message->getStatus();
     switch (status) {
@@ -106,6 +192,8 @@ Sender::handleDonePacket(Driver::Packet* packet)
             bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
             bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
             message->state.store(OutMessage::Status::COMPLETED);
+            message->timestamps.record(Message::FINISHED);
+            notifyDone(message);
             break;
         case OutMessage::Status::CANCELED:
             // Canceled by the the application; just ignore the DONE.
@@ -174,7 +262,7 @@ Sender::handleResendPacket(Driver::Packet* packet)
     } else if (message->numPackets < 2) {
         // We should never get a RESEND for a single packet message.  Just
         // ignore this RESEND from a buggy Receiver.
-        WARNING(
+        WARNING_RATE_LIMITED(
             "Message (%lu, %lu) with only 1 packet received unexpected RESEND "
             "request; peer Transport may be confused.",
             msgId.transportId, msgId.sequence);
@@ -185,13 +273,13 @@ Sender::handleResendPacket(Driver::Packet* packet)
     bucket->messageTimeouts.setTimeout(&message->messageTimeout);
     bucket->pingTimeouts.setTimeout(&message->pingTimeout);
 
-    SpinLock::Lock lock_queue(queueMutex);
+    QueueMutex::Lock lock_queue(queueMutex);
     QueuedMessageInfo* info = &message->queuedMessageInfo;
 
     // Check if RESEND request is out of range.
     if (index >= info->packets->numPackets ||
         resendEnd > info->packets->numPackets) {
-        WARNING(
+        WARNING_RATE_LIMITED(
             "Message (%lu, %lu) RESEND request range out of bounds: requested "
             "range [%d, %d); message only contains %d packets; peer Transport "
             "may be confused.",
@@ -209,28 +297,35 @@ Sender::handleResendPacket(Driver::Packet* packet)
         // preset packetsGranted.
         info->priority = header->priority;
         sendReady.store(true);
+        message->timestamps.accumulate(Message::GRANT_WAIT_CYCLES,
+                                       Message::GRANT_WAIT_START);
     }
 
+    // Packets picked by a trySend() call that is still handing them to the
+    // driver must not be sent concurrently from here.
+    int packetsTransmitted =
+        info->packetsTransmitted.load(std::memory_order_acquire);
     if (index >= info->packetsSent) {
         // If this RESEND is only requesting unsent packets, it must be that
         // this Sender has been busy and the Receiver is trying to ensure there
         // are no lost packets.  Reply BUSY and allow this Sender to send DATA
         // when it's ready.
-        Perf::counters.tx_busy_pkts.add(1);
+        perf->local().tx_busy_pkts.add(1);
         ControlPacket::send<Protocol::Packet::BusyHeader>(
-            driver, info->destination.ip, info->id);
+            driver, perf, info->destination.ip, info->id);
+    } else if (index >= packetsTransmitted) {
+        // The requested packets are being transmitted right now; a RESEND
+        // for any of them still missing will follow.
     } else {
         // There are some packets to resend but only resend packets that have
-        // already been sent.
-        resendEnd = std::min(resendEnd, info->packetsSent);
+        // already been transmitted.
+        resendEnd = std::min(resendEnd, packetsTransmitted);
         int resendPriority = policyManager->getResendPriority();
         for (uint16_t i = index; i < resendEnd; ++i) {
-            Driver::Packet* packet = info->packets->getPacket(i);
-            // Packets will be sent at the priority their original priority.
-            Perf::counters.tx_data_pkts.add(1);
-            Perf::counters.tx_bytes.add(packet->length);
-            driver->sendPacket(packet, message->destination.ip, resendPriority);
+            sendDataPacket(info->packets, i, resendPriority);
         }
+        message->timestamps.recordFirst(Message::FIRST_RESEND);
+        message->timestamps.record(Message::LAST_RESEND);
     }
 
     driver->releasePackets(&packet, 1);
@@ -262,7 +357,7 @@ Sender::handleGrantPacket(Driver::Packet* packet)
     bucket->pingTimeouts.setTimeout(&message->pingTimeout);
 
     if (message->state.load() == OutMessage::Status::IN_PROGRESS) {
-        SpinLock::Lock lock_queue(queueMutex);
+        QueueMutex::Lock lock_queue(queueMutex);
         QueuedMessageInfo* info = &message->queuedMessageInfo;
 
         // Convert the byteLimit to a packet index limit such that the packet
@@ -276,7 +371,7 @@ Sender::handleGrantPacket(Driver::Packet* packet)
         // Make that grants don't exceed the number of packets.  Internally,
         // the sender always assumes that packetsGranted <= numPackets.
         if (incomingGrantIndex > info->packets->numPackets) {
-            WARNING(
+            WARNING_RATE_LIMITED(
                 "Message (%lu, %lu) GRANT exceeds message length; granted "
                 "packets: %d, message packets %d; extra grants are ignored.",
                 msgId.transportId, msgId.sequence, incomingGrantIndex,
@@ -291,6 +386,8 @@ Sender::handleGrantPacket(Driver::Packet* packet)
             // not exceed the preset packetsGranted.
             info->priority = header->priority;
             sendReady.store(true);
+            message->timestamps.accumulate(Message::GRANT_WAIT_CYCLES,
+                                           Message::GRANT_WAIT_START);
         }
     }
 
@@ -334,7 +431,7 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
 
         // Remove Message from sendQueue.
         if (message->numPackets > 1) {
-            SpinLock::Lock lock_queue(queueMutex);
+            QueueMutex::Lock lock_queue(queueMutex);
             QueuedMessageInfo* info = &message->queuedMessageInfo;
             if (message->state == OutMessage::Status::IN_PROGRESS) {
                 assert(sendQueue.contains(&info->sendQueueNode));
@@ -346,22 +443,41 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
         bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
         bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
         message->state.store(OutMessage::Status::FAILED);
+        message->timestamps.record(Message::FINISHED);
+        notifyDone(message);
     } else {
         // Message isn't done yet so we will restart sending the message.
 
+        // The receiver may have lost track of this transport (e.g. it
+        // restarted); stop sending it compact headers until it learns about
+        // us again from a full header.
+        {
+            SpinLock::Lock lock_peers(compactPeers.mutex);
+            compactPeers.set.erase(message->destination.ip);
+        }
+
         // Make sure the message is not in the sendQueue before making any
         // changes to the message.
         if (message->numPackets > 1) {
-            SpinLock::Lock lock_queue(queueMutex);
-            QueuedMessageInfo* info = &message->queuedMessageInfo;
-            if (message->state == OutMessage::Status::IN_PROGRESS) {
-                assert(sendQueue.contains(&info->sendQueueNode));
-                sendQueue.remove(&info->sendQueueNode);
+            {
+                QueueMutex::Lock lock_queue(queueMutex);
+                QueuedMessageInfo* info = &message->queuedMessageInfo;
+                if (message->state == OutMessage::Status::IN_PROGRESS) {
+                    assert(sendQueue.contains(&info->sendQueueNode));
+                    sendQueue.remove(&info->sendQueueNode);
+                }
+                assert(!sendQueue.contains(&info->sendQueueNode));
             }
-            assert(!sendQueue.contains(&info->sendQueueNode));
+            // Packet headers are rewritten below.  Wait without holding the
+            // queueMutex so that trySend() isn't held up meanwhile.
+            waitForTransmission();
         }
 
         message->state.store(OutMessage::Status::IN_PROGRESS);
+        message->timestamps.accumulate(Message::GRANT_WAIT_CYCLES,
+                                       Message::GRANT_WAIT_START);
+        message->timestamps.recordFirst(Message::FIRST_RESEND);
+        message->timestamps.record(Message::LAST_RESEND);
 
         // Get the current policy for unscheduled bytes.
         Policy::Unscheduled policy = policyManager->getUnscheduledPolicy(
@@ -370,8 +486,31 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
             ((policy.unscheduledByteLimit + message->PACKET_DATA_LENGTH - 1) /
              message->PACKET_DATA_LENGTH);
 
+        if (message->compact) {
+            // Undo sendCompactPacket(); the receiver no longer knows this
+            // transport so the message is resent with a full header.
+            Driver::Packet* dataPacket = message->getPacket(0);
+            char* payload = static_cast<char*>(dataPacket->payload);
+            std::memmove(payload + message->TRANSPORT_HEADER_LENGTH,
+                         payload + sizeof(Protocol::Packet::CompactDataHeader),
+                         message->messageLength);
+            new (payload) Protocol::Packet::DataHeader(
+                message->source.port, message->destination.port, message->id,
+                Util::downCast<uint32_t>(message->messageLength),
+                policy.version,
+                Util::downCast<uint16_t>(unscheduledIndexLimit), 0);
+            dataPacket->length =
+                message->TRANSPORT_HEADER_LENGTH + message->messageLength;
+            message->compact = false;
+        }
+
         // Update the policy version for each packet
-        for (uint16_t i = 0; i < message->numPackets; ++i) {
+        message->policyVersion = policy.version;
+        message->unscheduledIndexLimit =
+            Util::downCast<uint16_t>(unscheduledIndexLimit);
+        for (uint16_t i = 0;
+             message->payloadOwner == nullptr && i < message->numPackets;
+             ++i) {
             Driver::Packet* dataPacket = message->getPacket(i);
             assert(dataPacket != nullptr);
             Protocol::Packet::DataHeader* header =
@@ -388,12 +527,7 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
         assert(message->numPackets > 0);
         if (message->numPackets == 1) {
             // If there is only one packet in the message, send it right away.
-            Driver::Packet* dataPacket = message->getPacket(0);
-            assert(dataPacket != nullptr);
-            Perf::counters.tx_data_pkts.add(1);
-            Perf::counters.tx_bytes.add(dataPacket->length);
-            driver->sendPacket(dataPacket, message->destination.ip,
-                               policy.priority);
+            sendDataPacket(message, 0, policy.priority);
             message->state.store(OutMessage::Status::SENT);
             // This message must be still be held by the application since the
             // message still exists (it would have been removed when dropped
@@ -409,7 +543,7 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
             }
         } else {
             // Otherwise, queue the message to be sent in SRPT order.
-            SpinLock::Lock lock_queue(queueMutex);
+            QueueMutex::Lock lock_queue(queueMutex);
             QueuedMessageInfo* info = &message->queuedMessageInfo;
             // Some of these values should still be set from when the message
             // was first queued.
@@ -423,6 +557,7 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
                 std::min(unscheduledIndexLimit, message->numPackets);
             info->priority = policy.priority;
             info->packetsSent = 0;
+            info->packetsTransmitted = 0;
             // Insert and move message into the correct order in the priority
             // queue.
             sendQueue.push_front(&info->sendQueueNode);
@@ -465,6 +600,8 @@ Sender::handleErrorPacket(Driver::Packet* packet)
             bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
             bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
             message->state.store(OutMessage::Status::FAILED);
+            message->timestamps.record(Message::FINISHED);
+            notifyDone(message);
             break;
         case OutMessage::Status::CANCELED:
             // Canceled by the the application; just ignore the ERROR.
@@ -505,6 +642,64 @@ Sender::handleErrorPacket(Driver::Packet* packet)
     driver->releasePackets(&packet, 1);
 }
 
+/**
+ * Hand a response to the request that is waiting for it.  The response also
+ * acknowledges the request, which is considered COMPLETED.
+ *
+ * @param requestId
+ *      Id of the request to which the response responds.
+ * @param response
+ *      The completely received response; the Sender takes ownership of it.
+ */
+void
+Sender::handleResponse(Protocol::MessageId requestId, Homa::InMessage* response)
+{
+    Homa::unique_ptr<Homa::InMessage> ownedResponse(response);
+    MessageBucket* bucket = messageBuckets.getBucket(requestId);
+    SpinLock::Lock lock(bucket->mutex);
+    Message* message = bucket->findMessage(requestId, lock);
+    if (message == nullptr || message->response != nullptr) {
+        // The request has already been released or the response is a
+        // duplicate; drop the response.
+        return;
+    }
+
+    if (message->getStatus() == OutMessage::Status::SENT) {
+        bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
+        bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
+        message->state.store(OutMessage::Status::COMPLETED);
+        message->timestamps.record(Message::FINISHED);
+        notifyDone(message);
+    }
+    message->response = ownedResponse.release();
+}
+
+/**
+ * Return messages sent with OutMessage::NOTIFY_DONE that have become done.
+ *
+ * @param[out] messages
+ *      Array of at least _maxMessages_ entries; the first entries are set to
+ *      the done messages.
+ * @param maxMessages
+ *      Maximum number of messages to return.
+ * @return
+ *      Number of messages returned in _messages_.
+ *
+ * @sa Homa::Transport::getDoneMessages()
+ */
+size_t
+Sender::getDoneMessages(Homa::OutMessage* messages[], size_t maxMessages)
+{
+    SpinLock::Lock lock_done(doneMessages.mutex);
+    size_t numDone = 0;
+    while (numDone < maxMessages && !doneMessages.list.empty()) {
+        Message* message = &doneMessages.list.front();
+        doneMessages.list.pop_front();
+        messages[numDone++] = message;
+    }
+    return numDone;
+}
+
 /**
  * Allow the Sender to make progress toward sending outgoing messages.
  *
@@ -514,23 +709,110 @@ void
 Sender::poll()
 {
     trySend();
+    flushBundles();
     checkTimeouts();
 }
 
 /**
- * Make incremental progress processing expired Sender timeouts.
+ * Send granted packets and any bundles whose coalescing budget has expired,
+ * without processing timeouts.
+ *
+ * @return
+ *      True if granted packets are still waiting to be sent; false otherwise.
+ */
+bool
+Sender::pollSend()
+{
+    trySend();
+    flushBundles();
+    return sendReady.load();
+}
+
+/**
+ * Enable or disable the coalescing of small single-packet messages.
+ *
+ * When enabled, small messages are held for up to the given budget so that
+ * messages bound for the same destination can share a BUNDLE packet.
+ *
+ * @param budgetCycles
+ *      Maximum number of cycles a message may be held before it is sent; 0
+ *      disables coalescing.
+ */
+void
+Sender::setCoalescingBudget(uint64_t budgetCycles)
+{
+    coalescingBudgetCycles.store(budgetCycles, std::memory_order_relaxed);
+    if (budgetCycles == 0) {
+        // Don't hold on to already bundled messages any longer.
+        nextBundleDeadline.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Send the BUNDLE packets whose coalescing budget has expired.
+ *
+ * Pulled out of poll() for ease of testing.
+ */
+void
+Sender::flushBundles()
+{
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    if (now < nextBundleDeadline.load(std::memory_order_relaxed)) {
+        return;
+    }
+    uint64_t budget = coalescingBudgetCycles.load(std::memory_order_relaxed);
+    SpinLock::Lock lock(bundles.mutex);
+    uint64_t nextDeadline = UINT64_MAX;
+    auto it = bundles.map.begin();
+    while (it != bundles.map.end()) {
+        Bundle* bundle = &it->second;
+        assert(bundle->packet != nullptr);
+        if (bundle->deadline <= now || budget == 0) {
+            sendBundle(it->first, bundle);
+            // Only destinations with pending messages are kept.
+            it = bundles.map.erase(it);
+        } else {
+            nextDeadline = std::min(nextDeadline, bundle->deadline);
+            ++it;
+        }
+    }
+    nextBundleDeadline.store(nextDeadline, std::memory_order_relaxed);
+}
+
+/**
+ * Process every expired Sender timeout.
+ *
+ * Returns right away unless some timeout might have elapsed; otherwise, every
+ * bucket is swept so that timeouts are processed promptly no matter how often
+ * this method is called.  Safe to call from a thread dedicated to timeouts.
  *
  * Pulled out of poll() for ease of testing.
  */
 void
 Sender::checkTimeouts()
 {
-    uint index = nextBucketIndex.fetch_add(1, std::memory_order_relaxed) &
-                 MessageBucketMap::HASH_KEY_MASK;
-    MessageBucket* bucket = messageBuckets.buckets.at(index);
     uint64_t now = PerfUtils::Cycles::rdtsc();
-    checkPingTimeouts(now, bucket);
-    checkMessageTimeouts(now, bucket);
+    if (now < nextTimeout.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // Skip the sweep if another thread is already doing it.
+    if (sweeping.test_and_set()) {
+        return;
+    }
+
+    // Timeouts scheduled during the sweep lower nextTimeout again on their
+    // own; the remaining timeouts of each swept bucket are folded back in.
+    nextTimeout.exchange(UINT64_MAX);
+    uint64_t deadline = UINT64_MAX;
+    for (MessageBucket* bucket : messageBuckets.buckets) {
+        checkPingTimeouts(now, bucket);
+        checkMessageTimeouts(now, bucket);
+        deadline = std::min(deadline, bucket->messageTimeouts.nextExpiration());
+        deadline = std::min(deadline, bucket->pingTimeouts.nextExpiration());
+    }
+    TimeoutManager<Message>::lowerDeadline(&nextTimeout, deadline);
+    sweeping.clear();
 }
 
 /**
@@ -539,7 +821,12 @@ Sender::checkTimeouts()
 Sender::Message::~Message()
 {
     // Sender message must be contiguous
-    driver->releasePackets(packets, numPackets);
+    if (payloadOwner == nullptr) {
+        driver->releasePackets(packets, numPackets);
+    }
+    // Release any received messages held by this message.
+    Homa::unique_ptr<Homa::InMessage> heldRequest(request);
+    Homa::unique_ptr<Homa::InMessage> heldResponse(response);
 }
 
 /**
@@ -598,6 +885,19 @@ Sender::Message::getStatus() const
     return state.load();
 }
 
+/**
+ * @copydoc Homa::OutMessage::getResponse()
+ */
+Homa::unique_ptr<Homa::InMessage>
+Sender::Message::getResponse()
+{
+    MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+    SpinLock::Lock lock(bucket->mutex);
+    Homa::unique_ptr<Homa::InMessage> message(response);
+    response = nullptr;
+    return message;
+}
+
 /**
  * @copydoc Homa::OutMessage::length()
  */
@@ -695,6 +995,34 @@ Sender::Message::send(SocketAddress destination,
     sender->sendMessage(this, destination, options);
 }
 
+/**
+ * @copydoc Homa::OutMessage::fanOut()
+ */
+void
+Sender::Message::fanOut(const SocketAddress destinations[], size_t count,
+                        Homa::unique_ptr<OutMessage> copies[],
+                        Sender::Message::Options options)
+{
+    sender->fanOutMessage(this, destinations, count, copies, options);
+}
+
+/**
+ * @copydoc Homa::OutMessage::timing()
+ */
+OutMessage::Timing
+Sender::Message::timing() const
+{
+    Timing timing;
+    timing.queued = timestamps.get(QUEUED);
+    timing.firstPacketSent = timestamps.get(FIRST_PACKET_SENT);
+    timing.lastPacketSent = timestamps.get(LAST_PACKET_SENT);
+    timing.grantWaitCycles = timestamps.get(GRANT_WAIT_CYCLES);
+    timing.firstResend = timestamps.get(FIRST_RESEND);
+    timing.lastResend = timestamps.get(LAST_RESEND);
+    timing.finished = timestamps.get(FINISHED);
+    return timing;
+}
+
 /**
  * Return the Packet with the given index.
  *
@@ -755,8 +1083,11 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
 {
     // Prepare the message
     assert(message->driver == driver);
-    // Allocate a new message id
-    Protocol::MessageId id(transportId, nextMessageSequenceNumber++);
+    // Allocate a new message id; responses reuse the id of their request.
+    Protocol::MessageId id = message->id;
+    if (message->request == nullptr) {
+        id = Protocol::MessageId(transportId, nextMessageSequenceNumber++);
+    }
 
     Policy::Unscheduled policy = policyManager->getUnscheduledPolicy(
         destination.ip, message->messageLength);
@@ -767,7 +1098,12 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
     message->id = id;
     message->destination = destination;
     message->options = options;
+    message->policyVersion = policy.version;
+    message->unscheduledIndexLimit =
+        Util::downCast<uint16_t>(unscheduledPacketLimit);
     message->state.store(OutMessage::Status::IN_PROGRESS);
+    message->timestamps.reset();
+    message->timestamps.record(Message::QUEUED);
 
     int actualMessageLen = 0;
     // fill out metadata.
@@ -781,11 +1117,14 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
                 i * message->PACKET_DATA_LENGTH);
         }
 
-        new (packet->payload) Protocol::Packet::DataHeader(
-            message->source.port, destination.port, message->id,
-            Util::downCast<uint32_t>(message->messageLength), policy.version,
-            Util::downCast<uint16_t>(unscheduledPacketLimit),
-            Util::downCast<uint16_t>(i));
+        if (message->payloadOwner == nullptr) {
+            new (packet->payload) Protocol::Packet::DataHeader(
+                message->source.port, destination.port, message->id,
+                Util::downCast<uint32_t>(message->messageLength),
+                policy.version,
+                Util::downCast<uint16_t>(unscheduledPacketLimit),
+                Util::downCast<uint16_t>(i));
+        }
         actualMessageLen += (packet->length - message->TRANSPORT_HEADER_LENGTH);
     }
 
@@ -800,31 +1139,46 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
     SpinLock::Lock lock(bucket->mutex);
     assert(!bucket->messages.contains(&message->bucketNode));
     bucket->messages.push_back(&message->bucketNode);
-    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
-    bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    message->activeCount.set(&perf->peers, destination.ip, 1);
+    if (message->numPackets > 1) {
+        bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+        bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    } else if (!(options & OutMessage::Options::NO_KEEP_ALIVE)) {
+        // Single-packet messages are usually acknowledged within a ping
+        // interval, so only the ping timeout is armed; the message timeout
+        // is armed by the first ping (see checkPingTimeouts()).
+        bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    }
 
     assert(message->numPackets > 0);
     if (message->numPackets == 1) {
-        // If there is only one packet in the message, send it right away.
-        Driver::Packet* packet = message->getPacket(0);
-        assert(packet != nullptr);
-        Perf::counters.tx_data_pkts.add(1);
-        Perf::counters.tx_bytes.add(packet->length);
-        driver->sendPacket(packet, message->destination.ip, policy.priority);
+        // If there is only one packet in the message, send it right away
+        // unless it can share a BUNDLE packet with other small messages.
+        if (!bundleMessage(message, policy.priority)) {
+            // Compact headers identify the message by this transport's id
+            // so they can't be used for responses.
+            bool compact = false;
+            if (id.transportId == transportId) {
+                SpinLock::Lock lock_peers(compactPeers.mutex);
+                compact = compactPeers.set.count(destination.ip) != 0;
+            }
+            if (compact) {
+                sendCompactPacket(message, policy.priority);
+            } else {
+                sendDataPacket(message, 0, policy.priority);
+            }
+        }
+        // Bundled messages count as transmitted once they are bundled.
+        message->timestamps.record(Message::FIRST_PACKET_SENT);
+        message->timestamps.record(Message::LAST_PACKET_SENT);
         message->state.store(OutMessage::Status::SENT);
         // By definition, this message must be still be held by the application
         // the send() call is since the progress. Assuming the message is still
         // held, we can skip the auto removal of SENT and !held messages.
         assert(message->held);
-        if (message->options & OutMessage::Options::NO_KEEP_ALIVE) {
-            // No timeouts need to be checked after sending the message when
-            // the NO_KEEP_ALIVE option is enabled.
-            bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
-            bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
-        }
     } else {
         // Otherwise, queue the message to be sent in SRPT order.
-        SpinLock::Lock lock_queue(queueMutex);
+        QueueMutex::Lock lock_queue(queueMutex);
         QueuedMessageInfo* info = &message->queuedMessageInfo;
         info->id = id;
         info->destination = message->destination;
@@ -834,6 +1188,7 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
             std::min(unscheduledPacketLimit, message->numPackets);
         info->priority = policy.priority;
         info->packetsSent = 0;
+        info->packetsTransmitted = 0;
         // Insert and move message into the correct order in the priority queue.
         sendQueue.push_front(&info->sendQueueNode);
         Intrusive::deprioritize<Message>(&sendQueue, &info->sendQueueNode,
@@ -842,6 +1197,240 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
     }
 }
 
+/**
+ * Send a message as the response to a request received by this transport.
+ *
+ * @param response
+ *      Sender::Message to be sent.
+ * @param requestId
+ *      Id of the request; the response is sent with the same id.
+ * @param destination
+ *      Address from which the request was sent.
+ * @param request
+ *      The request; it is released when the response is destroyed.
+ * @param options
+ *      Flags indicating requested non-default send behavior.
+ *
+ * @sa Homa::Transport::reply()
+ */
+void
+Sender::replyMessage(Homa::OutMessage* response, Protocol::MessageId requestId,
+                     SocketAddress destination, Homa::InMessage* request,
+                     OutMessage::Options options)
+{
+    Message* message = static_cast<Message*>(response);
+    assert(message->request == nullptr);
+    message->id = requestId;
+    message->request = request;
+    sendMessage(message, destination, options);
+}
+
+/**
+ * Send one copy of a message to each of several destinations; the copies
+ * borrow the message's packets rather than duplicating them.
+ *
+ * @param message
+ *      Sender::Message whose contents should be sent.  It must not have been
+ *      sent and must not be modified after this call.
+ * @param destinations
+ *      Destination addresses for the copies.
+ * @param count
+ *      Number of entries in _destinations_.
+ * @param[out] copies
+ *      Set to the messages sent to each destination.
+ * @param options
+ *      Flags indicating requested non-default send behavior.
+ *
+ * @sa Homa::OutMessage::fanOut()
+ */
+void
+Sender::fanOutMessage(Sender::Message* message,
+                      const SocketAddress destinations[], size_t count,
+                      Homa::unique_ptr<OutMessage> copies[],
+                      Sender::Message::Options options)
+{
+    assert(message->state == OutMessage::Status::NOT_STARTED);
+    assert(message->payloadOwner == nullptr);
+    for (size_t i = 0; i < count; ++i) {
+        Message* copy;
+        {
+            SpinLock::Lock lock_allocator(messageAllocator.mutex);
+            perf->local().allocated_tx_messages.add(1);
+            copy = messageAllocator.pool.construct(this, message->source.port);
+        }
+        message->payloadRefs.fetch_add(1);
+        copy->payloadOwner = message;
+        copy->start = message->start;
+        copy->messageLength = message->messageLength;
+        copy->numPackets = message->numPackets;
+        copy->occupied = message->occupied;
+        std::copy(message->packets, message->packets + message->numPackets,
+                  copy->packets);
+        sendMessage(copy, destinations[i], options);
+        copies[i].reset(copy);
+    }
+}
+
+/**
+ * Send one of a message's DATA packets.
+ *
+ * The packets of a message created by fanOut() are shared with other
+ * messages and do not carry this message's DATA header; the header is passed
+ * to the driver separately (see Driver::sendPacketWithHeader()), so drivers
+ * that support it send the shared payload without copying it.
+ *
+ * @param message
+ *      Message to which the packet belongs.
+ * @param index
+ *      Index of the packet in the message.
+ * @param priority
+ *      Network priority at which the packet should be sent.
+ */
+void
+Sender::sendDataPacket(Sender::Message* message, int index, int priority)
+{
+    Driver::Packet* packet = message->getPacket(index);
+    assert(packet != nullptr);
+    perf->local().tx_data_pkts.add(1);
+    perf->local().tx_bytes.add(packet->length);
+    perf->peers.find(message->destination.ip)->sent(packet->length);
+    if (message->payloadOwner != nullptr) {
+        Protocol::Packet::DataHeader header(
+            message->source.port, message->destination.port, message->id,
+            Util::downCast<uint32_t>(message->messageLength),
+            message->policyVersion, message->unscheduledIndexLimit,
+            Util::downCast<uint16_t>(index));
+        driver->sendPacketWithHeader(&header, sizeof(header), packet,
+                                     message->TRANSPORT_HEADER_LENGTH,
+                                     message->destination.ip, priority);
+    } else {
+        driver->sendPacket(packet, message->destination.ip, priority);
+    }
+}
+
+/**
+ * Send a single-packet message with a compact DATA header.
+ *
+ * The message data is moved down within its packet to directly follow the
+ * compact header, so nothing is allocated; Message::compact records the
+ * change so that the full header can be restored if the message is restarted
+ * (see handleUnknownPacket()).  The packet of a message created by fanOut()
+ * is shared and is never modified; its data is sent behind a separate compact
+ * header instead (see Driver::sendPacketWithHeader()).
+ *
+ * @param message
+ *      Single-packet message to be sent.
+ * @param priority
+ *      Network priority at which the packet should be sent.
+ */
+void
+Sender::sendCompactPacket(Sender::Message* message, int priority)
+{
+    Driver::Packet* packet = message->getPacket(0);
+    assert(packet != nullptr);
+    Protocol::Packet::CompactDataHeader header(
+        message->source.port, message->destination.port, message->id.sequence,
+        Util::downCast<uint16_t>(message->messageLength),
+        message->policyVersion);
+    int length = sizeof(header) + message->messageLength;
+    perf->local().tx_data_pkts.add(1);
+    perf->local().tx_bytes.add(length);
+    perf->peers.find(message->destination.ip)->sent(length);
+    if (message->payloadOwner != nullptr) {
+        driver->sendPacketWithHeader(&header, sizeof(header), packet,
+                                     message->TRANSPORT_HEADER_LENGTH,
+                                     message->destination.ip, priority);
+        return;
+    }
+    char* payload = static_cast<char*>(packet->payload);
+    std::memmove(payload + sizeof(header),
+                 payload + message->TRANSPORT_HEADER_LENGTH,
+                 message->messageLength);
+    std::memcpy(payload, &header, sizeof(header));
+    packet->length = length;
+    message->compact = true;
+    driver->sendPacket(packet, message->destination.ip, priority);
+}
+
+/**
+ * Copy a single-packet message into the BUNDLE packet being built for its
+ * destination, if coalescing is enabled and the message is small enough.
+ *
+ * @param message
+ *      Single-packet message whose DATA packet has been filled in.
+ * @param priority
+ *      Network priority at which the message should be sent.
+ * @return
+ *      True if the message was added to a BUNDLE packet; false if it should
+ *      be sent on its own.
+ */
+bool
+Sender::bundleMessage(Message* message, int priority)
+{
+    uint64_t budget = coalescingBudgetCycles.load(std::memory_order_relaxed);
+    if (budget == 0 || message->messageLength > MAX_BUNDLED_MESSAGE_LENGTH ||
+        message->payloadOwner != nullptr) {
+        return false;
+    }
+    Driver::Packet* packet = message->getPacket(0);
+    const int capacity = driver->getMaxPayloadSize();
+    const int bundleHeaderLength = sizeof(Protocol::Packet::BundleHeader);
+    if (bundleHeaderLength + packet->length > capacity) {
+        return false;
+    }
+
+    SpinLock::Lock lock(bundles.mutex);
+    IpAddress destination = message->destination.ip;
+    Bundle* bundle = &bundles.map[destination];
+    if (bundle->packet != nullptr &&
+        bundle->packet->length + packet->length > capacity) {
+        sendBundle(destination, bundle);
+    }
+    if (bundle->packet == nullptr) {
+        bundle->packet = driver->allocPacket();
+        new (bundle->packet->payload) Protocol::Packet::BundleHeader();
+        bundle->packet->length = bundleHeaderLength;
+        bundle->deadline = PerfUtils::Cycles::rdtsc() + budget;
+        bundle->priority = priority;
+        if (bundle->deadline <
+            nextBundleDeadline.load(std::memory_order_relaxed)) {
+            nextBundleDeadline.store(bundle->deadline,
+                                     std::memory_order_relaxed);
+        }
+    }
+
+    Protocol::Packet::BundleHeader* header =
+        static_cast<Protocol::Packet::BundleHeader*>(bundle->packet->payload);
+    std::memcpy(
+        static_cast<char*>(bundle->packet->payload) + bundle->packet->length,
+        packet->payload, packet->length);
+    bundle->packet->length += packet->length;
+    header->numMessages++;
+    bundle->priority = std::max(bundle->priority, priority);
+    return true;
+}
+
+/**
+ * Transmit a BUNDLE packet and release it.
+ *
+ * Must be called with bundles.mutex held.
+ *
+ * @param destination
+ *      Address to which the BUNDLE should be sent.
+ * @param bundle
+ *      The bundle to be sent; it will be left empty.
+ */
+void
+Sender::sendBundle(IpAddress destination, Bundle* bundle)
+{
+    perf->local().tx_bundle_pkts.add(1);
+    perf->local().tx_bytes.add(bundle->packet->length);
+    perf->peers.find(destination)->sent(bundle->packet->length);
+    driver->sendPacket(bundle->packet, destination, bundle->priority);
+    driver->releasePackets(&bundle->packet, 1);
+    bundle->packet = nullptr;
+}
+
 /**
  * Inform the Sender that a Message no longer needs to be sent.
  *
@@ -860,7 +1449,7 @@ Sender::cancelMessage(Sender::Message* message)
         if (message->numPackets > 1 &&
             message->state == OutMessage::Status::IN_PROGRESS) {
             // Check to see if the message needs to be dequeued.
-            SpinLock::Lock lock_queue(queueMutex);
+            QueueMutex::Lock lock_queue(queueMutex);
             // Recheck state with lock in case it change right before this.
             if (message->state == OutMessage::Status::IN_PROGRESS) {
                 QueuedMessageInfo* info = &message->queuedMessageInfo;
@@ -869,6 +1458,30 @@ Sender::cancelMessage(Sender::Message* message)
             }
         }
         message->state.store(OutMessage::Status::CANCELED);
+        message->timestamps.record(Message::FINISHED);
+        notifyDone(message);
+    }
+}
+
+/**
+ * Hold on to a message that has just become done so that it can be returned
+ * by getDoneMessages(), if the application asked to be notified.
+ *
+ * The caller must hold the message's MessageBucket::mutex.
+ *
+ * @param message
+ *      The Sender::Message that is now COMPLETED, FAILED, or CANCELED.
+ */
+void
+Sender::notifyDone(Sender::Message* message)
+{
+    if (!(message->options & OutMessage::Options::NOTIFY_DONE) ||
+        !message->held) {
+        return;
+    }
+    SpinLock::Lock lock_done(doneMessages.mutex);
+    if (!doneMessages.list.contains(&message->doneNode)) {
+        doneMessages.list.push_back(&message->doneNode);
     }
 }
 
@@ -885,21 +1498,59 @@ Sender::dropMessage(Sender::Message* message)
     MessageBucket* bucket = messageBuckets.getBucket(msgId);
     SpinLock::Lock lock(bucket->mutex);
     message->held = false;
-    Perf::counters.released_tx_messages.add(1);
+    perf->local().released_tx_messages.add(1);
+    if (message->options & OutMessage::Options::NOTIFY_DONE) {
+        // The application no longer wants to hear about the message.
+        SpinLock::Lock lock_done(doneMessages.mutex);
+        if (doneMessages.list.contains(&message->doneNode)) {
+            doneMessages.list.remove(&message->doneNode);
+        }
+    }
     if (message->state != OutMessage::Status::IN_PROGRESS) {
         // Ok to delete immediately since we don't have to wait for the message
         // to be sent.
         bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
         bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
         bucket->messages.remove(&message->bucketNode);
-        SpinLock::Lock lock_allocator(messageAllocator.mutex);
-        messageAllocator.pool.destroy(message);
-        Perf::counters.destroyed_tx_messages.add(1);
+        message->activeCount.set(&perf->peers, message->destination.ip, 0);
+        // A message that was never sent has no packets in trySend()'s hands.
+        if (message->numPackets > 1 &&
+            message->state != OutMessage::Status::NOT_STARTED) {
+            waitForTransmission();
+        }
+        destroyMessage(message);
     } else {
         // Defer deletion and wait for the message to be SENT.
     }
 }
 
+/**
+ * Destroy a message that is no longer tracked by the Sender.
+ *
+ * A message whose packets are still borrowed by copies created by fanOut() is
+ * kept until the last copy is destroyed.
+ *
+ * @param message
+ *      Sender::Message to destroy; it must not be in any MessageBucket.
+ */
+void
+Sender::destroyMessage(Sender::Message* message)
+{
+    Message* owner = message->payloadOwner;
+    if (message->payloadRefs.fetch_sub(1) > 1) {
+        // Copies still need this message's packets.
+        return;
+    }
+    {
+        SpinLock::Lock lock_allocator(messageAllocator.mutex);
+        messageAllocator.pool.destroy(message);
+    }
+    perf->local().destroyed_tx_messages.add(1);
+    if (owner != nullptr) {
+        destroyMessage(owner);
+    }
+}
+
 /**
  * Process any outbound messages in a given bucket that have timed out due to
  * lack of activity from the Receiver.
@@ -933,7 +1584,7 @@ Sender::checkMessageTimeouts(uint64_t now, MessageBucket* bucket)
         if (message->state != OutMessage::Status::COMPLETED) {
             if (message->state == OutMessage::Status::IN_PROGRESS) {
                 // Check to see if the message needs to be dequeued.
-                SpinLock::Lock lock_queue(queueMutex);
+                QueueMutex::Lock lock_queue(queueMutex);
                 // Recheck state with lock in case it change right before this.
                 if (message->state == OutMessage::Status::IN_PROGRESS) {
                     QueuedMessageInfo* info = &message->queuedMessageInfo;
@@ -942,6 +1593,9 @@ Sender::checkMessageTimeouts(uint64_t now, MessageBucket* bucket)
                 }
             }
             message->state.store(OutMessage::Status::FAILED);
+            message->timestamps.record(Message::FINISHED);
+            notifyDone(message);
+            perf->peers.find(message->destination.ip)->timeouts.fetch_add(1);
         }
         bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
         bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
@@ -989,11 +1643,16 @@ Sender::checkPingTimeouts(uint64_t now, MessageBucket* bucket)
             continue;
         } else {
             bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+            if (!bucket->messageTimeouts.isScheduled(
+                    &message->messageTimeout)) {
+                // Arm the message timeout deferred by sendMessage().
+                bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+            }
         }
 
         // Check if sender still has packets to send
         if (message->state.load() == OutMessage::Status::IN_PROGRESS) {
-            SpinLock::Lock lock_queue(queueMutex);
+            QueueMutex::Lock lock_queue(queueMutex);
             QueuedMessageInfo* info = &message->queuedMessageInfo;
             if (info->packetsSent < info->packetsGranted) {
                 // Sender is blocked on itself, no need to send ping
@@ -1003,9 +1662,9 @@ Sender::checkPingTimeouts(uint64_t now, MessageBucket* bucket)
 
         // Have not heard from the Receiver in the last timeout period. Ping
         // the receiver to ensure it still knows about this Message.
-        Perf::counters.tx_ping_pkts.add(1);
+        perf->local().tx_ping_pkts.add(1);
         ControlPacket::send<Protocol::Packet::PingHeader>(
-            message->driver, message->destination.ip, message->id);
+            message->driver, perf, message->destination.ip, message->id);
     }
 }
 
@@ -1035,11 +1694,24 @@ Sender::trySend()
      * the fewest remaining bytes to send (unsentBytes) are sent first (SRPT).
      * Each time this method is called we will try to send enough packet to keep
      * the NIC busy but not too many as to cause excessive queue in the NIC.
+     *
+     * The packets are picked while holding the queueMutex but handed to the
+     * driver only after it is released so that other threads (e.g. handling
+     * GRANTs or sending new messages) don't wait on the transmission.
      */
-    SpinLock::UniqueLock lock_queue(queueMutex);
+    struct {
+        Message* message;
+        int index;
+        int priority;
+    } batch[MAX_SEND_BATCH];
+    int batchSize = 0;
+    Protocol::MessageId sentMessageIds[MAX_SEND_BATCH];
+    int numSentMessages = 0;
     uint32_t queuedBytesEstimate = driver->getQueuedBytes();
-    std::vector<Protocol::MessageId> sentMessageIds;
-    sentMessageIds.reserve(32);
+
+    QueueMutex::UniqueLock lock_queue(queueMutex);
+    // Numbered before any message is marked SENT; see waitForTransmission().
+    uint64_t batchNumber = batchesStarted.fetch_add(1) + 1;
     // Optimistically assume we will finish sending every granted packet this
     // round; we will set again sendReady if it turns out we don't finish.
     sendReady = false;
@@ -1049,7 +1721,8 @@ Sender::trySend()
         assert(message.state.load() == OutMessage::Status::IN_PROGRESS);
         QueuedMessageInfo* info = &message.queuedMessageInfo;
         assert(info->packetsGranted <= info->packets->numPackets);
-        while (info->packetsSent < info->packetsGranted) {
+        while (info->packetsSent < info->packetsGranted &&
+               batchSize < MAX_SEND_BATCH) {
             // There are packets to send
             idle = false;
             Driver::Packet* packet =
@@ -1060,10 +1733,17 @@ Sender::trySend()
             if (queuedBytesEstimate > DRIVER_QUEUED_BYTE_LIMIT) {
                 break;
             }
-            // ... if not, send away!
-            Perf::counters.tx_data_pkts.add(1);
-            Perf::counters.tx_bytes.add(packet->length);
-            driver->sendPacket(packet, message.destination.ip, info->priority);
+            // ... if not, send away (once the lock is released).  The message
+            // is marked SENT as soon as its last packet is picked; another
+            // thread may process the receiver's DONE before it goes out.
+            if (info->packetsSent == 0) {
+                message.timestamps.recordFirst(Message::FIRST_PACKET_SENT);
+            }
+            if (info->packetsSent + 1 >= info->packets->numPackets) {
+                message.state.store(OutMessage::Status::SENT);
+                message.timestamps.recordFirst(Message::LAST_PACKET_SENT);
+            }
+            batch[batchSize++] = {&message, info->packetsSent, info->priority};
             int packetDataBytes =
                 packet->length - info->packets->TRANSPORT_HEADER_LENGTH;
             assert(info->unsentBytes >= packetDataBytes);
@@ -1077,25 +1757,34 @@ Sender::trySend()
         }
         if (info->packetsSent >= info->packets->numPackets) {
             // We have finished sending the message.
-            sentMessageIds.push_back(info->id);
-            message.state.store(OutMessage::Status::SENT);
+            sentMessageIds[numSentMessages++] = info->id;
             it = sendQueue.remove(it);
         } else if (info->packetsSent >= info->packetsGranted) {
             // We have sent every granted packet.
+            message.timestamps.recordFirst(Message::GRANT_WAIT_START);
             ++it;
         } else {
-            // We hit the DRIVER_QUEUED_BYTES_LIMIT; stop sending for now.
-            // We didn't finish sending all granted packets.
+            // We hit the DRIVER_QUEUED_BYTES_LIMIT or filled the batch; stop
+            // sending for now.  We didn't finish sending all granted packets.
             sendReady = true;
             break;
         }
     }
+    lock_queue.unlock();
+
+    for (int i = 0; i < batchSize; ++i) {
+        sendDataPacket(batch[i].message, batch[i].index, batch[i].priority);
+        // The packet may be resent from now on; see handleResendPacket().
+        batch[i].message->queuedMessageInfo.packetsTransmitted.store(
+            batch[i].index + 1, std::memory_order_release);
+    }
+    batchesTransmitted.store(batchNumber, std::memory_order_release);
     sending.clear();
 
-    // Unlock the queueMutex to process any SENT messages to ensure any bucket
-    // mutex is always acquired before the send queueMutex.
-    lock_queue.unlock();
-    for (Protocol::MessageId& msgId : sentMessageIds) {
+    // Process any SENT messages now that the queueMutex is released to ensure
+    // any bucket mutex is always acquired before the send queueMutex.
+    for (int i = 0; i < numSentMessages; ++i) {
+        Protocol::MessageId& msgId = sentMessageIds[i];
         MessageBucket* bucket = messageBuckets.getBucket(msgId);
         SpinLock::Lock lock(bucket->mutex);
         Message* message = bucket->findMessage(msgId, lock);
@@ -1109,9 +1798,8 @@ Sender::trySend()
             bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
             bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
             bucket->messages.remove(&message->bucketNode);
-            SpinLock::Lock lock_allocator(messageAllocator.mutex);
-            messageAllocator.pool.destroy(message);
-            Perf::counters.destroyed_tx_messages.add(1);
+            message->activeCount.set(&perf->peers, message->destination.ip, 0);
+            destroyMessage(message);
         } else if (message->options & OutMessage::Options::NO_KEEP_ALIVE) {
             // No timeouts need to be checked after sending the message when
             // the NO_KEEP_ALIVE option is enabled.
@@ -1121,7 +1809,27 @@ Sender::trySend()
     }
 
     if (!idle) {
-        Perf::counters.active_cycles.add(timer.split());
+        perf->addActiveCycles(timer.split());
+    }
+}
+
+/**
+ * Wait until the packets picked by an ongoing trySend() call have been handed
+ * to the driver.
+ *
+ * Must be called before changing or destroying a multi-packet message that
+ * is no longer in the sendQueue, but whose packets trySend() may have picked
+ * before it was removed.
+ */
+void
+Sender::waitForTransmission()
+{
+    // Only batches started before now can hold packets of such a message;
+    // later batches are not waited for, so the wait ends even while
+    // trySend() keeps being called.
+    uint64_t batch = batchesStarted.load();
+    while (batchesTransmitted.load(std::memory_order_acquire) < batch) {
+        TicketLock::pause();
     }
 }
 
@@ -23,12 +23,15 @@
 #include <array>
 #include <atomic>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "Intrusive.h"
 #include "ObjectPool.h"
+#include "Perf.h"
 #include "Policy.h"
 #include "Protocol.h"
 #include "SpinLock.h"
+#include "TicketLock.h"
 #include "Timeout.h"
 
 namespace Homa {
@@ -44,17 +47,35 @@ class Sender {
   public:
     explicit Sender(uint64_t transportId, Driver* driver,
                     Policy::Manager* policyManager,
+                    Perf::TransportCounters* perf,
                     uint64_t messageTimeoutCycles, uint64_t pingIntervalCycles);
     virtual ~Sender();
 
     virtual Homa::OutMessage* allocMessage(uint16_t sourcePort);
+    virtual void allocMessages(uint16_t sourcePort,
+                               Homa::OutMessage* messages[], size_t count);
+    Homa::OutMessage* allocMessage(uint16_t sourcePort,
+                                   Driver::Packet* const packets[],
+                                   int numPackets, int headroom,
+                                   int messageLength);
     virtual void handleDonePacket(Driver::Packet* packet);
     virtual void handleResendPacket(Driver::Packet* packet);
     virtual void handleGrantPacket(Driver::Packet* packet);
     virtual void handleUnknownPacket(Driver::Packet* packet);
     virtual void handleErrorPacket(Driver::Packet* packet);
+    virtual void handleResponse(Protocol::MessageId requestId,
+                                Homa::InMessage* response);
+    virtual void replyMessage(Homa::OutMessage* response,
+                              Protocol::MessageId requestId,
+                              SocketAddress destination,
+                              Homa::InMessage* request,
+                              OutMessage::Options options);
+    virtual size_t getDoneMessages(Homa::OutMessage* messages[],
+                                   size_t maxMessages);
     virtual void poll();
+    virtual bool pollSend();
     virtual void checkTimeouts();
+    void setCoalescingBudget(uint64_t budgetCycles);
 
   private:
     /// Forward declarations
@@ -90,6 +111,7 @@ class Sender {
             , packetsGranted(0)
             , priority(0)
             , packetsSent(0)
+            , packetsTransmitted(0)
             , sendQueueNode(message)
         {}
 
@@ -116,11 +138,41 @@ class Sender {
         /// The number of packets that have been sent for this Message.
         int packetsSent;
 
+        /// The number of packets of this Message that trySend() has handed to
+        /// the driver; trails packetsSent while trySend() transmits outside
+        /// the queueMutex.  Only these packets may be resent.  Written by
+        /// trySend() without holding the queueMutex.
+        std::atomic<int> packetsTransmitted;
+
         /// Intrusive structure used to enqueue the associated Message into
         /// the sendQueue.
         Intrusive::List<Message>::Node sendQueueNode;
     };
 
+    /**
+     * A BUNDLE packet into which small messages bound for one destination
+     * are being copied.
+     */
+    struct Bundle {
+        /**
+         * Bundle constructor.
+         */
+        Bundle()
+            : packet(nullptr)
+            , deadline(0)
+            , priority(0)
+        {}
+
+        /// Packet being filled; nullptr if no messages are waiting.
+        Driver::Packet* packet;
+
+        /// Cycle time by which the packet must be sent.
+        uint64_t deadline;
+
+        /// Highest network priority of the messages in the packet.
+        int priority;
+    };
+
     /**
      * Represents an outgoing message that can be sent.
      *
@@ -143,6 +195,13 @@ class Sender {
             , destination()
             , options(Options::NONE)
             , held(true)
+            , payloadOwner(nullptr)
+            , payloadRefs(1)
+            , policyVersion(0)
+            , unscheduledIndexLimit(0)
+            , compact(false)
+            , request(nullptr)
+            , response(nullptr)
             , start(0)
             , messageLength(0)
             , numPackets(0)
@@ -154,23 +213,48 @@ class Sender {
             , messageTimeout(this)
             , pingTimeout(this)
             , queuedMessageInfo(this)
+            , doneNode(this)
+            , activeCount(&Perf::PeerTable::Entry::active_messages)
+            , timestamps()
         {}
 
         virtual ~Message();
         virtual void append(const void* source, size_t count);
         virtual void cancel();
         virtual Status getStatus() const;
+        virtual Homa::unique_ptr<InMessage> getResponse();
         virtual size_t length() const;
         virtual void prepend(const void* source, size_t count);
         virtual void release();
         virtual void reserve(size_t count);
         virtual void send(SocketAddress destination,
                           Options options = Options::NONE);
+        virtual void fanOut(const SocketAddress destinations[], size_t count,
+                            Homa::unique_ptr<OutMessage> copies[],
+                            Options options = Options::NONE);
+        virtual Timing timing() const;
 
       private:
         /// Define the maximum number of packets that a message can hold.
         static const size_t MAX_MESSAGE_PACKETS = 1024;
 
+        /**
+         * Points in the life of the message recorded in timestamps; see
+         * OutMessage::Timing.
+         */
+        enum TimingPoint {
+            QUEUED,
+            FIRST_PACKET_SENT,
+            LAST_PACKET_SENT,
+            GRANT_WAIT_CYCLES,
+            FIRST_RESEND,
+            LAST_RESEND,
+            FINISHED,
+            GRANT_WAIT_START,  //< Every granted packet has been sent; only
+                               //< set while waiting for more grants.
+            NUM_TIMING_POINTS,
+        };
+
         Driver::Packet* getPacket(size_t index) const;
         Driver::Packet* getOrAllocPacket(size_t index);
 
@@ -205,6 +289,39 @@ class Sender {
         /// been release via dropMessage()); false, otherwise.
         bool held;
 
+        /// Message whose packets this message borrowed via fanOut(); nullptr
+        /// if this message owns its packets.  Borrowed packets are shared
+        /// between messages and are never written after fanOut(), so the
+        /// DATA headers of this message are built when each packet is sent.
+        Message* payloadOwner;
+
+        /// Number of references to this message's packets: one held on
+        /// behalf of the message itself plus one for each message borrowing
+        /// them.  The message is destroyed when the count reaches zero.
+        std::atomic<int> payloadRefs;
+
+        /// Policy version sent in the DATA headers of a message that borrows
+        /// its packets.
+        uint8_t policyVersion;
+
+        /// Unscheduled index limit sent in the DATA headers of a message that
+        /// borrows its packets.
+        uint16_t unscheduledIndexLimit;
+
+        /// True if the message's only packet has been rewritten in place with
+        /// a compact DATA header (see Sender::sendCompactPacket()).
+        bool compact;
+
+        /// Request to which this message is a response; nullptr if this
+        /// message is not a response.  The request is kept until this message
+        /// is destroyed and this message reuses its id.
+        Homa::InMessage* request;
+
+        /// Response received for this message that has not yet been returned
+        /// by getResponse(); nullptr if there is none.  Protected by the
+        /// associated MessageBucket::mutex.
+        Homa::InMessage* response;
+
         /// First byte where data is or will go if empty.
         int start;
 
@@ -246,6 +363,18 @@ class Sender {
         /// protected by the Sender::queueMutex.
         QueuedMessageInfo queuedMessageInfo;
 
+        /// Intrusive structure used by the Sender to hold this Message in
+        /// Sender::doneMessages once it is done.  Access to this structure is
+        /// protected by Sender::doneMessages.mutex.
+        Intrusive::List<Message>::Node doneNode;
+
+        /// This message's count (1 or 0) in its peer's active_messages
+        /// statistic.  Protected by the associated MessageBucket::mutex.
+        Perf::PeerTable::Share activeCount;
+
+        /// Times at which this message passed the points in TimingPoint.
+        Perf::Timestamps<NUM_TIMING_POINTS> timestamps;
+
         friend class Sender;
     };
 
@@ -265,13 +394,17 @@ class Sender {
          * @param pingIntervalCycles
          *      Number of cycles of inactivity to wait between checking on the
          *      liveness of a Message.
+         * @param nextTimeout
+         *      Deadline shared by all buckets; lowered whenever a timeout in
+         *      this bucket is scheduled to elapse before it.
          */
-        explicit MessageBucket(uint64_t messageTimeoutCycles,
-                               uint64_t pingIntervalCycles)
-            : mutex()
+        MessageBucket(uint64_t messageTimeoutCycles,
+                      uint64_t pingIntervalCycles,
+                      std::atomic<uint64_t>* nextTimeout)
+            : mutex("Sender::MessageBucket::mutex")
             , messages()
-            , messageTimeouts(messageTimeoutCycles)
-            , pingTimeouts(pingIntervalCycles)
+            , messageTimeouts(messageTimeoutCycles, nextTimeout)
+            , pingTimeouts(pingIntervalCycles, nextTimeout)
         {}
 
         /**
@@ -343,14 +476,17 @@ class Sender {
          * @param pingIntervalCycles
          *      Number of cycles of inactivity to wait between checking on the
          *      liveness of a Message.
+         * @param nextTimeout
+         *      Deadline shared by all buckets; see MessageBucket().
          */
         static std::array<MessageBucket*, NUM_BUCKETS> makeBuckets(
-            uint64_t messageTimeoutCycles, uint64_t pingIntervalCycles)
+            uint64_t messageTimeoutCycles, uint64_t pingIntervalCycles,
+            std::atomic<uint64_t>* nextTimeout)
         {
             std::array<MessageBucket*, NUM_BUCKETS> buckets;
             for (int i = 0; i < NUM_BUCKETS; ++i) {
-                buckets[i] =
-                    new MessageBucket(messageTimeoutCycles, pingIntervalCycles);
+                buckets[i] = new MessageBucket(
+                    messageTimeoutCycles, pingIntervalCycles, nextTimeout);
             }
             return buckets;
         }
@@ -364,10 +500,14 @@ class Sender {
          * @param pingIntervalCycles
          *      Number of cycles of inactivity to wait between checking on the
          *      liveness of a Message.
+         * @param nextTimeout
+         *      Deadline shared by all buckets; see MessageBucket().
          */
-        explicit MessageBucketMap(uint64_t messageTimeoutCycles,
-                                  uint64_t pingIntervalCycles)
-            : buckets(makeBuckets(messageTimeoutCycles, pingIntervalCycles))
+        MessageBucketMap(uint64_t messageTimeoutCycles,
+                         uint64_t pingIntervalCycles,
+                         std::atomic<uint64_t>* nextTimeout)
+            : buckets(makeBuckets(messageTimeoutCycles, pingIntervalCycles,
+                                  nextTimeout))
             , hasher()
         {}
 
@@ -400,11 +540,23 @@ class Sender {
 
     void sendMessage(Sender::Message* message, SocketAddress destination,
                      Message::Options options = Message::Options::NONE);
+    void fanOutMessage(Sender::Message* message,
+                       const SocketAddress destinations[], size_t count,
+                       Homa::unique_ptr<OutMessage> copies[],
+                       Message::Options options);
+    void sendDataPacket(Sender::Message* message, int index, int priority);
+    void sendCompactPacket(Sender::Message* message, int priority);
     void cancelMessage(Sender::Message* message);
+    void notifyDone(Sender::Message* message);
     void dropMessage(Sender::Message* message);
+    void destroyMessage(Sender::Message* message);
     void checkMessageTimeouts(uint64_t now, MessageBucket* bucket);
     void checkPingTimeouts(uint64_t now, MessageBucket* bucket);
     void trySend();
+    void waitForTransmission();
+    void flushBundles();
+    bool bundleMessage(Message* message, int priority);
+    void sendBundle(IpAddress destination, Bundle* bundle);
 
     /// Transport identifier.
     const uint64_t transportId;
@@ -416,6 +568,9 @@ class Sender {
     /// Provider of network packet priority decisions.
     Policy::Manager* const policyManager;
 
+    /// Performance counters of the Transport that owns this Sender.
+    Perf::TransportCounters* const perf;
+
     /// The sequence number to be used for the next Message.
     std::atomic<uint64_t> nextMessageSequenceNumber;
 
@@ -425,8 +580,12 @@ class Sender {
     /// Tracks all outbound messages being sent by the Sender.
     MessageBucketMap messageBuckets;
 
+    /// Lock type of the queueMutex.  Every poller that sends contends for it,
+    /// so it is a fair TicketLock.
+    using QueueMutex = TicketLock;
+
     /// Protects the readyQueue.
-    SpinLock queueMutex;
+    QueueMutex queueMutex;
 
     /// A list of outbound messages that have unsent packets.  Messages are kept
     /// in order of priority.
@@ -441,19 +600,77 @@ class Sender {
     /// if there is work to do is more efficient.
     std::atomic<bool> sendReady;
 
-    /// The index of the next bucket in the messageBuckets::buckets array to
-    /// process in the poll loop. The index is held in the lower order bits of
-    /// this variable; the higher order bits should be masked off using the
-    /// MessageBucketMap::HASH_KEY_MASK bit mask.
-    std::atomic<uint> nextBucketIndex;
+    /// Number of trySend() calls that have started picking packets; each
+    /// call's batch is numbered by this count after its increment.  Only
+    /// incremented while holding the queueMutex.
+    std::atomic<uint64_t> batchesStarted;
+
+    /// Number of the last trySend() batch whose packets have all been handed
+    /// to the driver.  Until then, those packets are no longer protected by
+    /// the queueMutex, so their messages must not be changed or destroyed
+    /// (see waitForTransmission()).
+    std::atomic<uint64_t> batchesTransmitted;
+
+    /// Maximum number of packets picked by one trySend() call.
+    static const int MAX_SEND_BATCH = 16;
+
+    /// Earliest cycle time at which any timeout in the messageBuckets might
+    /// elapse; lets checkTimeouts() return in O(1) when nothing is due.  It
+    /// may be earlier than any scheduled timeout (e.g. after cancellations),
+    /// but never later.
+    std::atomic<uint64_t> nextTimeout;
+
+    /// True if a thread is sweeping the messageBuckets in checkTimeouts();
+    /// false, otherwise.  Used to prevent concurrent sweeps from raising
+    /// nextTimeout past each other's unprocessed buckets.
+    std::atomic_flag sweeping = ATOMIC_FLAG_INIT;
 
     /// Used to allocate Message objects.
     struct {
         /// Protects the messageAllocator.pool
-        SpinLock mutex;
+        SpinLock mutex{"Sender::messageAllocator.mutex"};
         /// Pool allocator for Message objects.
         ObjectPool<Message> pool;
     } messageAllocator;
+
+    /// Peers that have acknowledged a message with a compact DONE and can
+    /// therefore receive single-packet messages with compact DATA headers.
+    struct {
+        /// Protects the compactPeers.set
+        SpinLock mutex{"Sender::compactPeers.mutex"};
+        /// Addresses of the compact capable peers.
+        std::unordered_set<IpAddress, IpAddress::Hasher> set;
+    } compactPeers;
+
+    /// Messages no longer than this many bytes may be coalesced.
+    static const int MAX_BUNDLED_MESSAGE_LENGTH = 512;
+
+    /// Number of cycles small messages may be held so they can be coalesced
+    /// into BUNDLE packets; 0 if coalescing is disabled.
+    std::atomic<uint64_t> coalescingBudgetCycles;
+
+    /// BUNDLE packets being filled with small messages for one destination.
+    struct {
+        /// Protects the bundles.map
+        SpinLock mutex{"Sender::bundles.mutex"};
+        /// Pending bundle for each destination with messages waiting to be
+        /// coalesced; a destination's entry is erased once its bundle is sent
+        /// by flushBundles().
+        std::unordered_map<IpAddress, Bundle, IpAddress::Hasher> map;
+    } bundles;
+
+    /// Earliest Bundle::deadline of the pending bundles; lets poll() skip
+    /// taking the bundles.mutex when nothing needs to be sent.
+    std::atomic<uint64_t> nextBundleDeadline;
+
+    /// Messages sent with OutMessage::NOTIFY_DONE that are done but have not
+    /// yet been returned by getDoneMessages().
+    struct {
+        /// Protects the doneMessages.list
+        SpinLock mutex{"Sender::doneMessages.mutex"};
+        /// Done messages in the order they became done.
+        Intrusive::List<Message> list;
+    } doneMessages;
 };
 
 }  // namespace Core
@@ -17,7 +17,12 @@
 #include <Homa/Debug.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <cstring>
+#include <thread>
+
 #include "Mock/MockDriver.h"
+#include "Mock/MockMessage.h"
 #include "Mock/MockPolicy.h"
 #include "Sender.h"
 
@@ -38,6 +43,7 @@ class SenderTest : public ::testing::Test {
         : mockDriver()
         , mockPacket{&payload}
         , mockPolicyManager(&mockDriver)
+        , perf()
         , sender()
         , savedLogPolicy(Debug::getLogPolicy())
     {
@@ -46,7 +52,7 @@ class SenderTest : public ::testing::Test {
         ON_CALL(mockDriver, getQueuedBytes).WillByDefault(Return(0));
         Debug::setLogPolicy(
             Debug::logPolicyFromString("src/ObjectPool@SILENT"));
-        sender = new Sender(22, &mockDriver, &mockPolicyManager,
+        sender = new Sender(22, &mockDriver, &mockPolicyManager, &perf,
                             messageTimeoutCycles, pingIntervalCycles);
         PerfUtils::Cycles::mockTscValue = 10000;
     }
@@ -62,6 +68,7 @@ class SenderTest : public ::testing::Test {
     Homa::Mock::MockDriver::MockPacket mockPacket;
     NiceMock<Homa::Mock::MockPolicyManager> mockPolicyManager;
     char payload[1028];
+    Perf::TransportCounters perf;
     Sender* sender;
     std::vector<std::pair<std::string, std::string>> savedLogPolicy;
 
@@ -128,6 +135,42 @@ TEST_F(SenderTest, allocMessage)
     EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
 }
 
+TEST_F(SenderTest, allocMessages)
+{
+    Homa::OutMessage* messages[3];
+    sender->allocMessages(60002, messages, 3);
+    EXPECT_EQ(3U, sender->messageAllocator.pool.outstandingObjects);
+    for (int i = 0; i < 3; ++i) {
+        Sender::Message* message = dynamic_cast<Sender::Message*>(messages[i]);
+        EXPECT_EQ(60002, message->source.port);
+    }
+}
+
+TEST_F(SenderTest, allocMessage_packets)
+{
+    char payloads[2][1031];
+    Homa::Mock::MockDriver::MockPacket packets[2] = {{payloads[0]},
+                                                     {payloads[1]}};
+    Driver::Packet* packetArray[2] = {&packets[0], &packets[1]};
+
+    Sender::Message* message = dynamic_cast<Sender::Message*>(
+        sender->allocMessage(60002, packetArray, 2, 20, 1500));
+
+    // 1031 - 31 bytes of data per packet.
+    EXPECT_EQ(2, message->numPackets);
+    EXPECT_EQ(&packets[0], message->getPacket(0));
+    EXPECT_EQ(&packets[1], message->getPacket(1));
+    EXPECT_EQ(1031, packets[0].length);
+    EXPECT_EQ(31 + 500, packets[1].length);
+    EXPECT_EQ(20, message->start);
+    EXPECT_EQ(1500, message->messageLength);
+    EXPECT_EQ(60002, message->source.port);
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&packets[0]), Eq(2)))
+        .Times(1);
+    sender->dropMessage(message);
+}
+
 TEST_F(SenderTest, handleDonePacket_basic)
 {
     Protocol::MessageId id = {42, 1};
@@ -158,6 +201,27 @@ TEST_F(SenderTest, handleDonePacket_basic)
     EXPECT_EQ(Homa::OutMessage::Status::COMPLETED, message->state);
 }
 
+TEST_F(SenderTest, handleDonePacket_compact)
+{
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    addMessage(sender, id, message);
+    message->destination = {22, 60001};
+    message->state = Homa::OutMessage::Status::SENT;
+
+    new (mockPacket.payload)
+        Protocol::Packet::DoneHeader(id, Protocol::Packet::COMPACT_VERSION);
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    sender->handleDonePacket(&mockPacket);
+
+    EXPECT_EQ(1U, sender->compactPeers.set.count(IpAddress{22}));
+    EXPECT_EQ(Homa::OutMessage::Status::COMPLETED, message->state);
+}
+
 TEST_F(SenderTest, handleDonePacket_CANCELED)
 {
     Protocol::MessageId id = {42, 1};
@@ -321,6 +385,7 @@ TEST_F(SenderTest, handleResendPacket_basic)
     SenderTest::addMessage(sender, id, message, true, 5);
     Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
     info->packetsSent = 5;
+    info->packetsTransmitted = 5;
     info->priority = 6;
     EXPECT_EQ(5, info->packetsGranted);
     EXPECT_EQ(10U, message->numPackets);
@@ -360,6 +425,51 @@ TEST_F(SenderTest, handleResendPacket_basic)
     }
 }
 
+TEST_F(SenderTest, handleResendPacket_transmitting)
+{
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    std::vector<Homa::Mock::MockDriver::MockPacket*> packets;
+    for (int i = 0; i < 10; ++i) {
+        packets.push_back(new Homa::Mock::MockDriver::MockPacket{payload});
+        setMessagePacket(message, i, packets[i]);
+    }
+    SenderTest::addMessage(sender, id, message, true, 5);
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    // trySend() picked packets 0-4 but has only handed 0-2 to the driver.
+    info->packetsSent = 5;
+    info->packetsTransmitted = 3;
+
+    Protocol::Packet::ResendHeader* resendHdr =
+        static_cast<Protocol::Packet::ResendHeader*>(mockPacket.payload);
+    resendHdr->common.messageId = id;
+    resendHdr->index = 2;
+    resendHdr->num = 3;
+    resendHdr->priority = 4;
+
+    EXPECT_CALL(mockPolicyManager, getResendPriority).WillOnce(Return(7));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packets[2]), _, Eq(7))).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    sender->handleResendPacket(&mockPacket);
+
+    // Only packets still being transmitted are requested.
+    Mock::VerifyAndClearExpectations(&mockDriver);
+    resendHdr->index = 3;
+    resendHdr->num = 2;
+    EXPECT_CALL(mockDriver, sendPacket).Times(0);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    sender->handleResendPacket(&mockPacket);
+
+    for (int i = 0; i < 10; ++i) {
+        delete packets[i];
+    }
+}
+
 TEST_F(SenderTest, handleResendPacket_staleResend)
 {
     Protocol::MessageId id = {42, 1};
@@ -684,9 +794,11 @@ TEST_F(SenderTest, handleUnknownPacket_basic)
         .WillOnce(Return(policyNew));
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(1);
+    sender->compactPeers.set.insert(destination.ip);
 
     sender->handleUnknownPacket(&mockPacket);
 
+    EXPECT_EQ(0U, sender->compactPeers.set.count(destination.ip));
     EXPECT_EQ(Homa::OutMessage::Status::IN_PROGRESS, message->state);
     for (int i = 0; i < 3; ++i) {
         Homa::Mock::MockDriver::MockPacket* packet = packets[i];
@@ -757,6 +869,58 @@ TEST_F(SenderTest, handleUnknownPacket_singlePacketMessage)
     EXPECT_FALSE(sender->sendReady.load());
 }
 
+TEST_F(SenderTest, handleUnknownPacket_compactMessage)
+{
+    Protocol::MessageId id = {42, 1};
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {2, 3000, 2};
+
+    // A message that was sent with a compact header.
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(60002));
+    char dataPayload[1028];
+    Homa::Mock::MockDriver::MockPacket dataPacket{dataPayload};
+    setMessagePacket(message, 0, &dataPacket);
+    message->id = id;
+    message->destination = destination;
+    message->messageLength = 100;
+    message->compact = true;
+    new (dataPayload)
+        Protocol::Packet::CompactDataHeader(60002, 60001, 1, 100, 1);
+    std::memset(dataPayload + sizeof(Protocol::Packet::CompactDataHeader), 'x',
+                message->messageLength);
+    dataPacket.length =
+        sizeof(Protocol::Packet::CompactDataHeader) + message->messageLength;
+    message->state.store(Homa::OutMessage::Status::SENT);
+    SenderTest::addMessage(sender, id, message);
+    sender->compactPeers.set.insert(destination.ip);
+
+    Protocol::Packet::UnknownHeader* header =
+        static_cast<Protocol::Packet::UnknownHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&dataPacket), _, _)).Times(1);
+
+    sender->handleUnknownPacket(&mockPacket);
+
+    // The message is resent with its full header restored.
+    Protocol::Packet::DataHeader* dataHeader =
+        static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload);
+    EXPECT_EQ(Protocol::Packet::VERSION, dataHeader->common.prefix.version);
+    EXPECT_EQ(id, dataHeader->common.messageId);
+    EXPECT_EQ(100U, dataHeader->totalLength);
+    EXPECT_EQ(policy.version, dataHeader->policyVersion);
+    EXPECT_EQ(0U, dataHeader->index);
+    EXPECT_EQ(message->TRANSPORT_HEADER_LENGTH + message->messageLength,
+              dataPacket.length);
+    EXPECT_EQ('x', dataPayload[message->TRANSPORT_HEADER_LENGTH]);
+    EXPECT_EQ('x', dataPayload[message->TRANSPORT_HEADER_LENGTH + 99]);
+    EXPECT_FALSE(message->compact);
+    EXPECT_EQ(0U, sender->compactPeers.set.count(destination.ip));
+}
+
 TEST_F(SenderTest, handleUnknownPacket_NO_KEEP_ALIVE)
 {
     Protocol::MessageId id = {42, 1};
@@ -1081,21 +1245,216 @@ TEST_F(SenderTest, handleErrorPacket_noMessage)
     sender->handleErrorPacket(&mockPacket);
 }
 
+TEST_F(SenderTest, handleResponse)
+{
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    SenderTest::addMessage(sender, id, message);
+    Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+    message->state = Homa::OutMessage::Status::SENT;
+    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+    bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    NiceMock<Homa::Mock::MockInMessage> response;
+    NiceMock<Homa::Mock::MockInMessage> duplicate;
+    EXPECT_CALL(response, release).Times(0);
+    EXPECT_CALL(duplicate, release).Times(1);
+
+    sender->handleResponse(id, &response);
+
+    EXPECT_EQ(Homa::OutMessage::Status::COMPLETED, message->state);
+    EXPECT_EQ(nullptr, message->messageTimeout.node.list);
+    EXPECT_EQ(nullptr, message->pingTimeout.node.list);
+    EXPECT_EQ(&response, message->response);
+
+    sender->handleResponse(id, &duplicate);
+
+    EXPECT_EQ(&response, message->response);
+    Mock::VerifyAndClearExpectations(&response);
+
+    Homa::unique_ptr<Homa::InMessage> received = message->getResponse();
+    EXPECT_EQ(&response, received.get());
+    EXPECT_EQ(nullptr, message->response);
+    EXPECT_EQ(nullptr, message->getResponse());
+    EXPECT_CALL(response, release).Times(1);
+}
+
+TEST_F(SenderTest, handleResponse_noMessage)
+{
+    NiceMock<Homa::Mock::MockInMessage> response;
+    EXPECT_CALL(response, release).Times(1);
+
+    sender->handleResponse({42, 1}, &response);
+}
+
+TEST_F(SenderTest, replyMessage)
+{
+    Protocol::MessageId requestId = {42, 7};
+    uint64_t sequence = sender->nextMessageSequenceNumber;
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(60002));
+    setMessagePacket(message, 0, &mockPacket);
+    message->messageLength = 100;
+    mockPacket.length =
+        message->messageLength + message->TRANSPORT_HEADER_LENGTH;
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 3000, 2};
+    // Responses are never sent with compact headers.
+    sender->compactPeers.set.insert(destination.ip);
+    NiceMock<Homa::Mock::MockInMessage> request;
+
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver,
+                sendPacket(Eq(&mockPacket), Eq(destination.ip), Eq(2)))
+        .Times(1);
+    EXPECT_CALL(request, release).Times(0);
+
+    sender->replyMessage(message, requestId, destination, &request,
+                         OutMessage::Options::NONE);
+
+    EXPECT_EQ(requestId, message->id);
+    EXPECT_EQ(&request, message->request);
+    EXPECT_EQ(sequence, sender->nextMessageSequenceNumber);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    EXPECT_EQ(requestId, header->common.messageId);
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
+
+    Mock::VerifyAndClearExpectations(&request);
+    EXPECT_CALL(request, release).Times(1);
+    sender->dropMessage(message);
+}
+
+TEST_F(SenderTest, getDoneMessages)
+{
+    Sender::Message* message[3];
+    for (int i = 0; i < 3; ++i) {
+        message[i] = dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+        message[i]->options = OutMessage::Options::NOTIFY_DONE;
+        sender->notifyDone(message[i]);
+    }
+    Homa::OutMessage* done[2] = {};
+
+    EXPECT_EQ(2U, sender->getDoneMessages(done, 2));
+    EXPECT_EQ(message[0], done[0]);
+    EXPECT_EQ(message[1], done[1]);
+    EXPECT_EQ(1U, sender->getDoneMessages(done, 2));
+    EXPECT_EQ(message[2], done[0]);
+    EXPECT_EQ(0U, sender->getDoneMessages(done, 2));
+
+    for (int i = 0; i < 3; ++i) {
+        sender->dropMessage(message[i]);
+    }
+}
+
 TEST_F(SenderTest, poll)
 {
     // Nothing to test.
     sender->poll();
 }
 
+TEST_F(SenderTest, pollSend)
+{
+    sender->sendReady = false;
+    EXPECT_FALSE(sender->pollSend());
+}
+
+TEST_F(SenderTest, setCoalescingBudget)
+{
+    sender->setCoalescingBudget(100);
+    EXPECT_EQ(100U, sender->coalescingBudgetCycles);
+    EXPECT_EQ(UINT64_MAX, sender->nextBundleDeadline);
+
+    // Disabling coalescing flushes pending bundles on the next poll.
+    sender->setCoalescingBudget(0);
+    EXPECT_EQ(0U, sender->coalescingBudgetCycles);
+    EXPECT_EQ(0U, sender->nextBundleDeadline);
+}
+
+TEST_F(SenderTest, flushBundles)
+{
+    char bundlePayload[2][1031];
+    Homa::Mock::MockDriver::MockPacket bundlePacket[2] = {{bundlePayload[0]},
+                                                          {bundlePayload[1]}};
+    sender->bundles.map[IpAddress{22}].packet = &bundlePacket[0];
+    sender->bundles.map[IpAddress{22}].deadline = 10000;
+    sender->bundles.map[IpAddress{23}].packet = &bundlePacket[1];
+    sender->bundles.map[IpAddress{23}].deadline = 10100;
+    sender->coalescingBudgetCycles = 100;
+    sender->nextBundleDeadline = 10000;
+
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&bundlePacket[0]), _, _)).Times(1);
+    EXPECT_CALL(mockDriver,
+                releasePackets(Pointee(&bundlePacket[0]), Eq(1)))
+        .Times(1);
+
+    sender->flushBundles();
+
+    EXPECT_EQ(0U, sender->bundles.map.count(IpAddress{22}));
+    EXPECT_EQ(&bundlePacket[1], sender->bundles.map[IpAddress{23}].packet);
+    EXPECT_EQ(10100U, sender->nextBundleDeadline);
+
+    // Nothing is due yet.
+    EXPECT_CALL(mockDriver, sendPacket).Times(0);
+    sender->flushBundles();
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&bundlePacket[1]), _, _)).Times(1);
+    EXPECT_CALL(mockDriver,
+                releasePackets(Pointee(&bundlePacket[1]), Eq(1)))
+        .Times(1);
+    PerfUtils::Cycles::mockTscValue = 10100;
+    sender->flushBundles();
+    EXPECT_EQ(UINT64_MAX, sender->nextBundleDeadline);
+    EXPECT_TRUE(sender->bundles.map.empty());
+}
+
 TEST_F(SenderTest, checkTimeouts)
 {
-    Sender::MessageBucket* bucket = sender->messageBuckets.buckets.at(0);
+    Sender::MessageBucket* bucket0 = sender->messageBuckets.buckets.at(0);
+    Sender::MessageBucket* bucket1 = sender->messageBuckets.buckets.at(1);
+    Sender::Message* message[3];
+    for (int i = 0; i < 3; ++i) {
+        message[i] = dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+        message[i]->state = Homa::OutMessage::Status::COMPLETED;
+    }
+    EXPECT_EQ(UINT64_MAX, sender->nextTimeout.load());
 
-    EXPECT_EQ(0, sender->nextBucketIndex.load());
+    bucket0->pingTimeouts.setTimeout(&message[0]->pingTimeout);
+    bucket1->pingTimeouts.setTimeout(&message[1]->pingTimeout);
+    PerfUtils::Cycles::mockTscValue = 10050;
+    bucket1->messageTimeouts.setTimeout(&message[2]->messageTimeout);
+    EXPECT_EQ(10100U, sender->nextTimeout.load());
 
+    // Nothing due yet.
     sender->checkTimeouts();
+    EXPECT_TRUE(bucket0->pingTimeouts.isScheduled(&message[0]->pingTimeout));
+    EXPECT_EQ(10100U, sender->nextTimeout.load());
 
-    EXPECT_EQ(1, sender->nextBucketIndex.load());
+    // Every due timeout is processed, whichever bucket it is in.
+    PerfUtils::Cycles::mockTscValue = 10100;
+    sender->checkTimeouts();
+    EXPECT_FALSE(bucket0->pingTimeouts.isScheduled(&message[0]->pingTimeout));
+    EXPECT_FALSE(bucket1->pingTimeouts.isScheduled(&message[1]->pingTimeout));
+    EXPECT_TRUE(
+        bucket1->messageTimeouts.isScheduled(&message[2]->messageTimeout));
+    EXPECT_EQ(11050U, sender->nextTimeout.load());
+}
+
+TEST_F(SenderTest, checkTimeouts_sweeping)
+{
+    Sender::MessageBucket* bucket = sender->messageBuckets.buckets.at(0);
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    message->state = Homa::OutMessage::Status::COMPLETED;
+    bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    PerfUtils::Cycles::mockTscValue = 10100;
+
+    sender->sweeping.test_and_set();
+    sender->checkTimeouts();
+    EXPECT_TRUE(bucket->pingTimeouts.isScheduled(&message->pingTimeout));
+    sender->sweeping.clear();
 }
 
 TEST_F(SenderTest, Message_destructor)
@@ -1295,6 +1654,30 @@ TEST_F(SenderTest, Message_send)
     // Nothing to test
 }
 
+TEST_F(SenderTest, Message_timing)
+{
+    Sender::Message msg(sender, 0);
+    for (int i = 0; i < Sender::Message::NUM_TIMING_POINTS; ++i) {
+        PerfUtils::Cycles::mockTscValue = 10000 + i;
+        msg.timestamps.record(i);
+    }
+
+    OutMessage::Timing timing = msg.timing();
+
+#if HOMA_MESSAGE_TIMING
+    EXPECT_EQ(10000U, timing.queued);
+    EXPECT_EQ(10001U, timing.firstPacketSent);
+    EXPECT_EQ(10002U, timing.lastPacketSent);
+    EXPECT_EQ(10003U, timing.grantWaitCycles);
+    EXPECT_EQ(10004U, timing.firstResend);
+    EXPECT_EQ(10005U, timing.lastResend);
+    EXPECT_EQ(10006U, timing.finished);
+#else
+    EXPECT_EQ(0U, timing.queued);
+    EXPECT_EQ(0U, timing.finished);
+#endif
+}
+
 TEST_F(SenderTest, Message_getPacket)
 {
     Sender::Message msg(sender, 0);
@@ -1412,7 +1795,8 @@ TEST_F(SenderTest, sendMessage_basic)
 
     // Check Sender metadata
     EXPECT_TRUE(bucket->messages.contains(&message->bucketNode));
-    EXPECT_EQ(11000U, message->messageTimeout.expirationCycleTime);
+    // The message timeout of a single-packet message is deferred.
+    EXPECT_FALSE(bucket->messageTimeouts.isScheduled(&message->messageTimeout));
     EXPECT_EQ(10100U, message->pingTimeout.expirationCycleTime);
 
     // Check sent packet metadata
@@ -1422,6 +1806,155 @@ TEST_F(SenderTest, sendMessage_basic)
     EXPECT_FALSE(sender->sendReady.load());
 }
 
+TEST_F(SenderTest, sendMessage_compact)
+{
+    Protocol::MessageId id = {sender->transportId,
+                              sender->nextMessageSequenceNumber};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(60002));
+    setMessagePacket(message, 0, &mockPacket);
+    message->messageLength = 100;
+    mockPacket.length =
+        message->messageLength + message->TRANSPORT_HEADER_LENGTH;
+    std::memset(static_cast<char*>(mockPacket.payload) +
+                    message->TRANSPORT_HEADER_LENGTH,
+                'x', message->messageLength);
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 3000, 2};
+    sender->compactPeers.set.insert(destination.ip);
+
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), Eq(destination.ip), _))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets).Times(0);
+
+    sender->sendMessage(message, destination);
+
+    // The packet is rewritten in place.
+    char* compactPayload = static_cast<char*>(mockPacket.payload);
+    Protocol::Packet::CompactDataHeader* header =
+        static_cast<Protocol::Packet::CompactDataHeader*>(mockPacket.payload);
+    EXPECT_EQ(Protocol::Packet::COMPACT_VERSION, header->prefix.version);
+    EXPECT_EQ(Protocol::Packet::DATA, header->opcode);
+    EXPECT_EQ(htobe16(60002), header->prefix.sport);
+    EXPECT_EQ(htobe16(60001), header->prefix.dport);
+    EXPECT_EQ(id.sequence, header->sequence);
+    EXPECT_EQ(100U, header->length);
+    EXPECT_EQ(policy.version, header->policyVersion);
+    EXPECT_EQ(sizeof(Protocol::Packet::CompactDataHeader) + 100,
+              mockPacket.length);
+    EXPECT_EQ('x', compactPayload[sizeof(Protocol::Packet::CompactDataHeader)]);
+    EXPECT_EQ('x',
+              compactPayload[sizeof(Protocol::Packet::CompactDataHeader) + 99]);
+    EXPECT_TRUE(message->compact);
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
+}
+
+TEST_F(SenderTest, sendMessage_bundled)
+{
+    SocketAddress destination = {22, 60001};
+    char payloads[2][1031];
+    Homa::Mock::MockDriver::MockPacket packets[2] = {{payloads[0]},
+                                                     {payloads[1]}};
+    Sender::Message* message[2];
+    for (int i = 0; i < 2; ++i) {
+        message[i] = dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+        setMessagePacket(message[i], 0, &packets[i]);
+        message[i]->messageLength = 100;
+        packets[i].length = 100 + message[i]->TRANSPORT_HEADER_LENGTH;
+    }
+    char bundlePayload[1031];
+    Homa::Mock::MockDriver::MockPacket bundlePacket{bundlePayload};
+    sender->setCoalescingBudget(100);
+
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&bundlePacket));
+    EXPECT_CALL(mockDriver, sendPacket).Times(0);
+
+    sender->sendMessage(message[0], destination);
+    sender->sendMessage(message[1], destination);
+
+    Protocol::Packet::BundleHeader* header =
+        static_cast<Protocol::Packet::BundleHeader*>(bundlePacket.payload);
+    EXPECT_EQ(Protocol::Packet::BUNDLE, header->opcode);
+    EXPECT_EQ(2U, header->numMessages);
+    EXPECT_EQ(sizeof(Protocol::Packet::BundleHeader) + 2 * (31 + 100),
+              bundlePacket.length);
+    Protocol::Packet::DataHeader* entry =
+        reinterpret_cast<Protocol::Packet::DataHeader*>(
+            bundlePayload + sizeof(Protocol::Packet::BundleHeader) + 131);
+    EXPECT_EQ(message[1]->id, entry->common.messageId);
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message[0]->state);
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message[1]->state);
+    EXPECT_EQ(10100U, sender->nextBundleDeadline);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // The bundle is sent once the budget expires.
+    EXPECT_CALL(mockDriver,
+                sendPacket(Eq(&bundlePacket), Eq(destination.ip), _))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&bundlePacket), Eq(1)))
+        .Times(1);
+    PerfUtils::Cycles::mockTscValue = 10100;
+    sender->flushBundles();
+}
+
+TEST_F(SenderTest, bundleMessage_full)
+{
+    SocketAddress destination = {22, 60001};
+    char payloads[2][1031];
+    Homa::Mock::MockDriver::MockPacket packets[2] = {{payloads[0]},
+                                                     {payloads[1]}};
+    Sender::Message* message[2];
+    for (int i = 0; i < 2; ++i) {
+        message[i] = dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+        setMessagePacket(message[i], 0, &packets[i]);
+        message[i]->destination = destination;
+        message[i]->messageLength = 500;
+        packets[i].length = 500 + message[i]->TRANSPORT_HEADER_LENGTH;
+    }
+    char bundlePayload[2][1031];
+    Homa::Mock::MockDriver::MockPacket bundlePacket[2] = {{bundlePayload[0]},
+                                                          {bundlePayload[1]}};
+    sender->setCoalescingBudget(100);
+
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&bundlePacket[0]))
+        .WillOnce(Return(&bundlePacket[1]));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&bundlePacket[0]), _, Eq(3)))
+        .Times(1);
+    EXPECT_CALL(mockDriver,
+                releasePackets(Pointee(&bundlePacket[0]), Eq(1)))
+        .Times(1);
+
+    EXPECT_TRUE(sender->bundleMessage(message[0], 3));
+    EXPECT_TRUE(sender->bundleMessage(message[1], 1));
+
+    EXPECT_EQ(&bundlePacket[1], sender->bundles.map[destination.ip].packet);
+    EXPECT_EQ(1, sender->bundles.map[destination.ip].priority);
+    sender->bundles.map.clear();
+}
+
+TEST_F(SenderTest, bundleMessage_notBundled)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    setMessagePacket(message, 0, &mockPacket);
+    message->messageLength = 100;
+    mockPacket.length = 100 + message->TRANSPORT_HEADER_LENGTH;
+
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
+
+    // Coalescing disabled.
+    EXPECT_FALSE(sender->bundleMessage(message, 0));
+
+    // Message too large.
+    sender->setCoalescingBudget(100);
+    message->messageLength = Sender::MAX_BUNDLED_MESSAGE_LENGTH + 1;
+    EXPECT_FALSE(sender->bundleMessage(message, 0));
+}
+
 TEST_F(SenderTest, sendMessage_multipacket)
 {
     char payload0[1027];
@@ -1553,6 +2086,121 @@ TEST_F(SenderTest, sendMessage_unscheduledLimit)
     EXPECT_EQ(5U, info->packetsGranted);
 }
 
+TEST_F(SenderTest, fanOutMessage)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(60002));
+    setMessagePacket(message, 0, &mockPacket);
+    message->messageLength = 100;
+    mockPacket.length =
+        message->messageLength + message->TRANSPORT_HEADER_LENGTH;
+    std::memset(payload, 0, message->TRANSPORT_HEADER_LENGTH);
+    std::memset(payload + message->TRANSPORT_HEADER_LENGTH, 'x',
+                message->messageLength);
+    SocketAddress destinations[2] = {{22, 60001}, {23, 60003}};
+    Core::Policy::Unscheduled policy = {1, 3000, 2};
+
+    // Each replica sends the shared packet behind its own header; nothing
+    // is allocated or copied by the Sender.
+    const uint32_t headerLength = sizeof(Protocol::Packet::DataHeader);
+    char headerBytes[2][headerLength];
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillRepeatedly(Return(policy));
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
+    EXPECT_CALL(mockDriver, sendPacket).Times(0);
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_CALL(mockDriver,
+                    sendPacketWithHeader(_, Eq(headerLength), Eq(&mockPacket),
+                                         Eq(headerLength),
+                                         Eq(destinations[i].ip), Eq(2)))
+            .WillOnce([&headerBytes, i](const void* header, uint32_t length,
+                                        Driver::Packet*, uint32_t, IpAddress,
+                                        int) {
+                std::memcpy(headerBytes[i], header, length);
+            });
+    }
+
+    Homa::unique_ptr<OutMessage> copies[2];
+    sender->fanOutMessage(message, destinations, 2, copies,
+                          OutMessage::Options::NONE);
+
+    EXPECT_EQ(3U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(3, message->payloadRefs);
+    EXPECT_EQ(OutMessage::Status::NOT_STARTED, message->state);
+    for (int i = 0; i < 2; ++i) {
+        Sender::Message* copy = dynamic_cast<Sender::Message*>(copies[i].get());
+        EXPECT_EQ(message, copy->payloadOwner);
+        EXPECT_EQ(&mockPacket, copy->getPacket(0));
+        EXPECT_EQ(OutMessage::Status::SENT, copy->state);
+        Protocol::Packet::DataHeader* header =
+            reinterpret_cast<Protocol::Packet::DataHeader*>(headerBytes[i]);
+        EXPECT_EQ(copy->id, header->common.messageId);
+        EXPECT_EQ(htobe16(destinations[i].port), header->common.prefix.dport);
+        EXPECT_EQ(100U, header->totalLength);
+    }
+    // The shared packet is never written.
+    EXPECT_EQ(0, payload[0]);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(0);
+    copies[0].reset();
+    sender->dropMessage(message);
+    EXPECT_EQ(2U, sender->messageAllocator.pool.outstandingObjects);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+    copies[1].reset();
+    EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+}
+
+TEST_F(SenderTest, fanOutMessage_compact)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(60002));
+    setMessagePacket(message, 0, &mockPacket);
+    message->messageLength = 100;
+    mockPacket.length =
+        message->messageLength + message->TRANSPORT_HEADER_LENGTH;
+    std::memset(payload, 0, message->TRANSPORT_HEADER_LENGTH);
+    std::memset(payload + message->TRANSPORT_HEADER_LENGTH, 'x',
+                message->messageLength);
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 3000, 2};
+    sender->compactPeers.set.insert(destination.ip);
+
+    Protocol::Packet::CompactDataHeader header(0, 0, 0, 0, 0);
+    const uint32_t headerLength = sizeof(header);
+    const uint32_t payloadOffset = message->TRANSPORT_HEADER_LENGTH;
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, sendPacket).Times(0);
+    EXPECT_CALL(mockDriver,
+                sendPacketWithHeader(_, Eq(headerLength), Eq(&mockPacket),
+                                     Eq(payloadOffset), Eq(destination.ip), _))
+        .WillOnce([&header](const void* source, uint32_t length,
+                            Driver::Packet*, uint32_t, IpAddress, int) {
+            std::memcpy(&header, source, length);
+        });
+
+    Homa::unique_ptr<OutMessage> copy;
+    sender->fanOutMessage(message, &destination, 1, &copy,
+                          OutMessage::Options::NONE);
+
+    // The shared packet is sent behind a separate compact header rather than
+    // rewritten in place.
+    EXPECT_EQ(Protocol::Packet::COMPACT_VERSION, header.prefix.version);
+    EXPECT_EQ(100U, header.length);
+    EXPECT_FALSE(dynamic_cast<Sender::Message*>(copy.get())->compact);
+    EXPECT_EQ(0, payload[0]);
+    EXPECT_EQ('x', payload[message->TRANSPORT_HEADER_LENGTH]);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+    copy.reset();
+    sender->dropMessage(message);
+}
+
 TEST_F(SenderTest, cancelMessage)
 {
     Protocol::MessageId id = {42, 1};
@@ -1577,6 +2225,34 @@ TEST_F(SenderTest, cancelMessage)
     EXPECT_EQ(Homa::OutMessage::Status::CANCELED, message->state.load());
 }
 
+TEST_F(SenderTest, notifyDone)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+
+    // Not requested.
+    sender->notifyDone(message);
+    EXPECT_TRUE(sender->doneMessages.list.empty());
+
+    // Requested.
+    message->options = OutMessage::Options::NOTIFY_DONE;
+    sender->notifyDone(message);
+    EXPECT_EQ(1U, sender->doneMessages.list.size());
+
+    // Already queued.
+    sender->notifyDone(message);
+    EXPECT_EQ(1U, sender->doneMessages.list.size());
+
+    // Released by the application.
+    sender->doneMessages.list.clear();
+    message->held = false;
+    sender->notifyDone(message);
+    EXPECT_TRUE(sender->doneMessages.list.empty());
+
+    message->held = true;
+    sender->dropMessage(message);
+}
+
 TEST_F(SenderTest, dropMessage_basic)
 {
     Sender::Message* message =
@@ -1588,6 +2264,28 @@ TEST_F(SenderTest, dropMessage_basic)
     sender->dropMessage(message);
 
     EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+    // Unsent messages were never counted as active.
+    std::vector<Perf::PeerStats> stats;
+    perf.peers.getStats(&stats);
+    EXPECT_TRUE(stats.empty());
+}
+
+TEST_F(SenderTest, dropMessage_SENT)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Protocol::MessageId id = {42, 1};
+    SenderTest::addMessage(sender, id, message);
+    message->state = OutMessage::Status::SENT;
+    message->activeCount.set(&perf.peers, IpAddress{22}, 1);
+    message->destination = {22, 60001};
+    Perf::PeerTable::Entry* peer = perf.peers.find(IpAddress{22});
+    EXPECT_EQ(1, peer->active_messages.get());
+
+    sender->dropMessage(message);
+
+    EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(0, peer->active_messages.get());
 }
 
 TEST_F(SenderTest, dropMessage_IN_PROGRESS)
@@ -1604,6 +2302,62 @@ TEST_F(SenderTest, dropMessage_IN_PROGRESS)
     EXPECT_FALSE(message->held);
 }
 
+TEST_F(SenderTest, dropMessage_doneMessage)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Protocol::MessageId id = {42, 1};
+    SenderTest::addMessage(sender, id, message);
+    message->options = OutMessage::Options::NOTIFY_DONE;
+    message->state = OutMessage::Status::SENT;
+    Protocol::Packet::DoneHeader* header =
+        static_cast<Protocol::Packet::DoneHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)));
+    sender->handleDonePacket(&mockPacket);
+    EXPECT_TRUE(sender->doneMessages.list.contains(&message->doneNode));
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    sender->dropMessage(message);
+
+    EXPECT_TRUE(sender->doneMessages.list.empty());
+    EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+}
+
+TEST_F(SenderTest, dropMessage_NOT_STARTED)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    char payloads[2][1028];
+    Homa::Mock::MockDriver::MockPacket packets[2] = {{payloads[0]},
+                                                     {payloads[1]}};
+    setMessagePacket(message, 0, &packets[0]);
+    setMessagePacket(message, 1, &packets[1]);
+    // A trySend() batch is in progress; it can't hold unsent packets.
+    sender->batchesStarted = 1;
+
+    sender->dropMessage(message);
+
+    EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+}
+
+TEST_F(SenderTest, waitForTransmission)
+{
+    sender->waitForTransmission();
+
+    sender->batchesStarted = 2;
+    sender->batchesTransmitted = 1;
+    std::thread sendThread([this] {
+        // Later batches start while the first one is still transmitting.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        sender->batchesStarted = 5;
+        sender->batchesTransmitted = 2;
+    });
+    sender->waitForTransmission();
+    sendThread.join();
+    EXPECT_LE(2U, sender->batchesTransmitted);
+}
+
 TEST_F(SenderTest, checkMessageTimeouts)
 {
     Sender::Message* message[4];
@@ -1705,6 +2459,7 @@ TEST_F(SenderTest, checkPingTimeouts)
     EXPECT_EQ(10100, message[4]->pingTimeout.expirationCycleTime);
     // Message[4]: Normal timeout: SENT
     EXPECT_EQ(10100, message[4]->pingTimeout.expirationCycleTime);
+    EXPECT_EQ(11000, message[4]->messageTimeout.expirationCycleTime);
     Protocol::Packet::CommonHeader* header =
         static_cast<Protocol::Packet::CommonHeader*>(mockPacket.payload);
     EXPECT_EQ(Protocol::Packet::PING, header->opcode);
@@ -1803,6 +2558,54 @@ TEST_F(SenderTest, trySend_basic)
     }
 }
 
+TEST_F(SenderTest, trySend_batchLimit)
+{
+    Protocol::MessageId id = {42, 10};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    const int BATCH = Sender::MAX_SEND_BATCH;
+    const int NUM_PKTS = BATCH + 4;
+    SenderTest::addMessage(sender, id, message, true, NUM_PKTS);
+    Homa::Mock::MockDriver::MockPacket* packet[NUM_PKTS];
+    for (int i = 0; i < NUM_PKTS; ++i) {
+        packet[i] = new Homa::Mock::MockDriver::MockPacket{payload};
+        packet[i]->length = message->TRANSPORT_HEADER_LENGTH + 10;
+        setMessagePacket(message, i, packet[i]);
+        info->unsentBytes += 10;
+    }
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    sender->sendReady = true;
+
+    // Packets are handed to the driver after the queueMutex is released.
+    EXPECT_CALL(mockDriver, sendPacket)
+        .Times(BATCH)
+        .WillRepeatedly([this](Driver::Packet*, IpAddress, int) {
+            EXPECT_LT(sender->batchesTransmitted, sender->batchesStarted);
+            EXPECT_TRUE(sender->queueMutex.try_lock());
+            sender->queueMutex.unlock();
+        });
+    sender->trySend();  // < test call
+    EXPECT_TRUE(sender->sendReady);
+    EXPECT_EQ(1U, sender->batchesStarted);
+    EXPECT_EQ(1U, sender->batchesTransmitted);
+    EXPECT_EQ(BATCH, info->packetsSent);
+    EXPECT_EQ(Homa::OutMessage::Status::IN_PROGRESS, message->state);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    EXPECT_CALL(mockDriver, sendPacket).Times(4);
+    sender->trySend();  // < test call
+    EXPECT_FALSE(sender->sendReady);
+    EXPECT_EQ(NUM_PKTS, info->packetsSent);
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
+    EXPECT_FALSE(sender->sendQueue.contains(&info->sendQueueNode));
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    for (int i = 0; i < NUM_PKTS; ++i) {
+        delete packet[i];
+    }
+}
+
 TEST_F(SenderTest, trySend_multipleMessages)
 {
     Protocol::MessageId id[3];
@@ -1864,6 +2667,89 @@ TEST_F(SenderTest, trySend_multipleMessages)
         bucket[2]->pingTimeouts.list.contains(&message[2]->pingTimeout.node));
 }
 
+TEST_F(SenderTest, trySend_doneBeforeTransmitted)
+{
+    // The receiver's DONE can be processed by another thread while trySend()
+    // is still handing the message's last packet to the driver; the message
+    // must already be SENT so that the DONE isn't ignored.
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    char payloads[2][1028];
+    Homa::Mock::MockDriver::MockPacket packets[2] = {{payloads[0]},
+                                                     {payloads[1]}};
+    for (int i = 0; i < 2; ++i) {
+        packets[i].length = 100 + message->TRANSPORT_HEADER_LENGTH;
+        setMessagePacket(message, i, &packets[i]);
+        info->unsentBytes += 100;
+    }
+    message->messageLength = 200;
+    SenderTest::addMessage(sender, id, message, true, 2);
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    sender->sendReady = true;
+
+    new (mockPacket.payload) Protocol::Packet::DoneHeader(id);
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&packets[0]), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&packets[1]), _, _))
+        .WillOnce([this, message](Driver::Packet*, IpAddress, int) {
+            EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
+            sender->handleDonePacket(&mockPacket);
+        });
+
+    sender->trySend();
+
+    EXPECT_EQ(Homa::OutMessage::Status::COMPLETED, message->state);
+    EXPECT_FALSE(sender->sendQueue.contains(&info->sendQueueNode));
+}
+
+TEST_F(SenderTest, trySend_resendWhileTransmitting)
+{
+    // A RESEND can be processed by another thread while trySend() is still
+    // handing the requested packets to the driver; only the packets already
+    // handed over may be resent, or the driver would be given the same packet
+    // twice at once.
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    char payloads[3][1028];
+    Homa::Mock::MockDriver::MockPacket packets[3] = {
+        {payloads[0]}, {payloads[1]}, {payloads[2]}};
+    for (int i = 0; i < 3; ++i) {
+        packets[i].length = 100 + message->TRANSPORT_HEADER_LENGTH;
+        setMessagePacket(message, i, &packets[i]);
+        info->unsentBytes += 100;
+    }
+    message->messageLength = 300;
+    SenderTest::addMessage(sender, id, message, true, 3);
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    sender->sendReady = true;
+
+    Protocol::Packet::ResendHeader* resendHdr =
+        static_cast<Protocol::Packet::ResendHeader*>(mockPacket.payload);
+    resendHdr->common.messageId = id;
+    resendHdr->index = 0;
+    resendHdr->num = 3;
+    resendHdr->priority = 0;
+    EXPECT_CALL(mockPolicyManager, getResendPriority).WillOnce(Return(7));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&packets[0]), _, _)).Times(2);
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&packets[1]), _, _))
+        .WillOnce([this, info](Driver::Packet*, IpAddress, int) {
+            EXPECT_EQ(1, info->packetsTransmitted);
+            sender->handleResendPacket(&mockPacket);
+        });
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&packets[2]), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    sender->trySend();
+
+    EXPECT_EQ(3, info->packetsTransmitted);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+    sender->dropMessage(message);
+}
+
 TEST_F(SenderTest, trySend_alreadyRunning)
 {
     Protocol::MessageId id = {42, 1};
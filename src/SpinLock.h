@@ -19,6 +19,10 @@
 #include <atomic>
 #include <mutex>
 
+#if HOMA_LOCK_PROFILING
+#include "Perf.h"
+#endif
+
 namespace Homa {
 
 /**
@@ -30,6 +34,12 @@ namespace Homa {
  * holding it, the thread will deadlock.
  *
  * This class implements the C++ "Lockable" named requirement.
+ *
+ * When built with HOMA_LOCK_PROFILING, each SpinLock also counts its
+ * acquisitions, contended acquisitions, spin cycles and maximum hold time in
+ * the Perf::LockCounters shared by all locks with the same name (see
+ * Homa::Perf::getLockStats()).  Otherwise, the name is ignored and the
+ * profiling costs nothing.
  */
 class SpinLock {
   private:
@@ -39,12 +49,29 @@ class SpinLock {
     // initializer list (July 2018).
     std::atomic_flag flag = ATOMIC_FLAG_INIT;
 
+#if HOMA_LOCK_PROFILING
+    /// Statistics shared by all SpinLocks with this lock's name.
+    Perf::LockCounters* const counters;
+
+    /// Cycle time at which the current holder acquired the lock.
+    uint64_t acquiredAt;
+#endif
+
   public:
     /**
      * Create a new unlocked SpinLock.
+     *
+     * @param name
+     *      Identifies the lock (or class of locks) in lock profiling
+     *      statistics; must be a string literal.
      */
-    explicit SpinLock()
+    explicit SpinLock(const char* name = "SpinLock")
+#if HOMA_LOCK_PROFILING
+        : counters(Perf::registerLock(name))
+        , acquiredAt(0)
+#endif
     {
+        (void)name;
         // It should have already been initialized to false but we clear it here
         // just in case.
         flag.clear();
@@ -61,10 +88,23 @@ class SpinLock {
      */
     void lock()
     {
+#if HOMA_LOCK_PROFILING
+        bool contended = flag.test_and_set(std::memory_order_acquire);
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        if (contended) {
+            while (flag.test_and_set(std::memory_order_acquire))
+                ;
+            acquiredAt = PerfUtils::Cycles::rdtsc();
+        } else {
+            acquiredAt = start;
+        }
+        counters->acquired(contended, acquiredAt - start);
+#else
         // test_and_set sets the flag to true and returns the previous value;
         // if it's True, someone else is owning the lock.
         while (flag.test_and_set(std::memory_order_acquire))
             ;
+#endif
     }
 
     /**
@@ -79,7 +119,16 @@ class SpinLock {
     {
         // test_and_set sets the flag to true and returns the previous value;
         // if it's True, someone else is owning the lock.
+#if HOMA_LOCK_PROFILING
+        if (flag.test_and_set(std::memory_order_acquire)) {
+            return false;
+        }
+        acquiredAt = PerfUtils::Cycles::rdtsc();
+        counters->acquired(false, 0);
+        return true;
+#else
         return !flag.test_and_set(std::memory_order_acquire);
+#endif
     }
 
     /**
@@ -88,6 +137,9 @@ class SpinLock {
      */
     void unlock()
     {
+#if HOMA_LOCK_PROFILING
+        counters->released(PerfUtils::Cycles::rdtsc() - acquiredAt);
+#endif
         flag.clear();
     }
 
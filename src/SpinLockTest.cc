@@ -43,5 +43,49 @@ TEST(SpinLockTest, unlock)
     EXPECT_FALSE(lock.flag.test_and_set(std::memory_order_acquire));
 }
 
+#if HOMA_LOCK_PROFILING
+TEST(SpinLockTest, profiling)
+{
+    SpinLock lock("SpinLockTest::profiling");
+    Perf::LockCounters* counters = lock.counters;
+    EXPECT_STREQ("SpinLockTest::profiling", counters->name);
+    EXPECT_EQ(counters, SpinLock("SpinLockTest::profiling").counters);
+    uint64_t acquisitions = counters->acquisitions.load();
+    uint64_t contended = counters->contended_acquisitions.load();
+
+    lock.lock();
+    lock.unlock();
+    EXPECT_TRUE(lock.try_lock());
+    EXPECT_FALSE(lock.try_lock());
+    lock.unlock();
+    EXPECT_EQ(acquisitions + 2, counters->acquisitions.load());
+    EXPECT_EQ(contended, counters->contended_acquisitions.load());
+
+    std::vector<Perf::LockStats> stats;
+    Perf::getLockStats(&stats);
+    bool found = false;
+    for (const Perf::LockStats& entry : stats) {
+        if (entry.name == "SpinLockTest::profiling") {
+            EXPECT_EQ(acquisitions + 2, entry.acquisitions);
+            found = true;
+        }
+    }
+    EXPECT_TRUE(found);
+}
+
+TEST(SpinLockTest, profiling_released)
+{
+    Perf::LockCounters counters("test");
+    counters.released(10);
+    counters.released(5);
+    EXPECT_EQ(10U, counters.max_hold_cycles.load());
+    counters.acquired(true, 7);
+    counters.acquired(false, 0);
+    EXPECT_EQ(2U, counters.acquisitions.load());
+    EXPECT_EQ(1U, counters.contended_acquisitions.load());
+    EXPECT_EQ(7U, counters.spin_cycles.load());
+}
+#endif
+
 }  // namespace
 }  // namespace Homa
@@ -105,7 +105,17 @@ std::string
 getName()
 {
     // get the thread ID before locking to avoid deadlock
-    uint64_t id = getId();
+    return getName(getId());
+}
+
+/**
+ * Get the friendly name for the thread with the given identifier (as returned
+ * by getId() on that thread).  This is useful when reporting on behalf of
+ * another thread, e.g. when writing out queued log messages.
+ */
+std::string
+getName(uint64_t id)
+{
     std::lock_guard<std::mutex> lockGuard(Internal::mutex);
     auto it = Internal::threadNames.find(id);
     if (it == Internal::threadNames.end())
@@ -38,6 +38,7 @@ const uint64_t NONE = 0;
 uint64_t getId();
 void setName(const std::string& name);
 std::string getName();
+std::string getName(uint64_t id);
 
 }  // namespace ThreadId
 }  // namespace Homa
@@ -0,0 +1,187 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_TICKETLOCK_H
+#define HOMA_TICKETLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#if HOMA_LOCK_PROFILING
+#include "Perf.h"
+#endif
+
+namespace Homa {
+
+/**
+ * A fair busy-waiting lock for heavily contended critical sections.
+ *
+ * Like SpinLock, TicketLock never sleeps and is not reentrant.  Unlike
+ * SpinLock, waiters acquire the lock in arrival (FIFO) order, so no thread
+ * can be starved, and waiters only read the lock's cache line while waiting.
+ * A waiter backs off (using PAUSE) in proportion to its distance from the
+ * front of the queue, which keeps the line quiet while the holder runs.
+ * Strict FIFO order means a preempted waiter delays everyone queued behind
+ * it, so TicketLock is meant for locks that multiple pollers are expected to
+ * fight over; SpinLock remains the better choice elsewhere.
+ *
+ * When built with HOMA_LOCK_PROFILING, TicketLock is profiled in the same way
+ * as SpinLock.
+ *
+ * This class implements the C++ "Lockable" named requirement.
+ */
+class TicketLock {
+  public:
+    /**
+     * Create a new unlocked TicketLock.
+     *
+     * @param name
+     *      Identifies the lock (or class of locks) in lock profiling
+     *      statistics; must be a string literal.
+     */
+    explicit TicketLock(const char* name = "TicketLock")
+        : nextTicket(0)
+        , nowServing(0)
+#if HOMA_LOCK_PROFILING
+        , counters(Perf::registerLock(name))
+        , acquiredAt(0)
+#endif
+    {
+        (void)name;
+    }
+
+    /**
+     * Acquire the TicketLock; blocks the thread (by continuously polling the
+     * lock) until the lock has been acquired.
+     */
+    void lock()
+    {
+        const uint32_t ticket =
+            nextTicket.fetch_add(1, std::memory_order_relaxed);
+        uint32_t serving = nowServing.load(std::memory_order_acquire);
+#if HOMA_LOCK_PROFILING
+        const bool contended = (serving != ticket);
+        const uint64_t start = PerfUtils::Cycles::rdtsc();
+#endif
+        while (serving != ticket) {
+            uint32_t pauses = (ticket - serving) * PAUSES_PER_WAITER;
+            if (pauses > MAX_BACKOFF_PAUSES) {
+                pauses = MAX_BACKOFF_PAUSES;
+            }
+            for (uint32_t i = 0; i < pauses; ++i) {
+                pause();
+            }
+            serving = nowServing.load(std::memory_order_acquire);
+        }
+#if HOMA_LOCK_PROFILING
+        acquiredAt = contended ? PerfUtils::Cycles::rdtsc() : start;
+        counters->acquired(contended, acquiredAt - start);
+#endif
+    }
+
+    /**
+     * Try to acquire the TicketLock; does not block the thread and returns
+     * immediately.
+     *
+     * @return
+     *      True if the lock was successfully acquired, false if it was already
+     *      owned by some other thread.
+     */
+    bool try_lock()
+    {
+        uint32_t serving = nowServing.load(std::memory_order_acquire);
+        uint32_t ticket = serving;
+        if (!nextTicket.compare_exchange_strong(ticket, serving + 1,
+                                                std::memory_order_acquire,
+                                                std::memory_order_relaxed)) {
+            return false;
+        }
+#if HOMA_LOCK_PROFILING
+        acquiredAt = PerfUtils::Cycles::rdtsc();
+        counters->acquired(false, 0);
+#endif
+        return true;
+    }
+
+    /**
+     * Release the TicketLock to the next waiter.  The caller must previously
+     * have acquired the lock with a call to lock() or try_lock().
+     */
+    void unlock()
+    {
+#if HOMA_LOCK_PROFILING
+        counters->released(PerfUtils::Cycles::rdtsc() - acquiredAt);
+#endif
+        // Only the holder writes nowServing, so no read-modify-write is needed.
+        nowServing.store(nowServing.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_release);
+    }
+
+    /**
+     * Define a type alias for an RAII TicketLock lock_guard for convenience.
+     */
+    using Lock = std::lock_guard<TicketLock>;
+
+    /**
+     * Define a type alias for a movable TicketLock unique_lock for
+     * convenience.
+     */
+    using UniqueLock = std::unique_lock<TicketLock>;
+
+    /**
+     * Tell the CPU that the thread is spin-waiting.
+     */
+    static inline void pause()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __asm__ __volatile__("pause" ::: "memory");
+#else
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+    }
+
+  private:
+
+    /// Number of PAUSE instructions a waiter executes, between checks of the
+    /// lock, for each waiter ahead of it.
+    static const uint32_t PAUSES_PER_WAITER = 16;
+
+    /// Upper bound on the PAUSE instructions executed between checks of the
+    /// lock.
+    static const uint32_t MAX_BACKOFF_PAUSES = 1024;
+
+    /// Ticket handed out to the next thread that calls lock().
+    std::atomic<uint32_t> nextTicket;
+
+    /// Ticket of the thread that currently owns (or may next take) the lock.
+    std::atomic<uint32_t> nowServing;
+
+#if HOMA_LOCK_PROFILING
+    /// Statistics shared by all locks with this lock's name.
+    Perf::LockCounters* const counters;
+
+    /// Cycle time at which the current holder acquired the lock.
+    uint64_t acquiredAt;
+#endif
+
+    // Disable copy and assign
+    TicketLock(const TicketLock&) = delete;
+    TicketLock& operator=(const TicketLock&) = delete;
+};
+
+}  // namespace Homa
+
+#endif  // HOMA_TICKETLOCK_H
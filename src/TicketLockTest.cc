@@ -0,0 +1,82 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "TicketLock.h"
+
+namespace Homa {
+namespace {
+
+TEST(TicketLockTest, lock)
+{
+    TicketLock lock;
+    lock.lock();
+    EXPECT_EQ(1U, lock.nextTicket.load());
+    EXPECT_EQ(0U, lock.nowServing.load());
+}
+
+TEST(TicketLockTest, lock_wait)
+{
+    TicketLock lock;
+    uint64_t count = 0;
+    lock.lock();
+    std::thread waiter([&] {
+        lock.lock();
+        ++count;
+        lock.unlock();
+    });
+    while (lock.nextTicket.load() != 2) {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(0U, count);
+    lock.unlock();
+    waiter.join();
+    EXPECT_EQ(1U, count);
+    EXPECT_EQ(2U, lock.nowServing.load());
+}
+
+TEST(TicketLockTest, try_lock)
+{
+    TicketLock lock;
+    EXPECT_TRUE(lock.try_lock());
+    EXPECT_FALSE(lock.try_lock());
+    EXPECT_EQ(1U, lock.nextTicket.load());
+}
+
+TEST(TicketLockTest, try_lock_wrapAround)
+{
+    TicketLock lock;
+    lock.nextTicket = UINT32_MAX;
+    lock.nowServing = UINT32_MAX;
+    EXPECT_TRUE(lock.try_lock());
+    lock.unlock();
+    EXPECT_EQ(0U, lock.nowServing.load());
+    EXPECT_TRUE(lock.try_lock());
+}
+
+TEST(TicketLockTest, unlock)
+{
+    TicketLock lock;
+    lock.lock();
+    lock.unlock();
+    EXPECT_EQ(1U, lock.nowServing.load());
+    EXPECT_TRUE(lock.try_lock());
+}
+
+}  // namespace
+}  // namespace Homa
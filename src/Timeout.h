@@ -87,9 +87,19 @@ class TimeoutManager {
      * Construct a new TimeoutManager with a particular timeout interval.  All
      * timeouts tracked by this manager will have the same timeout interval.
      *
+     * @param timeoutIntervalCycles
+     *      Number of cycles newly scheduled timeouts wait before they elapse.
+     * @param sharedDeadline
+     *      Optional deadline shared by several TimeoutManagers.  It is lowered
+     *      whenever a Timeout is scheduled to elapse before it, so that the
+     *      owner of the managers can tell in O(1) whether any of them might
+     *      have elapsed timeouts.  The owner is responsible for raising it
+     *      again after processing the elapsed timeouts.
      */
-    explicit TimeoutManager(uint64_t timeoutIntervalCycles)
+    explicit TimeoutManager(uint64_t timeoutIntervalCycles,
+                            std::atomic<uint64_t>* sharedDeadline = nullptr)
         : timeoutIntervalCycles(timeoutIntervalCycles)
+        , sharedDeadline(sharedDeadline)
         , nextTimeout(UINT64_MAX)
         , list()
     {}
@@ -109,6 +119,9 @@ class TimeoutManager {
         list.push_back(&timeout->node);
         nextTimeout.store(list.front().expirationCycleTime,
                           std::memory_order_relaxed);
+        if (sharedDeadline != nullptr) {
+            lowerDeadline(sharedDeadline, timeout->expirationCycleTime);
+        }
     }
 
     /**
@@ -128,6 +141,17 @@ class TimeoutManager {
         }
     }
 
+    /**
+     * Return true if the Timeout is currently scheduled with this manager.
+     *
+     * @param timeout
+     *      The Timeout that should be checked.
+     */
+    inline bool isScheduled(Timeout<ElementType>* timeout)
+    {
+        return list.contains(&timeout->node);
+    }
+
     /**
      * Check if any managed Timeouts have elapsed.
      *
@@ -146,6 +170,35 @@ class TimeoutManager {
         return now >= nextTimeout.load(std::memory_order_relaxed);
     }
 
+    /**
+     * Return the smallest expiration time of the managed Timeouts, or
+     * UINT64_MAX if there are none.
+     *
+     * This method is thread-safe in the same way as anyElapsed().
+     */
+    inline uint64_t nextExpiration() const
+    {
+        return nextTimeout.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Lower a deadline shared between threads to the given time if it is
+     * currently later.
+     *
+     * @param deadline
+     *      Deadline to be lowered.
+     * @param time
+     *      Cycle time to which the deadline should be lowered.
+     */
+    static inline void lowerDeadline(std::atomic<uint64_t>* deadline,
+                                     uint64_t time)
+    {
+        uint64_t current = deadline->load(std::memory_order_relaxed);
+        while (time < current &&
+               !deadline->compare_exchange_weak(current, time)) {
+        }
+    }
+
     /**
      * Check if the TimeoutManager manages no Timeouts.
      *
@@ -183,6 +236,9 @@ class TimeoutManager {
     /// they elapse.
     uint64_t timeoutIntervalCycles;
 
+    /// Deadline shared with other TimeoutManagers; see TimeoutManager().
+    std::atomic<uint64_t>* const sharedDeadline;
+
     /// The smallest timeout expiration time of all timeouts under
     /// management. Accessing this value is thread-safe.
     std::atomic<uint64_t> nextTimeout;
@@ -66,6 +66,32 @@ TEST(TimeoutManagerTest, setTimeout)
     PerfUtils::Cycles::mockTscValue = 0;
 }
 
+TEST(TimeoutManagerTest, setTimeout_sharedDeadline)
+{
+    PerfUtils::Cycles::mockTscValue = 10000;
+    std::atomic<uint64_t> deadline(UINT64_MAX);
+    TimeoutManager<char> manager(100, &deadline);
+    char owner;
+    Timeout<char> t1(&owner);
+    Timeout<char> t2(&owner);
+
+    manager.setTimeout(&t1);
+    EXPECT_EQ(10100U, deadline.load());
+
+    // Later timeouts don't raise the deadline.
+    PerfUtils::Cycles::mockTscValue = 10050;
+    manager.setTimeout(&t2);
+    EXPECT_EQ(10100U, deadline.load());
+
+    // Nor do cancellations.
+    manager.cancelTimeout(&t1);
+    EXPECT_EQ(10150U, manager.nextExpiration());
+    EXPECT_EQ(10100U, deadline.load());
+
+    manager.list.clear();
+    PerfUtils::Cycles::mockTscValue = 0;
+}
+
 TEST(TimeoutManagerTest, setTimeout_reset)
 {
     PerfUtils::Cycles::mockTscValue = 10000;
@@ -20,8 +20,10 @@
 #include <utility>
 
 #include "Cycles.h"
+#include "Debug.h"
 #include "Perf.h"
 #include "Protocol.h"
+#include "Util.h"
 
 namespace Homa {
 namespace Core {
@@ -47,12 +49,13 @@ const uint64_t RESEND_INTERVAL_US = BASE_TIMEOUT_US;
 TransportImpl::TransportImpl(Driver* driver, uint64_t transportId)
     : transportId(transportId)
     , driver(driver)
+    , perf()
     , policyManager(new Policy::Manager(driver))
-    , sender(new Sender(transportId, driver, policyManager.get(),
+    , sender(new Sender(transportId, driver, policyManager.get(), &perf,
                         PerfUtils::Cycles::fromMicroseconds(MESSAGE_TIMEOUT_US),
                         PerfUtils::Cycles::fromMicroseconds(PING_INTERVAL_US)))
     , receiver(
-          new Receiver(driver, policyManager.get(),
+          new Receiver(transportId, driver, policyManager.get(), &perf,
                        PerfUtils::Cycles::fromMicroseconds(MESSAGE_TIMEOUT_US),
                        PerfUtils::Cycles::fromMicroseconds(RESEND_INTERVAL_US)))
     , nextTimeoutCycles(0)
@@ -76,15 +79,179 @@ TransportImpl::poll()
     sender->poll();
     receiver->poll();
 
-    Perf::counters.total_cycles.add(timer.split());
+    // Hand received responses directly to the requests waiting for them.
+    Protocol::MessageId requestId;
+    while (Homa::InMessage* response = receiver->receiveResponse(&requestId)) {
+        sender->handleResponse(requestId, response);
+    }
+
+    perf.local().total_cycles.add(timer.split());
+}
+
+/// See Homa::Transport::poll(uint64_t)
+Transport::PollHints
+TransportImpl::poll(uint64_t budgetNs)
+{
+    Perf::Timer timer;
+    uint64_t deadline = PerfUtils::Cycles::rdtsc() +
+                        PerfUtils::Cycles::fromNanoseconds(budgetNs);
+    PollHints hints;
+
+    // Stages skipped for lack of budget are reported as pending.
+    hints.receivePending = pollReceive();
+    hints.sendPending = true;
+    hints.grantsPending = true;
+    hints.timeoutsPending = true;
+    if (PerfUtils::Cycles::rdtsc() < deadline) {
+        hints.sendPending = pollSend();
+    }
+    if (PerfUtils::Cycles::rdtsc() < deadline) {
+        hints.grantsPending = pollGrants();
+    }
+    if (PerfUtils::Cycles::rdtsc() < deadline) {
+        pollTimeouts();
+        hints.timeoutsPending = false;
+    }
+    while (hints.receivePending && PerfUtils::Cycles::rdtsc() < deadline) {
+        hints.receivePending = pollReceive();
+    }
+
+    perf.local().total_cycles.add(timer.split());
+    return hints;
+}
+
+/// See Homa::Transport::pollReceive()
+bool
+TransportImpl::pollReceive()
+{
+    bool receivePending = processPackets();
+
+    Protocol::MessageId requestId;
+    while (Homa::InMessage* response = receiver->receiveResponse(&requestId)) {
+        sender->handleResponse(requestId, response);
+    }
+    return receivePending;
+}
+
+/// See Homa::Transport::pollSend()
+bool
+TransportImpl::pollSend()
+{
+    return sender->pollSend();
+}
+
+/// See Homa::Transport::pollGrants()
+bool
+TransportImpl::pollGrants()
+{
+    return receiver->pollGrants();
+}
+
+/// See Homa::Transport::pollTimeouts()
+void
+TransportImpl::pollTimeouts()
+{
+    sender->checkTimeouts();
+    receiver->checkTimeouts();
+}
+
+/// See Homa::Transport::allocMany()
+void
+TransportImpl::allocMany(uint16_t sourcePort,
+                         Homa::unique_ptr<Homa::OutMessage> messages[],
+                         size_t count)
+{
+    const size_t MAX_BATCH = 32;
+    Homa::OutMessage* batch[MAX_BATCH];
+    for (size_t i = 0; i < count; i += MAX_BATCH) {
+        size_t numMessages = std::min(count - i, MAX_BATCH);
+        sender->allocMessages(sourcePort, batch, numMessages);
+        for (size_t j = 0; j < numMessages; ++j) {
+            messages[i + j].reset(batch[j]);
+        }
+    }
+}
+
+/// See Homa::Transport::receiveMany()
+size_t
+TransportImpl::receiveMany(Homa::unique_ptr<Homa::InMessage> messages[],
+                           size_t maxMessages)
+{
+    const size_t MAX_BATCH = 32;
+    Homa::InMessage* batch[MAX_BATCH];
+    size_t numReceived = 0;
+    while (numReceived < maxMessages) {
+        size_t limit = std::min(maxMessages - numReceived, MAX_BATCH);
+        size_t numMessages = receiver->receiveMessages(batch, limit);
+        for (size_t j = 0; j < numMessages; ++j) {
+            messages[numReceived++].reset(batch[j]);
+        }
+        if (numMessages < limit) {
+            break;
+        }
+    }
+    return numReceived;
+}
+
+/// See Homa::Transport::forward()
+Homa::unique_ptr<Homa::OutMessage>
+TransportImpl::forward(Homa::InMessage* message, uint16_t sourcePort)
+{
+    Driver::Packet* packets[Receiver::MAX_MESSAGE_PACKETS];
+    int headroom;
+    int messageLength = Util::downCast<int>(message->length());
+    int numPackets = receiver->takePackets(message, packets, &headroom);
+    if (numPackets > 0) {
+        return Homa::unique_ptr<Homa::OutMessage>(
+            sender->allocMessage(sourcePort, packets, numPackets, headroom,
+                                 headroom + messageLength));
+    }
+
+    // The packets have no room for a full DATA header (the message arrived
+    // with a compact header); copy the contents instead.  Such messages fit
+    // in a single packet so the copy is small.
+    Homa::unique_ptr<Homa::OutMessage> outMessage = alloc(sourcePort);
+    outMessage->reserve(headroom);
+    char buffer[256];
+    size_t offset = 0;
+    size_t count;
+    while ((count = message->get(offset, buffer, sizeof(buffer))) > 0) {
+        outMessage->append(buffer, count);
+        offset += count;
+    }
+    return outMessage;
+}
+
+/// See Homa::Transport::reply()
+void
+TransportImpl::reply(Homa::unique_ptr<Homa::InMessage> request,
+                     Homa::OutMessage* response, OutMessage::Options options)
+{
+    Protocol::MessageId requestId;
+    SocketAddress source;
+    receiver->getMessageSource(request.get(), &requestId, &source);
+    sender->replyMessage(response, requestId, source, request.release(),
+                         options);
+}
+
+/// See Homa::Transport::setCoalescingBudget()
+void
+TransportImpl::setCoalescingBudget(uint64_t microseconds)
+{
+    sender->setCoalescingBudget(
+        PerfUtils::Cycles::fromMicroseconds(microseconds));
 }
 
 /**
  * Helper method which receives a burst of incoming packets and process them
  * through the transport protocol.  Pulled out of TransportImpl::poll() to
  * simplify unit testing.
+ *
+ * @return
+ *      True if the burst was full, so more packets may be waiting; false
+ *      otherwise.
  */
-void
+bool
 TransportImpl::processPackets()
 {
     // Keep track of time spent doing active processing versus idle.
@@ -99,52 +266,132 @@ TransportImpl::processPackets()
     }
 
     if (numPackets > 0) {
-        Perf::counters.active_cycles.add(timer.split());
+        perf.addActiveCycles(timer.split());
     }
+    return numPackets == MAX_BURST;
 }
 
+/**
+ * Validate an incoming packet and dispatch it to the Sender or Receiver
+ * handler for its opcode.  Malformed packets are dropped.
+ *
+ * @param packet
+ *      The incoming packet to be processed.
+ * @param sourceIp
+ *      Source IP address of the packet.
+ */
 void
 TransportImpl::processPacket(Driver::Packet* packet, IpAddress sourceIp)
 {
-    assert(packet->length >=
-           Util::downCast<int>(sizeof(Protocol::Packet::CommonHeader)));
-    Perf::counters.rx_bytes.add(packet->length);
-    Protocol::Packet::CommonHeader* header =
-        static_cast<Protocol::Packet::CommonHeader*>(packet->payload);
-    switch (header->opcode) {
-        case Protocol::Packet::DATA:
-            Perf::counters.rx_data_pkts.add(1);
-            receiver->handleDataPacket(packet, sourceIp);
-            break;
-        case Protocol::Packet::GRANT:
-            Perf::counters.rx_grant_pkts.add(1);
-            sender->handleGrantPacket(packet);
-            break;
-        case Protocol::Packet::DONE:
-            Perf::counters.rx_done_pkts.add(1);
-            sender->handleDonePacket(packet);
-            break;
-        case Protocol::Packet::RESEND:
-            Perf::counters.rx_resend_pkts.add(1);
-            sender->handleResendPacket(packet);
-            break;
-        case Protocol::Packet::BUSY:
-            Perf::counters.rx_busy_pkts.add(1);
-            receiver->handleBusyPacket(packet);
-            break;
-        case Protocol::Packet::PING:
-            Perf::counters.rx_ping_pkts.add(1);
-            receiver->handlePingPacket(packet, sourceIp);
-            break;
-        case Protocol::Packet::UNKNOWN:
-            Perf::counters.rx_unknown_pkts.add(1);
-            sender->handleUnknownPacket(packet);
-            break;
-        case Protocol::Packet::ERROR:
-            Perf::counters.rx_error_pkts.add(1);
-            sender->handleErrorPacket(packet);
-            break;
+    using namespace Protocol::Packet;
+
+    /// Handler, and minimum packet length, for each opcode.
+    struct Dispatch {
+        uint32_t minLength;
+        void (*handle)(TransportImpl* transport, Driver::Packet* packet,
+                       IpAddress sourceIp);
+    };
+    static const Dispatch DISPATCH[MAX_OPCODE - MIN_OPCODE + 1] = {
+        {minLength(DATA),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress sourceIp) {
+             t->perf.local().rx_data_pkts.add(1);
+             t->receiver->handleDataPacket(packet, sourceIp);
+         }},
+        {minLength(GRANT),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress) {
+             t->perf.local().rx_grant_pkts.add(1);
+             t->sender->handleGrantPacket(packet);
+         }},
+        {minLength(DONE),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress) {
+             t->perf.local().rx_done_pkts.add(1);
+             t->sender->handleDonePacket(packet);
+         }},
+        {minLength(RESEND),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress sourceIp) {
+             t->perf.local().rx_resend_pkts.add(1);
+             t->perf.peers.find(sourceIp)->rx_resend_pkts.fetch_add(1);
+             t->sender->handleResendPacket(packet);
+         }},
+        {minLength(BUSY),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress) {
+             t->perf.local().rx_busy_pkts.add(1);
+             t->receiver->handleBusyPacket(packet);
+         }},
+        {minLength(PING),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress sourceIp) {
+             t->perf.local().rx_ping_pkts.add(1);
+             t->receiver->handlePingPacket(packet, sourceIp);
+         }},
+        {minLength(UNKNOWN),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress) {
+             t->perf.local().rx_unknown_pkts.add(1);
+             t->sender->handleUnknownPacket(packet);
+         }},
+        {minLength(ERROR),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress) {
+             t->perf.local().rx_error_pkts.add(1);
+             t->sender->handleErrorPacket(packet);
+         }},
+        {minLength(BUNDLE),
+         [](TransportImpl* t, Driver::Packet* packet, IpAddress sourceIp) {
+             t->perf.local().rx_bundle_pkts.add(1);
+             t->receiver->handleBundlePacket(packet, sourceIp);
+         }},
+    };
+
+    perf.local().rx_bytes.add(packet->length);
+    perf.peers.find(sourceIp)->received(packet->length);
+    // Only the prefix and opcode are common to every header format.
+    const CommonHeader* header =
+        static_cast<const CommonHeader*>(packet->payload);
+    if (packet->length <
+        Util::downCast<int>(sizeof(HeaderPrefix) + sizeof(header->opcode))) {
+        dropMalformedPacket(packet, sourceIp, "truncated");
+        return;
+    }
+    uint8_t version = header->prefix.version;
+    if (version != Protocol::Packet::VERSION &&
+        version != Protocol::Packet::COMPACT_VERSION) {
+        dropMalformedPacket(packet, sourceIp, "unsupported version");
+        return;
     }
+    // Opcodes below MIN_OPCODE wrap around and fail the same bounds check.
+    uint8_t index = header->opcode - MIN_OPCODE;
+    if (index >= sizeof(DISPATCH) / sizeof(DISPATCH[0])) {
+        dropMalformedPacket(packet, sourceIp, "unknown opcode");
+        return;
+    }
+    const Dispatch& dispatch = DISPATCH[index];
+    uint32_t requiredLength = version == Protocol::Packet::VERSION
+                                  ? dispatch.minLength
+                                  : minLength(header->opcode, version);
+    if (packet->length < Util::downCast<int>(requiredLength)) {
+        dropMalformedPacket(packet, sourceIp, "truncated");
+        return;
+    }
+    dispatch.handle(this, packet, sourceIp);
+}
+
+/**
+ * Drop a packet that cannot be processed.
+ *
+ * @param packet
+ *      The malformed packet; it will be released back to the driver.
+ * @param sourceIp
+ *      Source IP address of the packet.
+ * @param reason
+ *      Why the packet is being dropped.
+ */
+void
+TransportImpl::dropMalformedPacket(Driver::Packet* packet, IpAddress sourceIp,
+                                   const char* reason)
+{
+    perf.local().rx_malformed_pkts.add(1);
+    WARNING_RATE_LIMITED("Dropped %s packet of %d bytes from %s", reason,
+                         packet->length,
+                         IpAddress::toString(sourceIp).c_str());
+    driver->releasePackets(&packet, 1);
 }
 
 }  // namespace Core
@@ -26,6 +26,7 @@
 #include <vector>
 
 #include "ObjectPool.h"
+#include "Perf.h"
 #include "Policy.h"
 #include "Receiver.h"
 #include "Sender.h"
@@ -59,7 +60,38 @@ class TransportImpl : public Transport {
         return Homa::unique_ptr<Homa::InMessage>(receiver->receiveMessage());
     }
 
+    /// See Homa::Transport::receive(uint16_t)
+    virtual Homa::unique_ptr<Homa::InMessage> receive(uint16_t port)
+    {
+        return Homa::unique_ptr<Homa::InMessage>(
+            receiver->receiveMessage(port));
+    }
+
+    virtual void allocMany(uint16_t sourcePort,
+                           Homa::unique_ptr<Homa::OutMessage> messages[],
+                           size_t count);
+    virtual size_t receiveMany(Homa::unique_ptr<Homa::InMessage> messages[],
+                               size_t maxMessages);
+
+    /// See Homa::Transport::getDoneMessages()
+    virtual size_t getDoneMessages(Homa::OutMessage* messages[],
+                                   size_t maxMessages)
+    {
+        return sender->getDoneMessages(messages, maxMessages);
+    }
+
+    virtual Homa::unique_ptr<Homa::OutMessage> forward(
+        Homa::InMessage* message, uint16_t sourcePort);
+    virtual void reply(Homa::unique_ptr<Homa::InMessage> request,
+                       Homa::OutMessage* response,
+                       OutMessage::Options options = OutMessage::NONE);
     virtual void poll();
+    virtual PollHints poll(uint64_t budgetNs);
+    virtual bool pollReceive();
+    virtual bool pollSend();
+    virtual bool pollGrants();
+    virtual void pollTimeouts();
+    virtual void setCoalescingBudget(uint64_t microseconds);
 
     /// See Homa::Transport::getDriver()
     virtual Driver* getDriver()
@@ -67,6 +99,18 @@ class TransportImpl : public Transport {
         return driver;
     }
 
+    /// See Homa::Transport::getStats()
+    virtual void getStats(Perf::Stats* stats)
+    {
+        perf.getStats(stats);
+    }
+
+    /// See Homa::Transport::getPeerStats()
+    virtual void getPeerStats(std::vector<Perf::PeerStats>* stats)
+    {
+        perf.peers.getStats(stats);
+    }
+
     /// See Homa::Transport::getId()
     virtual uint64_t getId()
     {
@@ -74,8 +118,10 @@ class TransportImpl : public Transport {
     }
 
   private:
-    void processPackets();
+    bool processPackets();
     void processPacket(Driver::Packet* packet, IpAddress source);
+    void dropMalformedPacket(Driver::Packet* packet, IpAddress sourceIp,
+                             const char* reason);
 
     /// Unique identifier for this transport.
     const std::atomic<uint64_t> transportId;
@@ -83,6 +129,10 @@ class TransportImpl : public Transport {
     /// Driver from which this transport will send and receive packets.
     Driver* const driver;
 
+    /// Performance counters of this transport; must outlive the sender and
+    /// receiver.
+    Perf::TransportCounters perf;
+
     /// Module which manages the network packet priority policy.
     std::unique_ptr<Policy::Manager> policyManager;
 
@@ -14,11 +14,14 @@
  */
 
 #include <Homa/Debug.h>
+#include <Homa/Drivers/Fake/FakeDriver.h>
 #include <gtest/gtest.h>
 
 #include "Mock/MockDriver.h"
+#include "Mock/MockMessage.h"
 #include "Mock/MockReceiver.h"
 #include "Mock/MockSender.h"
+#include "Perf.h"
 #include "Protocol.h"
 #include "TransportImpl.h"
 #include "Tub.h"
@@ -31,7 +34,9 @@ using ::testing::_;
 using ::testing::DoAll;
 using ::testing::Eq;
 using ::testing::NiceMock;
+using ::testing::Pointee;
 using ::testing::Return;
+using ::testing::SetArgPointee;
 using ::testing::SetArrayArgument;
 
 class TransportImplTest : public ::testing::Test {
@@ -40,9 +45,10 @@ class TransportImplTest : public ::testing::Test {
         : mockDriver()
         , transport(new TransportImpl(&mockDriver, 22))
         , mockSender(
-              new NiceMock<Homa::Mock::MockSender>(22, &mockDriver, 0, 0))
-        , mockReceiver(
-              new NiceMock<Homa::Mock::MockReceiver>(&mockDriver, 0, 0))
+              new NiceMock<Homa::Mock::MockSender>(22, &mockDriver,
+                                                   &transport->perf, 0, 0))
+        , mockReceiver(new NiceMock<Homa::Mock::MockReceiver>(
+              &mockDriver, &transport->perf, 0, 0))
     {
         transport->sender.reset(mockSender);
         transport->receiver.reset(mockReceiver);
@@ -84,10 +90,119 @@ TEST_F(TransportImplTest, poll)
     transport->poll();
 }
 
+TEST_F(TransportImplTest, poll_budget)
+{
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    EXPECT_CALL(*mockSender, pollSend).WillOnce(Return(true));
+    EXPECT_CALL(*mockReceiver, pollGrants).WillOnce(Return(false));
+    EXPECT_CALL(*mockSender, checkTimeouts).Times(1);
+    EXPECT_CALL(*mockReceiver, checkTimeouts).Times(1);
+
+    Transport::PollHints hints = transport->poll(1000000);
+
+    EXPECT_FALSE(hints.receivePending);
+    EXPECT_TRUE(hints.sendPending);
+    EXPECT_FALSE(hints.grantsPending);
+    EXPECT_FALSE(hints.timeoutsPending);
+}
+
+TEST_F(TransportImplTest, poll_budgetExhausted)
+{
+    // The mocked clock doesn't advance so a zero budget is used up as soon
+    // as incoming packets have been processed.
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    EXPECT_CALL(*mockSender, pollSend).Times(0);
+    EXPECT_CALL(*mockReceiver, pollGrants).Times(0);
+    EXPECT_CALL(*mockSender, checkTimeouts).Times(0);
+    EXPECT_CALL(*mockReceiver, checkTimeouts).Times(0);
+
+    Transport::PollHints hints = transport->poll(0);
+
+    EXPECT_FALSE(hints.receivePending);
+    EXPECT_TRUE(hints.sendPending);
+    EXPECT_TRUE(hints.grantsPending);
+    EXPECT_TRUE(hints.timeoutsPending);
+}
+
+TEST_F(TransportImplTest, pollReceive)
+{
+    Protocol::MessageId requestId(22, 7);
+    NiceMock<Homa::Mock::MockInMessage> response;
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    EXPECT_CALL(*mockReceiver, receiveResponse)
+        .WillOnce(DoAll(SetArgPointee<0>(requestId), Return(&response)))
+        .WillOnce(Return(nullptr));
+    EXPECT_CALL(*mockSender, handleResponse(Eq(requestId), Eq(&response)))
+        .Times(1);
+    EXPECT_CALL(*mockSender, poll).Times(0);
+    EXPECT_CALL(*mockReceiver, poll).Times(0);
+
+    EXPECT_FALSE(transport->pollReceive());
+}
+
+TEST_F(TransportImplTest, poll_responses)
+{
+    Protocol::MessageId requestId(22, 7);
+    NiceMock<Homa::Mock::MockInMessage> response;
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    EXPECT_CALL(*mockReceiver, receiveResponse)
+        .WillOnce(DoAll(SetArgPointee<0>(requestId), Return(&response)))
+        .WillOnce(Return(nullptr));
+    EXPECT_CALL(*mockSender, handleResponse(Eq(requestId), Eq(&response)))
+        .Times(1);
+
+    transport->poll();
+}
+
+TEST_F(TransportImplTest, receiveMany)
+{
+    NiceMock<Homa::Mock::MockInMessage> messages[2];
+    Homa::InMessage* batch[2] = {&messages[0], &messages[1]};
+    EXPECT_CALL(*mockReceiver, receiveMessages(_, Eq(5U)))
+        .WillOnce(DoAll(SetArrayArgument<0>(batch, batch + 2), Return(2)));
+
+    Homa::unique_ptr<Homa::InMessage> received[5];
+    EXPECT_EQ(2U, transport->receiveMany(received, 5));
+    EXPECT_EQ(&messages[0], received[0].get());
+    EXPECT_EQ(&messages[1], received[1].get());
+    EXPECT_EQ(nullptr, received[2].get());
+}
+
+TEST_F(TransportImplTest, getDoneMessages)
+{
+    Homa::OutMessage* done[4];
+    EXPECT_CALL(*mockSender, getDoneMessages(Eq(done), Eq(4U)))
+        .WillOnce(Return(3));
+    EXPECT_EQ(3U, transport->getDoneMessages(done, 4));
+}
+
+TEST_F(TransportImplTest, reply)
+{
+    Protocol::MessageId requestId(42, 7);
+    SocketAddress source = {23, 60001};
+    NiceMock<Homa::Mock::MockInMessage> request;
+    NiceMock<Homa::Mock::MockOutMessage> response;
+    EXPECT_CALL(*mockReceiver, getMessageSource(Eq(&request), _, _))
+        .WillOnce(DoAll(SetArgPointee<1>(requestId), SetArgPointee<2>(source)));
+    EXPECT_CALL(*mockSender,
+                replyMessage(Eq(&response), Eq(requestId), _, Eq(&request),
+                             Eq(OutMessage::Options::NO_RETRY)))
+        .Times(1);
+    // The Sender takes over the request.
+    EXPECT_CALL(request, release).Times(0);
+
+    transport->reply(Homa::unique_ptr<Homa::InMessage>(&request), &response,
+                     OutMessage::Options::NO_RETRY);
+}
+
 TEST_F(TransportImplTest, processPackets)
 {
-    char payload[8][1024];
-    Homa::Driver::Packet* packets[8];
+    char payload[9][1024];
+    Homa::Driver::Packet* packets[9];
+    for (int i = 0; i < 9; ++i) {
+        static_cast<Protocol::Packet::CommonHeader*>((void*)payload[i])
+            ->prefix.version = Protocol::Packet::VERSION;
+    }
 
     // Set DATA packet
     Homa::Mock::MockDriver::MockPacket dataPacket{payload[0], 1024};
@@ -145,10 +260,123 @@ TEST_F(TransportImplTest, processPackets)
     packets[7] = &errorPacket;
     EXPECT_CALL(*mockSender, handleErrorPacket(Eq(&errorPacket)));
 
+    // Set BUNDLE packet
+    Homa::Mock::MockDriver::MockPacket bundlePacket{payload[8], 1024};
+    static_cast<Protocol::Packet::BundleHeader*>(bundlePacket.payload)
+        ->opcode = Protocol::Packet::BUNDLE;
+    packets[8] = &bundlePacket;
+    EXPECT_CALL(*mockReceiver, handleBundlePacket(Eq(&bundlePacket), _));
+
+    IpAddress srcAddrs[9];
+    std::fill(srcAddrs, srcAddrs + 9, IpAddress{22});
     EXPECT_CALL(mockDriver, receivePackets)
-        .WillOnce(DoAll(SetArrayArgument<1>(packets, packets + 8), Return(8)));
+        .WillOnce(DoAll(SetArrayArgument<1>(packets, packets + 9),
+                        SetArrayArgument<2>(srcAddrs, srcAddrs + 9),
+                        Return(9)));
 
     transport->processPackets();
+
+    std::vector<Perf::PeerStats> peers;
+    transport->getPeerStats(&peers);
+    ASSERT_EQ(1U, peers.size());
+    EXPECT_EQ(22U, peers.at(0).address.addr);
+    EXPECT_EQ(9U, peers.at(0).rx_pkts);
+    EXPECT_EQ(9 * 1024U, peers.at(0).rx_bytes);
+    EXPECT_EQ(1U, peers.at(0).rx_resend_pkts);
+}
+
+TEST_F(TransportImplTest, processPacket_malformed)
+{
+    char payload[1024];
+    Protocol::Packet::CommonHeader* header =
+        new (payload) Protocol::Packet::CommonHeader(Protocol::Packet::GRANT,
+                                                     Protocol::MessageId(1, 1));
+    Homa::Mock::MockDriver::MockPacket packet{payload, 0};
+    EXPECT_CALL(*mockSender, handleGrantPacket).Times(0);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&packet), Eq(1))).Times(4);
+    Perf::Stats before;
+    transport->getStats(&before);
+
+    // Too short for a header prefix and opcode.
+    packet.length = sizeof(Protocol::Packet::HeaderPrefix);
+    transport->processPacket(&packet, IpAddress{22});
+
+    // Too short for a GrantHeader.
+    packet.length = sizeof(Protocol::Packet::GrantHeader) - 1;
+    transport->processPacket(&packet, IpAddress{22});
+
+    // Unsupported version.
+    packet.length = sizeof(Protocol::Packet::GrantHeader);
+    header->prefix.version = Protocol::Packet::COMPACT_VERSION + 1;
+    transport->processPacket(&packet, IpAddress{22});
+
+    // Unknown opcode.
+    header->prefix.version = Protocol::Packet::VERSION;
+    header->opcode = Protocol::Packet::MIN_OPCODE - 1;
+    transport->processPacket(&packet, IpAddress{22});
+
+    Perf::Stats after;
+    transport->getStats(&after);
+    EXPECT_EQ(4U, after.rx_malformed_pkts - before.rx_malformed_pkts);
+}
+
+// Forwarding rewrites the received packets in place; the sender's packets
+// (kept for retransmission) must not change.
+TEST(TransportImplForwardTest, forward_senderPacketsUnchanged)
+{
+    Drivers::Fake::FakeDriver driverA;
+    Drivers::Fake::FakeDriver driverB;
+    Drivers::Fake::FakeDriver driverC;
+    TransportImpl a(&driverA, 1);
+    TransportImpl b(&driverB, 2);
+    TransportImpl c(&driverC, 3);
+
+    char data[4000];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = static_cast<char>(i);
+    }
+    Homa::unique_ptr<Homa::OutMessage> original = a.alloc(0);
+    original->append(data, sizeof(data));
+    original->send({driverB.getLocalAddress(), 60001});
+
+    Homa::unique_ptr<Homa::InMessage> received;
+    for (int i = 0; i < 1000 && !received; ++i) {
+        a.poll();
+        b.poll();
+        received = b.receive();
+    }
+    ASSERT_TRUE(received);
+
+    Homa::unique_ptr<Homa::OutMessage> forwarded = b.forward(received.get(), 0);
+    received->acknowledge();
+    received.reset();
+    forwarded->send({driverC.getLocalAddress(), 60001});
+
+    Homa::unique_ptr<Homa::InMessage> delivered;
+    for (int i = 0; i < 1000 && !delivered; ++i) {
+        a.poll();
+        b.poll();
+        c.poll();
+        delivered = c.receive();
+    }
+    ASSERT_TRUE(delivered);
+    ASSERT_EQ(sizeof(data), delivered->length());
+    char copy[sizeof(data)];
+    delivered->get(0, copy, sizeof(copy));
+    EXPECT_EQ(0, std::memcmp(data, copy, sizeof(data)));
+
+    Sender::Message* message = static_cast<Sender::Message*>(original.get());
+    size_t offset = 0;
+    for (int i = 0; i < message->numPackets; ++i) {
+        Driver::Packet* packet = message->getPacket(i);
+        Protocol::Packet::DataHeader* header =
+            static_cast<Protocol::Packet::DataHeader*>(packet->payload);
+        EXPECT_EQ(1U, header->common.messageId.transportId);
+        size_t length = packet->length - sizeof(Protocol::Packet::DataHeader);
+        EXPECT_EQ(0, std::memcmp(data + offset, header + 1, length));
+        offset += length;
+    }
+    EXPECT_EQ(sizeof(data), offset);
 }
 
 }  // namespace
@@ -25,13 +25,19 @@
 #include <iostream>
 #include <list>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include "Cycles.h"
+#include "Homa/Drivers/Fake/FakeDriver.h"
 #include "Homa/Drivers/Util/QueueEstimator.h"
+#include "Homa/Homa.h"
 #include "Intrusive.h"
 #include "ObjectPool.h"
+#include "Policy.h"
+#include "SpinLock.h"
+#include "TicketLock.h"
 #include "docopt.h"
 
 static const char USAGE[] = R"(Performance Nano-Benchmark
@@ -670,6 +676,182 @@ queueEstimatorTest()
     return PerfUtils::Cycles::toSeconds(stop - start) / (2 * count);
 }
 
+TestInfo fakeDriverTestInfo = {
+    "fakeDriver", "Send and receive a packet via FakeDriver",
+    R"(Measure the cost of allocating, sending, receiving, and releasing a
+packet between two Homa::Drivers::Fake::FakeDriver instances.)"};
+double
+fakeDriverTest()
+{
+    Homa::Drivers::Fake::FakeDriver sender;
+    Homa::Drivers::Fake::FakeDriver receiver;
+    Homa::IpAddress destination = receiver.getLocalAddress();
+    Homa::Driver::Packet* packets[16];
+    Homa::IpAddress sources[16];
+    int count = 1000000;
+    uint64_t start = PerfUtils::Cycles::rdtscp();
+    for (int i = 0; i < count; i++) {
+        Homa::Driver::Packet* packet = sender.allocPacket();
+        packet->length = 1000;
+        sender.sendPacket(packet, destination, i & 0x7);
+        sender.releasePackets(&packet, 1);
+        if ((i & 0xF) == 0xF) {
+            uint32_t numPackets = receiver.receivePackets(16, packets, sources);
+            receiver.releasePackets(packets, numPackets);
+        }
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+    return PerfUtils::Cycles::toSeconds(stop - start) / count;
+}
+
+TestInfo sendContentionTestInfo = {
+    "sendContention", "Send a message while another thread sends",
+    R"(Measure the cost of starting to send a 6-packet message while another
+thread continuously calls Transport::pollSend() on the same Transport.
+Both contend for the Sender's send queue lock, so this reflects how long
+the transmitting thread holds it.)"};
+double
+sendContentionTest()
+{
+    Homa::Drivers::Fake::FakeDriver driver;
+    Homa::Transport* transport = Homa::Transport::create(&driver, 1);
+    // Nothing listens at this address; packets sent to it are dropped.
+    Homa::SocketAddress destination = {Homa::IpAddress{0xFFFFFF}, 60001};
+    char buf[6 * 1400] = {};
+    std::atomic<bool> running(true);
+    std::thread poller([&] {
+        while (running.load(std::memory_order_relaxed)) {
+            transport->pollSend();
+        }
+    });
+    int count = 10000;
+    uint64_t cycles = 0;
+    for (int i = 0; i < count; i++) {
+        Homa::unique_ptr<Homa::OutMessage> message = transport->alloc(0);
+        message->append(buf, sizeof(buf));
+        uint64_t start = PerfUtils::Cycles::rdtscp();
+        message->send(destination, Homa::OutMessage::NO_KEEP_ALIVE);
+        cycles += PerfUtils::Cycles::rdtscp() - start;
+        while (message->getStatus() == Homa::OutMessage::Status::IN_PROGRESS) {
+            std::this_thread::yield();
+        }
+    }
+    running.store(false);
+    poller.join();
+    return PerfUtils::Cycles::toSeconds(cycles) / count;
+}
+
+/**
+ * Have up to 4 threads (one per CPU) repeatedly acquire and release the same
+ * lock, with a short critical section.
+ *
+ * @param maxWait
+ *      True to return the longest time any acquisition waited for the lock;
+ *      false to return the average time per acquisition.
+ */
+template <typename LockType>
+double
+lockContention(bool maxWait)
+{
+    const int numThreads =
+        std::max(1U, std::min(4U, std::thread::hardware_concurrency()));
+    const int count = 100000;
+    LockType lock;
+    volatile uint64_t shared = 0;
+    std::atomic<bool> start(false);
+    std::atomic<uint64_t> longestWait(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&] {
+            while (!start.load()) {
+            }
+            uint64_t longest = 0;
+            for (int i = 0; i < count; i++) {
+                uint64_t begin = PerfUtils::Cycles::rdtsc();
+                lock.lock();
+                longest = std::max(longest, PerfUtils::Cycles::rdtsc() - begin);
+                shared = shared + 1;
+                lock.unlock();
+            }
+            uint64_t prev = longestWait.load();
+            while (longest > prev &&
+                   !longestWait.compare_exchange_weak(prev, longest)) {
+            }
+        });
+    }
+    uint64_t begin = PerfUtils::Cycles::rdtscp();
+    start.store(true);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+    if (maxWait) {
+        return PerfUtils::Cycles::toSeconds(longestWait.load());
+    }
+    return PerfUtils::Cycles::toSeconds(stop - begin) / (numThreads * count);
+}
+
+TestInfo spinLockContentionTestInfo = {
+    "spinLockContention", "Contended SpinLock acquire/release",
+    R"(Measure the average time per acquisition of a SpinLock that up to 4
+threads (one per CPU) acquire and release in a tight loop; the inverse
+of the lock's throughput under contention.)"};
+double
+spinLockContentionTest()
+{
+    return lockContention<Homa::SpinLock>(false);
+}
+
+TestInfo spinLockMaxWaitTestInfo = {
+    "spinLockMaxWait", "Longest wait for a contended SpinLock",
+    R"(Measure the longest time any single acquisition waited in the
+spinLockContention test; shows how unfair the lock can be.)"};
+double
+spinLockMaxWaitTest()
+{
+    return lockContention<Homa::SpinLock>(true);
+}
+
+TestInfo ticketLockContentionTestInfo = {
+    "ticketLockContention", "Contended TicketLock acquire/release",
+    R"(Same as spinLockContention, but for a TicketLock.)"};
+double
+ticketLockContentionTest()
+{
+    return lockContention<Homa::TicketLock>(false);
+}
+
+TestInfo ticketLockMaxWaitTestInfo = {
+    "ticketLockMaxWait", "Longest wait for a contended TicketLock",
+    R"(Same as spinLockMaxWait, but for a TicketLock.)"};
+double
+ticketLockMaxWaitTest()
+{
+    return lockContention<Homa::TicketLock>(true);
+}
+
+TestInfo unscheduledPolicyTestInfo = {
+    "unscheduledPolicy", "Look up the send policy of a known peer",
+    R"(Measure the cost of Policy::Manager::getUnscheduledPolicy() for a peer
+that has been seen before, which the Sender calls for every message.)"};
+double
+unscheduledPolicyTest()
+{
+    Homa::Drivers::Fake::FakeDriver driver;
+    Homa::Core::Policy::Manager manager(&driver);
+    Homa::IpAddress destination{22};
+    manager.getUnscheduledPolicy(destination, 100);
+    int count = 1000000;
+    volatile int priority;
+    uint64_t start = PerfUtils::Cycles::rdtscp();
+    for (int i = 0; i < count; i++) {
+        priority = manager.getUnscheduledPolicy(destination, 100).priority;
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+    (void)priority;
+    return PerfUtils::Cycles::toSeconds(stop - start) / count;
+}
+
 TestInfo rdtscTestInfo = {
     "rdtsc", "Read the fine-grain cycle counter",
     R"(Measure the cost of reading the fine-grain cycle counter.)"};
@@ -754,6 +936,13 @@ TestCase tests[] = {
     {ilistPushPopTest, &ilistPushPopTestInfo},
     {heapTest, &heapTestInfo},
     {queueEstimatorTest, &queueEstimatorTestInfo},
+    {fakeDriverTest, &fakeDriverTestInfo},
+    {sendContentionTest, &sendContentionTestInfo},
+    {spinLockContentionTest, &spinLockContentionTestInfo},
+    {spinLockMaxWaitTest, &spinLockMaxWaitTestInfo},
+    {ticketLockContentionTest, &ticketLockContentionTestInfo},
+    {ticketLockMaxWaitTest, &ticketLockMaxWaitTestInfo},
+    {unscheduledPolicyTest, &unscheduledPolicyTestInfo},
     {rdtscTest, &rdtscTestInfo},
     {rdhrcTest, &rdhrcTestInfo},
     {rdcscTest, &rdcscTestInfo},
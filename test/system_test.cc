@@ -43,10 +43,12 @@ static const char USAGE[] = R"(Homa System Test.
         --servers=<n>   Number of virtual servers [default: 1].
         --size=<n>      Number of bytes to send as a payload [default: 10].
         --lossRate=<f>  Rate at which packets are lost [default: 0.0].
+        --coalesce=<us> Small message coalescing budget [default: 0].
 )";
 
 bool _PRINT_CLIENT_ = false;
 bool _PRINT_SERVER_ = false;
+uint64_t _COALESCING_BUDGET_US_ = 0;
 
 struct MessageHeader {
     uint64_t id;
@@ -60,7 +62,9 @@ struct Node {
         , transport(Homa::Transport::create(&driver, id))
         , thread()
         , run(false)
-    {}
+    {
+        transport->setCoalescingBudget(_COALESCING_BUDGET_US_);
+    }
 
     const uint64_t id;
     Homa::Drivers::Fake::FakeDriver driver;
@@ -163,6 +167,7 @@ main(int argc, char* argv[])
     int numBytes = args["--size"].asLong();
     int verboseLevel = args["--verbose"].asLong();
     double packetLossRate = atof(args["--lossRate"].asString().c_str());
+    _COALESCING_BUDGET_US_ = args["--coalesce"].asLong();
 
     // level of verboseness
     bool printSummary = false;